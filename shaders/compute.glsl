@@ -15,15 +15,89 @@ layout(std140, binding = 0) uniform camera_block {
   float u_density_scale;
 };
 
-// Render passes
-layout(rgba32f, binding = 0) uniform image2D u_albedo;
-layout(rgba32f, binding = 1) uniform image2D u_depth;
-layout(rgba32f, binding = 2) uniform image2D u_normal;
+// Render passes, formats and enabled passes come from RenderTargetLayout
+#ifndef ALBEDO_FORMAT
+#define ALBEDO_FORMAT rgba32f
+#define DEPTH_FORMAT rgba32f
+#define NORMAL_FORMAT rgba32f
+#define DEPTH_PASS 1
+#define NORMAL_PASS 1
+#define PACK_NORMALS 0
+#endif
+
+layout(ALBEDO_FORMAT, binding = 0) uniform writeonly image2D u_albedo;
+#if DEPTH_PASS
+layout(DEPTH_FORMAT, binding = 1) uniform writeonly image2D u_depth;
+#endif
+#if NORMAL_PASS
+layout(NORMAL_FORMAT, binding = 2) uniform writeonly image2D u_normal;
+#endif
 
 // Voxel texture
 layout(binding = 0) uniform sampler3D u_voxel_data;
 layout(binding = 1) uniform sampler3D u_voxel_normals;
 
+// Min/max octree over the densities, see preprocessing/minmax_octree.hpp for the layout
+layout(std430, binding = 2) readonly buffer minmax_octree {
+  uvec4 u_octree_dims;          // width, height, depth, leaf size
+  uvec4 u_octree_info;          // level count
+  uvec4 u_octree_levels[16];    // width, height, depth, first node
+  vec2  u_octree_nodes[];       // min, max
+};
+
+// Distance in voxels to the nearest voxel denser than u_distance_threshold, stored as R8
+layout(binding = 3) uniform sampler3D u_distance_field;
+layout(location = 0) uniform float u_distance_threshold;
+
+// Matches controls::RenderMode
+const int RENDER_COMPOSITE = 0;
+const int RENDER_MIP       = 1;
+const int RENDER_MINIP     = 2;
+const int RENDER_AVERAGE   = 3;
+layout(location = 1) uniform int u_render_mode;
+
+// Variant toggles from graphics/shader_variants.hpp, each one left undefined stays a runtime choice
+#ifndef RENDER_MODE
+#define RENDER_MODE u_render_mode
+#endif
+#ifndef SHADOWS
+#define SHADOWS 1
+#endif
+#ifndef LABELS
+#define LABELS 1
+#endif
+#ifndef OCCLUSION
+#define OCCLUSION 1
+#endif
+#ifndef STEP_SIZE
+#define STEP_SIZE 0.005
+#endif
+#ifndef MAX_STEPS
+#define MAX_STEPS 1000
+#endif
+
+const float NO_LIMIT = 3.4e38;
+
+// Connected component labels, see preprocessing/connected_components.hpp
+// Visibility holds one bit per label, bit 0 covers voxels outside every component
+layout(binding = 4) uniform usampler3D u_labels;
+layout(std430, binding = 5) readonly buffer label_visibility {
+  uint u_label_visible[];
+};
+layout(location = 4) uniform int u_labels_enabled;
+
+// Visibility from preprocessing/ambient_occlusion.hpp, half resolution R8 built for the current window
+layout(binding = 5) uniform sampler3D u_occlusion;
+layout(location = 5) uniform int u_occlusion_enabled;
+
+// Crop box in texture coordinates, rays only march through this part of the volume
+layout(location = 2) uniform vec3 u_crop_min;
+layout(location = 3) uniform vec3 u_crop_max;
+
+// A trilinear sample reaches voxels up to sqrt(3) away and the voxel a point falls in has its
+// centre up to sqrt(3)/2 away, so this much of the stored distance can't be leapt
+const float DISTANCE_MARGIN = 2.6;
+
 // Rotation matrix for temp viewing purposes
 mat4 u_volume_rotation = mat4(
   1.0,  0.0,  0.0,  0.0,
@@ -77,11 +151,64 @@ vec2 intersectAABB(vec3 ray_origin, vec3 ray_dir, vec3 box_min, vec3 box_max) {
   return vec2(t_near, t_far);
 }
 
+// Distance along the ray to the far side of the coarsest octree node around tex_pos whose max
+// is at or below lo or whose min is at or above hi, or -1 if there is no such node.
+// Walks down from the root.
+float rangeExit(vec3 ray_origin, vec3 ray_dir, vec3 tex_pos, vec3 box_min, vec3 box_max, float lo, float hi) {
+  int level_count = int(u_octree_info.x);
+  if (level_count == 0) return -1.0;
+
+  vec3 dims = vec3(u_octree_dims.xyz);
+  uvec3 leaf = uvec3(clamp(tex_pos * dims, vec3(0.0), dims - 1.0)) / u_octree_dims.w;
+
+  for (int l = level_count - 1; l >= 0; l--) {
+    uvec4 level = u_octree_levels[l];
+    uvec3 node = leaf >> uint(l);
+    vec2 bounds = u_octree_nodes[level.w + (node.z * level.y + node.y) * level.x + node.x];
+
+    if (bounds.y <= lo || bounds.x >= hi) {
+      vec3 size = vec3(float(u_octree_dims.w << uint(l))) / dims;
+      vec3 node_min = vec3(node) * size;
+      vec3 node_max = min(node_min + size, vec3(1.0));
+      vec3 extent = box_max - box_min;
+      return intersectAABB(ray_origin, ray_dir, box_min + node_min * extent, box_min + node_max * extent).y;
+    }
+    // Children stay within their parent's range
+    if (bounds.x > lo && bounds.y < hi) return -1.0;
+  }
+  return -1.0;
+}
+
+// Hidden labels are treated as empty, labels come from the nearest voxel
+bool labelVisible(vec3 tex_pos) {
+#if LABELS
+  if (u_labels_enabled == 0) return true;
+  ivec3 dims = textureSize(u_labels, 0);
+  uint label = texelFetch(u_labels, clamp(ivec3(tex_pos * vec3(dims)), ivec3(0), dims - 1), 0).r;
+  return (u_label_visible[label >> 5] & (1u << (label & 31u))) != 0u;
+#else
+  return true;
+#endif
+}
+
+// World space distance in any direction from tex_pos that only samples empty space, or -1 if
+// the sample at tex_pos itself might not be empty
+float distanceLeap(vec3 tex_pos, vec3 box_min, vec3 box_max) {
+  vec3 dims = vec3(textureSize(u_distance_field, 0));
+  ivec3 voxel = ivec3(clamp(tex_pos * dims, vec3(0.0), dims - 1.0));
+  float d = texelFetch(u_distance_field, voxel, 0).r * 255.0 - DISTANCE_MARGIN;
+  if (d <= 0.0) return -1.0;
+
+  vec3 voxels_per_unit = dims / (box_max - box_min);
+  return d / max(voxels_per_unit.x, max(voxels_per_unit.y, voxels_per_unit.z));
+}
+
 void rayMarch(vec3 ray_origin, vec3 ray_dir, out vec4 albedo, out vec4 depth, out vec4 normal, ivec2 pixel) {
   vec3 box_max = u_volume_scale.xyz;
   vec3 box_min = -box_max;
 
-  vec2 intersection = intersectAABB(ray_origin, ray_dir, box_min, box_max);
+  vec2 intersection = intersectAABB(ray_origin, ray_dir, box_min + u_crop_min * (box_max - box_min),
+                                    box_min + u_crop_max * (box_max - box_min));
   // Check for miss
   // Color miss black
   if (intersection.x > intersection.y || intersection.y < 0.0) {
@@ -92,10 +219,15 @@ void rayMarch(vec3 ray_origin, vec3 ray_dir, out vec4 albedo, out vec4 depth, ou
   }
  
   float t_end = intersection.y;
-  float step_size = 0.005;
-  int max_steps = 1000;
+  float step_size = STEP_SIZE;
+  int max_steps = MAX_STEPS;
   float jitter = hash(vec2(pixel)) * step_size;
-  float t = max(intersection.x, 0.0) + jitter;
+  // Positions come from the step index so skipping lands on exactly the samples a full march takes
+  float t_start = max(intersection.x, 0.0) + jitter;
+
+  // Raw densities at or below this are windowed to at most 0.01 and contribute nothing
+  float empty_below = u_win_center - u_win_width * 0.5 + 0.01 * u_win_width / u_density_scale;
+  bool was_empty = true;
 
   vec4 accumulated_color = vec4(0.0);
   vec3 first_hit_normal = vec3(0.0);
@@ -103,19 +235,39 @@ void rayMarch(vec3 ray_origin, vec3 ray_dir, out vec4 albedo, out vec4 depth, ou
   bool hit = false;
   vec3 first_hit_tex_pos = vec3(0.0);
 
-  for (int step = 0; step < max_steps && t < t_end; step++) {
-    if (accumulated_color.a >= 0.95) break;
+  for (int step = 0; step < max_steps; step++) {
+    float t = t_start + float(step) * step_size;
+    if (t >= t_end || accumulated_color.a >= 0.95) break;
 
     vec3 world_pos = ray_origin + ray_dir * t;
     // vec3 rotated_pos = (u_volume_rotation * vec4(world_pos, 1.0)).xyz;
     vec3 tex_pos = (world_pos - box_min) / (box_max - box_min);
 
-    float raw = texture(u_voxel_data, tex_pos).r;
+    // Jump over empty space, only after an empty sample so dense regions don't pay for the walk
+    if (was_empty) {
+      // The distance field holds for any window at least as tight as the one it was built for
+      if (empty_below >= u_distance_threshold) {
+        float leap = distanceLeap(tex_pos, box_min, box_max);
+        if (leap >= 0.0) {
+          step += int(leap / step_size);
+          continue;
+        }
+      }
+
+      float t_exit = rangeExit(ray_origin, ray_dir, tex_pos, box_min, box_max, empty_below, NO_LIMIT);
+      if (t_exit > t) {
+        step += max(int(ceil((t_exit - t) / step_size)), 1) - 1;
+        continue;
+      }
+    }
+
+    float raw = labelVisible(tex_pos) ? texture(u_voxel_data, tex_pos).r : 0.0;
 
     // Apply HU windowing: remap so that win_center is mid-gray
     // Clamp values so air is not shown
     float half_width = u_win_width * 0.5;
     float density = clamp((raw - (u_win_center - half_width)) / u_win_width * u_density_scale, 0.0, 1.0);
+    was_empty = density <= 0.01;
 
     if (density > 0.01) {
       if (!hit) {
@@ -129,24 +281,29 @@ void rayMarch(vec3 ray_origin, vec3 ray_dir, out vec4 albedo, out vec4 depth, ou
       // Lighting
       vec3 light_dir = normalize(vec3(-1.0, -1.0, 1.0));
       float shadow = 0.0;
+#if SHADOWS
+      // Fixed spacing, so the shadow reach doesn't change with the primary step size
+      const float shadow_step = 0.005;
       vec3 shadow_pos = world_pos;
       for (int s = 0; s < 32; s++) {
-        shadow_pos += light_dir * step_size * (1.0 + float(s) * 0.5);
+        shadow_pos += light_dir * shadow_step * (1.0 + float(s) * 0.5);
         if (isOutsideBox(shadow_pos, box_min, box_max)) break;
         vec3 shadow_tex = (shadow_pos - box_min) / (box_max - box_min);
-        shadow += texture(u_voxel_data, shadow_tex).r * step_size;
+        shadow += texture(u_voxel_data, shadow_tex).r * shadow_step;
       }
+#endif
       float back_occlusion = accumulated_color.a;
       float transmittance = exp(-shadow * 100.0) * (1.0 - back_occlusion * 0.5);
 
       vec3 sample_color = vec3(0.75, 0.6, 0.45) * density * transmittance;
+#if OCCLUSION
+      if (u_occlusion_enabled != 0) sample_color *= texture(u_occlusion, tex_pos).r;
+#endif
       float sample_alpha = clamp(density * step_size * 100.0, 0.0, 1.0);
 
       accumulated_color.rgb += sample_color * sample_alpha * (1.0 - accumulated_color.a);
       accumulated_color.a += sample_alpha * (1.0 - accumulated_color.a);
     }
-
-    t += step_size;
   }
 
   albedo = accumulated_color;
@@ -154,6 +311,124 @@ void rayMarch(vec3 ray_origin, vec3 ray_dir, out vec4 albedo, out vec4 depth, ou
   normal = hit ? texture(u_voxel_normals, first_hit_tex_pos) : vec4(0.0);
 }
 
+// Projection modes skip lighting entirely and write the windowed extreme or mean as grey
+// Positions come from the step index like rayMarch(), so skipped steps are exactly the ones a
+// full march would have taken
+float windowed(float raw) {
+  return clamp((raw - (u_win_center - u_win_width * 0.5)) / u_win_width * u_density_scale, 0.0, 1.0);
+}
+
+// Brightest sample, nodes whose max can't beat the current peak are skipped and the ray stops
+// once the peak saturates the window
+float maxIntensity(vec3 ray_origin, vec3 ray_dir, float t_start, float t_end, vec3 box_min, vec3 box_max, out float t_peak) {
+  float step_size = STEP_SIZE;
+  float lo = u_win_center - u_win_width * 0.5;
+  float saturated = lo + u_win_width / u_density_scale;
+  float peak = lo;
+  bool rising = false;
+  t_peak = -1.0;
+
+  for (int step = 0; step < MAX_STEPS; step++) {
+    float t = t_start + float(step) * step_size;
+    if (t >= t_end || peak >= saturated) break;
+
+    vec3 tex_pos = (ray_origin + ray_dir * t - box_min) / (box_max - box_min);
+    // A sample that just set the peak sits in nodes that reach it, don't bother walking
+    if (!rising) {
+      float t_exit = rangeExit(ray_origin, ray_dir, tex_pos, box_min, box_max, peak, NO_LIMIT);
+      if (t_exit > t) {
+        step += max(int(ceil((t_exit - t) / step_size)), 1) - 1;
+        continue;
+      }
+    }
+
+    if (!labelVisible(tex_pos)) continue;
+    float raw = texture(u_voxel_data, tex_pos).r;
+    rising = raw > peak;
+    if (rising) {
+      peak = raw;
+      t_peak = t;
+    }
+  }
+  return windowed(peak);
+}
+
+// Darkest sample, the mirror image of maxIntensity()
+float minIntensity(vec3 ray_origin, vec3 ray_dir, float t_start, float t_end, vec3 box_min, vec3 box_max, out float t_trough) {
+  float step_size = STEP_SIZE;
+  float lo = u_win_center - u_win_width * 0.5;
+  float trough = lo + u_win_width / u_density_scale;
+  bool falling = false;
+  t_trough = -1.0;
+
+  for (int step = 0; step < MAX_STEPS; step++) {
+    float t = t_start + float(step) * step_size;
+    if (t >= t_end || trough <= lo) break;
+
+    vec3 tex_pos = (ray_origin + ray_dir * t - box_min) / (box_max - box_min);
+    if (!falling) {
+      float t_exit = rangeExit(ray_origin, ray_dir, tex_pos, box_min, box_max, -NO_LIMIT, trough);
+      if (t_exit > t) {
+        step += max(int(ceil((t_exit - t) / step_size)), 1) - 1;
+        continue;
+      }
+    }
+
+    if (!labelVisible(tex_pos)) continue;
+    float raw = texture(u_voxel_data, tex_pos).r;
+    falling = raw < trough;
+    if (falling) {
+      trough = raw;
+      t_trough = t;
+    }
+  }
+  return windowed(trough);
+}
+
+// Mean of every sample, nothing can be skipped
+float averageIntensity(vec3 ray_origin, vec3 ray_dir, float t_start, float t_end, vec3 box_min, vec3 box_max) {
+  float step_size = STEP_SIZE;
+  float sum = 0.0;
+  int count = 0;
+
+  for (int step = 0; step < MAX_STEPS; step++) {
+    float t = t_start + float(step) * step_size;
+    if (t >= t_end) break;
+
+    vec3 tex_pos = (ray_origin + ray_dir * t - box_min) / (box_max - box_min);
+    if (!labelVisible(tex_pos)) continue;
+    sum += texture(u_voxel_data, tex_pos).r;
+    count++;
+  }
+  return count > 0 ? windowed(sum / float(count)) : 0.0;
+}
+
+void projectionMarch(vec3 ray_origin, vec3 ray_dir, out vec4 albedo, out vec4 depth, out vec4 normal, ivec2 pixel) {
+  vec3 box_max = u_volume_scale.xyz;
+  vec3 box_min = -box_max;
+  albedo = vec4(0.0);
+  depth = vec4(0.0);
+  normal = vec4(0.0);
+
+  vec2 intersection = intersectAABB(ray_origin, ray_dir, box_min + u_crop_min * (box_max - box_min),
+                                    box_min + u_crop_max * (box_max - box_min));
+  if (intersection.x > intersection.y || intersection.y < 0.0) return;
+
+  float t_start = max(intersection.x, 0.0) + hash(vec2(pixel)) * STEP_SIZE;
+  float t_hit = -1.0;
+  float value = 0.0;
+  if (RENDER_MODE == RENDER_MIP) {
+    value = maxIntensity(ray_origin, ray_dir, t_start, intersection.y, box_min, box_max, t_hit);
+  } else if (RENDER_MODE == RENDER_MINIP) {
+    value = minIntensity(ray_origin, ray_dir, t_start, intersection.y, box_min, box_max, t_hit);
+  } else {
+    value = averageIntensity(ray_origin, ray_dir, t_start, intersection.y, box_min, box_max);
+  }
+
+  albedo = vec4(vec3(value), 1.0);
+  if (t_hit >= 0.0) depth = vec4(vec3(t_hit / 5.0), 1.0);
+}
+
 void main() {
   // Get pixel and convert to device coordinates (NDC)
   ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
@@ -172,9 +447,21 @@ void main() {
   vec3 local_dir    = inv_rot * ray_dir;
 
   vec4 albedo, depth, normal = vec4(0.0);
-  rayMarch(local_origin, local_dir, albedo, depth, normal, pixel);
+  if (RENDER_MODE == RENDER_COMPOSITE) {
+    rayMarch(local_origin, local_dir, albedo, depth, normal, pixel);
+  } else {
+    projectionMarch(local_origin, local_dir, albedo, depth, normal, pixel);
+  }
 
   imageStore(u_albedo, pixel, albedo);
+#if DEPTH_PASS
   imageStore(u_depth, pixel, depth);
+#endif
+#if NORMAL_PASS
+#if PACK_NORMALS
+  // Unorm can't hold negative components, alpha is just hit or miss
+  normal = dot(normal.xyz, normal.xyz) > 1e-12 ? vec4(normalize(normal.xyz) * 0.5 + 0.5, 1.0) : vec4(0.0);
+#endif
   imageStore(u_normal, pixel, normal);
+#endif
 }
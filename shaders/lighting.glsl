@@ -0,0 +1,149 @@
+#version 430 core
+layout(local_size_x = 16, local_size_y = 16) in;
+
+// Deferred lighting for composite frames, see graphics/deferred_lighting.hpp. Runs after
+// compute.glsl and lights each pixel's first hit from the depth and normal passes.
+
+layout(std140, binding = 0) uniform camera_block {
+  mat4 u_view;
+  mat4 u_proj;
+  vec4 u_cam;
+  vec4 u_volume_scale;
+  int u_width;
+  int u_height;
+  float u_win_center;
+  float u_win_width;
+  float u_density_scale;
+};
+
+// Render passes, formats come from RenderTargetLayout, which has to write depth and normals
+#ifndef ALBEDO_FORMAT
+#define ALBEDO_FORMAT rgba32f
+#define DEPTH_FORMAT rgba32f
+#define NORMAL_FORMAT rgba32f
+#define PACK_NORMALS 0
+#endif
+
+layout(ALBEDO_FORMAT, binding = 0) uniform image2D u_albedo;
+layout(DEPTH_FORMAT, binding = 1) uniform readonly image2D u_depth;
+layout(NORMAL_FORMAT, binding = 2) uniform readonly image2D u_normal;
+
+// Raw densities for the shadow rays
+layout(binding = 0) uniform sampler3D u_voxel_data;
+
+// Matches graphics::LightType and graphics::PackedLight
+const uint LIGHT_DIRECTIONAL = 0u;
+const uint LIGHT_POINT       = 1u;
+const uint LIGHT_SPOT        = 2u;
+
+struct Light {
+  vec4 position;      // xyz, w is the type
+  vec4 direction;     // xyz, w is the cosine of a spot's half angle
+  vec4 color;         // Colour times power, w is size
+};
+
+layout(std430, binding = 6) readonly buffer light_list {
+  vec4 u_ambient;
+  Light u_lights[];
+};
+
+layout(location = 0) uniform int u_shadows;
+
+// Same spacing and strength as the shadow rays in compute.glsl
+const int SHADOW_STEPS = 32;
+const float SHADOW_STEP = 0.005;
+// Share of a spot's cone, from the edge in, over which it fades in
+const float SPOT_EDGE = 0.2;
+
+mat3 u_volume_rotation = mat3(
+  1.0,  0.0,  0.0,
+  0.0,  0.0,  1.0,
+  0.0, -1.0,  0.0
+);
+
+bool isOutsideBox(vec3 pos, vec3 box_min, vec3 box_max) {
+  return  pos.x < box_min.x || pos.x > box_max.x ||
+          pos.y < box_min.y || pos.y > box_max.y ||
+          pos.z < box_min.z || pos.z > box_max.z;
+}
+
+// Fraction of a light reaching pos from dir, marched in volume local space up to the box or the light
+float shadowTransmittance(vec3 pos, vec3 dir, float max_dist, vec3 box_min, vec3 box_max) {
+  float shadow = 0.0;
+  float travelled = 0.0;
+  for (int s = 0; s < SHADOW_STEPS; s++) {
+    float spacing = SHADOW_STEP * (1.0 + float(s) * 0.5);
+    travelled += spacing;
+    if (travelled > max_dist) break;
+    pos += dir * spacing;
+    if (isOutsideBox(pos, box_min, box_max)) break;
+    shadow += texture(u_voxel_data, (pos - box_min) / (box_max - box_min)).r * SHADOW_STEP;
+  }
+  return exp(-shadow * 100.0);
+}
+
+void main() {
+  ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+  if (pixel.x >= u_width || pixel.y >= u_height) return;
+
+  // Rays that hit nothing keep what the march wrote
+  float t = imageLoad(u_depth, pixel).r * 5.0;
+  if (t <= 0.0) return;
+
+  // Same ray setup as compute.glsl, the volume is only rotated so distances carry over
+  vec2 uv = vec2(pixel) / vec2(u_width, u_height) * 2.0 - 1.0;
+  mat4 inv_view_proj = inverse(u_proj * u_view);
+  vec4 target = inv_view_proj * vec4(uv.x, uv.y, 1.0, 1.0);
+  vec3 ray_dir = normalize(target.xyz / target.w - u_cam.xyz);
+  vec3 world_pos = u_cam.xyz + ray_dir * t;
+
+  mat3 to_world = -u_volume_rotation;
+  mat3 inv_rot = transpose(to_world);
+  vec3 local_pos = inv_rot * world_pos;
+  vec3 box_max = u_volume_scale.xyz;
+  vec3 box_min = -box_max;
+
+  vec4 stored = imageLoad(u_normal, pixel);
+#if PACK_NORMALS
+  vec3 index_normal = stored.a > 0.0 ? stored.xyz * 2.0 - 1.0 : vec3(0.0);
+#else
+  vec3 index_normal = stored.xyz;
+#endif
+  // Normals are gradients over voxel indices, scaled here into local space
+  vec3 gradient = index_normal * vec3(textureSize(u_voxel_data, 0)) / (box_max - box_min);
+  bool has_normal = dot(gradient, gradient) > 1e-12;
+  vec3 normal = has_normal ? normalize(to_world * gradient) : vec3(0.0);
+  // Shadow rays start a step off the surface, or they would mostly measure the hit voxel
+  vec3 shadow_origin = local_pos + inv_rot * normal * SHADOW_STEP;
+
+  vec3 light = u_ambient.rgb;
+  for (int i = 0; i < u_lights.length(); i++) {
+    Light l = u_lights[i];
+    uint type = uint(l.position.w);
+    vec3 to_light;
+    float dist = 1e30;
+    float attenuation = 1.0;
+    if (type == LIGHT_DIRECTIONAL) {
+      to_light = -l.direction.xyz;
+    } else {
+      vec3 d = l.position.xyz - world_pos;
+      dist = length(d);
+      to_light = d / max(dist, 1e-6);
+      float r = dist / max(l.color.w, 1e-6);
+      attenuation = 1.0 / (1.0 + r * r);
+      if (type == LIGHT_SPOT) {
+        float cos_outer = l.direction.w;
+        attenuation *= smoothstep(cos_outer, cos_outer + (1.0 - cos_outer) * SPOT_EDGE, dot(-to_light, l.direction.xyz));
+      }
+    }
+
+    float lambert = has_normal ? max(dot(normal, to_light), 0.0) : 1.0;
+    float intensity = lambert * attenuation;
+    if (intensity <= 0.0) continue;
+    if (u_shadows != 0) intensity *= shadowTransmittance(shadow_origin, inv_rot * to_light, dist, box_min, box_max);
+    light += l.color.rgb * intensity;
+  }
+
+  vec4 albedo = imageLoad(u_albedo, pixel);
+  imageStore(u_albedo, pixel, vec4(albedo.rgb * light, albedo.a));
+}
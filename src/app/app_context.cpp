@@ -29,6 +29,7 @@ AppContext makeApp(AppConfig& config) {
   SDL_WindowFlags window_flags = SDL_WINDOW_OPENGL |
                                  SDL_WINDOW_RESIZABLE |
                                  SDL_WINDOW_HIGH_PIXEL_DENSITY;
+  if (config.hidden) window_flags |= SDL_WINDOW_HIDDEN;
   SDL_Window* window = SDL_CreateWindow(config.title, config.width, config.height, window_flags);
   if (!window) SDL_Throw("SDL_CreateWindow");
 
@@ -64,16 +65,8 @@ AppContext makeApp(AppConfig& config) {
   return app;
 }
 
-// Mask flag to signal for update
-void pollInput(UpdateFlags& flags, InputState& input) {
-  // Rest per-frame data
-  input.mouse_dx = 0.f;
-  input.mouse_dy = 0.f;
-  input.scroll_dx = 0.f;
-  input.scroll_dy = 0.f;
-
-  SDL_Event event;
-  while (SDL_PollEvent(&event)) {
+namespace {
+  void handleEvent(SDL_Event& event, UpdateFlags& flags, InputState& input) {
     ImGui_ImplSDL3_ProcessEvent(&event);
 
     switch (event.type) {
@@ -150,6 +143,27 @@ void pollInput(UpdateFlags& flags, InputState& input) {
   }
 }
 
+// Mask flag to signal for update
+bool pollInput(UpdateFlags& flags, InputState& input, int wait_ms) {
+  // Rest per-frame data
+  input.mouse_dx = 0.f;
+  input.mouse_dy = 0.f;
+  input.scroll_dx = 0.f;
+  input.scroll_dy = 0.f;
+
+  bool any = false;
+  SDL_Event event;
+  if (wait_ms > 0 && SDL_WaitEventTimeout(&event, wait_ms)) {
+    handleEvent(event, flags, input);
+    any = true;
+  }
+  while (SDL_PollEvent(&event)) {
+    handleEvent(event, flags, input);
+    any = true;
+  }
+  return any;
+}
+
 // Separate function from PollInputs()
 void updateState(UpdateFlags& flags, AppContext& app, InputState& input, const ui::ViewportWindow& viewport) {
   auto& camera = activeCamera(app);
@@ -41,9 +41,11 @@ struct AppConfig {
   int height = 720;
   int gl_major = 3;
   int gl_minor = 3;
+  bool hidden = false;      // Offscreen use, the window is never shown
 };
 
 AppContext makeApp(AppConfig& config);
-void pollInput(UpdateFlags& flags, InputState& input);
+// Waits up to wait_ms for the first event when none are queued, true if anything arrived
+bool pollInput(UpdateFlags& flags, InputState& input, int wait_ms = 0);
 void updateState(UpdateFlags& flags, AppContext& app, InputState& input, const ui::ViewportWindow& viewport);
 void draw(const AppContext& app);
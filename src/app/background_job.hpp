@@ -0,0 +1,46 @@
+// app/background_job.hpp
+#pragma once
+#include <atomic>
+#include <thread>
+#include <utility>
+
+namespace jobs {
+
+  // Runs one computation off the main thread at a time and hands its result back when polled
+  template <typename T>
+  struct BackgroundJob {
+    std::thread worker;
+    std::atomic<bool> finished{false};
+    T result{};
+
+    BackgroundJob() = default;
+    BackgroundJob(const BackgroundJob&) = delete;
+    BackgroundJob& operator=(const BackgroundJob&) = delete;
+    ~BackgroundJob() { if (worker.joinable()) worker.join(); }
+  };
+
+  template <typename T>
+  bool isRunning(const BackgroundJob<T>& job) {
+    return job.worker.joinable() && !job.finished;
+  }
+
+  // fn(T& result) runs on a new thread, waits for any previous job first
+  template <typename T, typename Fn>
+  void startJob(BackgroundJob<T>& job, Fn&& fn) {
+    if (job.worker.joinable()) job.worker.join();
+    job.finished = false;
+    job.worker = std::thread([&job, fn = std::forward<Fn>(fn)]() mutable {
+      fn(job.result);
+      job.finished = true;
+    });
+  }
+
+  // True exactly once per job, when it has finished and result can be read
+  template <typename T>
+  bool pollJob(BackgroundJob<T>& job) {
+    if (!job.worker.joinable() || !job.finished) return false;
+    job.worker.join();
+    return true;
+  }
+
+} // namespace jobs
@@ -1,13 +1,49 @@
 // app/controls_data.hpp
 #pragma once
+#include <cstdint>
+#include <vector>
 
 namespace controls {
 
+// Matches the RENDER_* constants in compute.glsl
+enum class RenderMode : int {
+  COMPOSITE,    // Lit front-to-back compositing
+  MIP,          // Maximum intensity projection
+  MINIP,        // Minimum intensity projection
+  AVERAGE       // Average intensity projection
+};
+
 struct WinData {
   float win_center    = 0.3f;
   float win_width     = 0.4f;
   float density_scale = 1.0f;
   float scale         = 1.0f;
+  RenderMode mode     = RenderMode::COMPOSITE;
+  bool shadows        = true;
+  bool deferred_lighting = false; // Light first hits after the march, see graphics/deferred_lighting.hpp
+  bool high_quality   = false;    // Half the ray step, for stills rather than interaction
+  bool ambient_occlusion = true;  // Rebuilt in the background whenever the window changes
+
+  // Crop box as fractions of the volume's width, height and depth, rays are clipped to it
+  float crop_min[3]   = { 0.0f, 0.0f, 0.0f };
+  float crop_max[3]   = { 1.0f, 1.0f, 1.0f };
+  bool apply_crop     = false;    // Set by the UI, main rebuilds the volume as the cropped sub-volume
+};
+
+// Connected component segmentation of the active volume
+struct LabelControls {
+  float hu_min      = 200.0f;
+  float hu_max      = 3000.0f;
+  int min_voxels    = 500;
+  int open_radius   = 0;        // Opens the thresholded mask first, 0 skips it
+  bool fill_holes   = false;
+  bool run          = false;    // Set by the UI, main labels the volume in the background
+  bool running      = false;
+
+  bool enabled         = false; // Render only visible labels
+  bool show_unlabeled  = true;
+  std::vector<uint8_t> visible; // Per component, label l is visible[l - 1]
+  bool visibility_changed = false;
 };
 
 } // namespace controls
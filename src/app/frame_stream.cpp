@@ -0,0 +1,252 @@
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "frame_stream.hpp"
+
+namespace stream {
+
+namespace {
+  // Longest run one RLE record can hold
+  constexpr size_t MAX_RUN = 256;
+
+  template <typename T>
+  void put(std::vector<uint8_t>& out, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+  }
+
+  struct Reader {
+    const uint8_t* data;
+    size_t left;
+  };
+
+  template <typename T>
+  bool get(Reader& in, T& value) {
+    if (in.left < sizeof(T)) return false;
+    std::memcpy(&value, in.data, sizeof(T));
+    in.data += sizeof(T);
+    in.left -= sizeof(T);
+    return true;
+  }
+
+  // Retries short writes and signals, MSG_NOSIGNAL keeps a dropped client from killing the server
+  bool sendAll(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+      ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR) continue;
+      if (sent <= 0) return false;
+      data += sent;
+      size -= size_t(sent);
+    }
+    return true;
+  }
+
+  bool receiveAll(int fd, uint8_t* data, size_t size) {
+    while (size > 0) {
+      ssize_t got = recv(fd, data, size, 0);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) return false;
+      data += got;
+      size -= size_t(got);
+    }
+    return true;
+  }
+
+  void putVec3(std::vector<uint8_t>& out, const glm::vec3& v) {
+    put(out, v.x);
+    put(out, v.y);
+    put(out, v.z);
+  }
+
+  bool getVec3(Reader& in, glm::vec3& v) {
+    return get(in, v.x) && get(in, v.y) && get(in, v.z);
+  }
+
+  // Each record is a run length minus one and the pixel repeated, so flat background and the
+  // unchanged parts of a delta collapse to four bytes per 256 pixels
+  void encodeRuns(const uint8_t* rgb, size_t pixels, std::vector<uint8_t>& out) {
+    size_t i = 0;
+    while (i < pixels) {
+      const uint8_t* p = rgb + i * 3;
+      size_t run = 1;
+      while (i + run < pixels && run < MAX_RUN && std::memcmp(p, rgb + (i + run) * 3, 3) == 0) run++;
+      out.push_back(uint8_t(run - 1));
+      out.insert(out.end(), p, p + 3);
+      i += run;
+    }
+  }
+
+  bool decodeRuns(const uint8_t* data, size_t size, size_t pixels, uint8_t* rgb) {
+    size_t i = 0;
+    for (size_t at = 0; at + 4 <= size; at += 4) {
+      size_t run = size_t(data[at]) + 1;
+      if (i + run > pixels) return false;
+      for (size_t r = 0; r < run; r++, i++) std::memcpy(rgb + i * 3, data + at + 1, 3);
+    }
+    return i == pixels && size % 4 == 0;
+  }
+}
+
+bool sendMessage(int fd, MessageType type, const std::vector<uint8_t>& payload) {
+  std::vector<uint8_t> header;
+  put(header, uint8_t(type));
+  put(header, uint32_t(payload.size()));
+  return sendAll(fd, header.data(), header.size()) && sendAll(fd, payload.data(), payload.size());
+}
+
+bool receiveMessage(int fd, MessageType& type, std::vector<uint8_t>& payload) {
+  uint8_t header[5];
+  if (!receiveAll(fd, header, sizeof(header))) return false;
+  uint32_t size;
+  std::memcpy(&size, header + 1, sizeof(size));
+  if (size > MAX_PAYLOAD) {
+    printf("Dropping a %u byte message, the limit is %u\n", size, MAX_PAYLOAD);
+    return false;
+  }
+  type = MessageType(header[0]);
+  payload.resize(size);
+  return receiveAll(fd, payload.data(), size);
+}
+
+void writeHello(const std::vector<std::string>& volumes, std::vector<uint8_t>& out) {
+  out.clear();
+  put(out, PROTOCOL_VERSION);
+  put(out, uint32_t(volumes.size()));
+  for (const std::string& name : volumes) {
+    put(out, uint32_t(name.size()));
+    out.insert(out.end(), name.begin(), name.end());
+  }
+}
+
+bool readHello(const std::vector<uint8_t>& payload, std::vector<std::string>& volumes) {
+  Reader in{ payload.data(), payload.size() };
+  uint32_t version = 0, count = 0;
+  if (!get(in, version) || version != PROTOCOL_VERSION || !get(in, count)) {
+    printf("Server speaks protocol %u, this build speaks %u\n", version, PROTOCOL_VERSION);
+    return false;
+  }
+  volumes.clear();
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t length = 0;
+    if (!get(in, length) || in.left < length) return false;
+    volumes.emplace_back(reinterpret_cast<const char*>(in.data), length);
+    in.data += length;
+    in.left -= length;
+  }
+  return true;
+}
+
+void writeView(const ViewRequest& view, std::vector<uint8_t>& out) {
+  out.clear();
+  put(out, view.seq);
+  put(out, view.volume);
+  put(out, view.width);
+  put(out, view.height);
+  put(out, uint8_t(view.encoding));
+  putVec3(out, view.position);
+  putVec3(out, view.forward);
+  putVec3(out, view.up);
+  put(out, view.fov_deg);
+
+  const controls::WinData& w = view.window;
+  put(out, w.win_center);
+  put(out, w.win_width);
+  put(out, w.density_scale);
+  put(out, w.scale);
+  put(out, uint8_t(w.mode));
+  put(out, uint8_t(w.shadows << 0 | w.deferred_lighting << 1));
+  for (float v : w.crop_min) put(out, v);
+  for (float v : w.crop_max) put(out, v);
+}
+
+bool readView(const std::vector<uint8_t>& payload, ViewRequest& out) {
+  Reader in{ payload.data(), payload.size() };
+  uint8_t encoding = 0, mode = 0, lighting = 0;
+  controls::WinData& w = out.window;
+  bool ok = get(in, out.seq) && get(in, out.volume) && get(in, out.width) && get(in, out.height) &&
+            get(in, encoding) && getVec3(in, out.position) && getVec3(in, out.forward) && getVec3(in, out.up) &&
+            get(in, out.fov_deg) && get(in, w.win_center) && get(in, w.win_width) && get(in, w.density_scale) &&
+            get(in, w.scale) && get(in, mode) && get(in, lighting);
+  for (float& v : w.crop_min) ok = ok && get(in, v);
+  for (float& v : w.crop_max) ok = ok && get(in, v);
+  if (!ok || encoding > uint8_t(FrameEncoding::DELTA) || mode > uint8_t(controls::RenderMode::AVERAGE)) return false;
+
+  out.encoding = FrameEncoding(encoding);
+  w.mode = controls::RenderMode(mode);
+  w.shadows = lighting & 1;
+  w.deferred_lighting = lighting & 2;
+  return true;
+}
+
+void writeFrame(const FrameHeader& header, const std::vector<uint8_t>& pixels, std::vector<uint8_t>& out) {
+  out.clear();
+  out.reserve(pixels.size() + 32);
+  put(out, header.seq);
+  put(out, header.coalesced);
+  put(out, header.width);
+  put(out, header.height);
+  put(out, uint8_t(header.encoding));
+  put(out, header.render_ms);
+  put(out, header.encode_ms);
+  out.insert(out.end(), pixels.begin(), pixels.end());
+}
+
+bool readFrame(const std::vector<uint8_t>& payload, FrameHeader& header, const uint8_t*& pixels, size_t& size) {
+  Reader in{ payload.data(), payload.size() };
+  uint8_t encoding = 0;
+  if (!get(in, header.seq) || !get(in, header.coalesced) || !get(in, header.width) || !get(in, header.height) ||
+      !get(in, encoding) || !get(in, header.render_ms) || !get(in, header.encode_ms) ||
+      encoding > uint8_t(FrameEncoding::DELTA)) {
+    return false;
+  }
+  header.encoding = FrameEncoding(encoding);
+  pixels = in.data;
+  size = in.left;
+  return true;
+}
+
+FrameEncoding encodeFrame(const graphics::Image& image, const graphics::Image* previous, FrameEncoding requested,
+                          std::vector<uint8_t>& out) {
+  out.clear();
+  size_t pixels = (size_t)image.width * image.height;
+  bool can_delta = previous && previous->width == image.width && previous->height == image.height;
+  if (requested == FrameEncoding::DELTA && !can_delta) requested = FrameEncoding::RLE;
+
+  if (requested == FrameEncoding::DELTA) {
+    std::vector<uint8_t> delta(image.rgb.size());
+    for (size_t i = 0; i < delta.size(); i++) delta[i] = image.rgb[i] ^ previous->rgb[i];
+    encodeRuns(delta.data(), pixels, out);
+  } else if (requested == FrameEncoding::RLE) {
+    encodeRuns(image.rgb.data(), pixels, out);
+  }
+
+  if (requested == FrameEncoding::RAW || out.size() >= image.rgb.size()) {
+    out = image.rgb;
+    return FrameEncoding::RAW;
+  }
+  return requested;
+}
+
+bool decodeFrame(const FrameHeader& header, const uint8_t* data, size_t size, graphics::Image& image) {
+  size_t pixels = (size_t)header.width * header.height;
+  if (header.encoding == FrameEncoding::DELTA) {
+    if (image.width != header.width || image.height != header.height) return false;
+    std::vector<uint8_t> delta(pixels * 3);
+    if (!decodeRuns(data, size, pixels, delta.data())) return false;
+    for (size_t i = 0; i < delta.size(); i++) image.rgb[i] ^= delta[i];
+    return true;
+  }
+
+  image.width = header.width;
+  image.height = header.height;
+  image.rgb.resize(pixels * 3);
+  if (header.encoding == FrameEncoding::RLE) return decodeRuns(data, size, pixels, image.rgb.data());
+  if (size != image.rgb.size()) return false;
+  std::memcpy(image.rgb.data(), data, size);
+  return true;
+}
+
+} // namespace stream
@@ -0,0 +1,80 @@
+// app/frame_stream.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "controls_data.hpp"
+#include "graphics/image_compare.hpp"
+
+namespace stream {
+
+  // Wire protocol between the render server and its clients, see app/render_server.hpp. Every
+  // message is a type byte and a payload length followed by the payload. Fields are written in
+  // host byte order, both ends share a machine through a Unix socket.
+  constexpr uint32_t PROTOCOL_VERSION = 1;
+
+  // Largest frame edge, and the largest payload either end accepts, a raw frame that size with
+  // room for its header
+  constexpr uint32_t MAX_FRAME_SIZE = 4096;
+  constexpr uint32_t MAX_PAYLOAD = MAX_FRAME_SIZE * MAX_FRAME_SIZE * 3u + 256u;
+
+  enum class MessageType : uint8_t {
+    HELLO = 1,      // Server to client on connect, the protocol version and the volumes served
+    VIEW  = 2,      // Client to server, what to draw next
+    FRAME = 3,      // Server to client, an encoded frame
+    ERROR = 4       // Server to client, a message before the server hangs up
+  };
+
+  enum class FrameEncoding : uint8_t {
+    RAW   = 0,      // 8 bit RGB, top row first
+    RLE   = 1,      // Runs of identical pixels
+    DELTA = 2       // Runs over the bytewise XOR with the previous frame of the session
+  };
+
+  // Everything the CPU marcher needs from a client's camera and window settings
+  struct ViewRequest {
+    uint32_t seq = 0;               // Echoed in the frame, so clients can tell which request it answers
+    uint32_t volume = 0;            // Index into the HELLO list
+    uint16_t width = 0, height = 0;
+    FrameEncoding encoding = FrameEncoding::DELTA;
+    glm::vec3 position{ 0.f }, forward{ 0.f, 0.f, -1.f }, up{ 0.f, 1.f, 0.f };
+    float fov_deg = 30.f;
+    controls::WinData window;       // apply_crop, high_quality and ambient_occlusion aren't sent
+  };
+
+  struct FrameHeader {
+    uint32_t seq = 0;               // Of the request drawn
+    uint32_t coalesced = 0;         // Requests replaced by a newer one before they were drawn
+    uint16_t width = 0, height = 0;
+    FrameEncoding encoding = FrameEncoding::RAW;   // What was used, DELTA falls back on key frames
+    float render_ms = 0.f;
+    float encode_ms = 0.f;
+  };
+
+  // Whole messages over a stream socket, false once the peer has gone or sent garbage
+  bool sendMessage(int fd, MessageType type, const std::vector<uint8_t>& payload);
+  bool receiveMessage(int fd, MessageType& type, std::vector<uint8_t>& payload);
+
+  void writeHello(const std::vector<std::string>& volumes, std::vector<uint8_t>& out);
+  bool readHello(const std::vector<uint8_t>& payload, std::vector<std::string>& volumes);
+
+  void writeView(const ViewRequest& view, std::vector<uint8_t>& out);
+  bool readView(const std::vector<uint8_t>& payload, ViewRequest& out);
+
+  // The header followed by the encoded pixels
+  void writeFrame(const FrameHeader& header, const std::vector<uint8_t>& pixels, std::vector<uint8_t>& out);
+  bool readFrame(const std::vector<uint8_t>& payload, FrameHeader& header, const uint8_t*& pixels, size_t& size);
+
+  // previous is the last frame sent on the session, DELTA needs one of the same size and uses
+  // RLE instead without it. Either run encoding gives way to RAW when it would come out larger.
+  FrameEncoding encodeFrame(const graphics::Image& image, const graphics::Image* previous, FrameEncoding requested,
+                            std::vector<uint8_t>& out);
+
+  // Decodes over image, which must hold the previous frame for DELTA
+  bool decodeFrame(const FrameHeader& header, const uint8_t* data, size_t size, graphics::Image& image);
+
+} // namespace stream
@@ -1,14 +1,22 @@
 // /app/lights.hpp
+#pragma once
+
+#include <vector>
 
 #include <glm/glm.hpp>
 
 namespace lights {
 
+// Positions and directions are in world space, the space the camera moves in. Directions are
+// the way the light travels. size is the distance point and spot lights fall to half power at.
+
 struct directional {
   glm::vec3 direction = { 0.f, 1.f, 0.f };
   glm::vec3 color     = { 0.88f, 0.88f, 0.88f };
   float power         = 1.f;
-  float size          = 1.f;
+  float size          = 1.f;    // Unused, directional lights don't fall off
+
+  bool operator==(const directional&) const = default;
 };
 
 struct point {
@@ -16,14 +24,40 @@ struct point {
   glm::vec3 color     = { 0.88f, 0.88f, 0.88f };
   float power         = 1.f;
   float size          = 1.f;
+
+  bool operator==(const point&) const = default;
 };
 
 struct spot {
   glm::vec3 position  = { 0.f, 0.f, 0.f };
   glm::vec3 direction = { 0.f, 1.f, 0.f };
+  glm::vec3 color     = { 0.88f, 0.88f, 0.88f };
   float power         = 1.f;
-  float radius        = 0.5f;
+  float radius        = 0.5f;   // Half angle of the cone in radians
   float size          = 1.f;
+
+  bool operator==(const spot&) const = default;
+};
+
+// Everything the deferred lighting pass shades with, see graphics/deferred_lighting.hpp
+struct light_set {
+  glm::vec3 ambient = { 0.3f, 0.3f, 0.3f };
+  std::vector<directional> directionals;
+  std::vector<point> points;
+  std::vector<spot> spots;
+
+  bool operator==(const light_set&) const = default;
 };
 
+// One key light from where the marcher's built in light used to come from
+inline light_set defaultLights() {
+  light_set set;
+  set.directionals.push_back(directional{ glm::normalize(glm::vec3(-1.f, -1.f, -1.f)), glm::vec3(1.f), 0.9f, 1.f });
+  return set;
+}
+
+inline size_t lightCount(const light_set& set) {
+  return set.directionals.size() + set.points.size() + set.spots.size();
+}
+
 } // namespace lights
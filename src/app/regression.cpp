@@ -0,0 +1,610 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <map>
+
+#include "graphics/cpu_raymarch.hpp"
+#include "graphics/deferred_lighting.hpp"
+#include "graphics/image_compare.hpp"
+#include "graphics/render_targets.hpp"
+#include "graphics/shader_cache.hpp"
+#include "graphics/shader_variants.hpp"
+#include "graphics/sort_last.hpp"
+#include "graphics/volume_transform.hpp"
+
+#include "preprocessing/ambient_occlusion.hpp"
+#include "preprocessing/compute_gradient.hpp"
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/distance_field.hpp"
+#include "preprocessing/gaussian_blur.hpp"
+#include "preprocessing/minmax_octree.hpp"
+
+#include "app_context.hpp"
+#include "camera.hpp"
+#include "controls_data.hpp"
+#include "regression.hpp"
+
+namespace regress {
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+  using Budgets = std::map<std::string, double>;
+
+  // Stages can't fail by less than this, timer noise dominates anything that quick
+  constexpr double BUDGET_FLOOR_MS = 5.0;
+
+  // Sort-last frames restart each ray's sample phase and self-shadowing at slab boundaries,
+  // splits of the test volumes land at 32 dB and 0.956 in the worst pose
+  constexpr double SORT_LAST_MIN_PSNR = 30.0;
+  constexpr double SORT_LAST_MIN_SSIM = 0.94;
+
+  // Lit poses hold the GL frame to the CPU golden, so it carries both marchers' differences and
+  // the rgba16f albedo target on top of the lighting pass itself
+  constexpr double LIGHTING_MIN_PSNR = 30.0;
+  constexpr double LIGHTING_MIN_SSIM = 0.94;
+
+  constexpr const char* COMPUTE_PATH = "shaders/compute.glsl";
+  constexpr const char* LIGHTING_PATH = "shaders/lighting.glsl";
+  constexpr const char* BUDGET_FILE = "budgets.txt";
+
+  // Orbits from the default camera plus what is rendered from there
+  struct Pose {
+    const char* name;
+    float yaw, pitch;               // Radians, as cam::orbit() takes them
+    float dolly;
+    controls::RenderMode mode;
+    bool shadows;                   // Cast by the deferred lights instead when lit
+    bool occlusion;                 // Samples the volume's OcclusionVolume
+    bool lit;                       // Deferred lighting with regressionLights()
+    bool high_quality = false;      // Half the step, twice the steps
+  };
+
+  // Both marchers, shadows on and off, a pose close enough that rays start near the box,
+  // ambient occlusion on its own so it isn't masked by the shadows, deferred lighting, and the
+  // high quality step
+  const Pose POSES[] = {
+    { "front",     0.0f,  0.0f, 0.0f, controls::RenderMode::COMPOSITE, true,  false, false },
+    { "oblique",   0.8f,  0.3f, 0.0f, controls::RenderMode::COMPOSITE, true,  false, false },
+    { "top",       0.0f,  1.2f, 0.0f, controls::RenderMode::COMPOSITE, false, false, false },
+    { "close",     0.4f, -0.2f, 1.5f, controls::RenderMode::COMPOSITE, true,  false, false },
+    { "mip",       0.8f,  0.3f, 0.0f, controls::RenderMode::MIP,       true,  false, false },
+    { "average",   0.0f,  0.0f, 0.0f, controls::RenderMode::AVERAGE,   true,  false, false },
+    { "occluded",  0.8f,  0.3f, 0.0f, controls::RenderMode::COMPOSITE, false, true,  false },
+    { "lit",       0.8f,  0.3f, 0.0f, controls::RenderMode::COMPOSITE, true,  false, true  },
+    { "lit-close", 0.4f, -0.2f, 1.5f, controls::RenderMode::COMPOSITE, false, false, true  },
+    { "hq",        0.8f,  0.3f, 0.0f, controls::RenderMode::COMPOSITE, true,  false, false, true },
+  };
+
+  struct Volume {
+    std::string name;
+    preprocessing::VoxelGrid grid;
+    preprocessing::DicomMetadata meta{};
+    preprocessing::MinMaxOctree octree;
+    preprocessing::DistanceField distance;
+    preprocessing::OcclusionVolume occlusion;
+  };
+
+  struct Report {
+    Budgets measured;
+    int checks = 0;
+    int failures = 0;
+  };
+
+  // Same layout as camera_block in compute.glsl
+  struct CameraBlock {
+    glm::mat4 view;
+    glm::mat4 proj;
+    glm::vec4 cam;
+    glm::vec4 volume_scale;
+    GLuint width, height;
+    float win_center, win_width, density_scale;
+  };
+
+  // Compute shader run in a hidden window, on whatever driver is current (llvmpipe when
+  // LIBGL_ALWAYS_SOFTWARE is set)
+  struct GlRenderer {
+    AppContext app;
+    graphics::ShaderCache shaders;
+    graphics::Buffer camera_block{};
+    graphics::RenderTargets targets{};
+    graphics::Texture3D density{}, normals{}, distance{}, occlusion{};
+    graphics::Buffer octree{};
+    graphics::Buffer lights{};
+  };
+
+  double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  }
+
+  std::string fileName(const std::string& key) {
+    std::string name = key;
+    for (char& c : name) if (c == '/') c = '_';
+    return name;
+  }
+
+  // The viewer's key light plus one of each other type, so every branch of the lighting pass runs
+  lights::light_set regressionLights() {
+    lights::light_set set = lights::defaultLights();
+    set.points.push_back(lights::point{ glm::vec3(0.f, 1.f, 1.f), glm::vec3(1.f, 0.8f, 0.6f), 1.5f, 1.f });
+    set.spots.push_back(lights::spot{ glm::vec3(0.f, 0.f, 2.f), glm::vec3(0.f, 0.f, -1.f), glm::vec3(0.6f, 0.8f, 1.f),
+                                      2.f, 0.3f, 2.f });
+    return set;
+  }
+
+  // --- Synthetic volumes ---
+
+  void makeSyntheticVolume(const char* name, uint32_t width, uint32_t height, uint32_t depth, float spacing_z, Volume& out) {
+    out.name = name;
+    out.grid = preprocessing::VoxelGrid(width, height, depth);
+    out.meta = preprocessing::DicomMetadata{ 1.f, 1.f, spacing_z, 0.f, 0.f, 0.f,
+                                             int(width), int(height), int(depth), 0.f, 1.f };
+  }
+
+  // Soft edged ball, the same shape generateSphere() makes
+  void makeSphere(Volume& out) {
+    makeSyntheticVolume("sphere", 64, 64, 64, 1.f, out);
+    const float c = 31.5f, radius = 24.f;
+    for (uint32_t z = 0; z < 64; z++)
+      for (uint32_t y = 0; y < 64; y++)
+        for (uint32_t x = 0; x < 64; x++) {
+          float dist = glm::length(glm::vec3(x, y, z) - c);
+          out.grid.at(x, y, z) = dist < radius ? std::min(1.f, (radius - dist) / 2.f) : 0.f;
+        }
+  }
+
+  // Two nested shells with a tunnel bored through both, so there is empty space inside the
+  // volume to skip and shadows fall across it
+  void makeShells(Volume& out) {
+    makeSyntheticVolume("shells", 64, 64, 64, 1.f, out);
+    const float c = 31.5f;
+    for (uint32_t z = 0; z < 64; z++)
+      for (uint32_t y = 0; y < 64; y++)
+        for (uint32_t x = 0; x < 64; x++) {
+          float dist = glm::length(glm::vec3(x, y, z) - c);
+          float density = 0.f;
+          if (dist >= 26.f && dist < 30.f) density = 0.5f;
+          if (dist >= 12.f && dist < 16.f) density = 0.9f;
+          if (glm::length(glm::vec2(x, y) - c) < 6.f) density = 0.f;
+          out.grid.at(x, y, z) = density;
+        }
+  }
+
+  // Anisotropic slab with a density ramp and a plate one voxel thick, thin features are the
+  // first thing a longer ray step loses
+  void makeSlab(Volume& out) {
+    makeSyntheticVolume("slab", 96, 80, 40, 2.f, out);
+    for (uint32_t z = 0; z < 40; z++)
+      for (uint32_t y = 0; y < 80; y++)
+        for (uint32_t x = 0; x < 96; x++) {
+          float density = 0.f;
+          if (z >= 4 && z < 16 && y >= 8 && y < 72) density = float(x) / 95.f;
+          if (y == 40 && z >= 20 && z < 36) density = 1.f;
+          out.grid.at(x, y, z) = density;
+        }
+  }
+
+  // --- Budgets ---
+
+  // One "<stage> <milliseconds>" per line
+  bool readBudgets(const std::string& path, Budgets& out) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string key;
+    double ms;
+    while (in >> key >> ms) out[key] = ms;
+    return true;
+  }
+
+  bool writeBudgets(const std::string& path, const Budgets& budgets) {
+    std::ofstream out(path, std::ios::trunc);
+    for (const auto& [key, ms] : budgets) out << key << " " << ms << "\n";
+    if (!out) {
+      printf("Failed to write %s\n", path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // Records the stage's time, and unless budgets are being rewritten fails it when it went over
+  void checkStage(const RegressionOptions& options, const Budgets& budgets, const std::string& key,
+                  double ms, Report& report) {
+    report.measured[key] = ms;
+    auto it = budgets.find(key);
+    if (options.update || it == budgets.end()) {
+      printf("  %-32s %9.2f ms%s\n", key.c_str(), ms, options.update ? "" : "  (no budget)");
+      return;
+    }
+
+    double budget = it->second;
+    bool over = ms > budget * options.budget_slack && ms - budget > BUDGET_FLOOR_MS;
+    printf("  %-32s %9.2f ms  budget %9.2f ms%s\n", key.c_str(), ms, budget, over ? "  OVER BUDGET" : "");
+    report.checks++;
+    if (over) report.failures++;
+  }
+
+  // Writes the golden when updating, otherwise compares the frame with it. Frames that fail are
+  // written next to the golden as .actual.ppm for inspection.
+  // Compares against the golden another backend wrote, the frame is saved under its own name
+  // if it drifted. backend names the frame in the report and the saved file.
+  void compareImage(const RegressionOptions& options, const std::string& key, const char* backend,
+                    const char* golden_backend, double min_psnr, double min_ssim,
+                    const graphics::CpuFrame& frame, Report& report) {
+    graphics::Image image;
+    graphics::toImage(frame.albedo, frame.width, frame.height, image);
+
+    std::filesystem::path dir(options.golden_dir);
+    std::string golden_path = (dir / (fileName(key) + "." + golden_backend + ".ppm")).string();
+    if (options.update) {
+      if (std::string(backend) == golden_backend && !graphics::writePpm(golden_path, image)) report.failures++;
+      return;
+    }
+
+    report.checks++;
+    graphics::Image golden;
+    if (!graphics::readPpm(golden_path, golden)) {
+      printf("  %-32s %-3s  no golden at %s\n", key.c_str(), backend, golden_path.c_str());
+      report.failures++;
+      return;
+    }
+
+    double p = graphics::psnr(image, golden);
+    double s = graphics::ssim(image, golden);
+    bool drifted = p < min_psnr || s < min_ssim;
+    printf("  %-32s %-3s  psnr %6.2f dB  ssim %.4f%s\n", key.c_str(), backend, p, s, drifted ? "  DRIFTED" : "");
+    if (drifted) {
+      report.failures++;
+      graphics::writePpm((dir / (fileName(key) + "." + backend + ".actual.ppm")).string(), image);
+    }
+  }
+
+  void checkImage(const RegressionOptions& options, const std::string& key, const char* backend,
+                  const graphics::CpuFrame& frame, Report& report) {
+    compareImage(options, key, backend, backend, options.min_psnr, options.min_ssim, frame, report);
+  }
+
+  // --- Rendering ---
+
+  cam::Camera poseCamera(const Pose& pose, float aspect) {
+    cam::Camera c = cam::makeDefaultCamera();
+    cam::setAspectRatio(c, aspect);
+    cam::orbit(c, pose.yaw, pose.pitch);
+    cam::dolly(c, pose.dolly);
+    cam::updateView(c);
+    cam::updateProject(c);
+    return c;
+  }
+
+  // What the GL side compiles for a pose, the CPU port takes its steps from the same variant
+  graphics::ComputeVariant poseVariant(const Pose& pose) {
+    return graphics::ComputeVariant{ pose.mode, pose.shadows && !pose.lit, false, pose.high_quality, pose.occlusion };
+  }
+
+  graphics::CpuRenderParams renderParams(const cam::Camera& c, const Volume& volume, const controls::WinData& window,
+                                         const Pose& pose, const RegressionOptions& options) {
+    graphics::CpuRenderParams params{};
+    params.view          = c.view;
+    params.proj          = c.proj;
+    params.cam           = c.position;
+    params.volume_scale  = graphics::volumeScale(volume.meta, window.scale);
+    params.width         = options.width;
+    params.height        = options.height;
+    params.win_center    = window.win_center;
+    params.win_width     = window.win_width;
+    params.density_scale = window.density_scale;
+    params.mode          = pose.mode;
+    params.shadows       = pose.shadows && !pose.lit;
+    params.occlusion     = pose.occlusion ? &volume.occlusion : nullptr;
+    params.step_size     = graphics::stepSize(poseVariant(pose));
+    params.max_steps     = graphics::maxSteps(poseVariant(pose));
+    return params;
+  }
+
+  bool initGl(const RegressionOptions& options, GlRenderer& gl) {
+    AppConfig config{
+      .title    = "VoxRay regression",
+      .width    = int(options.width),
+      .height   = int(options.height),
+      .gl_major = 4,
+      .gl_minor = 3,
+      .hidden   = true
+    };
+    try {
+      gl.app = makeApp(config);
+    } catch (const std::exception& e) {
+      printf("No GL context for the regression run: %s\n", e.what());
+      return false;
+    }
+
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) {
+      printf("Failed to initialize GLEW\n");
+      return false;
+    }
+    auto renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    printf("GL_RENDERER=%s\n", renderer ? renderer : "?");
+
+    // Programs stay in memory, a stale binary must never stand in for the shader under test
+    graphics::initShaderCache("", gl.shaders);
+
+    if (!graphics::makeBuffer(GL_UNIFORM_BUFFER, sizeof(CameraBlock), nullptr, GL_DYNAMIC_DRAW, gl.camera_block)) return false;
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, gl.camera_block.id);
+
+    std::vector<uint8_t> bytes;
+    graphics::serializeLights(regressionLights(), bytes);
+    if (!graphics::makeBuffer(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(bytes.size()), bytes.data(), GL_STATIC_DRAW, gl.lights)) return false;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, gl.lights.id);
+
+    // Every pass, as the viewer writes them with deferred lighting on, since the lit poses read them
+    return graphics::makeRenderTargets(int(options.width), int(options.height), graphics::RenderTargetLayout{}, gl.targets);
+  }
+
+  void uploadGl(const Volume& volume, GlRenderer& gl) {
+    const preprocessing::VoxelGrid& grid = volume.grid;
+    graphics::destroy(gl.density);
+    graphics::destroy(gl.normals);
+    graphics::destroy(gl.distance);
+    graphics::destroy(gl.occlusion);
+    graphics::destroy(gl.octree);
+
+    graphics::makeTexture3D(GL_R32F, grid.width, grid.height, grid.depth, gl.density);
+    graphics::uploadTexture3D(gl.density, grid.data.data());
+    graphics::makeTexture3D(GL_RGBA32F, grid.width, grid.height, grid.depth, gl.normals);
+    graphics::uploadTexture3D(gl.normals, grid.normals.data());
+
+    const preprocessing::DistanceField& field = volume.distance;
+    graphics::makeTexture3D(GL_R8, field.width, field.height, field.depth, gl.distance);
+    graphics::uploadTexture3D(gl.distance, field.distance.data());
+
+    const preprocessing::OcclusionVolume& occlusion = volume.occlusion;
+    graphics::makeTexture3D(GL_R8, occlusion.width, occlusion.height, occlusion.depth, gl.occlusion);
+    graphics::uploadTexture3D(gl.occlusion, occlusion.visibility.data());
+
+    std::vector<uint8_t> bytes;
+    preprocessing::serializeOctree(volume.octree, bytes);
+    graphics::makeBuffer(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(bytes.size()), bytes.data(), GL_STATIC_DRAW, gl.octree);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gl.octree.id);
+  }
+
+  // Only the dispatches are timed, the programs are compiled before the clock starts
+  bool renderGl(GlRenderer& gl, const Volume& volume, const Pose& pose, const graphics::CpuRenderParams& params,
+                graphics::CpuFrame& out, double& ms) {
+    graphics::ComputeVariant variant = poseVariant(pose);
+    graphics::Program program{};
+    std::string error;
+    if (!graphics::computeProgram(gl.shaders, COMPUTE_PATH, graphics::computeVariantDefines(variant, gl.targets.layout), program, &error)) {
+      printf("%s\n", error.c_str());
+      return false;
+    }
+    graphics::Program lighting{};
+    if (pose.lit && !graphics::computeProgram(gl.shaders, LIGHTING_PATH, graphics::renderTargetDefines(gl.targets.layout), lighting, &error)) {
+      printf("%s\n", error.c_str());
+      return false;
+    }
+    glProgramUniform1f(program.id, 0, volume.distance.threshold);
+    glProgramUniform1i(program.id, 1, int(params.mode));
+    glProgramUniform3f(program.id, 2, 0.f, 0.f, 0.f);
+    glProgramUniform3f(program.id, 3, 1.f, 1.f, 1.f);
+    glProgramUniform1i(program.id, 4, 0);
+    glProgramUniform1i(program.id, 5, variant.occlusion ? 1 : 0);
+
+    CameraBlock block{ params.view, params.proj, glm::vec4(params.cam, 1.f), glm::vec4(params.volume_scale, 0.f),
+                       params.width, params.height, params.win_center, params.win_width, params.density_scale };
+    glNamedBufferSubData(gl.camera_block.id, 0, sizeof(block), &block);
+
+    graphics::useProgram(program);
+    graphics::bindTexture3D(gl.density, 0);
+    graphics::bindTexture3D(gl.normals, 1);
+    graphics::bindTexture3D(gl.distance, 3);
+    graphics::bindTexture3D(gl.occlusion, 5);
+    graphics::bindForCompute(gl.targets);
+
+    GLuint gx = (params.width + 16 - 1) / 16;
+    GLuint gy = (params.height + 16 - 1) / 16;
+    Clock::time_point start = Clock::now();
+    glDispatchCompute(gx, gy, 1);
+    if (pose.lit) {
+      glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+      graphics::useProgram(lighting);
+      glProgramUniform1i(lighting.id, 0, pose.shadows ? 1 : 0);
+      graphics::bindForLighting(gl.targets);
+      glDispatchCompute(gx, gy, 1);
+    }
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glFinish();
+    ms = millisecondsSince(start);
+
+    out.width = params.width;
+    out.height = params.height;
+    out.albedo.resize((size_t)params.width * params.height);
+    glGetTextureImage(gl.targets.albedo.id, 0, GL_RGBA, GL_FLOAT, GLsizei(out.albedo.size() * sizeof(glm::vec4)), out.albedo.data());
+    return true;
+  }
+
+  void destroyGl(const GlRenderer& gl) {
+    graphics::destroy(gl.shaders);
+    graphics::destroy(gl.camera_block);
+    graphics::destroy(gl.targets);
+    graphics::destroy(gl.density);
+    graphics::destroy(gl.normals);
+    graphics::destroy(gl.distance);
+    graphics::destroy(gl.occlusion);
+    graphics::destroy(gl.octree);
+    graphics::destroy(gl.lights);
+  }
+
+  // Preprocesses the volume like the series cache does, then renders every pose
+  // import_ms is only given for volumes read from disk
+  void runVolume(const RegressionOptions& options, const Budgets& budgets, Volume& volume,
+                 GlRenderer* gl, Report& report, double import_ms = -1.0) {
+    printf("%s (%u x %u x %u)\n", volume.name.c_str(), volume.grid.width, volume.grid.height, volume.grid.depth);
+    if (import_ms >= 0.0) checkStage(options, budgets, volume.name + "/import", import_ms, report);
+    controls::WinData window;   // What the viewer opens with
+    const lights::light_set lights = regressionLights();
+
+    Clock::time_point start = Clock::now();
+    preprocessing::computeGradientKernel(volume.grid);
+    preprocessing::gaussianBlur(volume.grid);
+    checkStage(options, budgets, volume.name + "/gradient", millisecondsSince(start), report);
+
+    start = Clock::now();
+    preprocessing::buildMinMaxOctree(volume.grid, volume.octree);
+    checkStage(options, budgets, volume.name + "/octree", millisecondsSince(start), report);
+
+    start = Clock::now();
+    float cutoff = graphics::windowThreshold(window.win_center, window.win_width, window.density_scale);
+    preprocessing::computeDistanceField(volume.grid, cutoff, volume.distance);
+    checkStage(options, budgets, volume.name + "/distance", millisecondsSince(start), report);
+
+    start = Clock::now();
+    preprocessing::computeAmbientOcclusion(volume.grid, window.win_center, window.win_width, window.density_scale,
+                                           volume.occlusion);
+    checkStage(options, budgets, volume.name + "/occlusion", millisecondsSince(start), report);
+
+    if (gl) uploadGl(volume, *gl);
+
+    // Workers fork with the prepared grid, each copies out its slab and builds its own octree
+    graphics::SortLastRenderer sort_last;
+    if (options.sort_last_workers &&
+        !graphics::startSortLast(volume.grid, options.sort_last_workers, options.width, options.height, sort_last)) {
+      report.failures++;
+    }
+
+    for (const Pose& pose : POSES) {
+      std::string key = volume.name + "/" + pose.name;
+      cam::Camera camera = poseCamera(pose, float(options.width) / options.height);
+      graphics::CpuRenderParams params = renderParams(camera, volume, window, pose, options);
+
+      graphics::CpuFrame frame;
+      start = Clock::now();
+      graphics::renderCpu(volume.grid, &volume.octree, &volume.distance, params, frame);
+      if (pose.lit) graphics::applyLighting(volume.grid, params, lights, pose.shadows, frame);
+      checkStage(options, budgets, key + "/cpu", millisecondsSince(start), report);
+      checkImage(options, key, "cpu", frame, report);
+
+      // Held to the single process golden, with looser floors for the per-ray terms slabs can't
+      // carry across their boundaries. Workers neither sample occlusion nor light their partials,
+      // so those poses are skipped.
+      if (sort_last.shared && !pose.occlusion && !pose.lit) {
+        graphics::CpuFrame composited;
+        start = Clock::now();
+        if (graphics::renderSortLast(sort_last, params, composited)) {
+          checkStage(options, budgets, key + "/sortlast", millisecondsSince(start), report);
+          compareImage(options, key, "sl", "cpu", SORT_LAST_MIN_PSNR, SORT_LAST_MIN_SSIM, composited, report);
+        } else {
+          report.failures++;
+        }
+      }
+
+      if (!gl) continue;
+      double ms = 0.0;
+      if (!renderGl(*gl, volume, pose, params, frame, ms)) {
+        report.failures++;
+        continue;
+      }
+      checkStage(options, budgets, key + "/gl", ms, report);
+      // lighting.glsl is held to applyLighting() directly rather than to a GL golden of its own
+      if (pose.lit) compareImage(options, key, "gl", "cpu", LIGHTING_MIN_PSNR, LIGHTING_MIN_SSIM, frame, report);
+      else checkImage(options, key, "gl", frame, report);
+    }
+    graphics::stopSortLast(sort_last);
+  }
+}
+
+bool parseRegressionOptions(int argc, char* argv[], RegressionOptions& out) {
+  if (argc < 3) {
+    printf("Usage: VoxRay --regress <golden directory> [--update] [--gl] [--min-psnr <dB>] [--min-ssim <0..1>] "
+           "[--budget-slack <factor>] [--sort-last <workers>] [DICOM directory...]\n");
+    return false;
+  }
+
+  out.golden_dir = argv[2];
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--update") {
+      out.update = true;
+    } else if (arg == "--gl") {
+      out.gl = true;
+    } else if (arg == "--sort-last") {
+      if (i + 1 >= argc) {
+        printf("%s needs a worker count\n", arg.c_str());
+        return false;
+      }
+      out.sort_last_workers = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--min-psnr" || arg == "--min-ssim" || arg == "--budget-slack") {
+      if (i + 1 >= argc) {
+        printf("%s needs a value\n", arg.c_str());
+        return false;
+      }
+      double value = std::strtod(argv[++i], nullptr);
+      if (!(value > 0.0)) {
+        printf("Invalid %s value %s\n", arg.c_str(), argv[i]);
+        return false;
+      }
+      if (arg == "--min-psnr") out.min_psnr = value;
+      else if (arg == "--min-ssim") out.min_ssim = value;
+      else out.budget_slack = value;
+    } else {
+      out.volumes.push_back(arg);
+    }
+  }
+  return true;
+}
+
+bool runRegression(const RegressionOptions& options) {
+  std::string budget_path = (std::filesystem::path(options.golden_dir) / BUDGET_FILE).string();
+  Budgets budgets;
+  if (options.update) {
+    std::error_code ec;
+    std::filesystem::create_directories(options.golden_dir, ec);
+    if (ec) {
+      printf("Failed to create %s: %s\n", options.golden_dir.c_str(), ec.message().c_str());
+      return false;
+    }
+  } else if (!readBudgets(budget_path, budgets)) {
+    printf("No budgets at %s, only image quality is checked\n", budget_path.c_str());
+  }
+
+  GlRenderer gl;
+  if (options.gl && !initGl(options, gl)) return false;
+  GlRenderer* gl_renderer = options.gl ? &gl : nullptr;
+
+  Report report;
+  for (void (*make)(Volume&) : { makeSphere, makeShells, makeSlab }) {
+    Volume volume;
+    make(volume);
+    runVolume(options, budgets, volume, gl_renderer, report);
+  }
+
+  for (const std::string& directory : options.volumes) {
+    std::filesystem::path path(directory);
+    if (path.filename().empty()) path = path.parent_path();
+
+    Volume volume;
+    volume.name = path.filename().string();
+    Clock::time_point start = Clock::now();
+    if (!preprocessing::importDicomSeries(directory, volume.grid, volume.meta)) {
+      printf("Failed to import %s\n", directory.c_str());
+      report.failures++;
+      continue;
+    }
+    runVolume(options, budgets, volume, gl_renderer, report, millisecondsSince(start));
+  }
+
+  if (options.gl) destroyGl(gl);
+
+  if (options.update) {
+    if (!writeBudgets(budget_path, report.measured)) return false;
+    printf("Wrote goldens and %zu budgets to %s\n", report.measured.size(), options.golden_dir.c_str());
+    return report.failures == 0;
+  }
+
+  printf("%d of %d checks failed\n", report.failures, report.checks);
+  return report.failures == 0;
+}
+
+} // namespace regress
@@ -0,0 +1,30 @@
+// app/regression.hpp
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace regress {
+
+  // Renders a fixed set of volumes from scripted camera poses and compares every frame against a
+  // golden image, so changes to the march loop can't drift image quality unnoticed. Every
+  // preprocessing stage and render is timed against a budget recorded alongside the goldens.
+  struct RegressionOptions {
+    std::string golden_dir;
+    std::vector<std::string> volumes;   // DICOM directories rendered after the synthetic volumes
+    bool update = false;                // Rewrite goldens and budgets from this run instead
+    bool gl = false;                    // Also render with the compute shader in a hidden window
+    uint32_t sort_last_workers = 0;     // Also render sort-last across this many worker processes
+    double min_psnr = 40.0;
+    double min_ssim = 0.98;
+    double budget_slack = 1.5;          // A stage fails once it takes this many times its budget
+    uint32_t width = 256, height = 256;
+  };
+
+  // Takes everything after --regress, the first argument is the golden directory
+  bool parseRegressionOptions(int argc, char* argv[], RegressionOptions& out);
+
+  // True when every frame matched and every stage was within budget
+  bool runRegression(const RegressionOptions& options);
+
+} // namespace regress
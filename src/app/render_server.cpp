@@ -0,0 +1,570 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "render_server.hpp"
+#include "camera.hpp"
+#include "series_cache.hpp"
+#include "graphics/cpu_raymarch.hpp"
+#include "graphics/deferred_lighting.hpp"
+#include "graphics/shader_variants.hpp"
+#include "graphics/volume_transform.hpp"
+#include "preprocessing/paged_volume.hpp"
+
+namespace server {
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  // Memory allowed for preprocessed series, the same as the viewer's cache
+  constexpr size_t SERIES_CACHE_BUDGET = size_t(8) << 30;
+  constexpr unsigned SERIES_LOAD_THREADS = 2;
+
+  // How often the accept loop wakes to notice a stop signal and reap finished sessions
+  constexpr int ACCEPT_POLL_MS = 200;
+
+  // Overviews of brick files are capped like the viewer's
+  constexpr uint32_t OVERVIEW_MAX_DIM = 512;
+
+  volatile std::sig_atomic_t stop_requested = 0;
+
+  void onStopSignal(int) { stop_requested = 1; }
+
+  double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  }
+
+  bool isBrickFile(const std::string& path) {
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".vxb") == 0;
+  }
+
+  bool socketAddress(const std::string& path, sockaddr_un& out) {
+    out = sockaddr_un{};
+    out.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(out.sun_path)) {
+      printf("Socket path %s is too long\n", path.c_str());
+      return false;
+    }
+    std::memcpy(out.sun_path, path.c_str(), path.size() + 1);
+    return true;
+  }
+
+  // One connected client. The reader thread only parses requests into pending, the render
+  // thread takes whatever is newest once it is free, so requests never queue up behind a frame.
+  struct Session {
+    int fd = -1;
+    uint32_t id = 0;
+    std::thread reader, renderer;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    stream::ViewRequest pending;
+    bool has_pending = false;
+    uint32_t coalesced = 0;             // Replaced since the last frame
+    bool closed = false;
+    std::string error;                  // Sent to the client before hanging up
+
+    std::atomic<int> running{0};        // Threads still going
+
+    // Only touched by the render thread
+    uint32_t frames = 0;
+    uint32_t total_coalesced = 0;
+    uint64_t bytes_sent = 0, raw_bytes = 0;
+    double render_ms = 0.0;
+  };
+
+  struct Server {
+    const ServerOptions& options;
+    series::SeriesCache cache;
+    std::list<preprocessing::PagedVolume> paged;    // Brick files the overviews are read from
+    std::vector<std::string> uids;                  // What HELLO lists, in order
+    lights::light_set lights = lights::defaultLights();
+    std::list<std::unique_ptr<Session>> sessions;
+    uint32_t next_id = 1;
+  };
+
+  void closeSession(Session& session, const std::string& error = "") {
+    {
+      std::lock_guard<std::mutex> lock(session.mutex);
+      if (session.error.empty()) session.error = error;
+      session.closed = true;
+    }
+    session.cv.notify_all();
+  }
+
+  void readRequests(const Server& server, Session& session) {
+    stream::MessageType type;
+    std::vector<uint8_t> payload;
+    while (stream::receiveMessage(session.fd, type, payload)) {
+      stream::ViewRequest view;
+      if (type != stream::MessageType::VIEW || !stream::readView(payload, view)) {
+        closeSession(session, "Malformed request");
+        break;
+      }
+      uint32_t max = server.options.max_frame_size;
+      if (view.volume >= server.uids.size() || view.width == 0 || view.height == 0 ||
+          view.width > max || view.height > max) {
+        closeSession(session, "Request out of range");
+        break;
+      }
+
+      std::lock_guard<std::mutex> lock(session.mutex);
+      if (session.has_pending) session.coalesced++;
+      session.pending = view;
+      session.has_pending = true;
+      session.cv.notify_all();
+    }
+    closeSession(session);
+    session.running--;
+  }
+
+  graphics::CpuRenderParams renderParams(const stream::ViewRequest& view, const preprocessing::DicomMetadata& meta) {
+    cam::Camera c;
+    c.position = view.position;
+    c.forward  = view.forward;
+    c.up       = view.up;
+    c.fov_deg  = view.fov_deg;
+    cam::setAspectRatio(c, float(view.width) / view.height);
+    cam::updateView(c);
+    cam::updateProject(c);
+
+    const controls::WinData& window = view.window;
+    graphics::CpuRenderParams params{};
+    params.view          = c.view;
+    params.proj          = c.proj;
+    params.cam           = c.position;
+    params.volume_scale  = graphics::volumeScale(meta, window.scale);
+    params.width         = view.width;
+    params.height        = view.height;
+    params.win_center    = window.win_center;
+    params.win_width     = window.win_width;
+    params.density_scale = window.density_scale;
+    params.mode          = window.mode;
+    params.shadows       = window.shadows && !window.deferred_lighting;
+    params.crop_min      = glm::vec3(window.crop_min[0], window.crop_min[1], window.crop_min[2]);
+    params.crop_max      = glm::vec3(window.crop_max[0], window.crop_max[1], window.crop_max[2]);
+    // high_quality isn't sent, so this is always the interactive step
+    graphics::ComputeVariant variant = graphics::computeVariant(window, false, false);
+    params.step_size     = graphics::stepSize(variant);
+    params.max_steps     = graphics::maxSteps(variant);
+    return params;
+  }
+
+  void renderRequests(Server& server, Session& session) {
+    graphics::Image previous;
+    bool has_previous = false;
+    std::vector<uint8_t> pixels, payload;
+
+    while (true) {
+      stream::ViewRequest view;
+      uint32_t coalesced = 0;
+      {
+        std::unique_lock<std::mutex> lock(session.mutex);
+        session.cv.wait(lock, [&] { return session.has_pending || session.closed; });
+        if (session.closed) break;
+        view = session.pending;
+        coalesced = session.coalesced;
+        session.has_pending = false;
+        session.coalesced = 0;
+      }
+
+      // Blocks only the first time a volume is asked for while it is still preprocessing
+      // and gives up once the client hangs up or the server is stopping
+      bool cancelled = false;
+      series::SeriesRef series = series::waitForSeries(server.cache, server.uids[view.volume], [&] {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        cancelled = session.closed || stop_requested;
+        return cancelled;
+      });
+      if (cancelled) break;
+      if (!series) {
+        closeSession(session, "Failed to load " + server.uids[view.volume]);
+        break;
+      }
+
+      Clock::time_point start = Clock::now();
+      graphics::CpuFrame frame;
+      graphics::CpuRenderParams params = renderParams(view, series->meta);
+      graphics::renderCpu(series->grid, &series->octree, nullptr, params, frame);
+      if (view.window.deferred_lighting) graphics::applyLighting(series->grid, params, server.lights, view.window.shadows, frame);
+      double render_ms = millisecondsSince(start);
+
+      start = Clock::now();
+      graphics::Image image;
+      graphics::toImage(frame.albedo, frame.width, frame.height, image);
+      stream::FrameHeader header;
+      header.seq = view.seq;
+      header.coalesced = coalesced;
+      header.width = view.width;
+      header.height = view.height;
+      header.encoding = stream::encodeFrame(image, has_previous ? &previous : nullptr, view.encoding, pixels);
+      header.render_ms = float(render_ms);
+      header.encode_ms = float(millisecondsSince(start));
+      stream::writeFrame(header, pixels, payload);
+      if (!stream::sendMessage(session.fd, stream::MessageType::FRAME, payload)) break;
+
+      previous = std::move(image);
+      has_previous = true;
+      session.frames++;
+      session.total_coalesced += coalesced;
+      session.bytes_sent += payload.size();
+      session.raw_bytes += previous.rgb.size();
+      session.render_ms += render_ms;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(session.mutex);
+      if (!session.error.empty()) {
+        std::vector<uint8_t> message(session.error.begin(), session.error.end());
+        stream::sendMessage(session.fd, stream::MessageType::ERROR, message);
+        printf("Session %u: %s\n", session.id, session.error.c_str());
+      }
+    }
+    // Wakes the reader if it is still blocked on the socket
+    shutdown(session.fd, SHUT_RDWR);
+    session.running--;
+  }
+
+  void printSessionStats(const Session& session) {
+    double ratio = session.raw_bytes ? 100.0 * session.bytes_sent / session.raw_bytes : 0.0;
+    printf("Session %u closed: %u frames, %u requests coalesced, %.1f KiB sent (%.1f%% of raw), %.2f ms mean render\n",
+           session.id, session.frames, session.total_coalesced, session.bytes_sent / 1024.0, ratio,
+           session.frames ? session.render_ms / session.frames : 0.0);
+  }
+
+  void finishSession(Session& session) {
+    if (session.reader.joinable()) session.reader.join();
+    if (session.renderer.joinable()) session.renderer.join();
+    close(session.fd);
+    printSessionStats(session);
+  }
+
+  void reapSessions(Server& server) {
+    for (auto it = server.sessions.begin(); it != server.sessions.end();) {
+      if ((*it)->running > 0) {
+        ++it;
+        continue;
+      }
+      finishSession(**it);
+      it = server.sessions.erase(it);
+    }
+  }
+
+  void acceptSession(Server& server, int fd) {
+    if (server.sessions.size() >= server.options.max_sessions) {
+      std::string error = "Server is full";
+      stream::sendMessage(fd, stream::MessageType::ERROR, std::vector<uint8_t>(error.begin(), error.end()));
+      close(fd);
+      return;
+    }
+
+    std::vector<uint8_t> hello;
+    stream::writeHello(server.uids, hello);
+    if (!stream::sendMessage(fd, stream::MessageType::HELLO, hello)) {
+      close(fd);
+      return;
+    }
+
+    auto session = std::make_unique<Session>();
+    session->fd = fd;
+    session->id = server.next_id++;
+    session->running = 2;
+    Session& s = *session;
+    s.reader = std::thread(readRequests, std::cref(server), std::ref(s));
+    s.renderer = std::thread(renderRequests, std::ref(server), std::ref(s));
+    server.sessions.push_back(std::move(session));
+    printf("Session %u opened\n", s.id);
+  }
+
+  bool registerVolumes(Server& server) {
+    for (const std::string& path : server.options.volumes) {
+      if (!isBrickFile(path)) {
+        series::discoverSeries(server.cache, path);
+        continue;
+      }
+      preprocessing::PagedVolume& volume = server.paged.emplace_back();
+      if (!preprocessing::openPagedVolume(path, preprocessing::PagedVolumeConfig{}, volume)) {
+        printf("Failed to open paged volume %s\n", path.c_str());
+        return false;
+      }
+      series::addSeries(server.cache, path, [&volume](series::LoadedSeries& out) {
+        return preprocessing::buildOverview(volume, OVERVIEW_MAX_DIM, out.grid, out.meta);
+      });
+    }
+
+    for (const series::SeriesStatus& status : series::listSeries(server.cache)) server.uids.push_back(status.uid);
+    if (server.uids.empty()) {
+      printf("No volumes to serve\n");
+      return false;
+    }
+    for (size_t i = 0; i < server.uids.size(); i++) printf("  [%zu] %s\n", i, server.uids[i].c_str());
+    return true;
+  }
+
+  bool parseEncoding(const std::string& name, stream::FrameEncoding& out) {
+    if (name == "raw") out = stream::FrameEncoding::RAW;
+    else if (name == "rle") out = stream::FrameEncoding::RLE;
+    else if (name == "delta") out = stream::FrameEncoding::DELTA;
+    else return false;
+    return true;
+  }
+
+  const char* encodingName(stream::FrameEncoding encoding) {
+    switch (encoding) {
+      case stream::FrameEncoding::RLE:   return "rle";
+      case stream::FrameEncoding::DELTA: return "delta";
+      default:                           return "raw";
+    }
+  }
+
+  double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, size_t(p * (values.size() - 1) + 0.5))];
+  }
+}
+
+bool parseServerOptions(int argc, char* argv[], ServerOptions& out) {
+  if (argc < 4) {
+    printf("Usage: VoxRay --serve <socket path> [--max-sessions <count>] [--max-size <pixels>] "
+           "<DICOM directory or .vxb>...\n");
+    return false;
+  }
+
+  out.socket_path = argv[2];
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--max-sessions" || arg == "--max-size") {
+      if (i + 1 >= argc) {
+        printf("%s needs a value\n", arg.c_str());
+        return false;
+      }
+      unsigned long value = std::strtoul(argv[++i], nullptr, 10);
+      if (value == 0 || (arg == "--max-size" && value > stream::MAX_FRAME_SIZE)) {
+        printf("Invalid %s value %s\n", arg.c_str(), argv[i]);
+        return false;
+      }
+      if (arg == "--max-sessions") out.max_sessions = uint32_t(value);
+      else out.max_frame_size = uint32_t(value);
+    } else {
+      out.volumes.push_back(arg);
+    }
+  }
+  if (out.volumes.empty()) {
+    printf("Must pass at least one volume to serve\n");
+    return false;
+  }
+  return true;
+}
+
+bool runServer(const ServerOptions& options) {
+  Server server{ options };
+  series::startSeriesCache(server.cache, SERIES_CACHE_BUDGET, SERIES_LOAD_THREADS);
+  if (!registerVolumes(server)) return false;
+  series::preloadSeries(server.cache);
+
+  sockaddr_un address;
+  if (!socketAddress(options.socket_path, address)) return false;
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    printf("Failed to create socket: %s\n", std::strerror(errno));
+    return false;
+  }
+  // A socket file left behind by a server that didn't shut down cleanly would block the bind
+  unlink(options.socket_path.c_str());
+  if (bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 ||
+      listen(listener, int(options.max_sessions)) < 0) {
+    printf("Failed to listen on %s: %s\n", options.socket_path.c_str(), std::strerror(errno));
+    close(listener);
+    return false;
+  }
+
+  struct sigaction action{};
+  action.sa_handler = onStopSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  printf("Serving %zu volumes on %s\n", server.uids.size(), options.socket_path.c_str());
+
+  while (!stop_requested) {
+    pollfd listening{ listener, POLLIN, 0 };
+    int ready = poll(&listening, 1, ACCEPT_POLL_MS);
+    reapSessions(server);
+    if (ready <= 0) continue;
+
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd >= 0) acceptSession(server, fd);
+  }
+
+  printf("Stopping, %zu sessions open\n", server.sessions.size());
+  for (auto& session : server.sessions) {
+    shutdown(session->fd, SHUT_RDWR);
+    closeSession(*session);
+  }
+  for (auto& session : server.sessions) finishSession(*session);
+  server.sessions.clear();
+
+  close(listener);
+  unlink(options.socket_path.c_str());
+  series::stopSeriesCache(server.cache);
+  return true;
+}
+
+bool parseClientOptions(int argc, char* argv[], ClientOptions& out) {
+  if (argc < 3) {
+    printf("Usage: VoxRay --client <socket path> [--volume <index>] [--encoding raw|rle|delta] "
+           "[--size <width>x<height>] [--bursts <count>] [--burst-size <count>] [--out <frame.ppm>]\n");
+    return false;
+  }
+
+  out.socket_path = argv[2];
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      printf("%s needs a value\n", arg.c_str());
+      return false;
+    }
+    std::string value = argv[++i];
+    bool ok = true;
+    if (arg == "--volume") {
+      out.volume = uint32_t(std::strtoul(value.c_str(), nullptr, 10));
+    } else if (arg == "--encoding") {
+      ok = parseEncoding(value, out.encoding);
+    } else if (arg == "--size") {
+      ok = std::sscanf(value.c_str(), "%ux%u", &out.width, &out.height) == 2 && out.width > 0 && out.height > 0 &&
+           out.width <= stream::MAX_FRAME_SIZE && out.height <= stream::MAX_FRAME_SIZE;
+    } else if (arg == "--bursts" || arg == "--burst-size") {
+      uint32_t count = uint32_t(std::strtoul(value.c_str(), nullptr, 10));
+      ok = count > 0;
+      if (arg == "--bursts") out.bursts = count;
+      else out.burst_size = count;
+    } else if (arg == "--out") {
+      out.out_path = value;
+    } else {
+      printf("Unknown option %s\n", arg.c_str());
+      return false;
+    }
+    if (!ok) {
+      printf("Invalid %s value %s\n", arg.c_str(), value.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool runClient(const ClientOptions& options) {
+  sockaddr_un address;
+  if (!socketAddress(options.socket_path, address)) return false;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+    printf("Failed to connect to %s: %s\n", options.socket_path.c_str(), std::strerror(errno));
+    if (fd >= 0) close(fd);
+    return false;
+  }
+
+  stream::MessageType type;
+  std::vector<uint8_t> payload;
+  std::vector<std::string> volumes;
+  bool ok = stream::receiveMessage(fd, type, payload);
+  if (ok && type == stream::MessageType::ERROR) {
+    printf("Server: %.*s\n", int(payload.size()), reinterpret_cast<const char*>(payload.data()));
+    ok = false;
+  } else if (!ok || type != stream::MessageType::HELLO || !stream::readHello(payload, volumes)) {
+    printf("No greeting from the server\n");
+    ok = false;
+  } else if (options.volume >= volumes.size()) {
+    printf("The server has %zu volumes, there is no volume %u\n", volumes.size(), options.volume);
+    ok = false;
+  }
+  if (!ok) {
+    close(fd);
+    return false;
+  }
+  printf("Rendering %s at %u x %u, %s frames\n", volumes[options.volume].c_str(), options.width, options.height,
+         encodingName(options.encoding));
+
+  // Orbits a full turn over the run, each request of a burst a little further round
+  cam::Camera camera = cam::makeDefaultCamera();
+  const float step = 6.2831853f / float(options.bursts * options.burst_size);
+
+  stream::ViewRequest view;
+  view.volume = options.volume;
+  view.width = uint16_t(options.width);
+  view.height = uint16_t(options.height);
+  view.encoding = options.encoding;
+  view.fov_deg = camera.fov_deg;
+
+  graphics::Image image;
+  std::vector<double> latency_ms;
+  uint32_t frames = 0, coalesced = 0, requests = 0;
+  uint64_t bytes = 0;
+  double render_ms = 0.0;
+  uint32_t counts[3] = {};
+
+  for (uint32_t burst = 0; burst < options.bursts && ok; burst++) {
+    Clock::time_point sent = Clock::now();
+    for (uint32_t r = 0; r < options.burst_size && ok; r++) {
+      cam::orbit(camera, step, 0.f);
+      view.seq = ++requests;
+      view.position = camera.position;
+      view.forward = camera.forward;
+      view.up = camera.up;
+      stream::writeView(view, payload);
+      ok = stream::sendMessage(fd, stream::MessageType::VIEW, payload);
+    }
+
+    // Frames for earlier requests of the burst can still arrive first, the deltas need them all
+    stream::FrameHeader header;
+    while (ok) {
+      const uint8_t* pixels = nullptr;
+      size_t size = 0;
+      ok = stream::receiveMessage(fd, type, payload);
+      if (ok && type == stream::MessageType::ERROR) {
+        printf("Server: %.*s\n", int(payload.size()), reinterpret_cast<const char*>(payload.data()));
+        ok = false;
+      }
+      ok = ok && type == stream::MessageType::FRAME && stream::readFrame(payload, header, pixels, size) &&
+           stream::decodeFrame(header, pixels, size, image);
+      if (!ok) break;
+
+      frames++;
+      coalesced += header.coalesced;
+      bytes += payload.size();
+      render_ms += header.render_ms;
+      counts[uint8_t(header.encoding)]++;
+      if (header.seq == requests) break;
+    }
+    if (ok) latency_ms.push_back(millisecondsSince(sent));
+  }
+  close(fd);
+
+  if (frames) {
+    uint64_t raw = uint64_t(frames) * options.width * options.height * 3;
+    double total = 0.0;
+    for (double ms : latency_ms) total += ms;
+    printf("%u requests, %u frames, %u coalesced on the server\n", requests, frames, coalesced);
+    printf("  %.1f KiB received, %.1f%% of raw (%u raw, %u rle, %u delta)\n", bytes / 1024.0, 100.0 * bytes / raw,
+           counts[0], counts[1], counts[2]);
+    printf("  burst latency mean %.2f ms  p95 %.2f ms, server render mean %.2f ms\n",
+           latency_ms.empty() ? 0.0 : total / latency_ms.size(), percentile(latency_ms, 0.95), render_ms / frames);
+  }
+  if (ok && !options.out_path.empty()) ok = graphics::writePpm(options.out_path, image);
+  return ok;
+}
+
+} // namespace server
@@ -0,0 +1,46 @@
+// app/render_server.hpp
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_stream.hpp"
+
+namespace server {
+
+  // Headless rendering for clients that can't run the viewer. Volumes are preprocessed into the
+  // series cache once and stay resident, clients connect over a Unix socket, send camera and
+  // window requests and get encoded frames back (see app/frame_stream.hpp). Every session has
+  // its own render thread, and requests that arrive while it is busy replace each other, so a
+  // burst of camera updates only renders the latest.
+  struct ServerOptions {
+    std::string socket_path;
+    std::vector<std::string> volumes;     // DICOM directories or .vxb brick files
+    uint32_t max_sessions = 8;
+    uint32_t max_frame_size = 2048;       // Largest frame edge a client may ask for
+  };
+
+  // Takes everything after --serve, the first argument is the socket path
+  bool parseServerOptions(int argc, char* argv[], ServerOptions& out);
+
+  // Serves until SIGINT or SIGTERM
+  bool runServer(const ServerOptions& options);
+
+  // Stand-in for a thin client. Orbits the default camera in bursts of requests, waits for the
+  // frame answering the last of each burst and reports sizes, latencies and what was coalesced.
+  struct ClientOptions {
+    std::string socket_path;
+    uint32_t volume = 0;
+    stream::FrameEncoding encoding = stream::FrameEncoding::DELTA;
+    uint32_t width = 512, height = 512;
+    uint32_t bursts = 60;
+    uint32_t burst_size = 4;              // Requests sent back to back before waiting
+    std::string out_path;                 // Last frame as a PPM, if set
+  };
+
+  // Takes everything after --client, the first argument is the socket path
+  bool parseClientOptions(int argc, char* argv[], ClientOptions& out);
+
+  bool runClient(const ClientOptions& options);
+
+} // namespace server
@@ -0,0 +1,374 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+#include "preprocessing/compute_gradient.hpp"
+#include "preprocessing/downsample.hpp"
+#include "preprocessing/gaussian_blur.hpp"
+
+#include "series_cache.hpp"
+
+namespace series {
+
+namespace {
+  // How often waitForSeries() checks whether its caller has given up
+  constexpr std::chrono::milliseconds WAIT_POLL_INTERVAL(100);
+
+  uint64_t nextGeneration() {
+    static std::atomic<uint64_t> generation{0};
+    return ++generation;
+  }
+
+  size_t seriesBytes(const LoadedSeries& series) {
+    return (series.grid.data.size() + series.raw.data.size()) * sizeof(float) + series.grid.normals.size() * sizeof(float4) +
+           series.octree.nodes.size() * sizeof(float2) + series.histogram.counts.size() * sizeof(uint64_t);
+  }
+
+  // Caller holds cache.mutex
+  // Series still referenced outside the cache (e.g. the one on screen) are never evicted. An
+  // evicted series keeps its compressed copy, those go least recently used first once there is
+  // no full series left to evict.
+  void evictOverBudget(SeriesCache& cache, const std::string& keep) {
+    while (cache.resident_bytes > cache.memory_budget) {
+      Entry* victim = nullptr;
+      for (auto& [uid, entry] : cache.entries) {
+        if (uid == keep || entry.state != LoadState::READY) continue;
+        if (entry.series.use_count() > 1) continue;
+        if (!victim || entry.last_used < victim->last_used) victim = &entry;
+      }
+      if (victim) {
+        printf("Evicting series %s\n", victim->info.uid.c_str());
+        cache.resident_bytes -= victim->series->bytes;
+        victim->series.reset();
+        victim->state = LoadState::UNLOADED;
+        continue;
+      }
+
+      for (auto& [uid, entry] : cache.entries) {
+        if (uid == keep || !entry.compressed || entry.state == LoadState::LOADING) continue;
+        if (!victim || entry.last_used < victim->last_used) victim = &entry;
+      }
+      if (!victim) return;
+
+      printf("Dropping compressed copy of series %s\n", victim->info.uid.c_str());
+      cache.resident_bytes -= victim->compressed->bytes;
+      victim->compressed.reset();
+    }
+  }
+
+  bool decompressSeries(const CompressedSeries& compressed, LoadedSeries& out) {
+    out.meta = compressed.meta;
+    out.histogram = compressed.histogram;
+    return preprocessing::decompressVolume(compressed.volume, out.grid);
+  }
+
+  // The first load of a DICOM series reads the files into a compressed copy and registers it
+  // with the cache, later loads only decompress that copy
+  bool loadDicomSeries(SeriesCache* cache, const preprocessing::DicomSeriesInfo& info, CompressedRef compressed,
+                       LoadedSeries& out) {
+    if (compressed) return decompressSeries(*compressed, out);
+
+    auto fresh = std::make_shared<CompressedSeries>();
+    if (!preprocessing::importDicomSeries(info.directory, info.uid, fresh->volume, fresh->meta, &fresh->histogram)) return false;
+    fresh->bytes = preprocessing::compressedBytes(fresh->volume) + fresh->histogram.counts.size() * sizeof(uint64_t);
+    {
+      std::lock_guard<std::mutex> lock(cache->mutex);
+      Entry& entry = cache->entries[info.uid];
+      entry.compressed = fresh;
+      cache->resident_bytes += fresh->bytes;
+      evictOverBudget(*cache, info.uid);
+    }
+    return decompressSeries(*fresh, out);
+  }
+
+  // Caller holds cache.mutex
+  void storeSeries(SeriesCache& cache, Entry& entry, SeriesRef series) {
+    // A preload never pushes out something the user has already looked at. requestSeries() clears
+    // preload at any point before this, so anything explicitly asked for is always kept.
+    if (entry.preload && cache.resident_bytes + series->bytes > cache.memory_budget) {
+      entry.preview.reset();
+      entry.state = LoadState::UNLOADED;
+      return;
+    }
+
+    cache.resident_bytes += series->bytes;
+    entry.series = std::move(series);
+    entry.preview.reset();
+    entry.state = LoadState::READY;
+    entry.last_used = entry.preload ? 0 : ++cache.clock;
+    evictOverBudget(cache, entry.info.uid);
+  }
+
+  void setProgress(SeriesCache* cache, const std::string& uid, float progress, const char* stage) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    Entry& entry = cache->entries[uid];
+    entry.progress = progress;
+    entry.stage = stage;
+  }
+
+  void loadWorker(SeriesCache* cache) {
+    while (true) {
+      preprocessing::DicomSeriesInfo info;
+      SeriesLoader loader;
+      CompressedRef compressed;
+      {
+        std::unique_lock<std::mutex> lock(cache->mutex);
+        cache->cv.wait(lock, [&] { return cache->stopping || !cache->queue.empty(); });
+        if (cache->stopping) return;
+
+        std::string uid = cache->queue.front();
+        cache->queue.pop_front();
+
+        Entry& entry = cache->entries[uid];
+        if (entry.state != LoadState::QUEUED) continue;
+        if (entry.preload && cache->resident_bytes >= cache->memory_budget) {
+          entry.state = LoadState::UNLOADED;
+          continue;
+        }
+        entry.state = LoadState::LOADING;
+        entry.progress = 0.f;
+        info = entry.info;
+        loader = entry.loader;
+        compressed = entry.compressed;
+        entry.stage = compressed ? "Decompressing" : "Reading";
+      }
+
+      auto series = std::make_shared<LoadedSeries>();
+      series->uid = info.uid;
+      series->generation = nextGeneration();
+      bool ok = loader ? loader(*series) : loadDicomSeries(cache, info, std::move(compressed), *series);
+      if (ok) preprocessing::summarizeHistogram(series->histogram, series->stats);
+
+      if (ok && cache->resample.enabled && !preprocessing::isResampled(series->meta, cache->resample)) {
+        setProgress(cache, info.uid, 0.2f, "Resampling");
+        preprocessing::VoxelGrid resampled;
+        preprocessing::DicomMetadata meta;
+        preprocessing::resampleGrid(series->grid, series->meta, cache->resample, resampled, meta);
+        printf("Resampled %s to %dx%dx%d at %.2f mm\n", info.uid.c_str(), meta.width, meta.height, meta.depth, meta.spacing_x);
+        series->grid = std::move(resampled);
+        series->meta = meta;
+      }
+
+      if (ok) {
+        // Publish a small preprocessed copy first so something can be shown right away
+        auto preview = std::make_shared<LoadedSeries>();
+        preview->uid = info.uid;
+        preview->generation = nextGeneration();
+        preprocessing::downsampleGrid(series->grid, series->meta, PREVIEW_MAX_DIM, preview->grid, preview->meta);
+        preview->raw = preview->grid;
+        preprocessing::computeGradientKernel(preview->grid);
+        preprocessing::gaussianBlur(preview->grid);
+        preprocessing::buildMinMaxOctree(preview->grid, preview->octree);
+        preview->stats = series->stats;
+        preview->bytes = seriesBytes(*preview);
+        {
+          std::lock_guard<std::mutex> lock(cache->mutex);
+          Entry& entry = cache->entries[info.uid];
+          entry.preview = std::move(preview);
+          entry.progress = 0.6f;
+          entry.stage = "Gradient";
+        }
+        cache->cv.notify_all();
+
+        series->raw = series->grid;
+        preprocessing::computeGradientKernel(series->grid);
+        setProgress(cache, info.uid, 0.8f, "Smoothing");
+        preprocessing::gaussianBlur(series->grid);
+        preprocessing::buildMinMaxOctree(series->grid, series->octree);
+        series->bytes = seriesBytes(*series);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        Entry& entry = cache->entries[info.uid];
+        entry.progress = 1.f;
+        entry.stage = "";
+        if (ok) {
+          storeSeries(*cache, entry, std::move(series));
+        } else {
+          printf("Failed to load series %s\n", info.uid.c_str());
+          entry.preview.reset();
+          entry.state = LoadState::FAILED;
+        }
+      }
+      cache->cv.notify_all();
+    }
+  }
+}
+
+SeriesCache::~SeriesCache() {
+  stopSeriesCache(*this);
+}
+
+void startSeriesCache(SeriesCache& cache, size_t memory_budget, unsigned worker_count) {
+  cache.memory_budget = memory_budget;
+  cache.stopping = false;
+  for (unsigned i = 0; i < worker_count; i++) {
+    cache.workers.emplace_back(loadWorker, &cache);
+  }
+}
+
+void stopSeriesCache(SeriesCache& cache) {
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.stopping = true;
+    cache.queue.clear();
+  }
+  cache.cv.notify_all();
+  for (auto& worker : cache.workers) worker.join();
+  cache.workers.clear();
+}
+
+size_t discoverSeries(SeriesCache& cache, const std::string& directory) {
+  std::vector<preprocessing::DicomSeriesInfo> found = preprocessing::listDicomSeries(directory);
+
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  for (const auto& info : found) {
+    if (cache.entries.count(info.uid)) continue;
+    cache.entries[info.uid].info = info;
+    cache.order.push_back(info.uid);
+    printf("Found series %s (%zu files)\n", info.uid.c_str(), info.file_count);
+  }
+  return found.size();
+}
+
+void addSeries(SeriesCache& cache, const std::string& uid, SeriesLoader loader) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  Entry& entry = cache.entries[uid];
+  if (entry.info.uid.empty()) cache.order.push_back(uid);
+
+  entry.info = { uid, "", 0 };
+  entry.loader = std::move(loader);
+}
+
+std::string addCroppedSeries(SeriesCache& cache, const std::string& source_uid, const preprocessing::CropRegion& region) {
+  char suffix[128];
+  snprintf(suffix, sizeof(suffix), " [crop %.2f-%.2f %.2f-%.2f %.2f-%.2f]", region.min[0], region.max[0],
+           region.min[1], region.max[1], region.min[2], region.max[2]);
+  std::string uid = source_uid + suffix;
+
+  preprocessing::DicomSeriesInfo info;
+  SeriesLoader source_loader;
+  std::weak_ptr<const CompressedSeries> source_compressed;
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.entries.find(source_uid);
+    if (it == cache.entries.end()) return "";
+    if (cache.entries.count(uid)) return uid;
+    info = it->second.info;
+    source_loader = it->second.loader;
+    source_compressed = it->second.compressed;
+  }
+
+  // The source's compressed copy is used while the cache still holds it, the crop doesn't keep it alive
+  addSeries(cache, uid, [info, source_loader, source_compressed, region](LoadedSeries& out) {
+    LoadedSeries full;
+    bool ok = false;
+    if (source_loader) ok = source_loader(full);
+    else if (CompressedRef compressed = source_compressed.lock()) ok = decompressSeries(*compressed, full);
+    else ok = preprocessing::importDicomSeries(info.directory, info.uid, full.grid, full.meta, &full.histogram);
+    if (!ok) return false;
+
+    preprocessing::cropGrid(full.grid, full.meta, preprocessing::cropBox(full.meta, region), out.grid, out.meta);
+    out.histogram = std::move(full.histogram);
+    return true;
+  });
+  return uid;
+}
+
+void requestSeries(SeriesCache& cache, const std::string& uid) {
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.entries.find(uid);
+    if (it == cache.entries.end()) return;
+
+    Entry& entry = it->second;
+    if (entry.state == LoadState::UNLOADED || entry.state == LoadState::FAILED) {
+      entry.state = LoadState::QUEUED;
+      entry.preload = false;
+      cache.queue.push_front(uid);
+    } else if (entry.state == LoadState::QUEUED && entry.preload) {
+      // Promote to the front, the stale preload slot is skipped once the state moves on
+      entry.preload = false;
+      cache.queue.push_front(uid);
+    } else if (entry.state == LoadState::LOADING) {
+      // Already on a worker, just make sure storeSeries() keeps it
+      entry.preload = false;
+    }
+  }
+  cache.cv.notify_all();
+}
+
+void preloadSeries(SeriesCache& cache) {
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for (const std::string& uid : cache.order) {
+      Entry& entry = cache.entries[uid];
+      if (entry.state != LoadState::UNLOADED) continue;
+      entry.state = LoadState::QUEUED;
+      entry.preload = true;
+      cache.queue.push_back(uid);
+    }
+  }
+  cache.cv.notify_all();
+}
+
+SeriesRef acquireSeries(SeriesCache& cache, const std::string& uid) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto it = cache.entries.find(uid);
+  if (it == cache.entries.end() || it->second.state != LoadState::READY) return nullptr;
+
+  it->second.last_used = ++cache.clock;
+  return it->second.series;
+}
+
+SeriesRef waitForSeries(SeriesCache& cache, const std::string& uid, const std::function<bool()>& cancelled) {
+  requestSeries(cache, uid);
+
+  std::unique_lock<std::mutex> lock(cache.mutex);
+  auto it = cache.entries.find(uid);
+  if (it == cache.entries.end()) return nullptr;
+
+  Entry& entry = it->second;
+  while (entry.state != LoadState::READY) {
+    if (entry.state == LoadState::FAILED || cache.stopping) return nullptr;
+    // Evicted before this thread woke up, so nothing else is going to load it again
+    if (entry.state == LoadState::UNLOADED) {
+      entry.state = LoadState::QUEUED;
+      entry.preload = false;
+      cache.queue.push_front(uid);
+      cache.cv.notify_all();
+    }
+
+    cache.cv.wait_for(lock, WAIT_POLL_INTERVAL);
+    if (cancelled) {
+      lock.unlock();
+      bool stop = cancelled();
+      lock.lock();
+      if (stop) return nullptr;
+    }
+  }
+
+  entry.last_used = ++cache.clock;
+  return entry.series;
+}
+
+SeriesRef acquirePreview(SeriesCache& cache, const std::string& uid) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto it = cache.entries.find(uid);
+  if (it == cache.entries.end()) return nullptr;
+  return it->second.preview;
+}
+
+std::vector<SeriesStatus> listSeries(SeriesCache& cache) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  std::vector<SeriesStatus> out;
+  out.reserve(cache.order.size());
+  for (const std::string& uid : cache.order) {
+    const Entry& entry = cache.entries[uid];
+    out.push_back({ uid, entry.info.directory, entry.info.file_count, entry.state, entry.progress, entry.stage });
+  }
+  return out;
+}
+
+} // namespace series
@@ -0,0 +1,137 @@
+// app/series_cache.hpp
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "preprocessing/crop.hpp"
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/histogram.hpp"
+#include "preprocessing/minmax_octree.hpp"
+#include "preprocessing/resample.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace series {
+
+  enum class LoadState {
+    UNLOADED,   // Known but not resident, either never loaded or evicted
+    QUEUED,
+    LOADING,
+    READY,
+    FAILED
+  };
+
+  // A fully preprocessed series, immutable once it's in the cache
+  struct LoadedSeries {
+    std::string uid;
+    uint64_t generation = 0;                  // Unique to every preview and series loaded, never 0
+    preprocessing::VoxelGrid grid;            // Smoothed, what gets rendered
+    preprocessing::VoxelGrid raw;             // The same densities before smoothing, for readouts
+    preprocessing::DicomMetadata meta;
+    preprocessing::MinMaxOctree octree;
+    preprocessing::HuHistogram histogram;     // Empty for loaders that don't produce one
+    preprocessing::HistogramStats stats;
+    size_t bytes = 0;
+  };
+  using SeriesRef = std::shared_ptr<const LoadedSeries>;
+
+  // Raw HU of a DICOM series exactly as read, losslessly compressed. It stays in the cache after
+  // the full series is evicted, so loading it again skips the files and only decompresses.
+  struct CompressedSeries {
+    preprocessing::CompressedVolume volume;
+    preprocessing::DicomMetadata meta;
+    preprocessing::HuHistogram histogram;
+    size_t bytes = 0;
+  };
+  using CompressedRef = std::shared_ptr<const CompressedSeries>;
+
+  // Produces the grid and metadata for series that don't come from a DICOM directory
+  using SeriesLoader = std::function<bool(LoadedSeries& out)>;
+
+  // Largest axis of the preview published while the full series is still being preprocessed
+  constexpr uint32_t PREVIEW_MAX_DIM = 128;
+
+  struct Entry {
+    preprocessing::DicomSeriesInfo info;
+    SeriesLoader loader;
+    LoadState state = LoadState::UNLOADED;
+    SeriesRef series;
+    SeriesRef preview;        // Only set while LOADING
+    CompressedRef compressed; // DICOM series only, kept while evicted
+    float progress = 0.f;
+    const char* stage = "";
+    uint64_t last_used = 0;
+    bool preload = false;
+  };
+
+  // UI-facing copy of an entry
+  struct SeriesStatus {
+    std::string uid;
+    std::string directory;
+    size_t file_count;
+    LoadState state;
+    float progress;
+    const char* stage;
+  };
+
+  // Holds several preprocessed series keyed by SeriesInstanceUID under a memory budget
+  // Loads run on background threads, least recently used series are evicted first. Compressed
+  // copies count against the same budget and are only dropped once no full series can be.
+  struct SeriesCache {
+    size_t memory_budget = size_t(8) << 30;
+    // Applied to every series straight after reading, set before startSeriesCache()
+    preprocessing::ResampleSettings resample;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unordered_map<std::string, Entry> entries;
+    std::vector<std::string> order;             // Discovery order, for stable listing
+    std::deque<std::string> queue;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    uint64_t clock = 0;
+    size_t resident_bytes = 0;
+
+    SeriesCache() = default;
+    SeriesCache(const SeriesCache&) = delete;
+    SeriesCache& operator=(const SeriesCache&) = delete;
+    ~SeriesCache();
+  };
+
+  void startSeriesCache(SeriesCache& cache, size_t memory_budget, unsigned worker_count);
+  void stopSeriesCache(SeriesCache& cache);
+
+  // Registers every series in the directory without loading anything, returns how many were found
+  size_t discoverSeries(SeriesCache& cache, const std::string& directory);
+  // Registers a series produced by a custom loader (e.g. a paged overview), it is loaded like any other
+  void addSeries(SeriesCache& cache, const std::string& uid, SeriesLoader loader);
+
+  // Registers a sub-volume of an existing series and returns its uid. The source is loaded again
+  // and cropped before any preprocessing, so only the kept voxels are filtered and uploaded.
+  // The histogram (and so the window presets) still covers the whole source.
+  std::string addCroppedSeries(SeriesCache& cache, const std::string& source_uid, const preprocessing::CropRegion& region);
+
+  // Queues a load if the series isn't resident, explicit requests go ahead of preloads
+  void requestSeries(SeriesCache& cache, const std::string& uid);
+  // Queues every unloaded series, preloads are dropped instead of evicting anything
+  void preloadSeries(SeriesCache& cache);
+
+  // Never blocks, returns nullptr until the series is READY
+  SeriesRef acquireSeries(SeriesCache& cache, const std::string& uid);
+  // Blocks until the series is READY, queueing it again if it gets dropped or evicted meanwhile.
+  // Returns nullptr if it fails to load, the cache stops or cancelled() returns true.
+  SeriesRef waitForSeries(SeriesCache& cache, const std::string& uid,
+                          const std::function<bool()>& cancelled = nullptr);
+  // Low resolution stand-in available part way through loading, nullptr before that and once READY
+  SeriesRef acquirePreview(SeriesCache& cache, const std::string& uid);
+
+  std::vector<SeriesStatus> listSeries(SeriesCache& cache);
+
+} // namespace series
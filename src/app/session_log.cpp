@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "session_log.hpp"
+
+namespace session {
+
+namespace {
+  constexpr char SESSION_MAGIC[4] = { 'V', 'X', 'S', 'L' };
+  // Version 2 added HAS_LIGHTS, version 1 logs read the same and replay with the default lights
+  constexpr uint32_t SESSION_VERSION = 2;
+
+  // Which optional parts follow a record's time stamp and flags
+  enum RecordContents : uint8_t {
+    HAS_INPUT    = 1 << 0,
+    HAS_WINDOW   = 1 << 1,
+    HAS_VIEWPORT = 1 << 2,
+    HAS_LIGHTS   = 1 << 3
+  };
+
+  // Frames this slow missed at least one vsync at 60 Hz
+  constexpr double SLOW_FRAME_MS = 1000.0 / 60.0;
+
+  template <typename T>
+  void put(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  bool get(std::istream& in, T& value) {
+    return bool(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+  }
+
+  uint8_t heldBits(const InputState& input) {
+    return uint8_t(input.lmb_held << 0 | input.rmb_held << 1 | input.mmb_held << 2 |
+                   input.alt_held << 3 | input.ctrl_held << 4 | input.shift_held << 5);
+  }
+
+  void setHeld(uint8_t bits, InputState& input) {
+    input.lmb_held   = bits & (1 << 0);
+    input.rmb_held   = bits & (1 << 1);
+    input.mmb_held   = bits & (1 << 2);
+    input.alt_held   = bits & (1 << 3);
+    input.ctrl_held  = bits & (1 << 4);
+    input.shift_held = bits & (1 << 5);
+  }
+
+  bool hasDeltas(const InputState& input) {
+    return input.mouse_dx != 0.f || input.mouse_dy != 0.f || input.scroll_dx != 0.f || input.scroll_dy != 0.f;
+  }
+
+  // apply_crop is left out, it acts on the series cache rather than on what is drawn
+  bool sameWindow(const controls::WinData& a, const controls::WinData& b) {
+    return a.win_center == b.win_center && a.win_width == b.win_width && a.density_scale == b.density_scale &&
+           a.scale == b.scale && a.mode == b.mode && a.shadows == b.shadows && a.high_quality == b.high_quality &&
+           a.deferred_lighting == b.deferred_lighting && a.ambient_occlusion == b.ambient_occlusion &&
+           std::equal(a.crop_min, a.crop_min + 3, b.crop_min) && std::equal(a.crop_max, a.crop_max + 3, b.crop_max);
+  }
+
+  void putWindow(std::ostream& out, const controls::WinData& window) {
+    put(out, window.win_center);
+    put(out, window.win_width);
+    put(out, window.density_scale);
+    put(out, window.scale);
+    put(out, uint8_t(window.mode));
+    put(out, uint8_t(window.shadows << 0 | window.high_quality << 1 | window.deferred_lighting << 2 |
+                      window.ambient_occlusion << 3));
+    for (float v : window.crop_min) put(out, v);
+    for (float v : window.crop_max) put(out, v);
+  }
+
+  bool getWindow(std::istream& in, controls::WinData& window) {
+    uint8_t mode = 0, bits = 0;
+    bool ok = get(in, window.win_center) && get(in, window.win_width) && get(in, window.density_scale) &&
+              get(in, window.scale) && get(in, mode) && get(in, bits);
+    for (float& v : window.crop_min) ok = ok && get(in, v);
+    for (float& v : window.crop_max) ok = ok && get(in, v);
+    window.mode = controls::RenderMode(mode);
+    window.shadows = bits & 1;
+    window.high_quality = bits & 2;
+    window.deferred_lighting = bits & 4;
+    window.ambient_occlusion = bits & 8;
+    window.apply_crop = false;
+    return ok;
+  }
+
+  // Counts first, then each light's fields in declaration order
+  void putLights(std::ostream& out, const lights::light_set& set) {
+    put(out, set.ambient);
+    put(out, uint8_t(set.directionals.size()));
+    put(out, uint8_t(set.points.size()));
+    put(out, uint8_t(set.spots.size()));
+    for (const lights::directional& l : set.directionals) {
+      put(out, l.direction);
+      put(out, l.color);
+      put(out, l.power);
+      put(out, l.size);
+    }
+    for (const lights::point& l : set.points) {
+      put(out, l.position);
+      put(out, l.color);
+      put(out, l.power);
+      put(out, l.size);
+    }
+    for (const lights::spot& l : set.spots) {
+      put(out, l.position);
+      put(out, l.direction);
+      put(out, l.color);
+      put(out, l.power);
+      put(out, l.radius);
+      put(out, l.size);
+    }
+  }
+
+  bool getLights(std::istream& in, lights::light_set& set) {
+    uint8_t directionals = 0, points = 0, spots = 0;
+    bool ok = get(in, set.ambient) && get(in, directionals) && get(in, points) && get(in, spots);
+    set.directionals.assign(ok ? directionals : 0, {});
+    set.points.assign(ok ? points : 0, {});
+    set.spots.assign(ok ? spots : 0, {});
+    for (lights::directional& l : set.directionals) {
+      ok = ok && get(in, l.direction) && get(in, l.color) && get(in, l.power) && get(in, l.size);
+    }
+    for (lights::point& l : set.points) {
+      ok = ok && get(in, l.position) && get(in, l.color) && get(in, l.power) && get(in, l.size);
+    }
+    for (lights::spot& l : set.spots) {
+      ok = ok && get(in, l.position) && get(in, l.direction) && get(in, l.color) && get(in, l.power) &&
+           get(in, l.radius) && get(in, l.size);
+    }
+    return ok;
+  }
+
+  double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t i = std::min(sorted.size() - 1, size_t(p * (sorted.size() - 1) + 0.5));
+    return sorted[i];
+  }
+}
+
+bool startRecording(const std::string& path, Recorder& recorder) {
+  recorder.out.open(path, std::ios::binary | std::ios::trunc);
+  if (!recorder.out) {
+    printf("Failed to open %s for recording\n", path.c_str());
+    return false;
+  }
+  recorder.out.write(SESSION_MAGIC, 4);
+  put(recorder.out, SESSION_VERSION);
+  recorder.start = Clock::now();
+  recorder.first = true;
+  recorder.frames = 0;
+  return true;
+}
+
+void recordFrame(Recorder& recorder, UpdateFlags flags, const InputState& input,
+                 const controls::WinData& window, const lights::light_set& lights,
+                 int viewport_width, int viewport_height) {
+  if (!recorder.out.is_open()) return;
+
+  const FrameRecord& last = recorder.last;
+  uint8_t contents = 0;
+  if (recorder.first || hasDeltas(input) || heldBits(input) != heldBits(last.input)) contents |= HAS_INPUT;
+  if (recorder.first || !sameWindow(window, last.window)) contents |= HAS_WINDOW;
+  if (recorder.first || lights != last.lights) contents |= HAS_LIGHTS;
+  if (recorder.first || viewport_width != last.viewport_width || viewport_height != last.viewport_height) contents |= HAS_VIEWPORT;
+  flags &= INPUT_FLAGS;
+  if (!contents && !flags) return;
+
+  float time_ms = std::chrono::duration<float, std::milli>(Clock::now() - recorder.start).count();
+  put(recorder.out, time_ms);
+  put(recorder.out, uint8_t(flags));
+  put(recorder.out, contents);
+  if (contents & HAS_INPUT) {
+    put(recorder.out, input.mouse_dx);
+    put(recorder.out, input.mouse_dy);
+    put(recorder.out, input.scroll_dx);
+    put(recorder.out, input.scroll_dy);
+    put(recorder.out, heldBits(input));
+  }
+  if (contents & HAS_WINDOW) putWindow(recorder.out, window);
+  if (contents & HAS_LIGHTS) putLights(recorder.out, lights);
+  if (contents & HAS_VIEWPORT) {
+    put(recorder.out, uint16_t(viewport_width));
+    put(recorder.out, uint16_t(viewport_height));
+  }
+
+  recorder.last = FrameRecord{ time_ms, flags, input, window, lights, viewport_width, viewport_height };
+  recorder.first = false;
+  recorder.frames++;
+}
+
+void stopRecording(Recorder& recorder) {
+  if (!recorder.out.is_open()) return;
+  recorder.out.close();
+  if (recorder.out.fail()) printf("Failed to finish the session log\n");
+  else printf("Recorded %u frames\n", recorder.frames);
+}
+
+bool readSession(const std::string& path, std::vector<FrameRecord>& out) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    printf("Failed to open %s\n", path.c_str());
+    return false;
+  }
+
+  char magic[4] = {};
+  uint32_t version = 0;
+  if (!in.read(magic, 4) || std::memcmp(magic, SESSION_MAGIC, 4) != 0 || !get(in, version) || version < 1 || version > SESSION_VERSION) {
+    printf("%s is not a session log this build can read\n", path.c_str());
+    return false;
+  }
+
+  // Parts a record leaves out carry over from the one before, except the per-frame deltas
+  out.clear();
+  FrameRecord frame;
+  float time_ms;
+  while (get(in, time_ms)) {
+    uint8_t flags = 0, contents = 0;
+    bool ok = get(in, flags) && get(in, contents);
+    frame.time_ms = time_ms;
+    frame.flags = UpdateFlags(flags & INPUT_FLAGS);
+    uint8_t held = heldBits(frame.input);
+    frame.input = InputState{};
+    setHeld(held, frame.input);
+
+    if (ok && (contents & HAS_INPUT)) {
+      ok = get(in, frame.input.mouse_dx) && get(in, frame.input.mouse_dy) &&
+           get(in, frame.input.scroll_dx) && get(in, frame.input.scroll_dy) && get(in, held);
+      setHeld(held, frame.input);
+    }
+    if (ok && (contents & HAS_WINDOW)) ok = getWindow(in, frame.window);
+    if (ok && (contents & HAS_LIGHTS)) ok = getLights(in, frame.lights);
+    if (ok && (contents & HAS_VIEWPORT)) {
+      uint16_t width = 0, height = 0;
+      ok = get(in, width) && get(in, height);
+      frame.viewport_width = width;
+      frame.viewport_height = height;
+    }
+    if (!ok) {
+      printf("Session log %s is truncated after %zu frames\n", path.c_str(), out.size());
+      break;
+    }
+    out.push_back(frame);
+  }
+  return true;
+}
+
+bool loadReplay(const std::string& path, bool realtime, Player& player) {
+  player = Player{};
+  player.realtime = realtime;
+  if (!readSession(path, player.frames)) return false;
+  if (player.frames.empty()) {
+    printf("%s has no frames to replay\n", path.c_str());
+    return false;
+  }
+  player.frame_ms.reserve(player.frames.size());
+  return true;
+}
+
+const FrameRecord* nextReplayFrame(Player& player) {
+  if (player.next >= player.frames.size()) return nullptr;
+  if (!player.started) {
+    player.started = true;
+    player.start = Clock::now();
+  }
+
+  // Realtime playback lines the first frame up with the start, the time spent loading before it
+  // was recorded isn't waited for again
+  if (player.realtime) {
+    float due = player.frames[player.next].time_ms - player.frames.front().time_ms;
+    float now = std::chrono::duration<float, std::milli>(Clock::now() - player.start).count();
+    if (now < due) return nullptr;
+  }
+  return &player.frames[player.next++];
+}
+
+int replayWaitMs(const Player& player) {
+  if (!player.realtime || !player.started || player.next >= player.frames.size()) return 0;
+  float due = player.frames[player.next].time_ms - player.frames.front().time_ms;
+  float now = std::chrono::duration<float, std::milli>(Clock::now() - player.start).count();
+  return std::max(0, int(due - now));
+}
+
+void printReplayTimings(const Player& player) {
+  const std::vector<double>& ms = player.frame_ms;
+  if (ms.empty()) {
+    printf("No frames were replayed\n");
+    return;
+  }
+
+  std::vector<double> sorted = ms;
+  std::sort(sorted.begin(), sorted.end());
+  double total = 0.0;
+  for (double t : ms) total += t;
+  size_t slow = size_t(std::count_if(ms.begin(), ms.end(), [](double t) { return t > SLOW_FRAME_MS; }));
+
+  printf("Replayed %zu frames in %.1f ms\n", ms.size(), total);
+  printf("  mean %.2f ms  p50 %.2f ms  p95 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+         total / ms.size(), percentile(sorted, 0.5), percentile(sorted, 0.95), percentile(sorted, 0.99), sorted.back());
+  printf("  %zu frames over %.1f ms\n", slow, SLOW_FRAME_MS);
+}
+
+bool writeReplayTimings(const std::string& path, const Player& player) {
+  std::ofstream out(path, std::ios::trunc);
+  out << "frame,time_ms,frame_ms,flags\n";
+  for (size_t i = 0; i < player.frame_ms.size() && i < player.frames.size(); i++) {
+    out << i << "," << player.frames[i].time_ms << "," << player.frame_ms[i] << "," << int(player.frames[i].flags) << "\n";
+  }
+  if (!out) {
+    printf("Failed to write %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace session
@@ -0,0 +1,74 @@
+// app/session_log.hpp
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "controls_data.hpp"
+#include "input_state.hpp"
+#include "lights.hpp"
+#include "update_flags.hpp"
+
+namespace session {
+
+  using Clock = std::chrono::steady_clock;
+
+  // Flags raised by input rather than by main reacting to its own state, the only ones logged
+  constexpr UpdateFlags INPUT_FLAGS = UpdateFlags(uint8_t(ORBIT) | uint8_t(ZOOM) | uint8_t(PAN) | uint8_t(RESIZE));
+
+  // A frame in which the input, the window settings, the lights or the viewport size changed.
+  // Frames where nothing happened aren't logged, the time stamps keep the gaps between the ones
+  // that are.
+  struct FrameRecord {
+    float time_ms = 0.f;          // Since recording started
+    UpdateFlags flags = NONE;     // Only INPUT_FLAGS
+    InputState input;
+    controls::WinData window;
+    lights::light_set lights = lights::defaultLights();
+    int viewport_width = 0;
+    int viewport_height = 0;
+  };
+
+  // Writes each frame as the parts that changed since the previous one
+  struct Recorder {
+    std::ofstream out;
+    Clock::time_point start;
+    FrameRecord last;
+    bool first = true;
+    uint32_t frames = 0;
+  };
+
+  bool startRecording(const std::string& path, Recorder& recorder);
+  // Logs the frame if anything in it differs from the last logged frame
+  void recordFrame(Recorder& recorder, UpdateFlags flags, const InputState& input,
+                   const controls::WinData& window, const lights::light_set& lights,
+                   int viewport_width, int viewport_height);
+  void stopRecording(Recorder& recorder);
+
+  bool readSession(const std::string& path, std::vector<FrameRecord>& out);
+
+  // Hands logged frames back one per main loop iteration, or when they are due if realtime
+  struct Player {
+    std::vector<FrameRecord> frames;
+    size_t next = 0;
+    bool realtime = false;
+    bool started = false;
+    Clock::time_point start;
+    std::vector<double> frame_ms;   // Wall time of each replayed frame
+  };
+
+  bool loadReplay(const std::string& path, bool realtime, Player& player);
+  // The frame to apply this iteration, nullptr while the next one isn't due yet
+  const FrameRecord* nextReplayFrame(Player& player);
+  // How long the loop may sleep before the next frame is due
+  int replayWaitMs(const Player& player);
+  inline bool replayDone(const Player& player) { return player.started && player.next >= player.frames.size(); }
+
+  // Mean, percentiles and the slowest frames to stdout
+  void printReplayTimings(const Player& player);
+  // One "frame,time_ms,frame_ms,flags" line per replayed frame
+  bool writeReplayTimings(const std::string& path, const Player& player);
+
+} // namespace session
@@ -0,0 +1,447 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+#include "graphics/cpu_raymarch.hpp"
+#include "graphics/volume_transform.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace graphics {
+
+namespace {
+  constexpr int   SHADOW_STEPS = 32;
+  // shadow_step in compute.glsl, fixed so the shadow reach doesn't follow the primary step
+  constexpr float SHADOW_STEP  = 0.005f;
+  // See DISTANCE_MARGIN in compute.glsl
+  constexpr float DISTANCE_MARGIN = 2.6f;
+  // How many voxels past the hit pickVoxel() looks for one inside the window
+  constexpr int   PROBE_DEPTH = 3;
+  constexpr float NO_LIMIT = std::numeric_limits<float>::infinity();
+
+  float hash(float x, float y) {
+    float v = std::sin(x * 127.1f + y * 311.7f) * 43758.5453f;
+    return v - std::floor(v);
+  }
+
+  glm::vec2 intersectAABB(const glm::vec3& origin, const glm::vec3& dir, const glm::vec3& box_min, const glm::vec3& box_max) {
+    glm::vec3 t_min = (box_min - origin) / dir;
+    glm::vec3 t_max = (box_max - origin) / dir;
+    glm::vec3 t_0 = glm::min(t_min, t_max);
+    glm::vec3 t_1 = glm::max(t_min, t_max);
+    return glm::vec2(std::max({ t_0.x, t_0.y, t_0.z }), std::min({ t_1.x, t_1.y, t_1.z }));
+  }
+
+  bool isOutsideBox(const glm::vec3& p, const glm::vec3& box_min, const glm::vec3& box_max) {
+    return p.x < box_min.x || p.x > box_max.x ||
+           p.y < box_min.y || p.y > box_max.y ||
+           p.z < box_min.z || p.z > box_max.z;
+  }
+
+  // Texel corners and weights for a linear fetch along one axis
+  void linearTaps(float coord, uint32_t size, uint32_t& i0, uint32_t& i1, float& f) {
+    float u = coord * size - 0.5f;
+    float base = std::floor(u);
+    f = u - base;
+    int i = int(base);
+    i0 = uint32_t(std::clamp(i, 0, int(size) - 1));
+    i1 = uint32_t(std::clamp(i + 1, 0, int(size) - 1));
+  }
+
+  template <typename T, typename Fetch>
+  T trilinear(const preprocessing::VoxelGrid& grid, const glm::vec3& tex, Fetch fetch) {
+    uint32_t x0, x1, y0, y1, z0, z1;
+    float fx, fy, fz;
+    linearTaps(tex.x, grid.width,  x0, x1, fx);
+    linearTaps(tex.y, grid.height, y0, y1, fy);
+    linearTaps(tex.z, grid.depth,  z0, z1, fz);
+
+    T c00 = fetch(x0, y0, z0) * (1.f - fx) + fetch(x1, y0, z0) * fx;
+    T c10 = fetch(x0, y1, z0) * (1.f - fx) + fetch(x1, y1, z0) * fx;
+    T c01 = fetch(x0, y0, z1) * (1.f - fx) + fetch(x1, y0, z1) * fx;
+    T c11 = fetch(x0, y1, z1) * (1.f - fx) + fetch(x1, y1, z1) * fx;
+    T c0 = c00 * (1.f - fy) + c10 * fy;
+    T c1 = c01 * (1.f - fy) + c11 * fy;
+    return c0 * (1.f - fz) + c1 * fz;
+  }
+
+  // Distance along the ray to the far side of the coarsest node around tex that is entirely at or
+  // below lo or at or above hi, or -1
+  float rangeExit(const preprocessing::MinMaxOctree& tree, const glm::vec3& origin, const glm::vec3& dir,
+                  const glm::vec3& tex, const glm::vec3& box_min, const glm::vec3& box_max, float lo, float hi) {
+    glm::vec3 dims(float(tree.width), float(tree.height), float(tree.depth));
+    glm::vec3 voxel = glm::clamp(tex * dims, glm::vec3(0.f), dims - 1.f);
+
+    uint32_t level = 0;
+    preprocessing::RangeClass c = preprocessing::classifyPoint(tree, uint32_t(voxel.x), uint32_t(voxel.y), uint32_t(voxel.z),
+                                                               lo, hi, level);
+    if (c == preprocessing::RangeClass::MIXED) return -1.f;
+
+    glm::vec3 size(float(tree.leaf_size << level));
+    glm::vec3 node_min = glm::floor(voxel / size) * size / dims;
+    glm::vec3 node_max = glm::min(node_min + size / dims, glm::vec3(1.f));
+    glm::vec3 extent = box_max - box_min;
+    return intersectAABB(origin, dir, box_min + node_min * extent, box_min + node_max * extent).y;
+  }
+
+  // World space distance in any direction from tex that only samples empty space, or -1
+  float distanceLeap(const preprocessing::DistanceField& field, const glm::vec3& tex,
+                     const glm::vec3& box_min, const glm::vec3& box_max) {
+    glm::vec3 dims(float(field.width), float(field.height), float(field.depth));
+    glm::vec3 voxel = glm::clamp(tex * dims, glm::vec3(0.f), dims - 1.f);
+    size_t index = ((size_t)uint32_t(voxel.z) * field.height + uint32_t(voxel.y)) * field.width + uint32_t(voxel.x);
+    float d = float(field.distance[index]) - DISTANCE_MARGIN;
+    if (d <= 0.f) return -1.f;
+
+    glm::vec3 voxels_per_unit = dims / (box_max - box_min);
+    return d / std::max({ voxels_per_unit.x, voxels_per_unit.y, voxels_per_unit.z });
+  }
+
+  void rayMarch(const preprocessing::VoxelGrid& grid, const preprocessing::MinMaxOctree* octree,
+                const preprocessing::DistanceField* distance, const CpuRenderParams& p,
+                const glm::vec3& ray_origin, const glm::vec3& ray_dir, uint32_t px, uint32_t py,
+                glm::vec4& albedo, glm::vec4& depth, glm::vec4& normal, CpuMarchStats& stats) {
+    glm::vec3 box_max = p.volume_scale;
+    glm::vec3 box_min = -box_max;
+
+    glm::vec2 intersection = intersectAABB(ray_origin, ray_dir, box_min + p.crop_min * (box_max - box_min),
+                                           box_min + p.crop_max * (box_max - box_min));
+    albedo = depth = normal = glm::vec4(0.f);
+    if (intersection.x > intersection.y || intersection.y < 0.f) return;
+
+    float t_end = intersection.y;
+    // Positions come from the step index so skipping lands on exactly the samples a full march takes
+    float t_start = std::max(intersection.x, 0.f) + hash(float(px), float(py)) * p.step_size;
+    float lo = windowThreshold(p.win_center, p.win_width, p.density_scale);
+    float half_width = p.win_width * 0.5f;
+
+    glm::vec4 accumulated(0.f);
+    float first_hit_depth = 0.f;
+    glm::vec3 first_hit_tex(0.f);
+    bool hit = false;
+    bool was_empty = true;
+
+    for (int step = 0; step < p.max_steps; step++) {
+      float t = t_start + step * p.step_size;
+      if (t >= t_end || accumulated.w >= 0.95f) break;
+
+      glm::vec3 world_pos = ray_origin + ray_dir * t;
+      glm::vec3 tex_pos = (world_pos - box_min) / (box_max - box_min);
+
+      // Only look for empty space after an empty sample, dense regions would just pay for the walk
+      if (distance && was_empty && lo >= distance->threshold) {
+        float leap = distanceLeap(*distance, tex_pos, box_min, box_max);
+        if (leap >= 0.f) {
+          step += int(leap / p.step_size);
+          stats.leaps++;
+          continue;
+        }
+      }
+      if (octree && was_empty) {
+        float t_exit = rangeExit(*octree, ray_origin, ray_dir, tex_pos, box_min, box_max, lo, NO_LIMIT);
+        if (t_exit > t) {
+          step += std::max(int(std::ceil((t_exit - t) / p.step_size)), 1) - 1;
+          stats.skips++;
+          continue;
+        }
+      }
+
+      float raw = sampleDensity(grid, tex_pos);
+      stats.samples++;
+      float density = std::clamp((raw - (p.win_center - half_width)) / p.win_width * p.density_scale, 0.f, 1.f);
+      was_empty = density <= 0.01f;
+
+      if (!was_empty) {
+        if (!hit) {
+          first_hit_depth = t;
+          first_hit_tex = tex_pos;
+          hit = true;
+        }
+
+        glm::vec3 light_dir = glm::normalize(glm::vec3(-1.f, -1.f, 1.f));
+        float shadow = 0.f;
+        glm::vec3 shadow_pos = world_pos;
+        for (int s = 0; s < (p.shadows ? SHADOW_STEPS : 0); s++) {
+          shadow_pos += light_dir * SHADOW_STEP * (1.f + float(s) * 0.5f);
+          if (isOutsideBox(shadow_pos, box_min, box_max)) break;
+          shadow += sampleDensity(grid, (shadow_pos - box_min) / (box_max - box_min)) * SHADOW_STEP;
+        }
+        float transmittance = std::exp(-shadow * 100.f) * (1.f - accumulated.w * 0.5f);
+
+        glm::vec3 sample_color = glm::vec3(0.75f, 0.6f, 0.45f) * density * transmittance;
+        if (p.occlusion) sample_color *= sampleOcclusion(*p.occlusion, tex_pos);
+        float sample_alpha = std::clamp(density * p.step_size * 100.f, 0.f, 1.f);
+
+        glm::vec3 rgb = glm::vec3(accumulated) + sample_color * sample_alpha * (1.f - accumulated.w);
+        accumulated = glm::vec4(rgb, accumulated.w + sample_alpha * (1.f - accumulated.w));
+      }
+    }
+
+    albedo = accumulated;
+    if (hit) {
+      depth = glm::vec4(glm::vec3(first_hit_depth / 5.f), 1.f);
+      normal = sampleNormal(grid, first_hit_tex);
+    }
+  }
+  float windowed(const CpuRenderParams& p, float raw) {
+    return std::clamp((raw - (p.win_center - p.win_width * 0.5f)) / p.win_width * p.density_scale, 0.f, 1.f);
+  }
+
+  // Ports of maxIntensity() and minIntensity() in compute.glsl, sign flips MIP into MinIP
+  // by marching the negated densities, extreme is the best (negated) raw value so far
+  float extremeIntensity(const preprocessing::VoxelGrid& grid, const preprocessing::MinMaxOctree* octree,
+                         const CpuRenderParams& p, float sign, const glm::vec3& ray_origin, const glm::vec3& ray_dir,
+                         float t_start, float t_end, const glm::vec3& box_min, const glm::vec3& box_max,
+                         float& t_hit, CpuMarchStats& stats) {
+    float lo = p.win_center - p.win_width * 0.5f;
+    float saturated = lo + p.win_width / p.density_scale;
+    // Past these the windowed value is pinned at 1 for MIP or 0 for MinIP
+    float extreme = sign > 0.f ? lo : -saturated;
+    float stop = sign > 0.f ? saturated : -lo;
+    bool improving = false;
+    t_hit = -1.f;
+
+    for (int step = 0; step < p.max_steps; step++) {
+      float t = t_start + step * p.step_size;
+      if (t >= t_end || extreme >= stop) break;
+
+      glm::vec3 tex_pos = (ray_origin + ray_dir * t - box_min) / (box_max - box_min);
+      if (octree && !improving) {
+        float t_exit = sign > 0.f ? rangeExit(*octree, ray_origin, ray_dir, tex_pos, box_min, box_max, extreme, NO_LIMIT)
+                                  : rangeExit(*octree, ray_origin, ray_dir, tex_pos, box_min, box_max, -NO_LIMIT, -extreme);
+        if (t_exit > t) {
+          step += std::max(int(std::ceil((t_exit - t) / p.step_size)), 1) - 1;
+          stats.skips++;
+          continue;
+        }
+      }
+
+      float raw = sign * sampleDensity(grid, tex_pos);
+      stats.samples++;
+      improving = raw > extreme;
+      if (improving) {
+        extreme = raw;
+        t_hit = t;
+      }
+    }
+    return windowed(p, sign * extreme);
+  }
+
+  float averageIntensity(const preprocessing::VoxelGrid& grid, const CpuRenderParams& p,
+                         const glm::vec3& ray_origin, const glm::vec3& ray_dir, float t_start, float t_end,
+                         const glm::vec3& box_min, const glm::vec3& box_max, CpuMarchStats& stats) {
+    float sum = 0.f;
+    int count = 0;
+    for (int step = 0; step < p.max_steps; step++) {
+      float t = t_start + step * p.step_size;
+      if (t >= t_end) break;
+      sum += sampleDensity(grid, (ray_origin + ray_dir * t - box_min) / (box_max - box_min));
+      count++;
+    }
+    stats.samples += count;
+    return count > 0 ? windowed(p, sum / float(count)) : 0.f;
+  }
+
+  void projectionMarch(const preprocessing::VoxelGrid& grid, const preprocessing::MinMaxOctree* octree,
+                       const CpuRenderParams& p, const glm::vec3& ray_origin, const glm::vec3& ray_dir,
+                       uint32_t px, uint32_t py, glm::vec4& albedo, glm::vec4& depth, glm::vec4& normal,
+                       CpuMarchStats& stats) {
+    glm::vec3 box_max = p.volume_scale;
+    glm::vec3 box_min = -box_max;
+    albedo = depth = normal = glm::vec4(0.f);
+
+    glm::vec2 intersection = intersectAABB(ray_origin, ray_dir, box_min + p.crop_min * (box_max - box_min),
+                                           box_min + p.crop_max * (box_max - box_min));
+    if (intersection.x > intersection.y || intersection.y < 0.f) return;
+
+    float t_start = std::max(intersection.x, 0.f) + hash(float(px), float(py)) * p.step_size;
+    float t_hit = -1.f;
+    float value = 0.f;
+    switch (p.mode) {
+      case controls::RenderMode::MIP:
+        value = extremeIntensity(grid, octree, p, 1.f, ray_origin, ray_dir, t_start, intersection.y, box_min, box_max, t_hit, stats);
+        break;
+      case controls::RenderMode::MINIP:
+        value = extremeIntensity(grid, octree, p, -1.f, ray_origin, ray_dir, t_start, intersection.y, box_min, box_max, t_hit, stats);
+        break;
+      default:
+        value = averageIntensity(grid, p, ray_origin, ray_dir, t_start, intersection.y, box_min, box_max, stats);
+        break;
+    }
+
+    albedo = glm::vec4(glm::vec3(value), 1.f);
+    if (t_hit >= 0.f) depth = glm::vec4(glm::vec3(t_hit / 5.f), 1.f);
+  }
+}
+
+float sampleDensity(const preprocessing::VoxelGrid& grid, const glm::vec3& tex) {
+  return trilinear<float>(grid, tex, [&](uint32_t x, uint32_t y, uint32_t z) { return grid.at(x, y, z); });
+}
+
+glm::vec4 sampleNormal(const preprocessing::VoxelGrid& grid, const glm::vec3& tex) {
+  if (grid.normals.empty()) return glm::vec4(0.f);
+  return trilinear<glm::vec4>(grid, tex, [&](uint32_t x, uint32_t y, uint32_t z) {
+    const float4& n = grid.normals[((size_t)z * grid.height + y) * grid.width + x];
+    return glm::vec4(n.x, n.y, n.z, n.w);
+  });
+}
+
+float sampleOcclusion(const preprocessing::OcclusionVolume& volume, const glm::vec3& tex) {
+  if (volume.visibility.empty()) return 1.f;
+  uint32_t x0, x1, y0, y1, z0, z1;
+  float fx, fy, fz;
+  linearTaps(tex.x, volume.width,  x0, x1, fx);
+  linearTaps(tex.y, volume.height, y0, y1, fy);
+  linearTaps(tex.z, volume.depth,  z0, z1, fz);
+  auto fetch = [&](uint32_t x, uint32_t y, uint32_t z) {
+    return float(volume.visibility[((size_t)z * volume.height + y) * volume.width + x]) / 255.f;
+  };
+
+  float c00 = fetch(x0, y0, z0) * (1.f - fx) + fetch(x1, y0, z0) * fx;
+  float c10 = fetch(x0, y1, z0) * (1.f - fx) + fetch(x1, y1, z0) * fx;
+  float c01 = fetch(x0, y0, z1) * (1.f - fx) + fetch(x1, y0, z1) * fx;
+  float c11 = fetch(x0, y1, z1) * (1.f - fx) + fetch(x1, y1, z1) * fx;
+  float c0 = c00 * (1.f - fy) + c10 * fy;
+  float c1 = c01 * (1.f - fy) + c11 * fy;
+  return c0 * (1.f - fz) + c1 * fz;
+}
+
+bool pickVoxel(const preprocessing::VoxelGrid& grid, const preprocessing::VoxelGrid& raw,
+               const preprocessing::MinMaxOctree* octree, const preprocessing::DicomMetadata& meta,
+               const CpuRenderParams& params, float px, float py, PickResult& out) {
+  if (grid.data.empty() || raw.data.size() != grid.data.size()) return false;
+  if (octree && octree->levels.empty()) octree = nullptr;
+
+  // Same ray setup as renderCpu()
+  glm::mat4 inv_view_proj = glm::inverse(params.proj * params.view);
+  glm::mat3 inv_rot = glm::transpose(-volumeRotation());
+  glm::vec2 uv = glm::vec2(px / params.width, py / params.height) * 2.f - 1.f;
+  glm::vec4 target = inv_view_proj * glm::vec4(uv.x, uv.y, 1.f, 1.f);
+  glm::vec3 ray_dir = inv_rot * glm::normalize(glm::vec3(target) / target.w - params.cam);
+  glm::vec3 ray_origin = inv_rot * params.cam;
+
+  glm::vec3 box_max = params.volume_scale;
+  glm::vec3 box_min = -box_max;
+  glm::vec2 intersection = intersectAABB(ray_origin, ray_dir, box_min + params.crop_min * (box_max - box_min),
+                                         box_min + params.crop_max * (box_max - box_min));
+  if (intersection.x > intersection.y || intersection.y < 0.f) return false;
+
+  float lo = windowThreshold(params.win_center, params.win_width, params.density_scale);
+  float t_start = std::max(intersection.x, 0.f);
+  auto texAt = [&](float t) { return (ray_origin + ray_dir * t - box_min) / (box_max - box_min); };
+
+  float t_hit = -1.f;
+  for (int step = 0; step < params.max_steps; step++) {
+    float t = t_start + step * params.step_size;
+    if (t >= intersection.y) break;
+
+    if (octree) {
+      float t_exit = rangeExit(*octree, ray_origin, ray_dir, texAt(t), box_min, box_max, lo, NO_LIMIT);
+      if (t_exit > t) {
+        step += std::max(int(std::ceil((t_exit - t) / params.step_size)), 1) - 1;
+        continue;
+      }
+    }
+    if (sampleDensity(grid, texAt(t)) <= lo) continue;
+
+    // The surface is somewhere since the previous step, which was empty or outside the box
+    float a = std::max(t - params.step_size, t_start), b = t;
+    for (int i = 0; i < 8; i++) {
+      float mid = 0.5f * (a + b);
+      if (sampleDensity(grid, texAt(mid)) > lo) b = mid;
+      else a = mid;
+    }
+    t_hit = b;
+    break;
+  }
+  if (t_hit < 0.f) return false;
+
+  glm::vec3 tex = texAt(t_hit);
+  glm::vec3 dims(float(grid.width), float(grid.height), float(grid.depth));
+  glm::vec3 spacing(meta.spacing_x, meta.spacing_y, meta.spacing_z);
+  glm::vec3 voxel = glm::clamp(tex * dims - 0.5f, glm::vec3(0.f), dims - 1.f);
+  float hu_range = meta.max_value - meta.min_value;
+
+  // The hit is where the smoothed field crosses the threshold, and smoothing spreads a surface
+  // over a voxel or two. The voxel reported is the first along the ray whose own density is in
+  // the window, or the nearest one to the hit if none is within PROBE_DEPTH voxels.
+  glm::vec3 voxel_size = (box_max - box_min) / dims;
+  float half_voxel = 0.5f * std::min({ voxel_size.x, voxel_size.y, voxel_size.z });
+  auto nearestVoxel = [&](float t) {
+    glm::vec3 v = glm::clamp(texAt(t) * dims - 0.5f, glm::vec3(0.f), dims - 1.f);
+    return glm::uvec3(uint32_t(v.x + 0.5f), uint32_t(v.y + 0.5f), uint32_t(v.z + 0.5f));
+  };
+  out.voxel = nearestVoxel(t_hit);
+  for (int i = 0; i <= 2 * PROBE_DEPTH; i++) {
+    glm::uvec3 v = nearestVoxel(t_hit + i * half_voxel);
+    if (raw.at(v.x, v.y, v.z) > lo) {
+      out.voxel = v;
+      break;
+    }
+  }
+
+  out.t = t_hit;
+  out.world = -volumeRotation() * (ray_origin + ray_dir * t_hit);
+  out.patient = glm::vec3(meta.origin_x, meta.origin_y, meta.origin_z) + voxel * spacing;
+  out.density = raw.at(out.voxel.x, out.voxel.y, out.voxel.z);
+  out.hu = meta.min_value + out.density * hu_range;
+
+  // Central differences one voxel apart
+  glm::vec3 texel = 1.f / dims;
+  glm::vec3 diff(
+    sampleDensity(grid, tex + glm::vec3(texel.x, 0.f, 0.f)) - sampleDensity(grid, tex - glm::vec3(texel.x, 0.f, 0.f)),
+    sampleDensity(grid, tex + glm::vec3(0.f, texel.y, 0.f)) - sampleDensity(grid, tex - glm::vec3(0.f, texel.y, 0.f)),
+    sampleDensity(grid, tex + glm::vec3(0.f, 0.f, texel.z)) - sampleDensity(grid, tex - glm::vec3(0.f, 0.f, texel.z)));
+  out.gradient = diff * hu_range / (2.f * spacing);
+  return true;
+}
+
+void renderCpu(const preprocessing::VoxelGrid& grid, const preprocessing::MinMaxOctree* octree,
+               const preprocessing::DistanceField* distance, const CpuRenderParams& params,
+               CpuFrame& out, CpuMarchStats* stats) {
+  out.width = params.width;
+  out.height = params.height;
+  size_t pixels = (size_t)params.width * params.height;
+  out.albedo.assign(pixels, glm::vec4(0.f));
+  out.depth.assign(pixels, glm::vec4(0.f));
+  out.normal.assign(pixels, glm::vec4(0.f));
+  if (octree && octree->levels.empty()) octree = nullptr;
+  if (distance && distance->distance.empty()) distance = nullptr;
+
+  // Same ray setup as main() in compute.glsl
+  glm::mat4 inv_view_proj = glm::inverse(params.proj * params.view);
+  glm::mat3 inv_rot = glm::transpose(-volumeRotation());
+  glm::vec3 local_origin = inv_rot * params.cam;
+
+  std::atomic<uint64_t> samples{0}, skips{0}, leaps{0};
+  preprocessing::parallelFor(0, params.height, [&](size_t row_begin, size_t row_end) {
+    CpuMarchStats local{};
+    for (uint32_t y = uint32_t(row_begin); y < row_end; y++) {
+      for (uint32_t x = 0; x < params.width; x++) {
+        glm::vec2 uv = glm::vec2(float(x) / params.width, float(y) / params.height) * 2.f - 1.f;
+        glm::vec4 target = inv_view_proj * glm::vec4(uv.x, uv.y, 1.f, 1.f);
+        glm::vec3 ray_dir = glm::normalize(glm::vec3(target) / target.w - params.cam);
+
+        size_t i = (size_t)y * params.width + x;
+        if (params.mode == controls::RenderMode::COMPOSITE) {
+          rayMarch(grid, octree, distance, params, local_origin, inv_rot * ray_dir, x, y,
+                   out.albedo[i], out.depth[i], out.normal[i], local);
+        } else {
+          projectionMarch(grid, octree, params, local_origin, inv_rot * ray_dir, x, y,
+                          out.albedo[i], out.depth[i], out.normal[i], local);
+        }
+      }
+    }
+    samples += local.samples;
+    skips += local.skips;
+    leaps += local.leaps;
+  });
+
+  if (stats) {
+    stats->samples = samples;
+    stats->skips = skips;
+    stats->leaps = leaps;
+  }
+}
+
+} // namespace graphics
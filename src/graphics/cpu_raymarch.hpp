@@ -0,0 +1,82 @@
+// graphics/cpu_raymarch.hpp
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "app/controls_data.hpp"
+#include "preprocessing/ambient_occlusion.hpp"
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/distance_field.hpp"
+#include "preprocessing/minmax_octree.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace graphics {
+
+  // Mirrors camera_block in compute.glsl
+  struct CpuRenderParams {
+    glm::mat4 view;
+    glm::mat4 proj;
+    glm::vec3 cam;
+    glm::vec3 volume_scale;
+    uint32_t width, height;
+    float win_center, win_width, density_scale;
+    controls::RenderMode mode = controls::RenderMode::COMPOSITE;   // u_render_mode
+    glm::vec3 crop_min = glm::vec3(0.f);                            // u_crop_min, u_crop_max
+    glm::vec3 crop_max = glm::vec3(1.f);
+    bool shadows = true;                                            // SHADOWS variant toggle
+    float step_size = 0.005f;                                       // STEP_SIZE and MAX_STEPS, see stepSize()
+    int max_steps = 1000;
+    const preprocessing::OcclusionVolume* occlusion = nullptr;      // OCCLUSION variant toggle, null for off
+  };
+
+  // The same passes the compute shader writes
+  struct CpuFrame {
+    uint32_t width = 0, height = 0;
+    std::vector<glm::vec4> albedo;
+    std::vector<glm::vec4> depth;
+    std::vector<glm::vec4> normal;
+  };
+
+  struct CpuMarchStats {
+    uint64_t samples = 0;     // Density lookups along primary rays
+    uint64_t skips = 0;       // Empty octree nodes jumped over, or nodes that can't change a projection
+    uint64_t leaps = 0;       // Distance field leaps
+  };
+
+  // Match GL_LINEAR with GL_CLAMP_TO_EDGE on the volume textures
+  float sampleDensity(const preprocessing::VoxelGrid& grid, const glm::vec3& tex);
+  glm::vec4 sampleNormal(const preprocessing::VoxelGrid& grid, const glm::vec3& tex);
+  float sampleOcclusion(const preprocessing::OcclusionVolume& volume, const glm::vec3& tex);
+
+  // Raw densities at or below this come out of the window at or below the 0.01 the marchers ignore
+  inline float windowThreshold(float win_center, float win_width, float density_scale) {
+    return win_center - win_width * 0.5f + 0.01f * win_width / density_scale;
+  }
+
+  // First visible voxel under a pixel, see pickVoxel()
+  struct PickResult {
+    glm::vec3 world;          // Same space as the camera
+    glm::vec3 patient;        // Millimetres, from the DicomMetadata origin and spacing
+    glm::uvec3 voxel;         // First voxel at or just past the hit whose unsmoothed density is in the window
+    float density;            // That voxel's unsmoothed density, normalized as stored
+    float hu;                 // That voxel's HU as read from the series
+    glm::vec3 gradient;       // HU per millimetre along the volume axes, of the smoothed field that is rendered
+    float t;                  // Distance along the ray from the camera
+  };
+
+  // First point along the ray through pixel (px, py) whose windowed density the composite march
+  // would show, refined between steps by bisection. Pixels are counted from the bottom left like
+  // gl_GlobalInvocationID. Uses the octree to skip empty space, so a probe costs one ray.
+  // raw is the same volume before smoothing, the reported values are read from it.
+  bool pickVoxel(const preprocessing::VoxelGrid& grid, const preprocessing::VoxelGrid& raw,
+                 const preprocessing::MinMaxOctree* octree, const preprocessing::DicomMetadata& meta,
+                 const CpuRenderParams& params, float px, float py, PickResult& out);
+
+  // Port of main() in compute.glsl, octree and distance may be null to sample every step
+  void renderCpu(const preprocessing::VoxelGrid& grid, const preprocessing::MinMaxOctree* octree,
+                 const preprocessing::DistanceField* distance, const CpuRenderParams& params,
+                 CpuFrame& out, CpuMarchStats* stats = nullptr);
+
+} // namespace graphics
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "graphics/deferred_lighting.hpp"
+#include "graphics/volume_transform.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace graphics {
+
+namespace {
+  // Same spacing and strength as the shadow rays in compute.glsl
+  constexpr int   SHADOW_STEPS = 32;
+  constexpr float SHADOW_STEP  = 0.005f;
+  // Share of a spot's cone, from the edge in, over which it fades in
+  constexpr float SPOT_EDGE    = 0.2f;
+
+  float smoothstep(float edge0, float edge1, float x) {
+    float t = std::clamp((x - edge0) / (edge1 - edge0), 0.f, 1.f);
+    return t * t * (3.f - 2.f * t);
+  }
+
+  // Fraction of a light reaching pos from dir, marched in volume local space. Stops at the box
+  // or at the light, whichever is closer.
+  float shadowTransmittance(const preprocessing::VoxelGrid& grid, glm::vec3 pos, const glm::vec3& dir, float max_dist,
+                            const glm::vec3& box_min, const glm::vec3& box_max) {
+    float shadow = 0.f;
+    float travelled = 0.f;
+    for (int s = 0; s < SHADOW_STEPS; s++) {
+      float spacing = SHADOW_STEP * (1.f + float(s) * 0.5f);
+      travelled += spacing;
+      if (travelled > max_dist) break;
+      pos += dir * spacing;
+      if (pos.x < box_min.x || pos.x > box_max.x ||
+          pos.y < box_min.y || pos.y > box_max.y ||
+          pos.z < box_min.z || pos.z > box_max.z) break;
+      shadow += sampleDensity(grid, (pos - box_min) / (box_max - box_min)) * SHADOW_STEP;
+    }
+    return std::exp(-shadow * 100.f);
+  }
+}
+
+void packLights(const lights::light_set& set, std::vector<PackedLight>& out) {
+  out.clear();
+  out.reserve(lights::lightCount(set));
+  for (const lights::directional& l : set.directionals) {
+    out.push_back(PackedLight{ glm::vec4(0.f, 0.f, 0.f, float(LightType::DIRECTIONAL)),
+                               glm::vec4(glm::normalize(l.direction), -1.f),
+                               glm::vec4(l.color * l.power, l.size) });
+  }
+  for (const lights::point& l : set.points) {
+    out.push_back(PackedLight{ glm::vec4(l.position, float(LightType::POINT)),
+                               glm::vec4(0.f, 0.f, 0.f, -1.f),
+                               glm::vec4(l.color * l.power, l.size) });
+  }
+  for (const lights::spot& l : set.spots) {
+    out.push_back(PackedLight{ glm::vec4(l.position, float(LightType::SPOT)),
+                               glm::vec4(glm::normalize(l.direction), std::cos(l.radius)),
+                               glm::vec4(l.color * l.power, l.size) });
+  }
+}
+
+void serializeLights(const lights::light_set& set, std::vector<uint8_t>& out) {
+  std::vector<PackedLight> packed;
+  packLights(set, packed);
+
+  glm::vec4 ambient(set.ambient, 0.f);
+  out.resize(sizeof(ambient) + packed.size() * sizeof(PackedLight));
+  std::memcpy(out.data(), &ambient, sizeof(ambient));
+  if (!packed.empty()) std::memcpy(out.data() + sizeof(ambient), packed.data(), packed.size() * sizeof(PackedLight));
+}
+
+void applyLighting(const preprocessing::VoxelGrid& grid, const CpuRenderParams& params,
+                   const lights::light_set& set, bool shadows, CpuFrame& frame) {
+  if (params.mode != controls::RenderMode::COMPOSITE || frame.depth.empty() || frame.normal.empty()) return;
+
+  std::vector<PackedLight> packed;
+  packLights(set, packed);
+
+  // Same ray setup as renderCpu(), the volume is only rotated so distances carry over
+  glm::mat4 inv_view_proj = glm::inverse(params.proj * params.view);
+  glm::mat3 to_world = -volumeRotation();
+  glm::mat3 inv_rot = glm::transpose(to_world);
+  glm::vec3 box_max = params.volume_scale;
+  glm::vec3 box_min = -box_max;
+  // Normals are gradients over voxel indices, this turns them into local space gradients
+  glm::vec3 index_to_local = glm::vec3(float(grid.width), float(grid.height), float(grid.depth)) / (box_max - box_min);
+
+  preprocessing::parallelFor(0, frame.height, [&](size_t row_begin, size_t row_end) {
+    for (uint32_t y = uint32_t(row_begin); y < row_end; y++) {
+      for (uint32_t x = 0; x < frame.width; x++) {
+        size_t i = (size_t)y * frame.width + x;
+        float t = frame.depth[i].x * 5.f;
+        if (t <= 0.f) continue;
+
+        glm::vec2 uv = glm::vec2(float(x) / frame.width, float(y) / frame.height) * 2.f - 1.f;
+        glm::vec4 target = inv_view_proj * glm::vec4(uv.x, uv.y, 1.f, 1.f);
+        glm::vec3 ray_dir = glm::normalize(glm::vec3(target) / target.w - params.cam);
+        glm::vec3 world_pos = params.cam + ray_dir * t;
+        glm::vec3 local_pos = inv_rot * world_pos;
+
+        glm::vec3 gradient = glm::vec3(frame.normal[i]) * index_to_local;
+        bool has_normal = glm::dot(gradient, gradient) > 1e-12f;
+        glm::vec3 normal = has_normal ? glm::normalize(to_world * gradient) : glm::vec3(0.f);
+        // Shadow rays start a step off the surface, or they would mostly measure the hit voxel
+        glm::vec3 shadow_origin = local_pos + inv_rot * normal * SHADOW_STEP;
+
+        glm::vec3 light = set.ambient;
+        for (const PackedLight& l : packed) {
+          LightType type = LightType(uint32_t(l.position.w));
+          glm::vec3 to_light;
+          float dist = std::numeric_limits<float>::infinity();
+          float attenuation = 1.f;
+          if (type == LightType::DIRECTIONAL) {
+            to_light = -glm::vec3(l.direction);
+          } else {
+            glm::vec3 d = glm::vec3(l.position) - world_pos;
+            dist = glm::length(d);
+            to_light = d / std::max(dist, 1e-6f);
+            float r = dist / std::max(l.color.w, 1e-6f);
+            attenuation = 1.f / (1.f + r * r);
+            if (type == LightType::SPOT) {
+              float cos_outer = l.direction.w;
+              attenuation *= smoothstep(cos_outer, cos_outer + (1.f - cos_outer) * SPOT_EDGE,
+                                        glm::dot(-to_light, glm::vec3(l.direction)));
+            }
+          }
+
+          float lambert = has_normal ? std::max(glm::dot(normal, to_light), 0.f) : 1.f;
+          float intensity = lambert * attenuation;
+          if (intensity <= 0.f) continue;
+          if (shadows) intensity *= shadowTransmittance(grid, shadow_origin, inv_rot * to_light, dist, box_min, box_max);
+          light += glm::vec3(l.color) * intensity;
+        }
+
+        glm::vec4& albedo = frame.albedo[i];
+        albedo = glm::vec4(glm::vec3(albedo) * light, albedo.w);
+      }
+    }
+  });
+}
+
+} // namespace graphics
@@ -0,0 +1,47 @@
+// graphics/deferred_lighting.hpp
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "app/lights.hpp"
+#include "cpu_raymarch.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace graphics {
+
+  // Deferred shading of composite frames. The march runs without its shadow rays and leaves the
+  // unlit colour in albedo, the first hit's distance in depth and its gradient in normal. A second
+  // pass (shaders/lighting.glsl, or applyLighting() on the CPU) then lights each pixel's first hit
+  // once per light, so lights cost per pixel instead of per sample times shadow steps. Shadows are
+  // one short march per pixel and light towards it through the raw densities.
+  //
+  // Only the first hit is lit, so what shows through semi-transparent tissue gets the lighting of
+  // the surface in front of it.
+
+  // Matches LIGHT_* in lighting.glsl
+  enum class LightType : uint32_t {
+    DIRECTIONAL = 0,
+    POINT       = 1,
+    SPOT        = 2
+  };
+
+  // Matches Light in lighting.glsl, std430
+  struct PackedLight {
+    glm::vec4 position;       // xyz, w is the LightType
+    glm::vec4 direction;      // Normalized xyz, w is the cosine of a spot's half angle
+    glm::vec4 color;          // Colour times power, w is size
+  };
+
+  void packLights(const lights::light_set& set, std::vector<PackedLight>& out);
+
+  // Storage buffer contents for light_list in lighting.glsl, the ambient term followed by the lights
+  void serializeLights(const lights::light_set& set, std::vector<uint8_t>& out);
+
+  // Port of lighting.glsl. frame must come from renderCpu() in composite mode with
+  // params.shadows off, anything else is left as it is.
+  void applyLighting(const preprocessing::VoxelGrid& grid, const CpuRenderParams& params,
+                     const lights::light_set& set, bool shadows, CpuFrame& frame);
+
+} // namespace graphics
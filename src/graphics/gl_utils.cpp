@@ -5,7 +5,7 @@
 
 namespace graphics {
 
-bool compileShader(GLenum type, const char* path, Shader& out, std::string* err) {
+bool compileShader(GLenum type, const char* path, Shader& out, std::string* err, const std::string& defines) {
   std::fstream in { path };
   std::string source_string = { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
 
@@ -16,6 +16,14 @@ bool compileShader(GLenum type, const char* path, Shader& out, std::string* err)
     return false;
   }
 
+  // #version has to stay first, so defines go on the line after it
+  if (!defines.empty()) {
+    size_t version = source_string.find("#version");
+    size_t line_end = version == std::string::npos ? std::string::npos : source_string.find('\n', version);
+    size_t at = line_end == std::string::npos ? 0 : line_end + 1;
+    source_string.insert(at, defines);
+  }
+
   const char* source = source_string.c_str();
 
   GLuint id = glCreateShader(type);
@@ -52,8 +60,9 @@ bool linkProgram(const Shader& vertex, const Shader& fragment, Program& out, std
   return true;
 }
 
-bool linkProgram(const Shader& compute, Program& out, std::string* err) {
+bool linkProgram(const Shader& compute, Program& out, std::string* err, bool retrievable) {
   GLuint program = glCreateProgram();
+  if (retrievable) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glAttachShader(program, compute.id);
   glLinkProgram(program);
 
@@ -105,8 +114,10 @@ bool makeTexture3D(GLenum format, GLsizei width, GLsizei height, GLsizei depth,
 
   glTextureStorage3D(id, 1, format, width, height, depth);
 
-  glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  // Integer textures can't be filtered and are incomplete unless sampled as nearest
+  GLint filter = (format == GL_R8UI || format == GL_R16UI) ? GL_NEAREST : GL_LINEAR;
+  glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, filter);
+  glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, filter);
   glTextureParameteri(id, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTextureParameteri(id, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   glTextureParameteri(id, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -133,14 +144,33 @@ bool makeFramebuffer(const Texture& color_attachment, Framebuffer& out) {
   return true;
 }
 
+void uploadTexture2D(const Texture& tex, const void* data) {
+  GLint width, height;
+  glGetTextureLevelParameteriv(tex.id, 0, GL_TEXTURE_WIDTH, &width);
+  glGetTextureLevelParameteriv(tex.id, 0, GL_TEXTURE_HEIGHT, &height);
+
+  GLenum upload_format = (tex.format == GL_R32F || tex.format == GL_R8) ? GL_RED : GL_RGBA;
+  GLenum upload_type = (tex.format == GL_R8 || tex.format == GL_RGBA8) ? GL_UNSIGNED_BYTE : GL_FLOAT;
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTextureSubImage2D(tex.id, 0, 0, 0, width, height, upload_format, upload_type, data);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
 void uploadTexture3D(const Texture3D& tex, const void* data) {
   GLint width, height, depth;
   glGetTextureLevelParameteriv(tex.id, 0, GL_TEXTURE_WIDTH, &width);
   glGetTextureLevelParameteriv(tex.id, 0, GL_TEXTURE_HEIGHT, &height);
   glGetTextureLevelParameteriv(tex.id, 0, GL_TEXTURE_DEPTH, &depth);
 
-  GLenum upload_format = (tex.format == GL_R32F) ? GL_RED : GL_RGBA;
-  glTextureSubImage3D(tex.id, 0, 0, 0, 0, width, height, depth, upload_format, GL_FLOAT, data);
+  GLenum upload_format = (tex.format == GL_R32F || tex.format == GL_R8) ? GL_RED : GL_RGBA;
+  GLenum upload_type = (tex.format == GL_R8) ? GL_UNSIGNED_BYTE : GL_FLOAT;
+  if (tex.format == GL_R8UI || tex.format == GL_R16UI) {
+    upload_format = GL_RED_INTEGER;
+    upload_type = (tex.format == GL_R8UI) ? GL_UNSIGNED_BYTE : GL_UNSIGNED_SHORT;
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTextureSubImage3D(tex.id, 0, 0, 0, 0, width, height, depth, upload_format, upload_type, data);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 }
 
 void destroy(const Shader& s)       { if (s.id) glDeleteShader(s.id); }
@@ -14,9 +14,11 @@ struct Texture      { GLuint id{}; GLenum target{}; GLenum format{}; };
 struct Texture3D    { GLuint id{}; GLenum target{}; GLenum format{}; };
 struct Framebuffer  { GLuint id{}; };
 
-bool compileShader(GLenum type, const char* src, Shader& out, std::string* err);
+// defines, if given, are inserted straight after the #version line
+bool compileShader(GLenum type, const char* path, Shader& out, std::string* err, const std::string& defines = "");
 bool linkProgram(const Shader& vertex, const Shader& fragment, Program& out, std::string* err);
-bool linkProgram(const Shader& compute, Program& out, std::string* err);
+// retrievable asks the driver to keep the binary around for glGetProgramBinary
+bool linkProgram(const Shader& compute, Program& out, std::string* err, bool retrievable = false);
 
 bool makeBuffer(GLenum target, GLsizeiptr size, const void* data, GLenum usage, Buffer& out);
 bool makeVao(VertexArray& out);
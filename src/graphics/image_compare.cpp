@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+
+#include "image_compare.hpp"
+
+namespace graphics {
+
+namespace {
+  // fragment.glsl mixes the gamma corrected albedo over this
+  const glm::vec3 BACKGROUND = glm::vec3(0.1f, 0.1f, 0.15f);
+
+  constexpr uint32_t SSIM_WINDOW = 8;
+  constexpr uint32_t SSIM_STRIDE = 4;
+
+  // Next header token, skipping whitespace and # comments
+  bool readToken(std::istream& in, std::string& out) {
+    out.clear();
+    int c = in.get();
+    while (c != EOF) {
+      if (c == '#') {
+        while (c != EOF && c != '\n') c = in.get();
+      } else if (!std::isspace(c)) {
+        break;
+      }
+      c = in.get();
+    }
+    while (c != EOF && !std::isspace(c)) {
+      out += char(c);
+      c = in.get();
+    }
+    // Exactly one whitespace byte separates maxval from the pixels, consumed above
+    return !out.empty();
+  }
+
+  std::vector<float> luma(const Image& image) {
+    std::vector<float> y((size_t)image.width * image.height);
+    for (size_t i = 0; i < y.size(); i++) {
+      const uint8_t* p = &image.rgb[i * 3];
+      y[i] = 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+    }
+    return y;
+  }
+
+  bool sameSize(const Image& a, const Image& b) {
+    return a.width == b.width && a.height == b.height && a.rgb.size() == b.rgb.size() && !a.rgb.empty();
+  }
+}
+
+void toImage(const std::vector<glm::vec4>& pixels, uint32_t width, uint32_t height, Image& out) {
+  out.width = width;
+  out.height = height;
+  out.rgb.assign((size_t)width * height * 3, 0);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      const glm::vec4& p = pixels[(size_t)y * width + x];
+      uint8_t* dst = &out.rgb[((size_t)(height - 1 - y) * width + x) * 3];
+      for (int c = 0; c < 3; c++) {
+        float gamma = std::pow(std::max(p[c], 0.f), 1.f / 2.2f);
+        float color = std::clamp(BACKGROUND[c] + (gamma - BACKGROUND[c]) * p.w, 0.f, 1.f);
+        dst[c] = uint8_t(std::lround(color * 255.f));
+      }
+    }
+  }
+}
+
+bool readPpm(const std::string& path, Image& out) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) return false;
+
+  std::string magic, width, height, maxval;
+  if (!readToken(in, magic) || !readToken(in, width) || !readToken(in, height) || !readToken(in, maxval)) {
+    printf("Malformed PPM header in %s\n", path.c_str());
+    return false;
+  }
+  if (magic != "P6" || maxval != "255") {
+    printf("Only 8 bit binary PPM is supported, %s is %s with maxval %s\n", path.c_str(), magic.c_str(), maxval.c_str());
+    return false;
+  }
+
+  out.width = uint32_t(std::stoul(width));
+  out.height = uint32_t(std::stoul(height));
+  out.rgb.resize((size_t)out.width * out.height * 3);
+  if (!in.read(reinterpret_cast<char*>(out.rgb.data()), out.rgb.size())) {
+    printf("Truncated PPM %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool writePpm(const std::string& path, const Image& image) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out << "P6\n" << image.width << " " << image.height << "\n255\n";
+  out.write(reinterpret_cast<const char*>(image.rgb.data()), image.rgb.size());
+  if (!out) {
+    printf("Failed to write %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+double psnr(const Image& a, const Image& b) {
+  if (!sameSize(a, b)) return 0.0;
+
+  double sum = 0.0;
+  for (size_t i = 0; i < a.rgb.size(); i++) {
+    double d = double(a.rgb[i]) - double(b.rgb[i]);
+    sum += d * d;
+  }
+  if (sum == 0.0) return std::numeric_limits<double>::infinity();
+  double mse = sum / a.rgb.size();
+  return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+double ssim(const Image& a, const Image& b) {
+  if (!sameSize(a, b)) return 0.0;
+
+  const double c1 = (0.01 * 255.0) * (0.01 * 255.0);
+  const double c2 = (0.03 * 255.0) * (0.03 * 255.0);
+  std::vector<float> ya = luma(a), yb = luma(b);
+
+  // Images smaller than a window are compared as one window
+  uint32_t wx = std::min(SSIM_WINDOW, a.width), wy = std::min(SSIM_WINDOW, a.height);
+  double total = 0.0;
+  size_t windows = 0;
+  for (uint32_t y0 = 0; y0 + wy <= a.height; y0 += SSIM_STRIDE) {
+    for (uint32_t x0 = 0; x0 + wx <= a.width; x0 += SSIM_STRIDE) {
+      double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+      for (uint32_t y = y0; y < y0 + wy; y++) {
+        for (uint32_t x = x0; x < x0 + wx; x++) {
+          double pa = ya[(size_t)y * a.width + x], pb = yb[(size_t)y * a.width + x];
+          sa += pa; sb += pb;
+          saa += pa * pa; sbb += pb * pb; sab += pa * pb;
+        }
+      }
+      double n = double(wx) * wy;
+      double ma = sa / n, mb = sb / n;
+      double va = saa / n - ma * ma, vb = sbb / n - mb * mb, cov = sab / n - ma * mb;
+      total += ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+      windows++;
+    }
+  }
+  return windows ? total / windows : 0.0;
+}
+
+} // namespace graphics
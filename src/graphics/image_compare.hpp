@@ -0,0 +1,31 @@
+// graphics/image_compare.hpp
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+namespace graphics {
+
+  // 8 bit RGB with the top row first, the layout binary PPM files use
+  struct Image {
+    uint32_t width = 0, height = 0;
+    std::vector<uint8_t> rgb;
+  };
+
+  // Quantizes an albedo pass the way fragment.glsl displays it, gamma corrected over the
+  // viewport background. Passes are stored bottom row first like gl_GlobalInvocationID.
+  void toImage(const std::vector<glm::vec4>& pixels, uint32_t width, uint32_t height, Image& out);
+
+  // Binary P6 with a maxval of 255
+  bool readPpm(const std::string& path, Image& out);
+  bool writePpm(const std::string& path, const Image& image);
+
+  // Peak signal to noise ratio over all channels in dB, infinity for identical images
+  double psnr(const Image& a, const Image& b);
+
+  // Mean structural similarity of the luma over 8x8 windows, 1 for identical images
+  double ssim(const Image& a, const Image& b);
+
+} // namespace graphics
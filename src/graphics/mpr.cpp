@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXRAY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "graphics/mpr.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace graphics {
+
+namespace {
+  struct PlaneAxes {
+    glm::vec3 u, v, normal;
+  };
+
+  // Screen up is anterior for axial and superior for coronal/sagittal, DICOM patient space has
+  // +y posterior and +z superior, so the v (down) axes point the other way
+  PlaneAxes planeAxes(MprOrientation orientation, float yaw, float pitch) {
+    switch (orientation) {
+      case MprOrientation::AXIAL:    return { { 1.f, 0.f, 0.f }, { 0.f, 1.f,  0.f }, { 0.f, 0.f, 1.f } };
+      case MprOrientation::CORONAL:  return { { 1.f, 0.f, 0.f }, { 0.f, 0.f, -1.f }, { 0.f, 1.f, 0.f } };
+      case MprOrientation::SAGITTAL: return { { 0.f, 1.f, 0.f }, { 0.f, 0.f, -1.f }, { 1.f, 0.f, 0.f } };
+      case MprOrientation::OBLIQUE:  break;
+    }
+
+    float cy = std::cos(yaw), sy = std::sin(yaw);
+    float cp = std::cos(pitch), sp = std::sin(pitch);
+    glm::vec3 u(cy, sy, 0.f);
+    glm::vec3 v0(-sy, cy, 0.f);
+    glm::vec3 n0(0.f, 0.f, 1.f);
+    glm::vec3 v = v0 * cp + n0 * sp;
+    glm::vec3 n = n0 * cp - v0 * sp;
+    return { u, v, n };
+  }
+
+  glm::vec3 spacing(const preprocessing::DicomMetadata& meta) {
+    return glm::vec3(meta.spacing_x, meta.spacing_y, meta.spacing_z);
+  }
+
+  glm::vec3 extent(const preprocessing::DicomMetadata& meta) {
+    return glm::vec3(float(meta.width - 1), float(meta.height - 1), float(meta.depth - 1)) * spacing(meta);
+  }
+
+  glm::vec3 origin(const preprocessing::DicomMetadata& meta) {
+    return glm::vec3(meta.origin_x, meta.origin_y, meta.origin_z);
+  }
+
+  // Length of the volume's projection onto a direction
+  float projectedLength(const glm::vec3& size, const glm::vec3& dir) {
+    return std::fabs(dir.x) * size.x + std::fabs(dir.y) * size.y + std::fabs(dir.z) * size.z;
+  }
+
+  inline uint8_t windowed(float raw, float lo, float inv_width) {
+    float v = std::clamp((raw - lo) * inv_width, 0.f, 1.f);
+    return uint8_t(v * 255.f + 0.5f);
+  }
+
+  float sampleScalar(const preprocessing::VoxelGrid& grid, float x, float y, float z) {
+    if (x < 0.f || y < 0.f || z < 0.f || x > grid.width - 1 || y > grid.height - 1 || z > grid.depth - 1) return 0.f;
+    uint32_t x0 = uint32_t(x), y0 = uint32_t(y), z0 = uint32_t(z);
+    uint32_t x1 = std::min(x0 + 1, grid.width - 1), y1 = std::min(y0 + 1, grid.height - 1), z1 = std::min(z0 + 1, grid.depth - 1);
+    float fx = x - x0, fy = y - y0, fz = z - z0;
+
+    auto at = [&](uint32_t i, uint32_t j, uint32_t k) { return grid.data[((size_t)k * grid.height + j) * grid.width + i]; };
+    float c00 = at(x0, y0, z0) + (at(x1, y0, z0) - at(x0, y0, z0)) * fx;
+    float c10 = at(x0, y1, z0) + (at(x1, y1, z0) - at(x0, y1, z0)) * fx;
+    float c01 = at(x0, y0, z1) + (at(x1, y0, z1) - at(x0, y0, z1)) * fx;
+    float c11 = at(x0, y1, z1) + (at(x1, y1, z1) - at(x0, y1, z1)) * fx;
+    float c0 = c00 + (c10 - c00) * fy;
+    float c1 = c01 + (c11 - c01) * fy;
+    return c0 + (c1 - c0) * fz;
+  }
+
+  // One output row, start is the voxel coordinate of pixel 0 and step the offset between pixels
+  void reformatRow(const preprocessing::VoxelGrid& grid, glm::vec3 start, glm::vec3 step, uint32_t width,
+                   float lo, float inv_width, uint8_t* out) {
+    uint32_t x = 0;
+#ifdef VOXRAY_SSE2
+    const __m128 lane  = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+    const __m128 zero  = _mm_setzero_ps();
+    const __m128 max_x = _mm_set1_ps(float(grid.width - 1));
+    const __m128 max_y = _mm_set1_ps(float(grid.height - 1));
+    const __m128 max_z = _mm_set1_ps(float(grid.depth - 1));
+    const __m128 v_lo  = _mm_set1_ps(lo);
+    const __m128 v_inv = _mm_set1_ps(inv_width * 255.f);
+    const __m128 v_max = _mm_set1_ps(255.f);
+    const __m128 half  = _mm_set1_ps(0.5f);
+    const size_t row = grid.width, slice = (size_t)grid.width * grid.height;
+    const float* data = grid.data.data();
+
+    for (; x + 4 <= width; x += 4) {
+      __m128 a  = _mm_add_ps(_mm_set1_ps(float(x)), lane);
+      __m128 px = _mm_add_ps(_mm_set1_ps(start.x), _mm_mul_ps(a, _mm_set1_ps(step.x)));
+      __m128 py = _mm_add_ps(_mm_set1_ps(start.y), _mm_mul_ps(a, _mm_set1_ps(step.y)));
+      __m128 pz = _mm_add_ps(_mm_set1_ps(start.z), _mm_mul_ps(a, _mm_set1_ps(step.z)));
+
+      // Pixels outside the volume are black
+      __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(px, zero), _mm_cmple_ps(px, max_x)),
+                      _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(py, zero), _mm_cmple_ps(py, max_y)),
+                                 _mm_and_ps(_mm_cmpge_ps(pz, zero), _mm_cmple_ps(pz, max_z))));
+      int mask = _mm_movemask_ps(inside);
+      if (mask == 0) {
+        std::fill(out + x, out + x + 4, uint8_t(0));
+        continue;
+      }
+      px = _mm_min_ps(_mm_max_ps(px, zero), max_x);
+      py = _mm_min_ps(_mm_max_ps(py, zero), max_y);
+      pz = _mm_min_ps(_mm_max_ps(pz, zero), max_z);
+
+      __m128i ix = _mm_cvttps_epi32(px), iy = _mm_cvttps_epi32(py), iz = _mm_cvttps_epi32(pz);
+      __m128 fx = _mm_sub_ps(px, _mm_cvtepi32_ps(ix));
+      __m128 fy = _mm_sub_ps(py, _mm_cvtepi32_ps(iy));
+      __m128 fz = _mm_sub_ps(pz, _mm_cvtepi32_ps(iz));
+
+      alignas(16) int32_t xs[4], ys[4], zs[4];
+      _mm_store_si128(reinterpret_cast<__m128i*>(xs), ix);
+      _mm_store_si128(reinterpret_cast<__m128i*>(ys), iy);
+      _mm_store_si128(reinterpret_cast<__m128i*>(zs), iz);
+
+      // Gather the eight corners per lane, neighbours clamp on the far faces
+      alignas(16) float c[8][4];
+      for (int l = 0; l < 4; l++) {
+        size_t base = (size_t)zs[l] * slice + (size_t)ys[l] * row + xs[l];
+        size_t dx = uint32_t(xs[l]) + 1 < grid.width  ? 1 : 0;
+        size_t dy = uint32_t(ys[l]) + 1 < grid.height ? row : 0;
+        size_t dz = uint32_t(zs[l]) + 1 < grid.depth  ? slice : 0;
+        c[0][l] = data[base];
+        c[1][l] = data[base + dx];
+        c[2][l] = data[base + dy];
+        c[3][l] = data[base + dy + dx];
+        c[4][l] = data[base + dz];
+        c[5][l] = data[base + dz + dx];
+        c[6][l] = data[base + dz + dy];
+        c[7][l] = data[base + dz + dy + dx];
+      }
+
+      auto lerp = [](__m128 p, __m128 q, __m128 f) { return _mm_add_ps(p, _mm_mul_ps(_mm_sub_ps(q, p), f)); };
+      __m128 c00 = lerp(_mm_load_ps(c[0]), _mm_load_ps(c[1]), fx);
+      __m128 c10 = lerp(_mm_load_ps(c[2]), _mm_load_ps(c[3]), fx);
+      __m128 c01 = lerp(_mm_load_ps(c[4]), _mm_load_ps(c[5]), fx);
+      __m128 c11 = lerp(_mm_load_ps(c[6]), _mm_load_ps(c[7]), fx);
+      __m128 value = lerp(lerp(c00, c10, fy), lerp(c01, c11, fy), fz);
+
+      __m128 grey = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(value, v_lo), v_inv), zero), v_max);
+      grey = _mm_and_ps(_mm_add_ps(grey, half), inside);
+      __m128i bytes = _mm_cvttps_epi32(grey);
+      bytes = _mm_packs_epi32(bytes, bytes);
+      bytes = _mm_packus_epi16(bytes, bytes);
+      int32_t packed = _mm_cvtsi128_si32(bytes);
+      std::copy_n(reinterpret_cast<const uint8_t*>(&packed), 4, out + x);
+    }
+#endif
+    for (; x < width; x++) {
+      glm::vec3 p = start + step * float(x);
+      bool inside = p.x >= 0.f && p.y >= 0.f && p.z >= 0.f &&
+                    p.x <= grid.width - 1 && p.y <= grid.height - 1 && p.z <= grid.depth - 1;
+      out[x] = inside ? windowed(sampleScalar(grid, p.x, p.y, p.z), lo, inv_width) : 0;
+    }
+  }
+
+  // Resident bricks of one paged reformat, indexed like the brick file, nullptr where not resident
+  struct BrickTable {
+    const preprocessing::BrickFileHeader& header;
+    std::vector<const float*> data;
+  };
+
+  // Bricks holding the eight trilinear corners of full resolution voxel p, up to eight of them
+  // when p sits on a brick face. Returns how many were written.
+  int cornerBricks(const preprocessing::BrickFileHeader& h, glm::vec3 p, uint32_t* out) {
+    const uint32_t bs = h.brick_size;
+    uint32_t x0 = uint32_t(p.x), y0 = uint32_t(p.y), z0 = uint32_t(p.z);
+    uint32_t bx[2] = { x0 / bs, std::min(x0 + 1, h.width  - 1) / bs };
+    uint32_t by[2] = { y0 / bs, std::min(y0 + 1, h.height - 1) / bs };
+    uint32_t bz[2] = { z0 / bs, std::min(z0 + 1, h.depth  - 1) / bs };
+
+    int count = 0;
+    for (int k = 0; k < (bz[1] != bz[0] ? 2 : 1); k++) {
+      for (int j = 0; j < (by[1] != by[0] ? 2 : 1); j++) {
+        for (int i = 0; i < (bx[1] != bx[0] ? 2 : 1); i++) out[count++] = preprocessing::brickIndex(h, bx[i], by[j], bz[k]);
+      }
+    }
+    return count;
+  }
+
+  // Trilinear sample at full resolution voxel p, false if any corner's brick isn't in the table
+  bool samplePaged(const BrickTable& table, glm::vec3 p, float& out) {
+    const preprocessing::BrickFileHeader& h = table.header;
+    const uint32_t bs = h.brick_size;
+    uint32_t x0 = uint32_t(p.x), y0 = uint32_t(p.y), z0 = uint32_t(p.z);
+    uint32_t xs[2] = { x0, std::min(x0 + 1, h.width  - 1) };
+    uint32_t ys[2] = { y0, std::min(y0 + 1, h.height - 1) };
+    uint32_t zs[2] = { z0, std::min(z0 + 1, h.depth  - 1) };
+
+    float c[8];
+    for (int n = 0; n < 8; n++) {
+      uint32_t x = xs[n & 1], y = ys[(n >> 1) & 1], z = zs[n >> 2];
+      const float* brick = table.data[preprocessing::brickIndex(h, x / bs, y / bs, z / bs)];
+      if (!brick) return false;
+      c[n] = brick[((size_t)(z % bs) * bs + (y % bs)) * bs + (x % bs)];
+    }
+
+    float fx = p.x - x0, fy = p.y - y0, fz = p.z - z0;
+    float c00 = c[0] + (c[1] - c[0]) * fx;
+    float c10 = c[2] + (c[3] - c[2]) * fx;
+    float c01 = c[4] + (c[5] - c[4]) * fx;
+    float c11 = c[6] + (c[7] - c[6]) * fx;
+    float c0 = c00 + (c10 - c00) * fy;
+    float c1 = c01 + (c11 - c01) * fy;
+    out = c0 + (c1 - c0) * fz;
+    return true;
+  }
+}
+
+MprSliceRange mprSliceRange(const preprocessing::DicomMetadata& meta, MprOrientation orientation, float yaw, float pitch) {
+  switch (orientation) {
+    case MprOrientation::AXIAL:    return { uint32_t(meta.depth),  meta.spacing_z };
+    case MprOrientation::CORONAL:  return { uint32_t(meta.height), meta.spacing_y };
+    case MprOrientation::SAGITTAL: return { uint32_t(meta.width),  meta.spacing_x };
+    case MprOrientation::OBLIQUE:  break;
+  }
+
+  float step = std::min({ meta.spacing_x, meta.spacing_y, meta.spacing_z });
+  float length = projectedLength(extent(meta), planeAxes(orientation, yaw, pitch).normal);
+  return { uint32_t(length / step) + 1, step };
+}
+
+MprPlane makeMprPlane(const preprocessing::DicomMetadata& meta, MprOrientation orientation, float slice,
+                      float yaw, float pitch, uint32_t width, uint32_t height) {
+  PlaneAxes axes = planeAxes(orientation, yaw, pitch);
+  MprSliceRange range = mprSliceRange(meta, orientation, yaw, pitch);
+  glm::vec3 size = extent(meta);
+
+  MprPlane plane;
+  plane.u = axes.u;
+  plane.v = axes.v;
+  plane.center = origin(meta) + size * 0.5f + axes.normal * ((slice - 0.5f * float(range.count - 1)) * range.spacing_mm);
+  plane.pixel_mm = std::max(projectedLength(size, axes.u) / std::max(width, 1u),
+                            projectedLength(size, axes.v) / std::max(height, 1u));
+  plane.pixel_mm = std::max(plane.pixel_mm, 1e-3f);
+  return plane;
+}
+
+void reformatSlice(const preprocessing::VoxelGrid& grid, const preprocessing::DicomMetadata& meta, const MprPlane& plane,
+                   uint32_t width, uint32_t height, float win_center, float win_width, float density_scale, uint8_t* out) {
+  if (grid.data.empty()) {
+    std::fill(out, out + (size_t)width * height, uint8_t(0));
+    return;
+  }
+
+  // Everything in voxel coordinates so each row is a start point plus a constant step
+  glm::vec3 to_voxel = 1.f / spacing(meta);
+  glm::vec3 du = plane.u * plane.pixel_mm * to_voxel;
+  glm::vec3 dv = plane.v * plane.pixel_mm * to_voxel;
+  glm::vec3 corner = (plane.center - origin(meta)) * to_voxel - du * (0.5f * (width - 1)) - dv * (0.5f * (height - 1));
+
+  float lo = win_center - 0.5f * win_width;
+  float inv_width = density_scale / std::max(win_width, 1e-6f);
+
+  preprocessing::parallelFor(0, height, [&](size_t row_begin, size_t row_end) {
+    for (size_t y = row_begin; y < row_end; y++) {
+      reformatRow(grid, corner + dv * float(y), du, width, lo, inv_width, out + y * width);
+    }
+  });
+}
+
+bool reformatSlicePaged(preprocessing::PagedVolume& volume, const preprocessing::VoxelGrid& fallback,
+                        const preprocessing::DicomMetadata& fallback_meta, const MprPlane& plane, uint32_t width,
+                        uint32_t height, float win_center, float win_width, float density_scale, uint8_t* out) {
+  const preprocessing::BrickFileHeader& h = volume.header;
+  const preprocessing::DicomMetadata meta = preprocessing::metadataFromHeader(h);
+  const glm::vec3 fallback_spacing = spacing(fallback_meta);
+  // The fallback already resolves everything a pixel this coarse can show
+  if (plane.pixel_mm >= std::min({ fallback_spacing.x, fallback_spacing.y, fallback_spacing.z })) {
+    reformatSlice(fallback, fallback_meta, plane, width, height, win_center, win_width, density_scale, out);
+    return true;
+  }
+
+  glm::vec3 to_voxel = 1.f / spacing(meta);
+  glm::vec3 du = plane.u * plane.pixel_mm * to_voxel;
+  glm::vec3 dv = plane.v * plane.pixel_mm * to_voxel;
+  glm::vec3 corner = (plane.center - origin(meta)) * to_voxel - du * (0.5f * (width - 1)) - dv * (0.5f * (height - 1));
+  auto inside = [&](glm::vec3 p) {
+    return p.x >= 0.f && p.y >= 0.f && p.z >= 0.f && p.x <= h.width - 1 && p.y <= h.height - 1 && p.z <= h.depth - 1;
+  };
+
+  // Every brick the slice touches, in row order so the requests load from the top down
+  std::vector<uint8_t> needed(preprocessing::brickCount(h), 0);
+  std::vector<uint32_t> touched;
+  for (uint32_t y = 0; y < height; y++) {
+    uint32_t previous = UINT32_MAX;
+    for (uint32_t x = 0; x < width; x++) {
+      glm::vec3 p = corner + dv * float(y) + du * float(x);
+      if (!inside(p)) continue;
+      uint32_t bricks[8];
+      int count = cornerBricks(h, p, bricks);
+      // Neighbouring pixels nearly always share a single brick
+      if (count == 1 && bricks[0] == previous) continue;
+      previous = count == 1 ? bricks[0] : UINT32_MAX;
+      for (int i = 0; i < count; i++) {
+        if (!needed[bricks[i]]) touched.push_back(bricks[i]);
+        needed[bricks[i]] = 1;
+      }
+    }
+  }
+
+  // More than half the cache would only thrash it against the frustum prefetch
+  size_t max_bricks = std::max<size_t>(1, volume.config.memory_budget / (preprocessing::brickVoxels(h) * sizeof(float)) / 2);
+  if (touched.size() > max_bricks) {
+    reformatSlice(fallback, fallback_meta, plane, width, height, win_center, win_width, density_scale, out);
+    return true;
+  }
+
+  // Held until the slice is written so eviction can't free them underneath
+  BrickTable table{ h, std::vector<const float*>(preprocessing::brickCount(h), nullptr) };
+  std::vector<preprocessing::BrickRef> held;
+  std::vector<uint32_t> missing;
+  held.reserve(touched.size());
+  for (uint32_t index : touched) {
+    uint32_t bx = index % h.bricks_x, by = (index / h.bricks_x) % h.bricks_y, bz = index / (h.bricks_x * h.bricks_y);
+    if (preprocessing::BrickRef brick = preprocessing::tryAcquireBrick(volume, bx, by, bz)) {
+      table.data[index] = brick->data.data();
+      held.push_back(std::move(brick));
+    } else {
+      missing.push_back(index);
+    }
+  }
+  if (!missing.empty()) preprocessing::requestBricks(volume, missing);
+
+  // Full resolution voxels to fallback voxels, through patient space
+  const glm::vec3 to_fallback = spacing(meta) / fallback_spacing;
+  const glm::vec3 fallback_offset = (origin(meta) - origin(fallback_meta)) / fallback_spacing;
+  const glm::vec3 fallback_max(float(fallback.width - 1), float(fallback.height - 1), float(fallback.depth - 1));
+
+  float lo = win_center - 0.5f * win_width;
+  float inv_width = density_scale / std::max(win_width, 1e-6f);
+
+  preprocessing::parallelFor(0, height, [&](size_t row_begin, size_t row_end) {
+    for (size_t y = row_begin; y < row_end; y++) {
+      uint8_t* row = out + y * width;
+      for (uint32_t x = 0; x < width; x++) {
+        glm::vec3 p = corner + dv * float(y) + du * float(x);
+        if (!inside(p)) {
+          row[x] = 0;
+          continue;
+        }
+        float value;
+        if (!samplePaged(table, p, value)) {
+          // Fallback cells are centred a little inside the volume's faces
+          glm::vec3 q = glm::clamp(p * to_fallback + fallback_offset, glm::vec3(0.f), fallback_max);
+          value = fallback.data.empty() ? 0.f : sampleScalar(fallback, q.x, q.y, q.z);
+        }
+        row[x] = windowed(value, lo, inv_width);
+      }
+    }
+  });
+  return missing.empty();
+}
+
+} // namespace graphics
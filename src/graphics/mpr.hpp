@@ -0,0 +1,57 @@
+// graphics/mpr.hpp
+#pragma once
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/paged_volume.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace graphics {
+
+  enum class MprOrientation : uint8_t {
+    AXIAL,
+    CORONAL,
+    SAGITTAL,
+    OBLIQUE     // Axial tilted by yaw about the patient z axis, then pitch about the new row axis
+  };
+
+  // A plane through the volume in patient space (millimetres, voxel i at origin + i * spacing)
+  // Image rows run along u and columns along v, both unit length, pixel_mm apart
+  struct MprPlane {
+    glm::vec3 center;
+    glm::vec3 u, v;
+    float pixel_mm;
+  };
+
+  struct MprSliceRange {
+    uint32_t count;
+    float spacing_mm;
+  };
+
+  // Slices available when scrolling along the plane normal, one per voxel layer for the standard
+  // orientations and at the finest spacing for oblique ones
+  MprSliceRange mprSliceRange(const preprocessing::DicomMetadata& meta, MprOrientation orientation, float yaw, float pitch);
+
+  // Plane for slice index slice (fractional is fine), scaled so the whole volume fits width x height
+  MprPlane makeMprPlane(const preprocessing::DicomMetadata& meta, MprOrientation orientation, float slice,
+                        float yaw, float pitch, uint32_t width, uint32_t height);
+
+  // Trilinear samples of the plane with the window applied in the same pass, written as 8-bit grey
+  // The window matches the marchers', density_scale included. grid should hold unsmoothed
+  // densities, slices are read diagnostically. Four pixels at a time with SSE2 where available,
+  // rows split across threads.
+  void reformatSlice(const preprocessing::VoxelGrid& grid, const preprocessing::DicomMetadata& meta, const MprPlane& plane,
+                     uint32_t width, uint32_t height, float win_center, float win_width, float density_scale, uint8_t* out);
+
+  // reformatSlice() at the full resolution of a paged volume. Bricks are read through its cache
+  // without blocking, pixels whose bricks aren't resident yet are taken from fallback (e.g. the
+  // overview, unsmoothed) and the missing bricks are requested. Returns false while any pixel
+  // still came from the fallback. Slices coarser than the fallback, or needing more bricks than
+  // half the cache holds, are read from the fallback alone.
+  bool reformatSlicePaged(preprocessing::PagedVolume& volume, const preprocessing::VoxelGrid& fallback,
+                          const preprocessing::DicomMetadata& fallback_meta, const MprPlane& plane, uint32_t width,
+                          uint32_t height, float win_center, float win_width, float density_scale, uint8_t* out);
+
+} // namespace graphics
@@ -1,21 +1,70 @@
 // graphics/render_targets.hpp
 #pragma once
+#include <string>
+
 #include "gl_utils.hpp"
 
 namespace graphics {
+  // Storage format of each pass and which passes are written at all. The compute shader is
+  // compiled against a layout with renderTargetDefines(), so its image formats always match.
+  struct RenderTargetLayout {
+    GLenum albedo = GL_RGBA16F;
+    GLenum depth  = GL_R32F;          // Only the first channel carries anything
+    GLenum normal = GL_RGB10_A2;      // Unorm formats store xyz * 0.5 + 0.5, alpha marks a hit
+    bool depth_pass  = true;
+    bool normal_pass = true;
+  };
+
   struct RenderTargets {
     Texture albedo;
     Texture depth;
     Texture normal;
+    RenderTargetLayout layout;
 
     int width = 0;
     int height = 0;
   };
 
-  inline bool makeRenderTargets(int width, int height, RenderTargets& out) {
-    if (!makeTexture2D(GL_TEXTURE_2D, GL_RGBA32F, width, height, out.albedo)) return false;
-    if (!makeTexture2D(GL_TEXTURE_2D, GL_RGBA32F, width, height, out.depth))  return false;
-    if (!makeTexture2D(GL_TEXTURE_2D, GL_RGBA32F, width, height, out.normal)) return false;
+  // GLSL image format qualifier for a sized internal format, nullptr if images can't use it
+  inline const char* imageFormatQualifier(GLenum format) {
+    switch (format) {
+      case GL_RGBA32F:    return "rgba32f";
+      case GL_RGBA16F:    return "rgba16f";
+      case GL_R32F:       return "r32f";
+      case GL_R16F:       return "r16f";
+      case GL_RGB10_A2:   return "rgb10_a2";
+      case GL_RGBA8:      return "rgba8";
+      default:            return nullptr;
+    }
+  }
+
+  inline bool isUnormFormat(GLenum format) {
+    return format == GL_RGB10_A2 || format == GL_RGBA8;
+  }
+
+  inline std::string renderTargetDefines(const RenderTargetLayout& layout) {
+    std::string defines;
+    defines += std::string("#define ALBEDO_FORMAT ") + imageFormatQualifier(layout.albedo) + "\n";
+    defines += std::string("#define DEPTH_FORMAT ") + imageFormatQualifier(layout.depth) + "\n";
+    defines += std::string("#define NORMAL_FORMAT ") + imageFormatQualifier(layout.normal) + "\n";
+    defines += std::string("#define DEPTH_PASS ") + (layout.depth_pass ? "1" : "0") + "\n";
+    defines += std::string("#define NORMAL_PASS ") + (layout.normal_pass ? "1" : "0") + "\n";
+    defines += std::string("#define PACK_NORMALS ") + (isUnormFormat(layout.normal) ? "1" : "0") + "\n";
+    return defines;
+  }
+
+  inline bool isValidLayout(const RenderTargetLayout& layout) {
+    return imageFormatQualifier(layout.albedo) && imageFormatQualifier(layout.depth) && imageFormatQualifier(layout.normal);
+  }
+
+  // Passes the layout turns off get no texture and are never bound
+  inline bool makeRenderTargets(int width, int height, const RenderTargetLayout& layout, RenderTargets& out) {
+    out.layout = layout;
+    out.depth  = Texture{};
+    out.normal = Texture{};
+    if (!makeTexture2D(GL_TEXTURE_2D, layout.albedo, width, height, out.albedo)) return false;
+    if (layout.depth_pass  && !makeTexture2D(GL_TEXTURE_2D, layout.depth, width, height, out.depth))   return false;
+    if (layout.normal_pass && !makeTexture2D(GL_TEXTURE_2D, layout.normal, width, height, out.normal)) return false;
 
     out.width = width;
     out.height = height;
@@ -28,7 +77,7 @@ namespace graphics {
     destroy(targets.depth);
     destroy(targets.normal);
 
-    return makeRenderTargets(width, height, targets);
+    return makeRenderTargets(width, height, targets.layout, targets);
   }
 
   inline void destroy(const RenderTargets& targets) {
@@ -39,8 +88,15 @@ namespace graphics {
 
   inline void bindForCompute(const RenderTargets& targets) {
     glBindImageTexture(0, targets.albedo.id, 0, GL_FALSE, 0, GL_WRITE_ONLY, targets.albedo.format);
-    glBindImageTexture(1, targets.depth.id, 0, GL_FALSE, 0, GL_WRITE_ONLY, targets.depth.format);
-    glBindImageTexture(2, targets.normal.id, 0, GL_FALSE, 0, GL_WRITE_ONLY, targets.normal.format);
+    if (targets.depth.id)  glBindImageTexture(1, targets.depth.id, 0, GL_FALSE, 0, GL_WRITE_ONLY, targets.depth.format);
+    if (targets.normal.id) glBindImageTexture(2, targets.normal.id, 0, GL_FALSE, 0, GL_WRITE_ONLY, targets.normal.format);
+  }
+
+  // The deferred lighting pass reads depth and normals and rewrites albedo in place
+  inline void bindForLighting(const RenderTargets& targets) {
+    glBindImageTexture(0, targets.albedo.id, 0, GL_FALSE, 0, GL_READ_WRITE, targets.albedo.format);
+    glBindImageTexture(1, targets.depth.id, 0, GL_FALSE, 0, GL_READ_ONLY, targets.depth.format);
+    glBindImageTexture(2, targets.normal.id, 0, GL_FALSE, 0, GL_READ_ONLY, targets.normal.format);
   }
 
   inline void bindForDisplay(const RenderTargets& targets) {
@@ -48,4 +104,17 @@ namespace graphics {
     glBindTextureUnit(1, targets.depth.id);
     glBindTextureUnit(2, targets.normal.id);
   }
+
+  // Bytes written per pixel each dispatch
+  inline int bytesPerPixel(const RenderTargetLayout& layout) {
+    auto size = [](GLenum format) {
+      switch (format) {
+        case GL_RGBA32F: return 16;
+        case GL_RGBA16F: return 8;
+        case GL_R16F:    return 2;
+        default:         return 4;
+      }
+    };
+    return size(layout.albedo) + (layout.depth_pass ? size(layout.depth) : 0) + (layout.normal_pass ? size(layout.normal) : 0);
+  }
 } // namespace graphics
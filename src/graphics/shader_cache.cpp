@@ -0,0 +1,142 @@
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "shader_cache.hpp"
+
+namespace graphics {
+
+namespace {
+  constexpr char BINARY_MAGIC[4] = { 'V', 'X', 'P', 'B' };
+  constexpr uint32_t BINARY_VERSION = 1;
+
+  struct BinaryHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t format;          // From glGetProgramBinary, driver specific
+    uint32_t length;
+  };
+
+  uint64_t fnv1a(const std::string& text, uint64_t hash = 0xcbf29ce484222325ull) {
+    for (unsigned char c : text) {
+      hash ^= c;
+      hash *= 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  std::string binaryPath(const ShaderCache& cache, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return (std::filesystem::path(cache.directory) / name).string();
+  }
+
+  // Fails quietly on anything stale or unreadable, the caller just compiles instead
+  bool loadBinary(const ShaderCache& cache, uint64_t key, Program& out) {
+    std::ifstream in(binaryPath(cache, key), std::ios::binary);
+    if (!in) return false;
+
+    BinaryHeader header{};
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    if (std::memcmp(header.magic, BINARY_MAGIC, 4) != 0 || header.version != BINARY_VERSION || header.key != key) return false;
+
+    std::vector<char> binary(header.length);
+    if (!in.read(binary.data(), binary.size())) return false;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary.data(), GLsizei(binary.size()));
+    GLint ok = 0; glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+      glDeleteProgram(program);
+      return false;
+    }
+
+    out = Program{ program };
+    return true;
+  }
+
+  void storeBinary(const ShaderCache& cache, uint64_t key, const Program& program) {
+    GLint length = 0;
+    glGetProgramiv(program.id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program.id, length, &length, &format, binary.data());
+
+    std::error_code ec;
+    std::filesystem::create_directories(cache.directory, ec);
+    // Written aside and renamed, so another instance never reads half a file
+    std::string path = binaryPath(cache, key);
+    std::string temp = path + ".tmp";
+    {
+      std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+      BinaryHeader header{ { BINARY_MAGIC[0], BINARY_MAGIC[1], BINARY_MAGIC[2], BINARY_MAGIC[3] },
+                           BINARY_VERSION, key, format, uint32_t(length) };
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(binary.data(), length);
+      if (!out) {
+        printf("Failed to write program binary %s\n", temp.c_str());
+        return;
+      }
+    }
+    std::filesystem::rename(temp, path, ec);
+    if (ec) printf("Failed to store program binary %s: %s\n", path.c_str(), ec.message().c_str());
+  }
+}
+
+void initShaderCache(const std::string& directory, ShaderCache& cache) {
+  cache.directory = directory;
+  cache.driver.clear();
+  for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+    auto value = reinterpret_cast<const char*>(glGetString(name));
+    cache.driver += value ? value : "?";
+    cache.driver += '\n';
+  }
+
+  // Drivers that can't load any binary format would just fill the directory with misses
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  if (formats == 0) cache.directory.clear();
+}
+
+bool computeProgram(ShaderCache& cache, const char* path, const std::string& defines, Program& out, std::string* err) {
+  std::string name = std::string(path) + '\n' + defines;
+  auto it = cache.programs.find(name);
+  if (it != cache.programs.end()) {
+    out = it->second;
+    return true;
+  }
+
+  std::ifstream in(path, std::ios::binary);
+  std::string source = { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+  uint64_t key = fnv1a(cache.driver, fnv1a(defines, fnv1a(source)));
+
+  Program program{};
+  if (!cache.directory.empty() && !source.empty() && loadBinary(cache, key, program)) {
+    cache.loaded++;
+  } else {
+    Shader shader{};
+    if (!compileShader(GL_COMPUTE_SHADER, path, shader, err, defines)) return false;
+    bool linked = linkProgram(shader, program, err, !cache.directory.empty());
+    destroy(shader);
+    if (!linked) return false;
+
+    cache.compiled++;
+    if (!cache.directory.empty()) storeBinary(cache, key, program);
+  }
+
+  cache.programs[name] = program;
+  out = program;
+  return true;
+}
+
+void destroy(const ShaderCache& cache) {
+  for (const auto& [name, program] : cache.programs) destroy(program);
+}
+
+} // namespace graphics
@@ -0,0 +1,31 @@
+// graphics/shader_cache.hpp
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "gl_utils.hpp"
+
+namespace graphics {
+
+  // Programs built from one compute shader source with different #define sets. Each combination
+  // is linked once per run, and its glGetProgramBinary blob is kept on disk so later runs load it
+  // instead of compiling. Blobs are keyed on the source, the defines and the driver, so editing
+  // the shader or updating the driver just misses the cache.
+  struct ShaderCache {
+    std::string directory;      // Empty keeps programs in memory only
+    std::string driver;         // GL_VENDOR, GL_RENDERER and GL_VERSION
+    std::unordered_map<std::string, Program> programs;
+    uint32_t loaded = 0;        // Programs read from disk this run
+    uint32_t compiled = 0;
+  };
+
+  // Needs a current context, directory is created on the first store
+  void initShaderCache(const std::string& directory, ShaderCache& cache);
+
+  // Program for the compute shader at path built with defines, owned by the cache
+  bool computeProgram(ShaderCache& cache, const char* path, const std::string& defines, Program& out, std::string* err);
+
+  void destroy(const ShaderCache& cache);
+
+} // namespace graphics
@@ -0,0 +1,45 @@
+// graphics/shader_variants.hpp
+#pragma once
+#include <string>
+
+#include "app/controls_data.hpp"
+#include "render_targets.hpp"
+
+namespace graphics {
+
+  // Feature toggles compiled into compute.glsl as constants instead of branched on per sample
+  // Anything left out of the defines falls back to the shader's runtime uniforms
+  struct ComputeVariant {
+    controls::RenderMode mode = controls::RenderMode::COMPOSITE;
+    bool shadows = true;          // Shadow rays towards the light in composite mode
+    bool labels = false;          // Label mask lookups, off while no labels are shown
+    bool high_quality = false;    // Half the step size, twice the steps
+    bool occlusion = false;       // Ambient occlusion fetches, off until a volume is built for what's shown
+
+    bool operator==(const ComputeVariant&) const = default;
+  };
+
+  // Deferred lighting casts its own shadows after the march, so the march doesn't
+  inline ComputeVariant computeVariant(const controls::WinData& window, bool labels, bool occlusion) {
+    return ComputeVariant{ window.mode, window.shadows && !window.deferred_lighting, labels, window.high_quality,
+                           window.ambient_occlusion && occlusion };
+  }
+
+  // Ray step in normalized volume units and the most steps a ray takes. The shader gets them as
+  // STEP_SIZE and MAX_STEPS, the CPU port through CpuRenderParams.
+  inline float stepSize(const ComputeVariant& variant) { return variant.high_quality ? 0.0025f : 0.005f; }
+  inline int maxSteps(const ComputeVariant& variant) { return variant.high_quality ? 2000 : 1000; }
+
+  // Defines for the variant plus the render target layout it writes to
+  inline std::string computeVariantDefines(const ComputeVariant& variant, const RenderTargetLayout& layout) {
+    std::string defines = renderTargetDefines(layout);
+    defines += "#define RENDER_MODE " + std::to_string(int(variant.mode)) + "\n";
+    defines += std::string("#define SHADOWS ") + (variant.shadows ? "1" : "0") + "\n";
+    defines += std::string("#define LABELS ") + (variant.labels ? "1" : "0") + "\n";
+    defines += std::string("#define OCCLUSION ") + (variant.occlusion ? "1" : "0") + "\n";
+    defines += "#define STEP_SIZE " + std::to_string(stepSize(variant)) + "\n";
+    defines += "#define MAX_STEPS " + std::to_string(maxSteps(variant)) + "\n";
+    return defines;
+  }
+
+} // namespace graphics
@@ -0,0 +1,453 @@
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include "graphics/sort_last.hpp"
+#include "graphics/volume_transform.hpp"
+#include "preprocessing/minmax_octree.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace graphics {
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  // How often the parent checks its workers are still alive while it waits for a frame
+  constexpr long LIVENESS_POLL_MS = 100;
+
+  // Lives at the start of the shared mapping, written by the parent between frames. The parent
+  // never blocks on a barrier, a worker that died would leave it waiting forever.
+  struct SharedState {
+    pthread_mutex_t mutex;              // Guards frame and finished
+    pthread_cond_t cv;                  // Parent and workers, frame or finished changed
+    pthread_barrier_t swap;             // Workers, between compositing rounds
+    uint64_t frame;                     // Bumped by the parent for every frame and for quit
+    uint32_t finished;                  // Workers whose region of the frame is final
+    CpuRenderParams params;
+    uint32_t rank_of[SORT_LAST_MAX_WORKERS];      // Per slab, 0 is nearest the camera
+    double render_ms[SORT_LAST_MAX_WORKERS];
+    double composite_ms[SORT_LAST_MAX_WORKERS];
+    bool quit;
+  };
+
+  // Voxels [z0, z1) are the slab's own, [g0, g1) adds the ghost layers
+  struct Slab {
+    uint32_t z0, z1, g0, g1;
+  };
+
+  Slab slabBounds(uint32_t depth, uint32_t workers, uint32_t index) {
+    Slab s;
+    s.z0 = uint32_t(uint64_t(depth) * index / workers);
+    s.z1 = uint32_t(uint64_t(depth) * (index + 1) / workers);
+    s.g0 = s.z0 > 0 ? s.z0 - 1 : 0;
+    s.g1 = std::min(s.z1 + 1, depth);
+    return s;
+  }
+
+  double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  }
+
+  glm::vec4* images(const SortLastRenderer& renderer) {
+    size_t offset = (sizeof(SharedState) + 63) & ~size_t(63);
+    return reinterpret_cast<glm::vec4*>(static_cast<char*>(renderer.shared) + offset);
+  }
+
+  size_t imagePixels(const SortLastRenderer& renderer) {
+    return (size_t)renderer.max_width * renderer.max_height;
+  }
+
+  void copySlab(const preprocessing::VoxelGrid& grid, const Slab& slab, preprocessing::VoxelGrid& out) {
+    size_t plane = (size_t)grid.width * grid.height;
+    out = preprocessing::VoxelGrid(grid.width, grid.height, slab.g1 - slab.g0);
+    std::copy_n(grid.data.begin() + slab.g0 * plane, out.data.size(), out.data.begin());
+    out.normals.resize(out.data.size());
+    std::copy_n(grid.normals.begin() + slab.g0 * plane, out.normals.size(), out.normals.begin());
+  }
+
+  // The slab as a volume of its own, boxed where it sits in the whole one. The camera and view
+  // move with the box offset so rays keep their directions, and the crop keeps rays to the
+  // slab's own voxels so no sample is taken twice. False when the crop leaves nothing.
+  bool slabParams(const CpuRenderParams& params, const Slab& slab, uint32_t depth, CpuRenderParams& out) {
+    out = params;
+    float d = float(depth), ghosted = float(slab.g1 - slab.g0);
+    float lo = std::max(params.crop_min.z, slab.z0 / d);
+    float hi = std::min(params.crop_max.z, slab.z1 / d);
+    if (lo >= hi) return false;
+    out.crop_min.z = (lo * d - slab.g0) / ghosted;
+    out.crop_max.z = (hi * d - slab.g0) / ghosted;
+
+    float s = params.volume_scale.z;
+    out.volume_scale.z = s * ghosted / d;
+    glm::vec3 offset(0.f, 0.f, s * ((slab.g0 + slab.g1) / d - 1.f));
+    glm::vec3 shift = -volumeRotation() * offset;
+
+    glm::mat4 translate(1.f);
+    translate[3] = glm::vec4(shift, 1.f);
+    out.view = params.view * translate;
+    out.cam = params.cam - shift;
+    // The parent's occlusion volume covers the whole grid and isn't mapped in the worker
+    out.occlusion = nullptr;
+    return true;
+  }
+
+  // Same ray setup as renderCpu(), length of the pixel's ray inside the crop box
+  float segmentLength(const CpuRenderParams& p, const glm::mat4& inv_view_proj, const glm::vec3& origin,
+                      uint32_t x, uint32_t y) {
+    glm::vec2 uv = glm::vec2(float(x) / p.width, float(y) / p.height) * 2.f - 1.f;
+    glm::vec4 target = inv_view_proj * glm::vec4(uv.x, uv.y, 1.f, 1.f);
+    glm::vec3 dir = glm::transpose(-volumeRotation()) * glm::normalize(glm::vec3(target) / target.w - p.cam);
+
+    glm::vec3 box_min = -p.volume_scale + p.crop_min * 2.f * p.volume_scale;
+    glm::vec3 box_max = -p.volume_scale + p.crop_max * 2.f * p.volume_scale;
+    glm::vec3 t0 = (box_min - origin) / dir, t1 = (box_max - origin) / dir;
+    glm::vec3 near = glm::min(t0, t1), far = glm::max(t0, t1);
+    float enter = std::max({ near.x, near.y, near.z, 0.f });
+    float exit = std::min({ far.x, far.y, far.z });
+    return std::max(exit - enter, 0.f);
+  }
+
+  // Average projections can't be blended as they are, so each partial carries its raw mean
+  // times the distance it covers and the distance itself. The sums are divided out and
+  // windowed at the end, windowing each slab's mean first would skew the clamped ones.
+  void weightAverages(const CpuRenderParams& p, std::vector<glm::vec4>& albedo) {
+    glm::mat4 inv_view_proj = glm::inverse(p.proj * p.view);
+    glm::vec3 origin = glm::transpose(-volumeRotation()) * p.cam;
+    for (uint32_t y = 0; y < p.height; y++) {
+      for (uint32_t x = 0; x < p.width; x++) {
+        glm::vec4& c = albedo[(size_t)y * p.width + x];
+        float length = c.w > 0.f ? segmentLength(p, inv_view_proj, origin, x, y) : 0.f;
+        c = glm::vec4(glm::vec3(c) * length, length);
+      }
+    }
+  }
+
+  // Alpha marks pixels whose ray crossed the slab at all, misses can't win a min or max
+  glm::vec4 blend(controls::RenderMode mode, const glm::vec4& front, const glm::vec4& back) {
+    switch (mode) {
+      case controls::RenderMode::MIP:
+        if (front.w <= 0.f) return back;
+        if (back.w <= 0.f) return front;
+        return glm::vec4(glm::max(glm::vec3(front), glm::vec3(back)), 1.f);
+      case controls::RenderMode::MINIP:
+        if (front.w <= 0.f) return back;
+        if (back.w <= 0.f) return front;
+        return glm::vec4(glm::min(glm::vec3(front), glm::vec3(back)), 1.f);
+      case controls::RenderMode::AVERAGE:
+        return front + back;
+      default:
+        // Premultiplied front-to-back, the same accumulation rayMarch() does per sample
+        return front + back * (1.f - front.w);
+    }
+  }
+
+  // Rows this rank still owns after the given number of binary-swap rounds
+  void swapRegion(uint32_t rank, uint32_t rounds, uint32_t height, uint32_t& lo, uint32_t& hi) {
+    lo = 0;
+    hi = height;
+    for (uint32_t r = 0; r < rounds; r++) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (rank & (1u << r)) lo = mid;
+      else hi = mid;
+    }
+  }
+
+  // Each round pairs ranks differing in one bit. The pair splits the rows they share, and each
+  // blends the partner's half into its own. Ranks below the bit hold the nearer group, so they
+  // are always the front operand.
+  void binarySwap(SharedState& state, glm::vec4* image_base, size_t stride, uint32_t workers, uint32_t rank) {
+    const CpuRenderParams& p = state.params;
+    glm::vec4* mine = image_base + rank * stride;
+    for (uint32_t r = 0; (1u << r) < workers; r++) {
+      pthread_barrier_wait(&state.swap);
+
+      uint32_t partner = rank ^ (1u << r);
+      const glm::vec4* theirs = image_base + partner * stride;
+      bool front = (rank & (1u << r)) == 0;
+
+      uint32_t lo, hi;
+      swapRegion(rank, r + 1, p.height, lo, hi);
+      for (size_t i = (size_t)lo * p.width; i < (size_t)hi * p.width; i++) {
+        mine[i] = front ? blend(p.mode, mine[i], theirs[i]) : blend(p.mode, theirs[i], mine[i]);
+      }
+    }
+  }
+
+  void workerMain(const preprocessing::VoxelGrid& grid, uint32_t workers, uint32_t index, SharedState& state,
+                  glm::vec4* image_base, size_t stride) {
+    // Every worker renders at once, so each takes its share of the cores
+    preprocessing::worker_limit = std::max(1u, preprocessing::workerCount() / workers);
+
+    Slab slab = slabBounds(grid.depth, workers, index);
+    preprocessing::VoxelGrid local;
+    copySlab(grid, slab, local);
+    preprocessing::MinMaxOctree octree;
+    preprocessing::buildMinMaxOctree(local, octree);
+
+    CpuFrame partial;
+    uint64_t seen = 0;
+    while (true) {
+      pthread_mutex_lock(&state.mutex);
+      while (state.frame == seen) pthread_cond_wait(&state.cv, &state.mutex);
+      seen = state.frame;
+      bool quit = state.quit;
+      pthread_mutex_unlock(&state.mutex);
+      if (quit) return;
+
+      uint32_t rank = state.rank_of[index];
+      const CpuRenderParams& frame = state.params;
+      size_t pixels = (size_t)frame.width * frame.height;
+      glm::vec4* mine = image_base + rank * stride;
+
+      Clock::time_point start = Clock::now();
+      CpuRenderParams params;
+      if (slabParams(frame, slab, grid.depth, params)) {
+        if (frame.mode == controls::RenderMode::AVERAGE) {
+          // An identity window over the normalized densities
+          params.win_center = 0.5f;
+          params.win_width = 1.f;
+          params.density_scale = 1.f;
+        }
+        renderCpu(local, &octree, nullptr, params, partial);
+        if (frame.mode == controls::RenderMode::AVERAGE) weightAverages(params, partial.albedo);
+        std::copy_n(partial.albedo.begin(), pixels, mine);
+      } else {
+        std::fill_n(mine, pixels, glm::vec4(0.f));
+      }
+      state.render_ms[rank] = millisecondsSince(start);
+
+      start = Clock::now();
+      binarySwap(state, image_base, stride, workers, rank);
+      state.composite_ms[rank] = millisecondsSince(start);
+
+      pthread_mutex_lock(&state.mutex);
+      state.finished++;
+      pthread_cond_broadcast(&state.cv);
+      pthread_mutex_unlock(&state.mutex);
+    }
+  }
+
+  bool initBarrier(pthread_barrier_t& barrier, uint32_t count) {
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    bool ok = pthread_barrier_init(&barrier, &attr, count) == 0;
+    pthread_barrierattr_destroy(&attr);
+    return ok;
+  }
+
+  bool initMutex(pthread_mutex_t& mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    bool ok = pthread_mutex_init(&mutex, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+    return ok;
+  }
+
+  // Timed waits on it measure the monotonic clock, so they can't be thrown off by clock changes
+  bool initCondition(pthread_cond_t& cv) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    bool ok = pthread_cond_init(&cv, &attr) == 0;
+    pthread_condattr_destroy(&attr);
+    return ok;
+  }
+
+  // Caller holds state.mutex
+  void publishFrame(SharedState& state) {
+    state.finished = 0;
+    state.frame++;
+    pthread_cond_broadcast(&state.cv);
+  }
+
+  // False as soon as any worker has exited, whatever the reason
+  bool workersAlive(SortLastRenderer& renderer) {
+    for (pid_t& pid : renderer.pids) {
+      if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid) {
+        printf("Sort-last worker %d exited\n", int(pid));
+        pid = 0;    // Already reaped
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Waits for every worker to finish the frame, checking between waits that none has died.
+  // A dead worker's partners are stuck in the swap barrier for good.
+  bool waitForWorkers(SortLastRenderer& renderer, SharedState& state) {
+    pthread_mutex_lock(&state.mutex);
+    while (state.finished < renderer.workers) {
+      timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += LIVENESS_POLL_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      if (pthread_cond_timedwait(&state.cv, &state.mutex, &deadline) == ETIMEDOUT && !workersAlive(renderer)) {
+        pthread_mutex_unlock(&state.mutex);
+        return false;
+      }
+    }
+    pthread_mutex_unlock(&state.mutex);
+    return true;
+  }
+
+  void killWorkers(SortLastRenderer& renderer) {
+    for (pid_t pid : renderer.pids) if (pid > 0) kill(pid, SIGKILL);
+    for (pid_t pid : renderer.pids) if (pid > 0) waitpid(pid, nullptr, 0);
+    renderer.pids.clear();
+  }
+}
+
+bool startSortLast(const preprocessing::VoxelGrid& grid, uint32_t workers, uint32_t max_width, uint32_t max_height,
+                   SortLastRenderer& out) {
+  if (workers == 0 || (workers & (workers - 1)) != 0 || workers > SORT_LAST_MAX_WORKERS) {
+    printf("Sort-last needs a power of two workers up to %u, not %u\n", SORT_LAST_MAX_WORKERS, workers);
+    return false;
+  }
+  if (workers > grid.depth || grid.normals.size() != grid.data.size()) {
+    printf("Can't split a volume %u slices deep across %u workers\n", grid.depth, workers);
+    return false;
+  }
+
+  out = SortLastRenderer{};
+  out.workers = workers;
+  out.depth = grid.depth;
+  out.max_width = max_width;
+  out.max_height = max_height;
+  size_t header = (sizeof(SharedState) + 63) & ~size_t(63);
+  out.shared_bytes = header + imagePixels(out) * workers * sizeof(glm::vec4);
+  out.shared = mmap(nullptr, out.shared_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (out.shared == MAP_FAILED) {
+    printf("Failed to map %zu bytes for sort-last compositing\n", out.shared_bytes);
+    out.shared = nullptr;
+    return false;
+  }
+
+  SharedState* state = new (out.shared) SharedState{};
+  if (!initMutex(state->mutex) || !initCondition(state->cv) || !initBarrier(state->swap, workers)) {
+    printf("Failed to create process shared synchronization\n");
+    munmap(out.shared, out.shared_bytes);
+    out.shared = nullptr;
+    return false;
+  }
+
+  for (uint32_t i = 0; i < workers; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      workerMain(grid, workers, i, *state, images(out), imagePixels(out));
+      _exit(0);
+    }
+    if (pid < 0) {
+      // The swap barrier can never fill without this worker, so the others are killed
+      printf("Failed to fork sort-last worker %u\n", i);
+      stopSortLast(out);
+      return false;
+    }
+    out.pids.push_back(pid);
+  }
+  return true;
+}
+
+bool renderSortLast(SortLastRenderer& renderer, const CpuRenderParams& params, CpuFrame& out, SortLastStats* stats) {
+  if (!renderer.shared || renderer.pids.size() != renderer.workers ||
+      params.width > renderer.max_width || params.height > renderer.max_height) return false;
+  SharedState& state = *static_cast<SharedState*>(renderer.shared);
+
+  // Parallel slabs have a visibility order for any camera, nearest slab first. A slab the camera
+  // is inside goes first, and slabs on opposite sides of it never share a ray.
+  float s = params.volume_scale.z;
+  float camera_z = (glm::transpose(-volumeRotation()) * params.cam).z;
+  std::vector<std::pair<float, uint32_t>> order;
+  for (uint32_t i = 0; i < renderer.workers; i++) {
+    Slab slab = slabBounds(renderer.depth, renderer.workers, i);
+    float lo = -s + 2.f * s * slab.z0 / renderer.depth;
+    float hi = -s + 2.f * s * slab.z1 / renderer.depth;
+    float distance = camera_z < lo ? lo - camera_z : camera_z > hi ? camera_z - hi : 0.f;
+    order.push_back({ distance, i });
+  }
+  std::sort(order.begin(), order.end());
+  for (uint32_t rank = 0; rank < renderer.workers; rank++) state.rank_of[order[rank].second] = rank;
+
+  pthread_mutex_lock(&state.mutex);
+  state.params = params;
+  state.quit = false;
+  publishFrame(state);
+  pthread_mutex_unlock(&state.mutex);
+
+  // The rest can't finish the frame, or any later one, without it
+  if (!waitForWorkers(renderer, state)) {
+    printf("Sort-last frame dropped, stopping the remaining workers\n");
+    killWorkers(renderer);
+    return false;
+  }
+
+  // Every rank ends up owning a band of rows of the final image
+  out.width = params.width;
+  out.height = params.height;
+  out.albedo.resize((size_t)params.width * params.height);
+  out.depth.clear();
+  out.normal.clear();
+  uint32_t rounds = 0;
+  while ((1u << rounds) < renderer.workers) rounds++;
+  for (uint32_t rank = 0; rank < renderer.workers; rank++) {
+    uint32_t lo, hi;
+    swapRegion(rank, rounds, params.height, lo, hi);
+    const glm::vec4* image = images(renderer) + rank * imagePixels(renderer);
+    std::copy(image + (size_t)lo * params.width, image + (size_t)hi * params.width, out.albedo.begin() + (size_t)lo * params.width);
+  }
+
+  if (params.mode == controls::RenderMode::AVERAGE) {
+    float lo = params.win_center - params.win_width * 0.5f;
+    for (glm::vec4& c : out.albedo) {
+      if (c.w <= 0.f) {
+        c = glm::vec4(0.f);
+        continue;
+      }
+      float value = std::clamp((c.x / c.w - lo) / params.win_width * params.density_scale, 0.f, 1.f);
+      c = glm::vec4(glm::vec3(value), 1.f);
+    }
+  }
+
+  if (stats) {
+    stats->render_ms = *std::max_element(state.render_ms, state.render_ms + renderer.workers);
+    stats->composite_ms = *std::max_element(state.composite_ms, state.composite_ms + renderer.workers);
+  }
+  return true;
+}
+
+void stopSortLast(SortLastRenderer& renderer) {
+  if (!renderer.shared) return;
+  SharedState& state = *static_cast<SharedState*>(renderer.shared);
+
+  // Only a full set of idle workers is told to quit, anything else may be stuck in the swap barrier
+  if (renderer.pids.size() == renderer.workers) {
+    pthread_mutex_lock(&state.mutex);
+    state.quit = true;
+    publishFrame(state);
+    pthread_mutex_unlock(&state.mutex);
+    for (pid_t pid : renderer.pids) waitpid(pid, nullptr, 0);
+  } else {
+    killWorkers(renderer);
+  }
+
+  pthread_barrier_destroy(&state.swap);
+  pthread_cond_destroy(&state.cv);
+  pthread_mutex_destroy(&state.mutex);
+  munmap(renderer.shared, renderer.shared_bytes);
+  renderer = SortLastRenderer{};
+}
+
+} // namespace graphics
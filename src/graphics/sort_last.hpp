@@ -0,0 +1,51 @@
+// graphics/sort_last.hpp
+#pragma once
+#include <sys/types.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "cpu_raymarch.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace graphics {
+
+  // Sort-last rendering on one machine, with processes standing in for cluster nodes. The volume
+  // is split into z slabs and each worker process keeps only its slab, plus a ghost layer either
+  // side for interpolation, and renders it with renderCpu(). The partial images are merged with
+  // binary-swap compositing through shared memory, so every worker blends 1/N of the frame.
+  //
+  // Partials are composited in visibility order, which matches a single march except that the
+  // composite mode's shadow rays and self-shadowing term stop at slab boundaries. Ambient
+  // occlusion is not applied.
+  struct SortLastRenderer {
+    uint32_t workers = 0;
+    uint32_t depth = 0;                 // Of the whole volume
+    uint32_t max_width = 0, max_height = 0;
+    std::vector<pid_t> pids;
+    void* shared = nullptr;             // SharedState followed by one image per worker
+    size_t shared_bytes = 0;
+  };
+
+  struct SortLastStats {
+    double render_ms = 0.0;             // Slowest worker's partial image
+    double composite_ms = 0.0;          // Slowest worker's binary swap
+  };
+
+  constexpr uint32_t SORT_LAST_MAX_WORKERS = 64;
+
+  // workers must be a power of two and no more than the volume's depth. The grid needs its
+  // normals. Forks without exec, and the workers only run the CPU marcher, so CUDA or a GL
+  // context in the parent is fine as long as no other thread is mid-work when it is called.
+  // Each worker caps its parallelFor() threads at its share of the cores.
+  bool startSortLast(const preprocessing::VoxelGrid& grid, uint32_t workers, uint32_t max_width, uint32_t max_height,
+                     SortLastRenderer& out);
+
+  // Fills only the albedo pass, frames can be up to the size given at start. Fails the frame if a
+  // worker has died, and every frame after it, since the rest can't composite without it.
+  bool renderSortLast(SortLastRenderer& renderer, const CpuRenderParams& params, CpuFrame& out,
+                      SortLastStats* stats = nullptr);
+
+  void stopSortLast(SortLastRenderer& renderer);
+
+} // namespace graphics
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "graphics/texture_upload.hpp"
+
+namespace graphics {
+
+bool beginTextureUpload(const Texture3D& texture, const void* data, TextureUpload& out) {
+  destroy(out);
+
+  GLint width, height, depth;
+  glGetTextureLevelParameteriv(texture.id, 0, GL_TEXTURE_WIDTH, &width);
+  glGetTextureLevelParameteriv(texture.id, 0, GL_TEXTURE_HEIGHT, &height);
+  glGetTextureLevelParameteriv(texture.id, 0, GL_TEXTURE_DEPTH, &depth);
+
+  const bool single = texture.format == GL_R32F;
+  out.texture          = texture;
+  out.source           = static_cast<const unsigned char*>(data);
+  out.upload_format    = single ? GL_RED : GL_RGBA;
+  out.width            = width;
+  out.height           = height;
+  out.depth            = depth;
+  out.slice_bytes      = (size_t)width * height * (single ? 1 : 4) * sizeof(float);
+  out.slices_per_chunk = GLsizei(std::clamp<size_t>(UPLOAD_CHUNK_BYTES / out.slice_bytes, 1, depth));
+  out.next_slice       = 0;
+  out.slot_bytes       = out.slices_per_chunk * out.slice_bytes;
+
+  // Coherent persistent mapping, chunks are memcpy'd straight into GPU visible memory
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glCreateBuffers(1, &out.ring);
+  if (!out.ring) return false;
+  glNamedBufferStorage(out.ring, GLsizeiptr(out.slot_bytes * UPLOAD_RING_SLOTS), nullptr, flags);
+  out.mapped = glMapNamedBufferRange(out.ring, 0, GLsizeiptr(out.slot_bytes * UPLOAD_RING_SLOTS), flags);
+  if (!out.mapped) {
+    destroy(out);
+    return false;
+  }
+  return true;
+}
+
+bool continueTextureUpload(TextureUpload& upload, int max_chunks) {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.ring);
+
+  for (int chunk = 0; chunk < max_chunks && upload.next_slice < upload.depth; chunk++) {
+    GLsync& fence = upload.fences[upload.slot];
+    if (fence) {
+      // Still being read by the GPU, try again next frame rather than stall
+      if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) break;
+      glDeleteSync(fence);
+      fence = nullptr;
+    }
+
+    GLsizei count = std::min(upload.slices_per_chunk, upload.depth - upload.next_slice);
+    size_t offset = upload.slot * upload.slot_bytes;
+    std::memcpy(static_cast<unsigned char*>(upload.mapped) + offset,
+                upload.source + upload.next_slice * upload.slice_bytes, count * upload.slice_bytes);
+
+    glTextureSubImage3D(upload.texture.id, 0, 0, 0, upload.next_slice, upload.width, upload.height, count,
+                        upload.upload_format, GL_FLOAT, reinterpret_cast<const void*>(uintptr_t(offset)));
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    upload.next_slice += count;
+    upload.slot = (upload.slot + 1) % UPLOAD_RING_SLOTS;
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  return upload.next_slice >= upload.depth;
+}
+
+void destroy(TextureUpload& upload) {
+  for (GLsync& fence : upload.fences) {
+    if (fence) glDeleteSync(fence);
+    fence = nullptr;
+  }
+  if (upload.ring) {
+    if (upload.mapped) glUnmapNamedBuffer(upload.ring);
+    glDeleteBuffers(1, &upload.ring);
+  }
+  upload.ring = 0;
+  upload.mapped = nullptr;
+  upload.source = nullptr;
+}
+
+} // namespace graphics
@@ -0,0 +1,40 @@
+// graphics/texture_upload.hpp
+#pragma once
+#include <GL/glew.h>
+
+#include <cstddef>
+
+#include "graphics/gl_utils.hpp"
+
+namespace graphics {
+
+  constexpr int    UPLOAD_RING_SLOTS  = 3;
+  constexpr size_t UPLOAD_CHUNK_BYTES = size_t(16) << 20;
+
+  // Streams client memory into an existing 3D texture in z-chunks through a ring of persistently
+  // mapped pixel unpack buffers. A slot is only refilled once the GPU has signalled its fence,
+  // so a frame never blocks on the copy, it just submits fewer chunks.
+  struct TextureUpload {
+    Texture3D texture{};
+    const unsigned char* source = nullptr;    // Must stay alive until the upload finishes
+    GLenum upload_format = GL_RED;
+    GLsizei width = 0, height = 0, depth = 0;
+    size_t slice_bytes = 0;
+    GLsizei slices_per_chunk = 1;
+    GLsizei next_slice = 0;
+
+    GLuint ring = 0;
+    void* mapped = nullptr;
+    size_t slot_bytes = 0;
+    GLsync fences[UPLOAD_RING_SLOTS]{};
+    int slot = 0;
+  };
+
+  bool beginTextureUpload(const Texture3D& texture, const void* data, TextureUpload& out);
+  // Submits at most max_chunks chunks, returns true once every slice has been submitted
+  bool continueTextureUpload(TextureUpload& upload, int max_chunks);
+  inline float uploadProgress(const TextureUpload& u) { return u.depth ? float(u.next_slice) / u.depth : 0.f; }
+  // Releases the ring, the texture itself belongs to the caller
+  void destroy(TextureUpload& upload);
+
+} // namespace graphics
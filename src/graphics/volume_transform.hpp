@@ -0,0 +1,49 @@
+// graphics/volume_transform.hpp
+#pragma once
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "preprocessing/dicom_utils.hpp"
+
+namespace graphics {
+
+  // Matches u_volume_rotation in compute.glsl
+  inline glm::mat3 volumeRotation() {
+    return glm::mat3(
+      1.f,  0.f,  0.f,
+      0.f,  0.f,  1.f,
+      0.f, -1.f,  0.f
+    );
+  }
+
+  // Half extents of the volume box in world space, largest axis is scale
+  inline glm::vec3 volumeScale(const preprocessing::DicomMetadata& meta, float scale) {
+    float max_dim = float(std::max({meta.width, meta.height, meta.depth}));
+    return glm::vec3(
+      meta.width  * meta.spacing_x / max_dim,
+      meta.height * meta.spacing_y / max_dim,
+      meta.depth  * meta.spacing_z / max_dim
+    ) * scale;
+  }
+
+  // Maps normalized volume coordinates [0, 1]^3 to world space
+  // The shader goes the other way: local = transpose(-R) * world, tex = (local + scale) / (2 * scale)
+  inline glm::mat4 worldFromVolume(const glm::vec3& volume_scale) {
+    glm::mat3 r = volumeRotation();
+    glm::mat3 m = -r * glm::mat3(
+      2.f * volume_scale.x, 0.f, 0.f,
+      0.f, 2.f * volume_scale.y, 0.f,
+      0.f, 0.f, 2.f * volume_scale.z
+    );
+    glm::vec3 offset = r * volume_scale;
+
+    return glm::mat4(
+      glm::vec4(m[0], 0.f),
+      glm::vec4(m[1], 0.f),
+      glm::vec4(m[2], 0.f),
+      glm::vec4(offset, 1.f)
+    );
+  }
+
+} // namespace graphics
@@ -4,14 +4,26 @@
 #include "app/lights.hpp"
 #include "app/frame_data.hpp"
 #include "app/controls_data.hpp"
+#include "app/series_cache.hpp"
+#include "app/background_job.hpp"
+#include "app/regression.hpp"
+#include "app/session_log.hpp"
+#include "app/render_server.hpp"
 
 #include "preprocessing/compute_gradient.hpp"
 #include "ui/imgui_utils.hpp"
+#include "ui/windows.hpp"
 #include "ui/viewport_window.hpp"
 
 #include "graphics/gl_utils.hpp"
+#include "graphics/cpu_raymarch.hpp"
+#include "graphics/deferred_lighting.hpp"
 #include "graphics/render_targets.hpp"
+#include "graphics/shader_cache.hpp"
+#include "graphics/shader_variants.hpp"
+#include "graphics/texture_upload.hpp"
 #include "graphics/update_graphics.hpp"
+#include "graphics/volume_transform.hpp"
 
 #include "imgui.h"
 #include "imgui_impl_opengl3.h"
@@ -19,9 +31,273 @@
 
 #include "preprocessing/voxel_grid.hpp"
 #include "preprocessing/dicom_utils.hpp"
-#include "preprocessing/gaussian_blur.hpp"
+#include "preprocessing/paged_volume.hpp"
+#include "preprocessing/distance_field.hpp"
+#include "preprocessing/ambient_occlusion.hpp"
+#include "preprocessing/connected_components.hpp"
+#include "preprocessing/histogram.hpp"
+#include "preprocessing/marching_cubes.hpp"
+#include "preprocessing/mesh_export.hpp"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace {
+  // Memory allowed for preprocessed series held by the cache
+  constexpr size_t SERIES_CACHE_BUDGET = size_t(8) << 30;
+
+  // Program binaries of the compute shader variants, relative to the working directory like shaders/
+  constexpr const char* SHADER_CACHE_DIR = "shader_cache";
+
+  // Largest axis of what a paged volume makes resident, its overview and cropped regions
+  constexpr uint32_t PAGED_MAX_DIM = 512;
+
+  bool isBrickFile(const std::string& path) {
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".vxb") == 0;
+  }
+
+  // Registers a region of a paged volume read from its bricks through the cache, the overview
+  // stays on screen while they load. Returns the region's uid.
+  std::string addPagedRegion(series::SeriesCache& cache, preprocessing::PagedVolume& volume, const std::string& path,
+                             const preprocessing::CropBox& box) {
+    char suffix[128];
+    snprintf(suffix, sizeof(suffix), " [region %u-%u %u-%u %u-%u]", box.min[0], box.max[0], box.min[1], box.max[1],
+             box.min[2], box.max[2]);
+    std::string uid = path + suffix;
+    series::addSeries(cache, uid, [&volume, box](series::LoadedSeries& out) {
+      return preprocessing::buildRegion(volume, box, PAGED_MAX_DIM, out.grid, out.meta);
+    });
+    return uid;
+  }
+
+  // Interaction logging, see app/session_log.hpp
+  struct SessionOptions {
+    std::string record_path;      // Log every frame's input to this file
+    std::string replay_path;      // Drive the viewer from this log instead of the user
+    std::string timings_path;     // Per-frame replay timings as CSV
+    bool realtime = false;        // Replay at the recorded pace rather than as fast as possible
+  };
+
+  // Takes --spacing <mm>, --voxel-budget <millions> and --lanczos out of the arguments, then
+  // --record <log>, --replay <log>, --realtime and --timings <csv>, and returns the rest as
+  // paths. Either of the first two turns resampling on.
+  bool parseViewerOptions(int argc, char* argv[], preprocessing::ResampleSettings& settings,
+                          SessionOptions& session, std::vector<std::string>& paths) {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--record" || arg == "--replay" || arg == "--timings") {
+        if (i + 1 >= argc) {
+          printf("%s needs a path\n", arg.c_str());
+          return false;
+        }
+        if (arg == "--record") session.record_path = argv[++i];
+        else if (arg == "--replay") session.replay_path = argv[++i];
+        else session.timings_path = argv[++i];
+      } else if (arg == "--realtime") {
+        session.realtime = true;
+      } else if (arg == "--spacing" || arg == "--voxel-budget") {
+        if (i + 1 >= argc) {
+          printf("%s needs a value\n", arg.c_str());
+          return false;
+        }
+        float value = std::strtof(argv[++i], nullptr);
+        if (!(value > 0.f)) {
+          printf("Invalid %s value %s\n", arg.c_str(), argv[i]);
+          return false;
+        }
+        if (arg == "--spacing") settings.spacing_mm = value;
+        else settings.max_voxels = size_t(double(value) * 1e6);
+        settings.enabled = true;
+      } else if (arg == "--lanczos") {
+        settings.filter = preprocessing::ResampleFilter::LANCZOS3;
+      } else if (arg.rfind("--", 0) == 0) {
+        printf("Unknown option %s\n", arg.c_str());
+        return false;
+      } else {
+        paths.push_back(arg);
+      }
+    }
+    return true;
+  }
+
+  // Frames kept going after the last event so ImGui hover and popups settle, how often the UI
+  // redraws while only background work is in flight, and the longest idle sleep between checks
+  constexpr int SETTLE_FRAMES        = 3;
+  constexpr int BACKGROUND_REDRAW_MS = 50;
+  constexpr int IDLE_WAIT_MS         = 500;
+
+  // Chunks per texture submitted each frame while a volume streams in
+  constexpr int UPLOAD_CHUNKS_PER_FRAME = 2;
+
+  // How far the window cutoff can rise past the distance field's threshold before it is rebuilt,
+  // the field stays correct but leaps get shorter the further apart they are
+  constexpr float DISTANCE_FIELD_SLACK = 0.05f;
+
+  // (Re)creates the density and normal textures to match the grid and uploads both
+  // Only used for previews, which are small enough to upload in one go
+  void uploadVolume(const preprocessing::VoxelGrid& grid, graphics::Texture3D& density, graphics::Texture3D& normals) {
+    graphics::destroy(density);
+    graphics::destroy(normals);
+
+    graphics::makeTexture3D(GL_R32F, grid.width, grid.height, grid.depth, density);
+    graphics::uploadTexture3D(density, grid.data.data());
+
+    graphics::makeTexture3D(GL_RGBA32F, grid.width, grid.height, grid.depth, normals);
+    graphics::uploadTexture3D(normals, grid.normals.data());
+  }
+
+  // Label texture as 8 bit when every label fits, 16 bit otherwise
+  void uploadLabels(const preprocessing::LabelVolume& labels, graphics::Texture3D& texture) {
+    graphics::destroy(texture);
+    if (preprocessing::fitsInBytes(labels)) {
+      std::vector<uint8_t> bytes(labels.labels.begin(), labels.labels.end());
+      graphics::makeTexture3D(GL_R8UI, labels.width, labels.height, labels.depth, texture);
+      graphics::uploadTexture3D(texture, bytes.data());
+    } else {
+      graphics::makeTexture3D(GL_R16UI, labels.width, labels.height, labels.depth, texture);
+      graphics::uploadTexture3D(texture, labels.labels.data());
+    }
+  }
+
+  // One bit per label for the label_visibility block, bit 0 for unlabeled voxels
+  void uploadLabelVisibility(const controls::LabelControls& controls, graphics::Buffer& buffer) {
+    std::vector<uint32_t> bits((preprocessing::MAX_LABELS + 32) / 32, 0u);
+    if (controls.show_unlabeled) bits[0] |= 1u;
+    for (size_t i = 0; i < controls.visible.size(); i++) {
+      if (controls.visible[i]) bits[(i + 1) >> 5] |= 1u << ((i + 1) & 31);
+    }
+
+    GLsizeiptr size = GLsizeiptr(bits.size() * sizeof(uint32_t));
+    if (!buffer.id) {
+      graphics::makeBuffer(GL_SHADER_STORAGE_BUFFER, size, bits.data(), GL_DYNAMIC_DRAW, buffer);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, buffer.id);
+    } else {
+      glNamedBufferSubData(buffer.id, 0, size, bits.data());
+    }
+  }
+
+  // When only labeled voxels are drawn, rays only need to cover the visible labels' bounding boxes
+  void cullToLabels(const preprocessing::LabelVolume& labels, const controls::LabelControls& controls,
+                    float crop_min[3], float crop_max[3]) {
+    if (!controls.enabled || controls.show_unlabeled || labels.components.empty()) return;
+
+    const float dims[3] = { float(labels.width), float(labels.height), float(labels.depth) };
+    float lo[3] = { 1.f, 1.f, 1.f }, hi[3] = { 0.f, 0.f, 0.f };
+    for (size_t i = 0; i < labels.components.size() && i < controls.visible.size(); i++) {
+      if (!controls.visible[i]) continue;
+      const preprocessing::LabelInfo& c = labels.components[i];
+      for (int a = 0; a < 3; a++) {
+        lo[a] = std::min(lo[a], c.min[a] / dims[a]);
+        hi[a] = std::max(hi[a], (c.max[a] + 1) / dims[a]);
+      }
+    }
+
+    for (int a = 0; a < 3; a++) {
+      crop_min[a] = std::max(crop_min[a], lo[a]);
+      crop_max[a] = std::max(crop_min[a], std::min(crop_max[a], hi[a]));
+    }
+  }
+
+  // What the compute shader is given this frame, for answering queries on the CPU
+  graphics::CpuRenderParams cpuRenderParams(const cam::Camera& c, const preprocessing::DicomMetadata& meta,
+                                            const controls::WinData& window, const ui::ViewportWindow& viewport) {
+    graphics::CpuRenderParams params{};
+    params.view          = c.view;
+    params.proj          = c.proj;
+    params.cam           = c.position;
+    params.volume_scale  = graphics::volumeScale(meta, window.scale);
+    params.width         = uint32_t(viewport.width);
+    params.height        = uint32_t(viewport.height);
+    params.win_center    = window.win_center;
+    params.win_width     = window.win_width;
+    params.density_scale = window.density_scale;
+    params.mode          = window.mode;
+    params.shadows       = window.shadows && !window.deferred_lighting;
+    params.crop_min      = glm::vec3(window.crop_min[0], window.crop_min[1], window.crop_min[2]);
+    params.crop_max      = glm::vec3(window.crop_max[0], window.crop_max[1], window.crop_max[2]);
+    graphics::ComputeVariant variant = graphics::computeVariant(window, false, false);
+    params.step_size     = graphics::stepSize(variant);
+    params.max_steps     = graphics::maxSteps(variant);
+    return params;
+  }
+
+  // Light list the deferred lighting pass reads, respecified whole since the count changes
+  void uploadLights(const lights::light_set& set, graphics::Buffer& buffer) {
+    std::vector<uint8_t> bytes;
+    graphics::serializeLights(set, bytes);
+
+    if (!buffer.id) {
+      graphics::makeBuffer(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(bytes.size()), bytes.data(), GL_DYNAMIC_DRAW, buffer);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, buffer.id);
+    } else {
+      glNamedBufferData(buffer.id, GLsizeiptr(bytes.size()), bytes.data(), GL_DYNAMIC_DRAW);
+    }
+  }
+
+  // Only albedo is displayed, depth and normals are written just for the deferred lighting pass
+  graphics::RenderTargetLayout targetLayout(bool deferred_lighting) {
+    graphics::RenderTargetLayout layout{};
+    layout.depth_pass  = deferred_lighting;
+    layout.normal_pass = deferred_lighting;
+    return layout;
+  }
+
+  // Replaces the octree storage buffer the compute shader skips empty space with
+  void uploadOctree(const preprocessing::MinMaxOctree& octree, graphics::Buffer& buffer) {
+    std::vector<uint8_t> bytes;
+    preprocessing::serializeOctree(octree, bytes);
+
+    graphics::destroy(buffer);
+    graphics::makeBuffer(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(bytes.size()), bytes.data(), GL_STATIC_DRAW, buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, buffer.id);
+  }
+
+  // Full resolution volume streaming into textures that aren't bound until it completes
+  struct PendingVolume {
+    series::SeriesRef series;
+    graphics::TextureUpload density;
+    graphics::TextureUpload normals;
+  };
+
+  void cancelPendingVolume(PendingVolume& pending) {
+    graphics::destroy(pending.density.texture);
+    graphics::destroy(pending.normals.texture);
+    graphics::destroy(pending.density);
+    graphics::destroy(pending.normals);
+    pending = PendingVolume{};
+  }
+
+  bool beginPendingVolume(series::SeriesRef series, PendingVolume& pending) {
+    cancelPendingVolume(pending);
+
+    const preprocessing::VoxelGrid& grid = series->grid;
+    graphics::Texture3D density{}, normals{};
+    if (!graphics::makeTexture3D(GL_R32F, grid.width, grid.height, grid.depth, density) ||
+        !graphics::makeTexture3D(GL_RGBA32F, grid.width, grid.height, grid.depth, normals) ||
+        !graphics::beginTextureUpload(density, grid.data.data(), pending.density) ||
+        !graphics::beginTextureUpload(normals, grid.normals.data(), pending.normals)) {
+      graphics::destroy(density);
+      graphics::destroy(normals);
+      graphics::destroy(pending.density);
+      graphics::destroy(pending.normals);
+      pending = PendingVolume{};
+      return false;
+    }
+
+    pending.series = std::move(series);
+    return true;
+  }
+
+  float pendingProgress(const PendingVolume& pending) {
+    if (!pending.series) return -1.f;
+    return 0.5f * (graphics::uploadProgress(pending.density) + graphics::uploadProgress(pending.normals));
+  }
+}
 
 int main(int argc, char* argv[]) {
   if (argc < 2) {
@@ -29,7 +305,74 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  const char* scan_path = argv[1];
+  // Convert a DICOM series into a brick file that can be opened out-of-core
+  if (std::string(argv[1]) == "--convert") {
+    if (argc < 4) {
+      printf("Usage: VoxRay --convert <DICOM directory> <output.vxb>\n");
+      return 1;
+    }
+    preprocessing::DicomMetadata meta;
+    return preprocessing::convertDicomSeriesToBricks(argv[2], argv[3], preprocessing::DEFAULT_BRICK_SIZE, meta) ? 0 : 1;
+  }
+
+  // Extract an isosurface at a Hounsfield value and write it as STL or PLY
+  if (std::string(argv[1]) == "--mesh") {
+    char* threshold_end = nullptr;
+    float threshold = argc >= 5 ? std::strtof(argv[3], &threshold_end) : 0.f;
+    if (argc < 5 || threshold_end == argv[3] || *threshold_end != '\0' || !std::isfinite(threshold)) {
+      printf("Usage: VoxRay --mesh <DICOM directory> <HU threshold> <output.stl|output.ply>\n");
+      return 1;
+    }
+    // Smoothing would shift and thin small bone and vessel surfaces, so the mesh is cut from the
+    // densities as read
+    preprocessing::VoxelGrid grid;
+    preprocessing::DicomMetadata meta;
+    if (!preprocessing::importDicomSeries(argv[2], grid, meta)) return 1;
+    preprocessing::computeGradientKernel(grid);
+
+    preprocessing::Mesh mesh;
+    preprocessing::extractIsosurface(grid, meta, threshold, mesh);
+    printf("Extracted %zu triangles, %zu vertices\n", mesh.indices.size() / 3, mesh.positions.size());
+    return preprocessing::writeMesh(argv[4], mesh) ? 0 : 1;
+  }
+
+  // Render the regression volumes and compare them against goldens, see app/regression.hpp
+  if (std::string(argv[1]) == "--regress") {
+    regress::RegressionOptions options;
+    if (!regress::parseRegressionOptions(argc, argv, options)) return 1;
+    return regress::runRegression(options) ? 0 : 1;
+  }
+
+  // Render resident volumes for clients on a local socket, see app/render_server.hpp
+  if (std::string(argv[1]) == "--serve") {
+    server::ServerOptions options;
+    if (!server::parseServerOptions(argc, argv, options)) return 1;
+    return server::runServer(options) ? 0 : 1;
+  }
+
+  // Stand-in thin client for the server above
+  if (std::string(argv[1]) == "--client") {
+    server::ClientOptions options;
+    if (!server::parseClientOptions(argc, argv, options)) return 1;
+    return server::runClient(options) ? 0 : 1;
+  }
+
+  preprocessing::ResampleSettings resample;
+  SessionOptions session_options;
+  std::vector<std::string> paths;
+  if (!parseViewerOptions(argc, argv, resample, session_options, paths)) return 1;
+  if (paths.empty()) {
+    printf("Must pass DICOM directory path\n");
+    return 1;
+  }
+
+  // A replay only reads the log, so recording one at the same time would just copy it
+  session::Recorder recorder;
+  session::Player player;
+  const bool replaying = !session_options.replay_path.empty();
+  if (replaying && !session::loadReplay(session_options.replay_path, session_options.realtime, player)) return 1;
+  if (!replaying && !session_options.record_path.empty() && !session::startRecording(session_options.record_path, recorder)) return 1;
+  const std::string scan_path = paths.front();
 
   using namespace graphics;
   using namespace cam;
@@ -62,11 +405,29 @@ int main(int argc, char* argv[]) {
   printf("\n");
 
   std::string error;
+  RenderTargetLayout target_layout = targetLayout(controls::WinData{}.deferred_lighting);
+
+  // Compute variants are linked the first time they are used and kept on disk between runs
   const char* compute_path = "shaders/compute.glsl";
-  Shader compute{}; Program compute_prog;
-  if (!compileShader(GL_COMPUTE_SHADER, compute_path, compute, &error))     { SDL_Log("%s", error.c_str()); return 1; }
-  if (!linkProgram(compute, compute_prog, &error))                          { SDL_Log("%s", error.c_str()); return 1; }
-  destroy(compute);
+  ShaderCache shader_cache;
+  initShaderCache(SHADER_CACHE_DIR, shader_cache);
+  ComputeVariant compute_variant{};
+  Program compute_prog{};
+  if (!computeProgram(shader_cache, compute_path, computeVariantDefines(compute_variant, target_layout), compute_prog, &error)) {
+    SDL_Log("%s", error.c_str());
+    return 1;
+  }
+
+  // Compiled against the layout that writes every pass, it only runs while that one is in use
+  const char* lighting_path = "shaders/lighting.glsl";
+  Program lighting_prog{};
+  if (!computeProgram(shader_cache, lighting_path, renderTargetDefines(targetLayout(true)), lighting_prog, &error)) {
+    SDL_Log("%s", error.c_str());
+    return 1;
+  }
+  lights::light_set light_set = lights::defaultLights();
+  Buffer light_buffer{};
+  uploadLights(light_set, light_buffer);
 
   const char* vertex_path = "shaders/vertex.glsl";
   const char* fragment_path = "shaders/fragment.glsl";
@@ -88,22 +449,83 @@ int main(int argc, char* argv[]) {
   frame::beginFrame(timer);
 
   // --- Load DICOM ---
-  preprocessing::VoxelGrid voxels;
-  preprocessing::DicomMetadata dicom_meta;
-  if (!preprocessing::importDicomSeries(scan_path, voxels, dicom_meta)) {
-    SDL_Log("Failed to laod DICOM series");
+  // Every series found on the command line is registered with the cache and loaded on worker
+  // threads, the window stays responsive and shows a preview as soon as one is ready.
+  // Brick files stay on disk, a downsampled overview is made resident for rendering while slices
+  // and cropped regions read the full resolution bricks
+  const bool paged = isBrickFile(scan_path);
+  preprocessing::PagedVolume paged_volume;
+  if (paged && !preprocessing::openPagedVolume(scan_path, preprocessing::PagedVolumeConfig{}, paged_volume)) {
+    SDL_Log("Failed to open paged volume");
     return 1;
   }
-  preprocessing::computeGradientKernel(voxels);
-  preprocessing::gaussianBlur(voxels);
 
-  Texture3D voxel_texture;
-  makeTexture3D(GL_R32F, dicom_meta.width, dicom_meta.height, dicom_meta.depth, voxel_texture);
-  uploadTexture3D(voxel_texture, voxels.data.data());
+  series::SeriesCache series_cache;
+  series_cache.resample = resample;
+  series::startSeriesCache(series_cache, SERIES_CACHE_BUDGET, 2);
+
+  std::string selected_uid;
+  if (paged) {
+    series::addSeries(series_cache, scan_path, [&paged_volume](series::LoadedSeries& out) {
+      return preprocessing::buildOverview(paged_volume, PAGED_MAX_DIM, out.grid, out.meta);
+    });
+    selected_uid = scan_path;
+  } else {
+    for (const std::string& path : paths) series::discoverSeries(series_cache, path);
+    auto listing = series::listSeries(series_cache);
+    if (listing.empty()) {
+      SDL_Log("No DICOM series found");
+      return 1;
+    }
+    selected_uid = listing.front().uid;
+  }
 
-  Texture3D normals_texture;
-  makeTexture3D(GL_RGBA32F, dicom_meta.width, dicom_meta.height, dicom_meta.depth, normals_texture);
-  uploadTexture3D(normals_texture, voxels.normals.data());
+  series::requestSeries(series_cache, selected_uid);
+  series::preloadSeries(series_cache);
+  std::string requested_uid = selected_uid;
+
+  // What is bound for rendering, either a preview or the full series
+  series::SeriesRef active;
+  preprocessing::DicomMetadata dicom_meta{};
+  Texture3D voxel_texture{};
+  Texture3D normals_texture{};
+  Buffer octree_buffer{};
+  PendingVolume pending;
+
+  // Distance field for the active volume, built off the main thread for the current window cutoff
+  jobs::BackgroundJob<preprocessing::DistanceField> distance_job;
+  series::SeriesRef distance_source;      // What the running or last job was built from
+  series::SeriesRef distance_uploaded;    // What distance_texture was built from
+  Texture3D distance_texture{};
+  float distance_threshold = std::numeric_limits<float>::infinity();
+  glProgramUniform1f(compute_prog.id, 0, distance_threshold);
+  glProgramUniform1i(compute_prog.id, 1, int(controls::RenderMode::COMPOSITE));
+  glProgramUniform3f(compute_prog.id, 2, 0.f, 0.f, 0.f);
+  glProgramUniform3f(compute_prog.id, 3, 1.f, 1.f, 1.f);
+
+  // Ambient occlusion for the active volume, rebuilt in the background for each new window
+  jobs::BackgroundJob<preprocessing::OcclusionVolume> occlusion_job;
+  series::SeriesRef occlusion_source;     // What the running or last job was built from
+  series::SeriesRef occlusion_uploaded;   // What occlusion_texture was built from
+  controls::WinData occlusion_window;     // Window the running or last job was built for
+  Texture3D occlusion_texture{};
+  glProgramUniform1i(compute_prog.id, 5, 0);
+  // Cropped series waiting to replace the one on screen, the crop box is reset once it does
+  std::string crop_uid;
+  // Crop box the shader has, the user's box tightened by label culling
+  float applied_crop_min[3] = { 0.f, 0.f, 0.f };
+  float applied_crop_max[3] = { 1.f, 1.f, 1.f };
+
+  // Connected components of the active volume, labeled in the background on request
+  controls::LabelControls label_controls;
+  jobs::BackgroundJob<preprocessing::LabelVolume> label_job;
+  series::SeriesRef label_source;         // What the running or last job labeled
+  series::SeriesRef labels_for;           // What labels and label_texture belong to
+  preprocessing::LabelVolume labels;
+  Texture3D label_texture{};
+  Buffer label_visibility{};
+  uploadLabelVisibility(label_controls, label_visibility);
+  glProgramUniform1i(compute_prog.id, 4, 0);
 
   // --- Viewport subwindow ---
   Framebuffer framebuffer{}; Texture color_attach{};
@@ -113,8 +535,17 @@ int main(int argc, char* argv[]) {
     .texture = color_attach
   };
 
+  ui::MprWindow mpr_view { .name = "Slices" };
+
+  // Replays draw at the logged viewport size with vsync off, so frame times are the work itself
+  if (replaying) {
+    viewport.fixed_size = true;
+    SDL_GL_SetSwapInterval(0);
+  }
+
   RenderTargets targets{};
-  if (!makeRenderTargets(viewport.width, viewport.height, targets)) return 1;
+  if (!makeRenderTargets(viewport.width, viewport.height, target_layout, targets)) return 1;
+  printf("Render targets write %d bytes per pixel\n", bytesPerPixel(target_layout));
 
   // UseProgram(display_prog);
   bindVao(vao);
@@ -131,6 +562,9 @@ int main(int argc, char* argv[]) {
   controls::WinData old_window = window;
 
   UpdateFlags flags = NONE;
+  int settle_frames = SETTLE_FRAMES;
+  bool background_busy = true;
+  bool viewport_dirty = true;
   while ((flags & STOP) != STOP) {
     // Gather frame rate data
     // Can also be used to write to terminal once per second
@@ -138,7 +572,37 @@ int main(int argc, char* argv[]) {
       // printf("(%d, %d)\n", targets.width, targets.height);
     }
 
-    pollInput(flags, input);
+    // Sleep until the next event unless something on screen is still changing
+    int wait_ms = 0;
+    if (!flags && settle_frames == 0) wait_ms = background_busy ? BACKGROUND_REDRAW_MS : IDLE_WAIT_MS;
+    const session::FrameRecord* replayed = nullptr;
+    if (replaying) {
+      // Only quitting is taken from the user. The log starts once the volume has finished
+      // loading, and from then on supplies the input and viewport size of every frame. Until
+      // then nothing settles, so the loop redraws at the background rate instead of spinning.
+      UpdateFlags user_flags = NONE;
+      InputState user_input;
+      pollInput(user_flags, user_input, player.started ? session::replayWaitMs(player) : BACKGROUND_REDRAW_MS);
+      flags |= user_flags & STOP;
+
+      input.mouse_dx = input.mouse_dy = input.scroll_dx = input.scroll_dy = 0.f;
+      if (player.started || (active && !background_busy)) replayed = session::nextReplayFrame(player);
+      if (replayed) {
+        flags |= replayed->flags;
+        input = replayed->input;
+        if (viewport.width != replayed->viewport_width || viewport.height != replayed->viewport_height) {
+          viewport.width = replayed->viewport_width;
+          viewport.height = replayed->viewport_height;
+          viewport.update_framebuffer = true;
+          flags |= VIEWPORT_RESIZE | RESIZE;
+        }
+      }
+    } else if (pollInput(flags, input, wait_ms)) {
+      settle_frames = SETTLE_FRAMES;
+    } else if (settle_frames > 0) {
+      settle_frames--;
+    }
+    session::Clock::time_point frame_start = session::Clock::now();
 
     // --- DearImGui stuff ---
     ImGui_ImplOpenGL3_NewFrame();
@@ -146,9 +610,244 @@ int main(int argc, char* argv[]) {
     ImGui::NewFrame();
     ImGui::DockSpaceOverViewport();
     ui::renderViewport(viewport, flags);
-    ui::renderUI(frame_data, window);
+    // Hover probe, answered from the resident volume without reading anything back from the GPU
+    if (viewport.hovered && active) {
+      graphics::PickResult pick;
+      graphics::CpuRenderParams probe = cpuRenderParams(activeCamera(app), dicom_meta, window, viewport);
+      probe.crop_min = glm::vec3(applied_crop_min[0], applied_crop_min[1], applied_crop_min[2]);
+      probe.crop_max = glm::vec3(applied_crop_max[0], applied_crop_max[1], applied_crop_max[2]);
+      if (graphics::pickVoxel(active->grid, active->raw, &active->octree, dicom_meta, probe, viewport.mouse_x, viewport.mouse_y, pick)) {
+        ui::renderProbeTooltip(pick);
+      }
+    }
+    ui::renderUI(frame_data, window, active ? &active->stats : nullptr, dicom_meta);
+    std::vector<series::SeriesStatus> listing = series::listSeries(series_cache);
+    ui::renderSeriesBrowser(listing, active ? active->uid : "", pendingProgress(pending), selected_uid);
+    // Slices of a paged overview are refined from the full resolution bricks
+    preprocessing::PagedVolume* mpr_paged = paged && active && active->uid == scan_path ? &paged_volume : nullptr;
+    ui::renderMprWindow(mpr_view, active ? &active->raw : nullptr, active ? active->generation : 0, dicom_meta, window, mpr_paged);
+    ui::renderLabels(label_controls, labels_for ? &labels : nullptr, dicom_meta);
+    if (ui::renderLights(light_set)) {
+      uploadLights(light_set, light_buffer);
+      if (window.deferred_lighting) flags |= CONTROLS;
+    }
+
+    // Replayed frames overwrite whatever the controls did with the logged settings
+    if (replayed) {
+      window = replayed->window;
+      if (replayed->lights != light_set) {
+        light_set = replayed->lights;
+        uploadLights(light_set, light_buffer);
+        if (window.deferred_lighting) flags |= CONTROLS;
+      }
+    } else if (!replaying) {
+      session::recordFrame(recorder, flags, input, window, light_set, viewport.width, viewport.height);
+    }
+
+    if (selected_uid != requested_uid) {
+      series::requestSeries(series_cache, selected_uid);
+      requested_uid = selected_uid;
+    }
+
+    // Show the selected series' preview while it is still being preprocessed
+    if (!active || active->uid != selected_uid) {
+      if (series::SeriesRef preview = series::acquirePreview(series_cache, selected_uid)) {
+        active = preview;
+        dicom_meta = active->meta;
+        uploadVolume(active->grid, voxel_texture, normals_texture);
+        uploadOctree(active->octree, octree_buffer);
+        flags |= CONTROLS;
+      }
+    }
+
+    // Stream the full series in behind whatever is on screen
+    if (!pending.series || pending.series->uid != selected_uid) {
+      series::SeriesRef full = series::acquireSeries(series_cache, selected_uid);
+      if (full && full != active && !beginPendingVolume(full, pending)) {
+        SDL_Log("Failed to start volume upload");
+      }
+    }
+
+    if (pending.series) {
+      bool density_done = graphics::continueTextureUpload(pending.density, UPLOAD_CHUNKS_PER_FRAME);
+      bool normals_done = graphics::continueTextureUpload(pending.normals, UPLOAD_CHUNKS_PER_FRAME);
+      if (density_done && normals_done) {
+        destroy(voxel_texture);
+        destroy(normals_texture);
+        voxel_texture = pending.density.texture;
+        normals_texture = pending.normals.texture;
+        active = pending.series;
+        dicom_meta = active->meta;
+        uploadOctree(active->octree, octree_buffer);
+
+        graphics::destroy(pending.density);
+        graphics::destroy(pending.normals);
+        pending = PendingVolume{};
+        flags |= CONTROLS;
+      }
+    }
+
+    // Leaping is switched off until the field matches what is on screen
+    if (distance_uploaded != active && distance_threshold != std::numeric_limits<float>::infinity()) {
+      distance_threshold = std::numeric_limits<float>::infinity();
+      glProgramUniform1f(compute_prog.id, 0, distance_threshold);
+    }
+    if (jobs::pollJob(distance_job) && distance_source == active) {
+      const preprocessing::DistanceField& field = distance_job.result;
+      destroy(distance_texture);
+      makeTexture3D(GL_R8, field.width, field.height, field.depth, distance_texture);
+      uploadTexture3D(distance_texture, field.distance.data());
+      distance_uploaded = active;
+      distance_threshold = field.threshold;
+      glProgramUniform1f(compute_prog.id, 0, distance_threshold);
+      flags |= CONTROLS;
+    }
+
+    float cutoff = graphics::windowThreshold(window.win_center, window.win_width, window.density_scale);
+    bool field_stale = distance_source != active || cutoff < distance_threshold || cutoff > distance_threshold + DISTANCE_FIELD_SLACK;
+    if (active && field_stale && !jobs::isRunning(distance_job)) {
+      distance_source = active;
+      jobs::startJob(distance_job, [series = active, cutoff](preprocessing::DistanceField& out) {
+        preprocessing::computeDistanceField(series->grid, cutoff, out);
+      });
+    }
 
-    if (old_window.win_center != window.win_center || old_window.win_width != window.win_width || old_window.density_scale != window.density_scale || old_window.scale != window.scale) {
+    // A volume built for an older window still beats none, it is only dropped with its series
+    if (jobs::pollJob(occlusion_job) && occlusion_source == active) {
+      const preprocessing::OcclusionVolume& volume = occlusion_job.result;
+      destroy(occlusion_texture);
+      makeTexture3D(GL_R8, volume.width, volume.height, volume.depth, occlusion_texture);
+      uploadTexture3D(occlusion_texture, volume.visibility.data());
+      occlusion_uploaded = active;
+      flags |= CONTROLS;
+    }
+    if (occlusion_uploaded && occlusion_uploaded != active) {
+      destroy(occlusion_texture);
+      occlusion_texture = Texture3D{};
+      occlusion_uploaded.reset();
+    }
+
+    bool occlusion_stale = occlusion_source != active || occlusion_window.win_center != window.win_center ||
+                           occlusion_window.win_width != window.win_width || occlusion_window.density_scale != window.density_scale;
+    if (window.ambient_occlusion && active && occlusion_stale && !jobs::isRunning(occlusion_job)) {
+      occlusion_source = active;
+      occlusion_window = window;
+      jobs::startJob(occlusion_job, [series = active, window](preprocessing::OcclusionVolume& out) {
+        preprocessing::computeAmbientOcclusion(series->grid, window.win_center, window.win_width, window.density_scale, out);
+      });
+    }
+
+    // Rebuild the textures from just the cropped voxels. Paged volumes read the region from the
+    // bricks, so a small enough one comes out at full resolution.
+    if (window.apply_crop) {
+      window.apply_crop = false;
+      preprocessing::CropRegion region;
+      std::copy_n(window.crop_min, 3, region.min);
+      std::copy_n(window.crop_max, 3, region.max);
+      if (paged && active && !preprocessing::isFullVolume(region)) {
+        crop_uid = addPagedRegion(series_cache, paged_volume, scan_path, preprocessing::regionBox(paged_volume, active->meta, region));
+        selected_uid = crop_uid;
+      } else if (active && !preprocessing::isFullVolume(region)) {
+        crop_uid = series::addCroppedSeries(series_cache, active->uid, region);
+        if (!crop_uid.empty()) selected_uid = crop_uid;
+      }
+    }
+    if (!crop_uid.empty() && selected_uid != crop_uid) crop_uid.clear();
+    if (!crop_uid.empty() && active && active->uid == crop_uid) {
+      std::fill_n(window.crop_min, 3, 0.f);
+      std::fill_n(window.crop_max, 3, 1.f);
+      crop_uid.clear();
+    }
+
+    // Connected components, dropped as soon as a different volume goes on screen
+    if (label_controls.run && active && !jobs::isRunning(label_job)) {
+      label_controls.run = false;
+      label_controls.running = true;
+      label_source = active;
+      float lo = preprocessing::normalizedHu(dicom_meta, label_controls.hu_min);
+      float hi = preprocessing::normalizedHu(dicom_meta, label_controls.hu_max);
+      uint32_t min_voxels = uint32_t(std::max(label_controls.min_voxels, 1));
+      uint32_t radius = uint32_t(std::max(label_controls.open_radius, 0));
+      bool fill = label_controls.fill_holes;
+      jobs::startJob(label_job, [series = active, lo, hi, min_voxels, radius, fill](preprocessing::LabelVolume& out) {
+        preprocessing::BitMask mask;
+        preprocessing::thresholdMask(series->grid, lo, hi, mask);
+        if (radius > 0) preprocessing::openMask(mask, radius, mask);
+        if (fill) preprocessing::fillHoles(mask, mask);
+        preprocessing::labelComponents(mask, min_voxels, out);
+      });
+    }
+    if (jobs::pollJob(label_job)) {
+      label_controls.running = false;
+      if (label_source == active) {
+        labels = std::move(label_job.result);
+        labels_for = active;
+        uploadLabels(labels, label_texture);
+        label_controls.visible.assign(labels.components.size(), 1);
+        label_controls.visibility_changed = true;
+      }
+    }
+    if (labels_for && labels_for != active) {
+      labels = preprocessing::LabelVolume{};
+      labels_for.reset();
+      destroy(label_texture);
+      label_texture = Texture3D{};
+      label_controls.visible.clear();
+      label_controls.visibility_changed = true;
+    }
+    if (label_controls.visibility_changed) {
+      label_controls.visibility_changed = false;
+      uploadLabelVisibility(label_controls, label_visibility);
+      glProgramUniform1i(compute_prog.id, 4, label_controls.enabled && label_texture.id ? 1 : 0);
+      flags |= CONTROLS;
+    }
+
+    // Depth and normals are only written while something reads them, the variant is rebuilt for the new layout
+    bool layout_changed = targetLayout(window.deferred_lighting).depth_pass != target_layout.depth_pass;
+    if (layout_changed) {
+      target_layout = targetLayout(window.deferred_lighting);
+      targets.layout = target_layout;
+      if (!resizeRenderTargets(viewport.width, viewport.height, targets)) SDL_Log("Failed to rebuild render targets");
+      printf("Render targets write %d bytes per pixel\n", bytesPerPixel(target_layout));
+    }
+
+    // Every variant is its own program with its own uniforms, so the current values are carried over
+    ComputeVariant wanted_variant = computeVariant(window, label_controls.enabled && label_texture.id, occlusion_texture.id != 0);
+    if (layout_changed || !(wanted_variant == compute_variant)) {
+      Program program{};
+      if (computeProgram(shader_cache, compute_path, computeVariantDefines(wanted_variant, target_layout), program, &error)) {
+        compute_prog = program;
+        glProgramUniform1f(compute_prog.id, 0, distance_threshold);
+        glProgramUniform1i(compute_prog.id, 1, int(window.mode));
+        glProgramUniform3fv(compute_prog.id, 2, 1, applied_crop_min);
+        glProgramUniform3fv(compute_prog.id, 3, 1, applied_crop_max);
+        glProgramUniform1i(compute_prog.id, 4, wanted_variant.labels ? 1 : 0);
+        glProgramUniform1i(compute_prog.id, 5, wanted_variant.occlusion ? 1 : 0);
+        flags |= CONTROLS;
+      } else {
+        // The last good program stays bound, and a broken variant is only reported once
+        SDL_Log("%s", error.c_str());
+      }
+      compute_variant = wanted_variant;
+    }
+
+    float crop_min[3], crop_max[3];
+    std::copy_n(window.crop_min, 3, crop_min);
+    std::copy_n(window.crop_max, 3, crop_max);
+    if (labels_for) cullToLabels(labels, label_controls, crop_min, crop_max);
+    bool crop_changed = !std::equal(crop_min, crop_min + 3, applied_crop_min) ||
+                        !std::equal(crop_max, crop_max + 3, applied_crop_max);
+    if (crop_changed) {
+      std::copy_n(crop_min, 3, applied_crop_min);
+      std::copy_n(crop_max, 3, applied_crop_max);
+      glProgramUniform3fv(compute_prog.id, 2, 1, applied_crop_min);
+      glProgramUniform3fv(compute_prog.id, 3, 1, applied_crop_max);
+    }
+    if (old_window.mode != window.mode) {
+      glProgramUniform1i(compute_prog.id, 1, int(window.mode));
+    }
+    if (old_window.win_center != window.win_center || old_window.win_width != window.win_width || old_window.density_scale != window.density_scale || old_window.scale != window.scale || old_window.mode != window.mode ||
+        old_window.shadows != window.shadows || old_window.deferred_lighting != window.deferred_lighting || crop_changed) {
       flags |= CONTROLS;
       old_window = window;
     }
@@ -158,52 +857,80 @@ int main(int argc, char* argv[]) {
       updateState(flags, app, input, viewport);
       updateGraphicsState(flags, targets, viewport);
 
-      useProgram(compute_prog);
-      bindTexture3D(voxel_texture, 0);
-      bindTexture3D(normals_texture, 1);
-      bindForCompute(targets);
-
-      GLuint gx = (viewport.width + 16 - 1) / 16;
-      GLuint gy = (viewport.height + 16 - 1) / 16;
-      glDispatchCompute(gx, gy, 1);
-
-      glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+      // Page in the full resolution bricks the camera can currently see, ready for slices and crops
+      if (paged && active && active->uid == scan_path) {
+        glm::mat4 world_from_volume = worldFromVolume(volumeScale(dicom_meta, window.scale));
+        preprocessing::prefetchFrustum(paged_volume, viewProject(activeCamera(app)) * world_from_volume);
+      }
+
+      // Written before the dispatch so it marches with this frame's camera and window
+      // TODO move out of main loop
+      auto& c = activeCamera(app);
+      glm::vec4 pos = glm::vec4(glm::vec3(c.position), 1.f);
+
+      glm::vec4 volume_scale = glm::vec4(graphics::volumeScale(dicom_meta, window.scale), 0.f);
+
+      GLuint offset = 0;
+      glBindBuffer(cam_ubo.target, cam_ubo.id);
+      glBufferSubData(cam_ubo.target, offset, sizeof(glm::mat4), &c.view[0][0]);          offset += sizeof(glm::mat4);
+      glBufferSubData(cam_ubo.target, offset, sizeof(glm::mat4), &c.proj[0][0]);          offset += sizeof(glm::mat4);
+      glBufferSubData(cam_ubo.target, offset, sizeof(glm::vec4), &pos.x);                 offset += sizeof(glm::vec4);
+      glBufferSubData(cam_ubo.target, offset, sizeof(glm::vec4), &volume_scale.x);        offset += sizeof(glm::vec4);
+      glBufferSubData(cam_ubo.target, offset, sizeof(GLuint),    &viewport.width);        offset += sizeof(GLuint);
+      glBufferSubData(cam_ubo.target, offset, sizeof(GLuint),    &viewport.height);       offset += sizeof(GLuint);
+      glBufferSubData(cam_ubo.target, offset, sizeof(float),     &window.win_center);     offset += sizeof(float);
+      glBufferSubData(cam_ubo.target, offset, sizeof(float),     &window.win_width);      offset += sizeof(float);
+      glBufferSubData(cam_ubo.target, offset, sizeof(float),     &window.density_scale);
+
+      // Nothing to march through until the first preview arrives
+      if (active) {
+        useProgram(compute_prog);
+        bindTexture3D(voxel_texture, 0);
+        bindTexture3D(normals_texture, 1);
+        bindTexture3D(distance_texture, 3);
+        bindTexture3D(label_texture, 4);
+        bindTexture3D(occlusion_texture, 5);
+        bindForCompute(targets);
+
+        GLuint gx = (viewport.width + 16 - 1) / 16;
+        GLuint gy = (viewport.height + 16 - 1) / 16;
+        glDispatchCompute(gx, gy, 1);
+
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+
+        // Lights the march's first hits, one pass over the pixels whatever the step count
+        if (window.deferred_lighting && window.mode == controls::RenderMode::COMPOSITE) {
+          useProgram(lighting_prog);
+          glProgramUniform1i(lighting_prog.id, 0, window.shadows ? 1 : 0);
+          bindForLighting(targets);
+          glDispatchCompute(gx, gy, 1);
+
+          glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+        }
+      }
+
+      viewport_dirty = true;
+    }
 
+    // The viewport texture keeps the last image, so the quad is only drawn again after a dispatch
+    if (viewport_dirty) {
       useProgram(display_prog);
       bindForDisplay(targets);
-    }
-
-    // TODO move out of main loop
-    auto& c = activeCamera(app);
-    glm::vec4 pos = glm::vec4(glm::vec3(c.position), 1.f);
-
-    float max_dim = float(std::max({dicom_meta.width, dicom_meta.height, dicom_meta.depth}));
-    glm::vec4 volume_scale = glm::vec4(
-      dicom_meta.width  * dicom_meta.spacing_x / max_dim,
-      dicom_meta.height * dicom_meta.spacing_y / max_dim,
-      dicom_meta.depth  * dicom_meta.spacing_z / max_dim,
-      0.f
-    ) * window.scale;
-
-    GLuint offset = 0;
-    glBindBuffer(cam_ubo.target, cam_ubo.id);
-    glBufferSubData(cam_ubo.target, offset, sizeof(glm::mat4), &c.view[0][0]);          offset += sizeof(glm::mat4);
-    glBufferSubData(cam_ubo.target, offset, sizeof(glm::mat4), &c.proj[0][0]);          offset += sizeof(glm::mat4);
-    glBufferSubData(cam_ubo.target, offset, sizeof(glm::vec4), &pos.x);                 offset += sizeof(glm::vec4);
-    glBufferSubData(cam_ubo.target, offset, sizeof(glm::vec4), &volume_scale.x);        offset += sizeof(glm::vec4);
-    glBufferSubData(cam_ubo.target, offset, sizeof(GLuint),    &viewport.width);        offset += sizeof(GLuint);
-    glBufferSubData(cam_ubo.target, offset, sizeof(GLuint),    &viewport.height);       offset += sizeof(GLuint);
-    glBufferSubData(cam_ubo.target, offset, sizeof(float),     &window.win_center);     offset += sizeof(float);
-    glBufferSubData(cam_ubo.target, offset, sizeof(float),     &window.win_width);      offset += sizeof(float);
-    glBufferSubData(cam_ubo.target, offset, sizeof(float),     &window.density_scale);
+      bindFramebuffer(viewport.fbo);
+      glViewport(0, 0, viewport.width, viewport.height);
+      glClear(GL_COLOR_BUFFER_BIT);
 
-    bindFramebuffer(viewport.fbo);
-    glViewport(0, 0, viewport.width, viewport.height);
-    glClear(GL_COLOR_BUFFER_BIT);
+      glDrawArrays(GL_TRIANGLES, 0, 3);
 
-    glDrawArrays(GL_TRIANGLES, 0, 3);
+      unbindFramebuffer();
+      viewport_dirty = false;
+    }
 
-    unbindFramebuffer();
+    background_busy = pending.series || jobs::isRunning(distance_job) || jobs::isRunning(label_job) ||
+                      jobs::isRunning(occlusion_job) ||
+                      std::any_of(listing.begin(), listing.end(), [](const series::SeriesStatus& status) {
+                        return status.state == series::LoadState::QUEUED || status.state == series::LoadState::LOADING;
+                      });
 
     ImGui::Render();
     // Multi viewports don't work on Wayland which I'm using while writing this.
@@ -215,10 +942,33 @@ int main(int argc, char* argv[]) {
     // Currently just swaps window
     // Keeping this because I might add more functionality in the future
     draw(app);
+
+    // Waits for the frame's GPU work so it is counted here rather than in a later frame
+    if (replayed) {
+      glFinish();
+      player.frame_ms.push_back(std::chrono::duration<double, std::milli>(session::Clock::now() - frame_start).count());
+    }
+    if (replaying && session::replayDone(player)) flags |= STOP;
   }
 
+  if (replaying) {
+    session::printReplayTimings(player);
+    if (!session_options.timings_path.empty()) session::writeReplayTimings(session_options.timings_path, player);
+  }
+  session::stopRecording(recorder);
+
+  cancelPendingVolume(pending);
+  destroy(voxel_texture);
+  destroy(normals_texture);
+  destroy(octree_buffer);
+  destroy(distance_texture);
+  destroy(occlusion_texture);
+  destroy(mpr_view.texture);
+  destroy(label_texture);
+  destroy(label_visibility);
+  destroy(light_buffer);
   destroy(vao);
-  destroy(compute_prog);
+  destroy(shader_cache);
   destroy(display_prog);
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplSDL3_Shutdown();
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include "preprocessing/ambient_occlusion.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  // Box filter over n values stride apart. Everything past either end is air, so it counts as
+  // empty rather than clamping to the edge. The whole line is summed before anything is written,
+  // so in place is fine.
+  void blurLine(float* line, size_t n, size_t stride, uint32_t radius, std::vector<double>& prefix) {
+    prefix[0] = 0.0;
+    for (size_t i = 0; i < n; i++) prefix[i + 1] = prefix[i] + line[i * stride];
+
+    const double norm = 1.0 / double(2 * radius + 1);
+    for (size_t i = 0; i < n; i++) {
+      size_t lo = i >= radius ? i - radius : 0;
+      size_t hi = std::min(n, i + radius + 1);
+      line[i * stride] = float((prefix[hi] - prefix[lo]) * norm);
+    }
+  }
+
+  // One box filter along each axis. X and Y lines stay within a slice, Z runs over rows so each
+  // thread owns whole z lines.
+  void blurVolume(std::vector<float>& data, uint32_t w, uint32_t h, uint32_t d, uint32_t radius) {
+    const size_t slice = (size_t)w * h;
+
+    parallelFor(0, d, [&](size_t z_begin, size_t z_end) {
+      std::vector<double> prefix(std::max(w, h) + 1);
+      for (size_t z = z_begin; z < z_end; z++) {
+        float* base = data.data() + z * slice;
+        for (uint32_t y = 0; y < h; y++) blurLine(base + (size_t)y * w, w, 1, radius, prefix);
+        for (uint32_t x = 0; x < w; x++) blurLine(base + x, h, w, radius, prefix);
+      }
+    });
+
+    parallelFor(0, h, [&](size_t y_begin, size_t y_end) {
+      std::vector<double> prefix(d + 1);
+      for (size_t y = y_begin; y < y_end; y++) {
+        for (uint32_t x = 0; x < w; x++) blurLine(data.data() + y * w + x, d, slice, radius, prefix);
+      }
+    });
+  }
+}
+
+void computeAmbientOcclusion(const VoxelGrid& grid, float win_center, float win_width, float density_scale,
+                             OcclusionVolume& out) {
+  const uint32_t w = (grid.width + 1) / 2, h = (grid.height + 1) / 2, d = (grid.depth + 1) / 2;
+  const size_t slice = (size_t)w * h;
+
+  out.width = w;
+  out.height = h;
+  out.depth = d;
+  out.win_center = win_center;
+  out.win_width = win_width;
+  out.density_scale = density_scale;
+  out.visibility.assign(slice * d, 255);
+  if (grid.data.empty()) return;
+
+  // Windowed the same way as the marchers, averaged over each 2x2x2 block
+  const float lo = win_center - win_width * 0.5f;
+  std::vector<float> occupancy(slice * d);
+  parallelFor(0, d, [&](size_t z_begin, size_t z_end) {
+    for (size_t z = z_begin; z < z_end; z++) {
+      uint32_t z0 = uint32_t(z) * 2, z1 = std::min(z0 + 2, grid.depth);
+      for (uint32_t y = 0; y < h; y++) {
+        uint32_t y0 = y * 2, y1 = std::min(y0 + 2, grid.height);
+        for (uint32_t x = 0; x < w; x++) {
+          uint32_t x0 = x * 2, x1 = std::min(x0 + 2, grid.width);
+          float sum = 0.f;
+          for (uint32_t gz = z0; gz < z1; gz++) {
+            for (uint32_t gy = y0; gy < y1; gy++) {
+              const float* row = grid.data.data() + ((size_t)gz * grid.height + gy) * grid.width;
+              for (uint32_t gx = x0; gx < x1; gx++) {
+                sum += std::clamp((row[gx] - lo) / win_width * density_scale, 0.f, 1.f);
+              }
+            }
+          }
+          occupancy[z * slice + (size_t)y * w + x] = sum / float((z1 - z0) * (y1 - y0) * (x1 - x0));
+        }
+      }
+    }
+  });
+
+  std::vector<float> total(slice * d, 0.f);
+  for (uint32_t radius : OCCLUSION_RADII) {
+    blurVolume(occupancy, w, h, d, radius);
+    parallelFor(0, total.size(), [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) total[i] += occupancy[i];
+    });
+  }
+
+  const float scales = float(std::size(OCCLUSION_RADII));
+  parallelFor(0, total.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      float visibility = std::clamp((1.f - total[i] / scales) / (1.f - OCCLUSION_UNOCCLUDED), 0.f, 1.f);
+      out.visibility[i] = uint8_t(visibility * 255.f + 0.5f);
+    }
+  });
+}
+
+} // namespace preprocessing
@@ -0,0 +1,33 @@
+// preprocessing/ambient_occlusion.hpp
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // Box filter radii, in occlusion voxels, of the blurs applied one after another. Each blur
+  // widens the last, so together they weigh near occluders more than far ones.
+  constexpr uint32_t OCCLUSION_RADII[] = { 2, 4, 8 };
+
+  // Blurred occupancy that still counts as fully visible. A flat surface is half solid, and the
+  // samples a composite ray takes in the first few voxels below it see a little more.
+  constexpr float OCCLUSION_UNOCCLUDED = 0.7f;
+
+  // How much of the sky each voxel sees, from multi-scale blurred occupancy. Occupancy is the
+  // windowed density, so the volume belongs to one window and is rebuilt when it changes.
+  // Kept at half the grid's resolution, occlusion is low frequency and the blurs get 8x cheaper.
+  // Visibility falls linearly from 1 at OCCLUSION_UNOCCLUDED to 0 when fully occupied, so creases
+  // and cavities darken, and is stored as R8.
+  struct OcclusionVolume {
+    uint32_t width = 0, height = 0, depth = 0;
+    float win_center = 0.f, win_width = 0.f, density_scale = 0.f;
+    std::vector<uint8_t> visibility;
+  };
+
+  // Each blur is one separable pass per axis with the lines split across threads
+  void computeAmbientOcclusion(const VoxelGrid& grid, float win_center, float win_width, float density_scale,
+                               OcclusionVolume& out);
+
+} // namespace preprocessing
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXRAY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "preprocessing/brick_codec.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  constexpr size_t LANES = 4;
+  constexpr size_t ROWS  = CODEC_BLOCK / LANES;
+
+  uint32_t bitWidth(uint32_t v) {
+    uint32_t bits = 0;
+    while (v) { bits++; v >>= 1; }
+    return bits;
+  }
+
+  size_t headerBytes(size_t blocks) {
+    size_t bytes = sizeof(uint32_t) + blocks * sizeof(uint16_t) + blocks * sizeof(uint8_t);
+    return (bytes + 15) & ~size_t(15);
+  }
+
+  // Lane l holds values l, l + 4, l + 8, ... so row j of the block is one 128-bit word slice
+  void packBlock(const uint16_t* values, uint16_t base, uint32_t bits, uint32_t* words) {
+    std::memset(words, 0, bits * LANES * sizeof(uint32_t));
+    for (size_t j = 0; j < ROWS; j++) {
+      uint32_t pos   = uint32_t(j) * bits;
+      uint32_t word  = pos / 32;
+      uint32_t shift = pos % 32;
+      for (size_t l = 0; l < LANES; l++) {
+        uint32_t v = uint32_t(values[j * LANES + l] - base);
+        words[word * LANES + l] |= v << shift;
+        if (shift + bits > 32) words[(word + 1) * LANES + l] |= v >> (32 - shift);
+      }
+    }
+  }
+
+#ifndef VOXRAY_SSE2
+  void unpackBlockScalar(const uint8_t* payload, uint32_t bits, uint32_t* values) {
+    uint32_t words[16 * LANES];
+    std::memcpy(words, payload, bits * LANES * sizeof(uint32_t));
+    uint32_t mask = (1u << bits) - 1;
+
+    for (size_t j = 0; j < ROWS; j++) {
+      uint32_t pos   = uint32_t(j) * bits;
+      uint32_t word  = pos / 32;
+      uint32_t shift = pos % 32;
+      for (size_t l = 0; l < LANES; l++) {
+        uint32_t v = words[word * LANES + l] >> shift;
+        if (shift + bits > 32) v |= words[(word + 1) * LANES + l] << (32 - shift);
+        values[j * LANES + l] = v & mask;
+      }
+    }
+  }
+#endif
+
+#ifdef VOXRAY_SSE2
+  // One row of 4 values, shifts are compile time constants so each width gets straight-line code
+  template <int B, int J>
+  inline void unpackRow(const __m128i* in, __m128i mask, __m128i offset, __m128 range, float* out) {
+    constexpr int pos   = J * B;
+    constexpr int word  = pos / 32;
+    constexpr int shift = pos % 32;
+
+    __m128i v = _mm_srli_epi32(_mm_loadu_si128(in + word), shift);
+    if constexpr (shift + B > 32) {
+      v = _mm_or_si128(v, _mm_slli_epi32(_mm_loadu_si128(in + word + 1), 32 - shift));
+    }
+    v = _mm_add_epi32(_mm_and_si128(v, mask), offset);
+    _mm_storeu_ps(out + J * LANES, _mm_div_ps(_mm_cvtepi32_ps(v), range));
+  }
+
+  template <int B, size_t... J>
+  inline void unpackRows(const __m128i* in, __m128i mask, __m128i offset, __m128 range, float* out, std::index_sequence<J...>) {
+    (unpackRow<B, int(J)>(in, mask, offset, range, out), ...);
+  }
+
+  template <int B>
+  void unpackBlockFloat(const uint8_t* payload, int32_t offset, float range, float* out) {
+    const __m128i mask = _mm_set1_epi32(int((1u << B) - 1));
+    unpackRows<B>(reinterpret_cast<const __m128i*>(payload), mask, _mm_set1_epi32(offset),
+                  _mm_set1_ps(range), out, std::make_index_sequence<ROWS>{});
+  }
+
+  template <>
+  void unpackBlockFloat<0>(const uint8_t*, int32_t offset, float range, float* out) {
+    const __m128 v = _mm_div_ps(_mm_cvtepi32_ps(_mm_set1_epi32(offset)), _mm_set1_ps(range));
+    for (size_t j = 0; j < ROWS; j++) _mm_storeu_ps(out + j * LANES, v);
+  }
+
+  using UnpackFn = void (*)(const uint8_t*, int32_t, float, float*);
+
+  template <size_t... B>
+  constexpr auto makeUnpackTable(std::index_sequence<B...>) {
+    return std::array<UnpackFn, sizeof...(B)>{ &unpackBlockFloat<int(B)>... };
+  }
+
+  constexpr auto UNPACK_TABLE = makeUnpackTable(std::make_index_sequence<17>{});
+#endif
+
+  // Validates the stream and returns pointers to the per-block headers and payload
+  bool parseStream(const uint8_t* data, size_t size, size_t count,
+                   const uint16_t*& bases, const uint8_t*& bits, const uint8_t*& payload) {
+    size_t blocks = (count + CODEC_BLOCK - 1) / CODEC_BLOCK;
+    if (size < headerBytes(blocks)) return false;
+
+    uint32_t stored_blocks = 0;
+    std::memcpy(&stored_blocks, data, sizeof(uint32_t));
+    if (stored_blocks != blocks) return false;
+
+    bases   = reinterpret_cast<const uint16_t*>(data + sizeof(uint32_t));
+    bits    = data + sizeof(uint32_t) + blocks * sizeof(uint16_t);
+    payload = data + headerBytes(blocks);
+
+    size_t payload_bytes = 0;
+    for (size_t b = 0; b < blocks; b++) {
+      if (bits[b] > 16) return false;
+      payload_bytes += bits[b] * LANES * sizeof(uint32_t);
+    }
+    return headerBytes(blocks) + payload_bytes <= size;
+  }
+}
+
+void encodeBitpacked(const uint16_t* codes, size_t count, std::vector<uint8_t>& out) {
+  size_t blocks = (count + CODEC_BLOCK - 1) / CODEC_BLOCK;
+  std::vector<uint16_t> bases(blocks);
+  std::vector<uint8_t> bits(blocks);
+
+  // Last block is padded with its final value so it doesn't widen the bit range
+  uint16_t block[CODEC_BLOCK];
+  auto gather = [&](size_t b) {
+    size_t first = b * CODEC_BLOCK;
+    size_t valid = std::min(CODEC_BLOCK, count - first);
+    std::memcpy(block, codes + first, valid * sizeof(uint16_t));
+    std::fill(block + valid, block + CODEC_BLOCK, block[valid - 1]);
+  };
+
+  size_t payload_bytes = 0;
+  for (size_t b = 0; b < blocks; b++) {
+    gather(b);
+    auto [lo, hi] = std::minmax_element(block, block + CODEC_BLOCK);
+    bases[b] = *lo;
+    bits[b]  = uint8_t(bitWidth(uint32_t(*hi - *lo)));
+    payload_bytes += bits[b] * LANES * sizeof(uint32_t);
+  }
+
+  size_t header = headerBytes(blocks);
+  out.assign(header + payload_bytes, 0);
+
+  uint32_t stored_blocks = uint32_t(blocks);
+  std::memcpy(out.data(), &stored_blocks, sizeof(uint32_t));
+  std::memcpy(out.data() + sizeof(uint32_t), bases.data(), blocks * sizeof(uint16_t));
+  std::memcpy(out.data() + sizeof(uint32_t) + blocks * sizeof(uint16_t), bits.data(), blocks);
+
+  uint8_t* payload = out.data() + header;
+  uint32_t words[16 * LANES];
+  for (size_t b = 0; b < blocks; b++) {
+    if (bits[b] == 0) continue;
+    gather(b);
+    packBlock(block, bases[b], bits[b], words);
+    size_t bytes = bits[b] * LANES * sizeof(uint32_t);
+    std::memcpy(payload, words, bytes);
+    payload += bytes;
+  }
+}
+
+bool decodeBitpackedToFloat(const uint8_t* data, size_t size, size_t count, int32_t offset, float hu_range, float* out) {
+  const uint16_t* bases; const uint8_t* bits; const uint8_t* payload;
+  if (!parseStream(data, size, count, bases, bits, payload)) return false;
+
+  float tail[CODEC_BLOCK];
+  for (size_t first = 0, b = 0; first < count; first += CODEC_BLOCK, b++) {
+    int32_t block_offset = int32_t(bases[b]) + offset;
+    bool full = count - first >= CODEC_BLOCK;
+    float* dst = full ? out + first : tail;
+
+#ifdef VOXRAY_SSE2
+    UNPACK_TABLE[bits[b]](payload, block_offset, hu_range, dst);
+#else
+    uint32_t values[CODEC_BLOCK];
+    unpackBlockScalar(payload, bits[b], values);
+    for (size_t i = 0; i < CODEC_BLOCK; i++) dst[i] = static_cast<float>(int32_t(values[i]) + block_offset) / hu_range;
+#endif
+    payload += bits[b] * LANES * sizeof(uint32_t);
+
+    if (!full) std::memcpy(out + first, tail, (count - first) * sizeof(float));
+  }
+  return true;
+}
+
+void compressVolume(const int16_t* hu, uint32_t width, uint32_t height, uint32_t depth,
+                    int32_t hu_min, int32_t hu_max, CompressedVolume& out) {
+  out.width  = width;
+  out.height = height;
+  out.depth  = depth;
+  out.hu_min = hu_min;
+  out.hu_max = hu_max;
+  out.slices.assign(depth, {});
+
+  const size_t slice = (size_t)width * height;
+  parallelFor(0, depth, [&](size_t z_begin, size_t z_end) {
+    std::vector<uint16_t> codes(slice);
+    for (size_t z = z_begin; z < z_end; z++) {
+      const int16_t* src = hu + z * slice;
+      for (size_t i = 0; i < slice; i++) codes[i] = uint16_t(int32_t(src[i]) + HU_CODE_BIAS);
+      encodeBitpacked(codes.data(), slice, out.slices[z]);
+    }
+  });
+}
+
+bool decompressVolume(const CompressedVolume& volume, VoxelGrid& grid) {
+  grid = VoxelGrid(volume.width, volume.height, volume.depth);
+
+  const size_t slice = (size_t)volume.width * volume.height;
+  const int32_t offset = -HU_CODE_BIAS - volume.hu_min;
+  const float hu_range = static_cast<float>(volume.hu_max - volume.hu_min);
+
+  std::atomic<bool> ok{true};
+  parallelFor(0, volume.depth, [&](size_t z_begin, size_t z_end) {
+    for (size_t z = z_begin; z < z_end; z++) {
+      const std::vector<uint8_t>& stream = volume.slices[z];
+      if (!decodeBitpackedToFloat(stream.data(), stream.size(), slice, offset, hu_range, grid.data.data() + z * slice)) {
+        ok.store(false, std::memory_order_relaxed);
+      }
+    }
+  });
+
+  if (!ok) printf("Corrupt compressed volume\n");
+  return ok;
+}
+
+size_t compressedBytes(const CompressedVolume& volume) {
+  size_t bytes = 0;
+  for (const auto& slice : volume.slices) bytes += slice.size();
+  return bytes;
+}
+
+} // namespace preprocessing
@@ -0,0 +1,53 @@
+// preprocessing/brick_codec.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // Lossless codec for HU data stored as unsigned codes = hu + HU_CODE_BIAS
+  // Values are split into blocks of 128, each stored as a 16-bit base plus the offsets from it
+  // bit-packed at the smallest width that fits. Offsets are packed in 4 interleaved 32-bit lanes
+  // so an SSE register unpacks 4 values per shift. CT data with 12 effective bits typically
+  // lands at 4-10 bits per voxel after the per-block base is removed.
+  //
+  // Stream layout:
+  //   uint32_t block_count
+  //   uint16_t base[block_count]
+  //   uint8_t  bits[block_count]
+  //   padding to 16 bytes
+  //   payload, bits[i] * 16 bytes per block
+  constexpr size_t  CODEC_BLOCK  = 128;
+  constexpr int32_t HU_CODE_BIAS = 32768;
+
+  enum class BrickCodec : uint32_t {
+    RAW     = 0,
+    BITPACK = 1
+  };
+
+  // count does not need to be a multiple of CODEC_BLOCK, the tail is padded internally
+  void encodeBitpacked(const uint16_t* codes, size_t count, std::vector<uint8_t>& out);
+  // Fused decode and normalization, out[i] = (code + offset) / hu_range
+  // With offset = -HU_CODE_BIAS - hu_min this matches importDicomSeries() bit for bit
+  bool decodeBitpackedToFloat(const uint8_t* data, size_t size, size_t count, int32_t offset, float hu_range, float* out);
+
+  // Raw HU volume held compressed in memory, one independently decodable stream per slice
+  struct CompressedVolume {
+    uint32_t width  = 0;
+    uint32_t height = 0;
+    uint32_t depth  = 0;
+    int32_t  hu_min = 0;
+    int32_t  hu_max = 0;
+    std::vector<std::vector<uint8_t>> slices;
+  };
+
+  void compressVolume(const int16_t* hu, uint32_t width, uint32_t height, uint32_t depth,
+                      int32_t hu_min, int32_t hu_max, CompressedVolume& out);
+  // Produces the same grid importDicomSeries() would have, slices decode in parallel
+  bool decompressVolume(const CompressedVolume& volume, VoxelGrid& grid);
+  size_t compressedBytes(const CompressedVolume& volume);
+
+} // namespace preprocessing
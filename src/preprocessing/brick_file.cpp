@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "preprocessing/brick_file.hpp"
+
+namespace preprocessing {
+
+bool beginBrickFile(const std::string& path, const DicomMetadata& metadata, uint32_t brick_size, BrickCodec codec, BrickWriter& out) {
+  out.out.open(path, std::ios::binary | std::ios::trunc);
+  if (!out.out) {
+    printf("Failed to open brick file for writing: %s\n", path.c_str());
+    return false;
+  }
+
+  BrickFileHeader& h = out.header;
+  std::memcpy(h.magic, BRICK_FILE_MAGIC, sizeof(h.magic));
+  h.version    = BRICK_FILE_VERSION;
+  h.width      = metadata.width;
+  h.height     = metadata.height;
+  h.depth      = metadata.depth;
+  h.brick_size = brick_size;
+  h.bricks_x   = (h.width  + brick_size - 1) / brick_size;
+  h.bricks_y   = (h.height + brick_size - 1) / brick_size;
+  h.bricks_z   = (h.depth  + brick_size - 1) / brick_size;
+  h.spacing_x  = metadata.spacing_x;
+  h.spacing_y  = metadata.spacing_y;
+  h.spacing_z  = metadata.spacing_z;
+  h.origin_x   = metadata.origin_x;
+  h.origin_y   = metadata.origin_y;
+  h.origin_z   = metadata.origin_z;
+  h.hu_min     = 0;
+  h.hu_max     = 0;
+  h.codec      = codec;
+
+  // Header and offset table get rewritten in endBrickFile() once the HU range is known
+  out.offsets.assign(brickCount(h) + 1, 0);
+  out.out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.out.write(reinterpret_cast<const char*>(out.offsets.data()), out.offsets.size() * sizeof(uint64_t));
+  out.offsets[0] = sizeof(h) + out.offsets.size() * sizeof(uint64_t);
+
+  out.scratch.resize(brickVoxels(h));
+  out.slabs_written = 0;
+  return true;
+}
+
+// slab holds slab_depth full slices (width * height each)
+bool writeBrickSlab(BrickWriter& writer, const int16_t* slab, uint32_t slab_depth) {
+  const BrickFileHeader& h = writer.header;
+  if (writer.slabs_written >= h.bricks_z) return false;
+
+  const uint32_t bs = h.brick_size;
+  const size_t slice = (size_t)h.width * h.height;
+
+  for (uint32_t by = 0; by < h.bricks_y; by++) {
+    for (uint32_t bx = 0; bx < h.bricks_x; bx++) {
+      // Gather brick, clamping to the last valid voxel on partial edges
+      for (uint32_t z = 0; z < bs; z++) {
+        uint32_t sz = std::min(z, slab_depth - 1);
+        for (uint32_t y = 0; y < bs; y++) {
+          uint32_t sy = std::min(by * bs + y, h.height - 1);
+          const int16_t* row = slab + sz * slice + (size_t)sy * h.width;
+          int16_t* dst = writer.scratch.data() + ((size_t)z * bs + y) * bs;
+          for (uint32_t x = 0; x < bs; x++) {
+            dst[x] = row[std::min(bx * bs + x, h.width - 1)];
+          }
+        }
+      }
+
+      const char* payload = reinterpret_cast<const char*>(writer.scratch.data());
+      size_t bytes = writer.scratch.size() * sizeof(int16_t);
+      if (h.codec == BrickCodec::BITPACK) {
+        writer.codes.resize(writer.scratch.size());
+        for (size_t i = 0; i < writer.scratch.size(); i++) writer.codes[i] = uint16_t(int32_t(writer.scratch[i]) + HU_CODE_BIAS);
+        encodeBitpacked(writer.codes.data(), writer.codes.size(), writer.encoded);
+        payload = reinterpret_cast<const char*>(writer.encoded.data());
+        bytes = writer.encoded.size();
+      }
+
+      uint32_t index = brickIndex(h, bx, by, writer.slabs_written);
+      writer.out.write(payload, bytes);
+      writer.offsets[index + 1] = writer.offsets[index] + bytes;
+    }
+  }
+
+  writer.slabs_written++;
+  return bool(writer.out);
+}
+
+bool endBrickFile(BrickWriter& writer, int32_t hu_min, int32_t hu_max) {
+  if (writer.slabs_written != writer.header.bricks_z) {
+    printf("Brick file incomplete: %u of %u slabs written\n", writer.slabs_written, writer.header.bricks_z);
+    return false;
+  }
+
+  writer.header.hu_min = hu_min;
+  writer.header.hu_max = hu_max;
+
+  writer.out.seekp(0);
+  writer.out.write(reinterpret_cast<const char*>(&writer.header), sizeof(writer.header));
+  writer.out.write(reinterpret_cast<const char*>(writer.offsets.data()), writer.offsets.size() * sizeof(uint64_t));
+  writer.out.close();
+  return !writer.out.fail();
+}
+
+bool readBrickFileHeader(std::ifstream& in, BrickFileHeader& header, std::vector<uint64_t>& offsets) {
+  in.seekg(0);
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!in || std::memcmp(header.magic, BRICK_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    printf("Not a brick file\n");
+    return false;
+  }
+  if (header.version != BRICK_FILE_VERSION) {
+    printf("Unsupported brick file version %u\n", header.version);
+    return false;
+  }
+
+  offsets.resize(brickCount(header) + 1);
+  in.read(reinterpret_cast<char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+  return bool(in);
+}
+
+bool readBrickPayload(std::ifstream& in, const BrickFileHeader& header, const std::vector<uint64_t>& offsets,
+                      uint32_t index, std::vector<uint8_t>& out) {
+  if (index >= brickCount(header)) return false;
+
+  uint64_t bytes = offsets[index + 1] - offsets[index];
+  out.resize(bytes);
+  in.seekg(offsets[index]);
+  in.read(reinterpret_cast<char*>(out.data()), bytes);
+  return bool(in);
+}
+
+bool decodeBrick(const BrickFileHeader& header, const std::vector<uint8_t>& payload, float* out) {
+  size_t count = brickVoxels(header);
+  float hu_range = static_cast<float>(std::max(header.hu_max - header.hu_min, 1));
+
+  switch (header.codec) {
+    case BrickCodec::RAW: {
+      if (payload.size() != count * sizeof(int16_t)) return false;
+      const int16_t* hu = reinterpret_cast<const int16_t*>(payload.data());
+      for (size_t i = 0; i < count; i++) out[i] = static_cast<float>(hu[i] - header.hu_min) / hu_range;
+      return true;
+    }
+    case BrickCodec::BITPACK:
+      return decodeBitpackedToFloat(payload.data(), payload.size(), count, -HU_CODE_BIAS - header.hu_min, hu_range, out);
+  }
+  return false;
+}
+
+DicomMetadata metadataFromHeader(const BrickFileHeader& header) {
+  DicomMetadata metadata{};
+  metadata.width     = header.width;
+  metadata.height    = header.height;
+  metadata.depth     = header.depth;
+  metadata.spacing_x = header.spacing_x;
+  metadata.spacing_y = header.spacing_y;
+  metadata.spacing_z = header.spacing_z;
+  metadata.origin_x  = header.origin_x;
+  metadata.origin_y  = header.origin_y;
+  metadata.origin_z  = header.origin_z;
+  metadata.min_value = static_cast<float>(header.hu_min);
+  metadata.max_value = static_cast<float>(header.hu_max);
+  return metadata;
+}
+
+} // namespace preprocessing
@@ -0,0 +1,66 @@
+// preprocessing/brick_file.hpp
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "preprocessing/brick_codec.hpp"
+#include "preprocessing/dicom_utils.hpp"
+
+namespace preprocessing {
+
+  // On-disk layout of a bricked volume:
+  //   BrickFileHeader
+  //   uint64_t offsets[brick_count + 1]   (byte offset of each brick payload, last entry is end of file)
+  //   brick payloads, z-major brick order
+  // Each payload is brick_size^3 Hounsfield values, either raw int16 or a bit-packed stream
+  // (see brick_codec.hpp). Edge bricks are padded by repeating the last valid voxel so every
+  // brick can be sampled without bounds checks.
+  constexpr char     BRICK_FILE_MAGIC[4]   = { 'V', 'X', 'B', 'K' };
+  constexpr uint32_t BRICK_FILE_VERSION    = 2;
+  constexpr uint32_t DEFAULT_BRICK_SIZE    = 64;
+
+  struct BrickFileHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t width, height, depth;
+    uint32_t brick_size;
+    uint32_t bricks_x, bricks_y, bricks_z;
+    float    spacing_x, spacing_y, spacing_z;
+    float    origin_x, origin_y, origin_z;
+    int32_t  hu_min, hu_max;
+    BrickCodec codec;
+  };
+
+  inline uint32_t brickCount(const BrickFileHeader& h) { return h.bricks_x * h.bricks_y * h.bricks_z; }
+  inline uint32_t brickIndex(const BrickFileHeader& h, uint32_t bx, uint32_t by, uint32_t bz) {
+    return (bz * h.bricks_y + by) * h.bricks_x + bx;
+  }
+  inline size_t brickVoxels(const BrickFileHeader& h) { return (size_t)h.brick_size * h.brick_size * h.brick_size; }
+
+  // Streaming writer, bricks are written one slab (brick_size slices) at a time so the whole
+  // volume never has to be resident
+  struct BrickWriter {
+    std::ofstream out;
+    BrickFileHeader header{};
+    std::vector<uint64_t> offsets;
+    std::vector<int16_t> scratch;
+    std::vector<uint16_t> codes;
+    std::vector<uint8_t> encoded;
+    uint32_t slabs_written = 0;
+  };
+
+  bool beginBrickFile(const std::string& path, const DicomMetadata& metadata, uint32_t brick_size, BrickCodec codec, BrickWriter& out);
+  bool writeBrickSlab(BrickWriter& writer, const int16_t* slab, uint32_t slab_depth);
+  bool endBrickFile(BrickWriter& writer, int32_t hu_min, int32_t hu_max);
+
+  bool readBrickFileHeader(std::ifstream& in, BrickFileHeader& header, std::vector<uint64_t>& offsets);
+  bool readBrickPayload(std::ifstream& in, const BrickFileHeader& header, const std::vector<uint64_t>& offsets,
+                        uint32_t index, std::vector<uint8_t>& out);
+  // Decodes a payload into brick_size^3 densities normalized like importDicomSeries()
+  bool decodeBrick(const BrickFileHeader& header, const std::vector<uint8_t>& payload, float* out);
+
+  DicomMetadata metadataFromHeader(const BrickFileHeader& header);
+
+} // namespace preprocessing
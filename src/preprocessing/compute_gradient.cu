@@ -33,6 +33,8 @@ __global__ void computeGradient(const float* density, float4* normals, uint32_t
 namespace preprocessing {
 
 void computeGradientKernel(VoxelGrid& grid) {
+  grid.normals.resize(grid.data.size());
+
   float4* d_normals = nullptr;
   size_t size_normals = grid.width * grid.height * grid.depth * sizeof(float4);
   cudaMalloc(&d_normals, size_normals);
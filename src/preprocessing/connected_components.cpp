@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <bit>
+#include <numeric>
+
+#include "preprocessing/connected_components.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  struct Run {
+    uint32_t x0, x1;          // [x0, x1)
+    uint32_t y, z;
+  };
+
+  // Runs of one slab of slices, rows are (z - z0) * height + y
+  struct Slab {
+    uint32_t z0, z1;
+    std::vector<Run> runs;
+    std::vector<uint32_t> row_start;    // One past the end holds runs.size()
+    uint32_t offset = 0;                // Index of the first run in the global union-find
+  };
+
+  // Roots are always the smallest index in their set, which keeps parent[i] <= i
+  uint32_t findRoot(std::vector<uint32_t>& parent, uint32_t i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  }
+
+  void unite(std::vector<uint32_t>& parent, uint32_t a, uint32_t b) {
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+  }
+
+  // Unions every pair of overlapping runs between two rows, both sorted by x0
+  void uniteRows(std::vector<uint32_t>& parent, const Run* a, uint32_t a_first, uint32_t a_count,
+                 const Run* b, uint32_t b_first, uint32_t b_count) {
+    uint32_t i = 0, j = 0;
+    while (i < a_count && j < b_count) {
+      if (a[i].x0 < b[j].x1 && b[j].x0 < a[i].x1) unite(parent, a_first + i, b_first + j);
+      if (a[i].x1 < b[j].x1) i++;
+      else j++;
+    }
+  }
+
+  // Runs are found a word at a time, skipping clear and set stretches with bit scans
+  void extractRuns(const BitMask& mask, Slab& slab) {
+    slab.row_start.clear();
+    for (uint32_t z = slab.z0; z < slab.z1; z++) {
+      for (uint32_t y = 0; y < mask.height; y++) {
+        slab.row_start.push_back(uint32_t(slab.runs.size()));
+        const uint64_t* row = mask.row(y, z);
+
+        uint32_t x = 0;
+        while (x < mask.width) {
+          uint64_t set = row[x >> 6] >> (x & 63);
+          if (!set) {
+            x = (x | 63) + 1;
+            continue;
+          }
+          x += std::countr_zero(set);
+          uint32_t start = x;
+          while (x < mask.width) {
+            uint64_t clear = ~row[x >> 6] >> (x & 63);
+            if (clear) {
+              x += std::countr_zero(clear);
+              break;
+            }
+            x = (x | 63) + 1;
+          }
+          x = std::min(x, mask.width);
+          slab.runs.push_back({ start, x, y, z });
+        }
+      }
+    }
+    slab.row_start.push_back(uint32_t(slab.runs.size()));
+  }
+
+  // Rows within the slab only, so slabs touch disjoint parts of parent
+  void uniteSlab(const BitMask& mask, const Slab& slab, std::vector<uint32_t>& parent) {
+    uint32_t rows = (slab.z1 - slab.z0) * mask.height;
+    for (uint32_t r = 0; r < rows; r++) {
+      uint32_t first = slab.row_start[r], count = slab.row_start[r + 1] - first;
+      if (count == 0) continue;
+
+      uint32_t y = r % mask.height;
+      if (y > 0) {
+        uint32_t prev = slab.row_start[r - 1];
+        uniteRows(parent, &slab.runs[first], slab.offset + first, count,
+                  &slab.runs[prev], slab.offset + prev, first - prev);
+      }
+      if (r >= mask.height) {
+        uint32_t below = slab.row_start[r - mask.height];
+        uint32_t below_count = slab.row_start[r - mask.height + 1] - below;
+        uniteRows(parent, &slab.runs[first], slab.offset + first, count,
+                  &slab.runs[below], slab.offset + below, below_count);
+      }
+    }
+  }
+}
+
+void labelComponents(const VoxelGrid& grid, float lo, float hi, uint32_t min_voxels, LabelVolume& out) {
+  BitMask mask;
+  thresholdMask(grid, lo, hi, mask);
+  labelComponents(mask, min_voxels, out);
+}
+
+void labelComponents(const BitMask& mask, uint32_t min_voxels, LabelVolume& out) {
+  out = LabelVolume{};
+  out.width = mask.width;
+  out.height = mask.height;
+  out.depth = mask.depth;
+  out.labels.assign((size_t)mask.width * mask.height * mask.depth, 0);
+  if (out.labels.empty()) return;
+
+  // Same split parallelFor uses, so each worker owns one slab throughout
+  uint32_t slab_count = std::min<uint32_t>(workerCount(), mask.depth);
+  uint32_t slab_depth = (mask.depth + slab_count - 1) / slab_count;
+  slab_count = (mask.depth + slab_depth - 1) / slab_depth;
+  std::vector<Slab> slabs(slab_count);
+  for (uint32_t s = 0; s < slab_count; s++) {
+    slabs[s].z0 = s * slab_depth;
+    slabs[s].z1 = std::min(mask.depth, slabs[s].z0 + slab_depth);
+  }
+
+  parallelFor(0, slab_count, [&](size_t begin, size_t end) {
+    for (size_t s = begin; s < end; s++) extractRuns(mask, slabs[s]);
+  });
+
+  uint32_t run_count = 0;
+  for (Slab& slab : slabs) {
+    slab.offset = run_count;
+    run_count += uint32_t(slab.runs.size());
+  }
+  std::vector<uint32_t> parent(run_count);
+  std::iota(parent.begin(), parent.end(), 0u);
+
+  parallelFor(0, slab_count, [&](size_t begin, size_t end) {
+    for (size_t s = begin; s < end; s++) uniteSlab(mask, slabs[s], parent);
+  });
+
+  // Merge pass: the first slice of each slab against the last slice of the one before
+  for (uint32_t s = 1; s < slab_count; s++) {
+    const Slab& below = slabs[s - 1];
+    const Slab& above = slabs[s];
+    uint32_t below_base = (below.z1 - below.z0 - 1) * mask.height;
+    for (uint32_t y = 0; y < mask.height; y++) {
+      uint32_t a = above.row_start[y], a_count = above.row_start[y + 1] - a;
+      uint32_t b = below.row_start[below_base + y], b_count = below.row_start[below_base + y + 1] - b;
+      if (a_count == 0 || b_count == 0) continue;
+      uniteRows(parent, &above.runs[a], above.offset + a, a_count, &below.runs[b], below.offset + b, b_count);
+    }
+  }
+
+  // parent[i] <= i, so one forward pass leaves every run pointing straight at its root
+  for (uint32_t i = 0; i < run_count; i++) parent[i] = parent[parent[i]];
+
+  // Size and bounds per root
+  std::vector<LabelInfo> info(run_count);
+  for (const Slab& slab : slabs) {
+    for (uint32_t i = 0; i < slab.runs.size(); i++) {
+      const Run& run = slab.runs[i];
+      uint32_t root = parent[slab.offset + i];
+      LabelInfo& c = info[root];
+      if (root == slab.offset + i) c = { { run.x0, run.y, run.z }, { run.x1 - 1, run.y, run.z }, 0 };
+      c.min[0] = std::min(c.min[0], run.x0);
+      c.min[1] = std::min(c.min[1], run.y);
+      c.min[2] = std::min(c.min[2], run.z);
+      c.max[0] = std::max(c.max[0], run.x1 - 1);
+      c.max[1] = std::max(c.max[1], run.y);
+      c.max[2] = std::max(c.max[2], run.z);
+      c.voxels += run.x1 - run.x0;
+    }
+  }
+
+  std::vector<uint32_t> roots;
+  for (uint32_t i = 0; i < run_count; i++) {
+    if (parent[i] != i) continue;
+    if (info[i].voxels >= min_voxels) roots.push_back(i);
+    else out.dropped++;
+  }
+  std::sort(roots.begin(), roots.end(), [&](uint32_t a, uint32_t b) { return info[a].voxels > info[b].voxels; });
+  if (roots.size() > MAX_LABELS) {
+    out.dropped += roots.size() - MAX_LABELS;
+    roots.resize(MAX_LABELS);
+  }
+
+  // Reuses the root slots to hold labels
+  std::vector<uint16_t> label_of(run_count, 0);
+  out.components.reserve(roots.size());
+  for (size_t l = 0; l < roots.size(); l++) {
+    label_of[roots[l]] = uint16_t(l + 1);
+    out.components.push_back(info[roots[l]]);
+  }
+
+  parallelFor(0, slab_count, [&](size_t begin, size_t end) {
+    for (size_t s = begin; s < end; s++) {
+      const Slab& slab = slabs[s];
+      for (uint32_t i = 0; i < slab.runs.size(); i++) {
+        const Run& run = slab.runs[i];
+        uint16_t label = label_of[parent[slab.offset + i]];
+        if (label == 0) continue;
+        uint16_t* row = &out.labels[((size_t)run.z * mask.height + run.y) * mask.width];
+        std::fill(row + run.x0, row + run.x1, label);
+      }
+    }
+  });
+}
+
+} // namespace preprocessing
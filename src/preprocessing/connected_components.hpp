@@ -0,0 +1,40 @@
+// preprocessing/connected_components.hpp
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "preprocessing/morphology.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // Labels past this are folded into the background
+  constexpr uint32_t MAX_LABELS = 65535;
+
+  struct LabelInfo {
+    uint32_t min[3];          // Inclusive voxel bounding box
+    uint32_t max[3];
+    uint64_t voxels;
+  };
+
+  // 0 is background, label l > 0 is components[l - 1]. Labels are ordered largest first.
+  struct LabelVolume {
+    uint32_t width = 0, height = 0, depth = 0;
+    std::vector<uint16_t> labels;
+    std::vector<LabelInfo> components;
+    uint64_t dropped = 0;     // Components under min_voxels or past MAX_LABELS
+  };
+
+  // Labels 6-connected components of voxels with lo <= density <= hi. The thresholded mask is
+  // reduced to runs along x per slab of slices, runs are unioned within each slab on its own
+  // thread and a merge pass then joins the runs either side of every slab boundary.
+  void labelComponents(const VoxelGrid& grid, float lo, float hi, uint32_t min_voxels, LabelVolume& out);
+  // Same for the set voxels of a mask, e.g. one already cleaned up with openMask or fillHoles
+  void labelComponents(const BitMask& mask, uint32_t min_voxels, LabelVolume& out);
+
+  // Every label fits in a byte, so the volume can be stored as 8 bit
+  inline bool fitsInBytes(const LabelVolume& volume) {
+    return volume.components.size() <= 255;
+  }
+
+} // namespace preprocessing
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "preprocessing/crop.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+CropBox cropBox(const DicomMetadata& metadata, const CropRegion& region) {
+  const uint32_t size[3] = { uint32_t(metadata.width), uint32_t(metadata.height), uint32_t(metadata.depth) };
+
+  CropBox box;
+  for (int a = 0; a < 3; a++) {
+    float lo = std::clamp(std::min(region.min[a], region.max[a]), 0.f, 1.f);
+    float hi = std::clamp(std::max(region.min[a], region.max[a]), 0.f, 1.f);
+    box.min[a] = std::min(uint32_t(std::floor(lo * size[a])), size[a] - 1);
+    box.max[a] = std::clamp(uint32_t(std::ceil(hi * size[a])), box.min[a] + 1, size[a]);
+  }
+  return box;
+}
+
+bool isFullVolume(const CropRegion& region) {
+  for (int a = 0; a < 3; a++) {
+    if (region.min[a] > 0.f || region.max[a] < 1.f) return false;
+  }
+  return true;
+}
+
+void cropGrid(const VoxelGrid& grid, const DicomMetadata& metadata, const CropBox& box,
+              VoxelGrid& out, DicomMetadata& out_metadata) {
+  uint32_t w = box.max[0] - box.min[0];
+  uint32_t h = box.max[1] - box.min[1];
+  uint32_t d = box.max[2] - box.min[2];
+  out = VoxelGrid(w, h, d);
+
+  parallelFor(0, d, [&](size_t z_begin, size_t z_end) {
+    for (uint32_t z = uint32_t(z_begin); z < z_end; z++) {
+      for (uint32_t y = 0; y < h; y++) {
+        const float* src = &grid.data[((size_t)(z + box.min[2]) * grid.height + y + box.min[1]) * grid.width + box.min[0]];
+        std::memcpy(&out.data[((size_t)z * h + y) * w], src, w * sizeof(float));
+      }
+    }
+  });
+
+  out_metadata = metadata;
+  out_metadata.width    = int(w);
+  out_metadata.height   = int(h);
+  out_metadata.depth    = int(d);
+  out_metadata.origin_x += box.min[0] * metadata.spacing_x;
+  out_metadata.origin_y += box.min[1] * metadata.spacing_y;
+  out_metadata.origin_z += box.min[2] * metadata.spacing_z;
+}
+
+} // namespace preprocessing
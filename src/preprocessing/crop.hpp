@@ -0,0 +1,32 @@
+// preprocessing/crop.hpp
+#pragma once
+#include <cstdint>
+
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // Crop as fractions of the volume along DicomMetadata's width, height and depth axes
+  // Resolution independent, so the same region applies to a preview and its full series
+  struct CropRegion {
+    float min[3] = { 0.f, 0.f, 0.f };
+    float max[3] = { 1.f, 1.f, 1.f };
+  };
+
+  // Voxel index box [min, max) in DicomMetadata coordinates
+  struct CropBox {
+    uint32_t min[3];
+    uint32_t max[3];
+  };
+
+  // Rounded outwards and at least one voxel thick on every axis
+  CropBox cropBox(const DicomMetadata& metadata, const CropRegion& region);
+  bool isFullVolume(const CropRegion& region);
+
+  // Copies the sub-volume and moves the origin so voxels keep their patient positions
+  // Normals are left for computeGradientKernel()
+  void cropGrid(const VoxelGrid& grid, const DicomMetadata& metadata, const CropBox& box,
+                VoxelGrid& out, DicomMetadata& out_metadata);
+
+} // namespace preprocessing
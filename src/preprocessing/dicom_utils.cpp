@@ -4,6 +4,9 @@
 #include "itkImageSeriesReader.h"
 #include "itkImageFileWriter.h"
 #include "preprocessing/voxel_grid.hpp"
+#include "preprocessing/brick_file.hpp"
+#include "preprocessing/histogram.hpp"
+#include <algorithm>
 #include <iterator>
 #include <itkMacro.h>
 
@@ -58,14 +61,76 @@ namespace {
   }
 }
 
-// Mainly based on ITK example function from here: https://examples.itk.org/src/io/gdcm/readdicomseriesandwrite3dimage/documentation
-bool importDicomSeries(const std::string& directory, VoxelGrid& grid, DicomMetadata& metadata) {
-  // ITK type definitions
+namespace {
   using PixelType = signed short;
-  constexpr unsigned int Dimension = 3;
-  using ImageType = itk::Image<PixelType, Dimension>;
-  using ReaderType = itk::ImageSeriesReader<ImageType>;
-  using ImageIOType = itk::GDCMImageIO;
+  using ImageType = itk::Image<PixelType, 3>;
+
+  bool readDicomFiles(const std::vector<std::string>& fileNames, ImageType::Pointer& image) {
+    using ReaderType = itk::ImageSeriesReader<ImageType>;
+    using ImageIOType = itk::GDCMImageIO;
+
+    ImageIOType::Pointer dicomIO = ImageIOType::New();
+    ReaderType::Pointer reader = ReaderType::New();
+    reader->SetImageIO(dicomIO);
+    reader->SetFileNames(fileNames);
+
+    try {
+      reader->Update();
+    } catch (const itk::ExceptionObject& e) {
+      printf("Error reading DICOM: %s\n", e.what());
+      return false;
+    }
+
+    image = reader->GetOutput();
+    return true;
+  }
+
+  // Reads the image and finds the min/max Hounsfield values from its histogram
+  bool readDicomImage(const std::vector<std::string>& fileNames, ImageType::Pointer& image, DicomMetadata& metadata,
+                      HuHistogram* histogram = nullptr) {
+    if (!readDicomFiles(fileNames, image)) return false;
+
+    getSize(image, metadata);
+    getSpacing(image, metadata);
+    getOrigin(image, metadata);
+
+    size_t total_voxels = (size_t)metadata.width * metadata.height * metadata.depth;
+    HuHistogram local;
+    if (!histogram) histogram = &local;
+    buildHuHistogram(image->GetBufferPointer(), total_voxels, *histogram);
+
+    PixelType hu_min = histogram->min_hu;
+    PixelType hu_max = histogram->max_hu;
+    metadata.min_value = static_cast<float>(hu_min);
+    metadata.max_value = static_cast<float>(hu_max);
+
+    printf ("HU range: [%d, %d]\n", hu_min, hu_max);
+    return true;
+  }
+
+  bool importDicomFiles(const std::vector<std::string>& fileNames, VoxelGrid& grid, DicomMetadata& metadata,
+                        HuHistogram* histogram) {
+    printf("Found %zu DICOM files\n", fileNames.size());
+
+    ImageType::Pointer image;
+    if (!readDicomImage(fileNames, image, metadata, histogram)) return false;
+
+    // Normalize range into [0, 1] and write to grid
+    size_t total_voxels = (size_t)metadata.width * metadata.height * metadata.depth;
+    const PixelType* buffer = image->GetBufferPointer();
+    PixelType hu_min = static_cast<PixelType>(metadata.min_value);
+    grid = VoxelGrid(metadata.width, metadata.height, metadata.depth);
+    float hu_range = metadata.max_value - metadata.min_value;
+    for (size_t i = 0; i < total_voxels; i++) {
+      grid.data[i] = static_cast<float>(buffer[i] - hu_min) / hu_range;
+    }
+
+    return true;
+  }
+}
+
+// Mainly based on ITK example function from here: https://examples.itk.org/src/io/gdcm/readdicomseriesandwrite3dimage/documentation
+bool importDicomSeries(const std::string& directory, VoxelGrid& grid, DicomMetadata& metadata, HuHistogram* histogram) {
   using NamesGeneratorType = itk:: GDCMSeriesFileNames;
 
   NamesGeneratorType::Pointer nameGenerator = NamesGeneratorType::New();
@@ -77,50 +142,129 @@ bool importDicomSeries(const std::string& directory, VoxelGrid& grid, DicomMetad
     return false;
   }
 
-  printf("Found %zu DICOM files\n", fileNames.size());
+  return importDicomFiles(fileNames, grid, metadata, histogram);
+}
 
-  // Read DICOM series
-  // TODO: break this out into its own helper function for better readability
-  ImageIOType::Pointer dicomIO = ImageIOType::New();
-  ReaderType::Pointer reader = ReaderType::New();
-  reader->SetImageIO(dicomIO);
-  reader->SetFileNames(fileNames);
+bool importDicomSeries(const std::string& directory, const std::string& series_uid, VoxelGrid& grid, DicomMetadata& metadata,
+                       HuHistogram* histogram) {
+  using NamesGeneratorType = itk:: GDCMSeriesFileNames;
 
-  try {
-    reader->Update();
-  } catch (const itk::ExceptionObject e) {
-    printf("Error reading DICOM: %s\n", e.what());
+  NamesGeneratorType::Pointer nameGenerator = NamesGeneratorType::New();
+  nameGenerator->SetDirectory(directory);
+
+  const std::vector<std::string>& fileNames = nameGenerator->GetFileNames(series_uid);
+  if (fileNames.empty()) {
+    printf("No DICOM files for series %s in %s\n", series_uid.c_str(), directory.c_str());
+    return false;
+  }
+
+  return importDicomFiles(fileNames, grid, metadata, histogram);
+}
+
+bool importDicomSeries(const std::string& directory, const std::string& series_uid, CompressedVolume& volume,
+                       DicomMetadata& metadata, HuHistogram* histogram) {
+  using NamesGeneratorType = itk:: GDCMSeriesFileNames;
+
+  NamesGeneratorType::Pointer nameGenerator = NamesGeneratorType::New();
+  nameGenerator->SetDirectory(directory);
+
+  const std::vector<std::string>& fileNames = nameGenerator->GetFileNames(series_uid);
+  if (fileNames.empty()) {
+    printf("No DICOM files for series %s in %s\n", series_uid.c_str(), directory.c_str());
     return false;
   }
 
-  ImageType::Pointer image = reader->GetOutput();
-  getSize(image, metadata);
-  getSpacing(image, metadata);
-  getOrigin(image, metadata);
+  ImageType::Pointer image;
+  if (!readDicomImage(fileNames, image, metadata, histogram)) return false;
 
-  // Extract and normalize pixel data
   size_t total_voxels = (size_t)metadata.width * metadata.height * metadata.depth;
-  const PixelType* buffer = image->GetBufferPointer();
-
-  // Find min/max Hounsfield values
-  PixelType hu_min = buffer[0];
-  PixelType hu_max = buffer[0];
-  for (size_t i = 1; i < total_voxels; i++) {
-    if (buffer[i] < hu_min) hu_min = buffer[i];
-    if (buffer[i] > hu_max) hu_max = buffer[i];
+  compressVolume(image->GetBufferPointer(), metadata.width, metadata.height, metadata.depth,
+                 static_cast<int32_t>(metadata.min_value), static_cast<int32_t>(metadata.max_value), volume);
+
+  printf("Compressed %zu voxels to %.1f MB (%.2fx)\n", total_voxels, compressedBytes(volume) / 1048576.0,
+         double(total_voxels * sizeof(PixelType)) / compressedBytes(volume));
+  return true;
+}
+
+std::vector<DicomSeriesInfo> listDicomSeries(const std::string& directory) {
+  using NamesGeneratorType = itk:: GDCMSeriesFileNames;
+
+  NamesGeneratorType::Pointer nameGenerator = NamesGeneratorType::New();
+  nameGenerator->SetDirectory(directory);
+
+  std::vector<DicomSeriesInfo> series;
+  try {
+    for (const std::string& uid : nameGenerator->GetSeriesUIDs()) {
+      series.push_back({ uid, directory, nameGenerator->GetFileNames(uid).size() });
+    }
+  } catch (const itk::ExceptionObject& e) {
+    printf("Error scanning %s: %s\n", directory.c_str(), e.what());
   }
-  metadata.min_value = static_cast<float>(hu_min);
-  metadata.max_value = static_cast<float>(hu_max);
 
-  printf ("HU range: [%d, %d]", hu_min, hu_max);
+  return series;
+}
 
-  // Normalize range into [0, 1] and write to grid
-  grid = VoxelGrid(metadata.width, metadata.height, metadata.depth);
-  float hu_range = static_cast<float>(hu_max - hu_min);
-  for (size_t i = 0; i < total_voxels; i++) {
-    grid.data[i] = static_cast<float>(buffer[i] - hu_min) / hu_range;
+bool convertDicomSeriesToBricks(const std::string& directory, const std::string& path, uint32_t brick_size, DicomMetadata& metadata) {
+  using NamesGeneratorType = itk:: GDCMSeriesFileNames;
+
+  NamesGeneratorType::Pointer nameGenerator = NamesGeneratorType::New();
+  nameGenerator->SetDirectory(directory);
+
+  const std::vector<std::string>& fileNames = nameGenerator->GetInputFileNames();
+  if (fileNames.empty()) {
+    printf("No DICOM files found in %s\n", directory.c_str());
+    return false;
+  }
+
+  printf("Found %zu DICOM files, converting to %s\n", fileNames.size(), path.c_str());
+
+  BrickWriter writer;
+  PixelType hu_min = 0;
+  PixelType hu_max = 0;
+
+  // Read the series one slab of brick_size slices at a time
+  for (size_t first = 0; first < fileNames.size(); first += brick_size) {
+    size_t count = std::min<size_t>(brick_size, fileNames.size() - first);
+    std::vector<std::string> slabNames(fileNames.begin() + first, fileNames.begin() + first + count);
+
+    ImageType::Pointer image;
+    if (!readDicomFiles(slabNames, image)) return false;
+
+    DicomMetadata slab_meta{};
+    getSize(image, slab_meta);
+
+    // Spacing and origin come from the first slab, which has more than one slice
+    if (first == 0) {
+      metadata = slab_meta;
+      getSpacing(image, metadata);
+      getOrigin(image, metadata);
+      metadata.depth = static_cast<int>(fileNames.size());
+      if (!beginBrickFile(path, metadata, brick_size, BrickCodec::BITPACK, writer)) return false;
+    } else if (slab_meta.width != metadata.width || slab_meta.height != metadata.height) {
+      printf("Slice size changed mid-series at file %zu\n", first);
+      return false;
+    }
+
+    size_t slab_voxels = (size_t)metadata.width * metadata.height * count;
+    const PixelType* buffer = image->GetBufferPointer();
+    if (first == 0) hu_min = hu_max = buffer[0];
+    for (size_t i = 0; i < slab_voxels; i++) {
+      if (buffer[i] < hu_min) hu_min = buffer[i];
+      if (buffer[i] > hu_max) hu_max = buffer[i];
+    }
+
+    if (!writeBrickSlab(writer, buffer, static_cast<uint32_t>(count))) {
+      printf("Failed writing slab at file %zu\n", first);
+      return false;
+    }
   }
 
+  if (!endBrickFile(writer, hu_min, hu_max)) return false;
+
+  metadata.min_value = static_cast<float>(hu_min);
+  metadata.max_value = static_cast<float>(hu_max);
+  printf("HU range: [%d, %d]\n", hu_min, hu_max);
+
   return true;
 }
 
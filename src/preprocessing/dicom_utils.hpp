@@ -1,12 +1,17 @@
 // preprocessing/dicom_utils.hpp
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
+#include "preprocessing/brick_codec.hpp"
 #include "preprocessing/voxel_grid.hpp"
 
 namespace preprocessing {
 
+  struct HuHistogram;
+
   struct DicomMetadata {
     float spacing_x, spacing_y, spacing_z;
     float origin_x, origin_y, origin_z;
@@ -14,6 +19,27 @@ namespace preprocessing {
     float min_value, max_value;
   };
 
-  bool importDicomSeries(const std::string& directory, VoxelGrid& grid, DicomMetadata& metadata);
+  struct DicomSeriesInfo {
+    std::string uid;          // SeriesInstanceUID
+    std::string directory;
+    size_t file_count;
+  };
+
+  // Every series found in the directory, a study folder usually holds several
+  std::vector<DicomSeriesInfo> listDicomSeries(const std::string& directory);
+
+  // histogram, if given, receives the HU histogram built during the min/max scan
+  bool importDicomSeries(const std::string& directory, VoxelGrid& grid, DicomMetadata& metadata,
+                         HuHistogram* histogram = nullptr);
+  bool importDicomSeries(const std::string& directory, const std::string& series_uid, VoxelGrid& grid, DicomMetadata& metadata,
+                         HuHistogram* histogram = nullptr);
+  // Keeps the raw HU values losslessly compressed instead of expanding them to floats
+  // decompressVolume() produces the same grid the overloads above would have
+  bool importDicomSeries(const std::string& directory, const std::string& series_uid, CompressedVolume& volume,
+                         DicomMetadata& metadata, HuHistogram* histogram = nullptr);
+
+  // Streams the series into a brick file one slab at a time for out-of-core viewing
+  // Only brick_size slices are ever resident, so this works for series larger than RAM
+  bool convertDicomSeriesToBricks(const std::string& directory, const std::string& path, uint32_t brick_size, DicomMetadata& metadata);
 
 } // namespace preprocessing
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cmath>
+
+#include "preprocessing/distance_field.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  constexpr float FAR = 1e20f;
+
+  // Scratch for one line, v holds parabola vertices and z the boundaries between them
+  struct LineScratch {
+    std::vector<float> f, d, z;
+    std::vector<int> v;
+
+    void resize(size_t n) {
+      f.resize(n);
+      d.resize(n);
+      z.resize(n + 1);
+      v.resize(n);
+    }
+  };
+
+  // 1D squared distance transform of the line in s.f into s.d, lower envelope of parabolas
+  void transformLine(LineScratch& s, int n) {
+    int k = 0;
+    s.v[0] = 0;
+    s.z[0] = -FAR;
+    s.z[1] = FAR;
+
+    for (int q = 1; q < n; q++) {
+      if (s.f[q] >= FAR) continue;   // Never part of the envelope
+      if (s.f[s.v[k]] >= FAR) {
+        // Only empty parabolas so far, replace outright
+        s.v[k] = q;
+        continue;
+      }
+
+      float x;
+      while (true) {
+        int p = s.v[k];
+        x = ((s.f[q] + float(q) * q) - (s.f[p] + float(p) * p)) / (2.f * (q - p));
+        if (x > s.z[k] || k == 0) break;
+        k--;
+      }
+      if (x <= s.z[k]) {
+        s.v[k] = q;
+        s.z[k + 1] = FAR;
+        continue;
+      }
+      k++;
+      s.v[k] = q;
+      s.z[k] = x;
+      s.z[k + 1] = FAR;
+    }
+
+    k = 0;
+    for (int q = 0; q < n; q++) {
+      while (s.z[k + 1] < q) k++;
+      int p = s.v[k];
+      float base = s.f[p];
+      s.d[q] = base >= FAR ? FAR : float(q - p) * (q - p) + base;
+    }
+  }
+}
+
+void computeDistanceField(const VoxelGrid& grid, float threshold, DistanceField& out) {
+  const uint32_t w = grid.width, h = grid.height, d = grid.depth;
+  const size_t slice = (size_t)w * h;
+
+  out.width = w;
+  out.height = h;
+  out.depth = d;
+  out.threshold = threshold;
+  out.distance.assign(slice * d, uint8_t(DISTANCE_FIELD_MAX));
+  if (grid.data.empty()) return;
+
+  std::vector<float> squared(slice * d);
+
+  // X pass doubles as the occupancy seed, each slice is independent
+  parallelFor(0, d, [&](size_t z_begin, size_t z_end) {
+    LineScratch s;
+    s.resize(w);
+    for (size_t z = z_begin; z < z_end; z++) {
+      for (uint32_t y = 0; y < h; y++) {
+        const float* src = grid.data.data() + z * slice + (size_t)y * w;
+        float* dst = squared.data() + z * slice + (size_t)y * w;
+        for (uint32_t x = 0; x < w; x++) s.f[x] = src[x] > threshold ? 0.f : FAR;
+        transformLine(s, int(w));
+        std::copy(s.d.begin(), s.d.begin() + w, dst);
+      }
+    }
+  });
+
+  parallelFor(0, d, [&](size_t z_begin, size_t z_end) {
+    LineScratch s;
+    s.resize(h);
+    for (size_t z = z_begin; z < z_end; z++) {
+      float* base = squared.data() + z * slice;
+      for (uint32_t x = 0; x < w; x++) {
+        for (uint32_t y = 0; y < h; y++) s.f[y] = base[(size_t)y * w + x];
+        transformLine(s, int(h));
+        for (uint32_t y = 0; y < h; y++) base[(size_t)y * w + x] = s.d[y];
+      }
+    }
+  });
+
+  // Z pass runs over rows instead so each thread owns whole z lines
+  const float max_squared = float(DISTANCE_FIELD_MAX) * DISTANCE_FIELD_MAX;
+  parallelFor(0, h, [&](size_t y_begin, size_t y_end) {
+    LineScratch s;
+    s.resize(d);
+    for (size_t y = y_begin; y < y_end; y++) {
+      for (uint32_t x = 0; x < w; x++) {
+        size_t column = y * w + x;
+        for (uint32_t z = 0; z < d; z++) s.f[z] = squared[z * slice + column];
+        transformLine(s, int(d));
+        for (uint32_t z = 0; z < d; z++) {
+          float sq = std::min(s.d[z], max_squared);
+          out.distance[z * slice + column] = uint8_t(std::floor(std::sqrt(sq)));
+        }
+      }
+    }
+  });
+}
+
+} // namespace preprocessing
@@ -0,0 +1,26 @@
+// preprocessing/distance_field.hpp
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // Distances saturate here, far enough that a leap is never the bottleneck
+  constexpr uint32_t DISTANCE_FIELD_MAX = 255;
+
+  // Euclidean distance from every voxel to the nearest voxel denser than threshold, in voxels,
+  // floored so it never overstates the gap. Stays valid for any window whose cutoff is at or
+  // above threshold, since raising the cutoff only empties more voxels.
+  struct DistanceField {
+    uint32_t width = 0, height = 0, depth = 0;
+    float threshold = 0.f;
+    std::vector<uint8_t> distance;
+  };
+
+  // Felzenszwalb-Huttenlocher squared distance transform, one separable pass per axis with the
+  // lines of each pass split across threads
+  void computeDistanceField(const VoxelGrid& grid, float threshold, DistanceField& out);
+
+} // namespace preprocessing
@@ -0,0 +1,49 @@
+#include <algorithm>
+
+#include "preprocessing/downsample.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+void downsampleGrid(const VoxelGrid& grid, const DicomMetadata& metadata, uint32_t max_dim,
+                    VoxelGrid& out, DicomMetadata& out_metadata) {
+  uint32_t largest = std::max({ grid.width, grid.height, grid.depth });
+  uint32_t factor  = std::max(1u, (largest + max_dim - 1) / max_dim);
+
+  uint32_t ow = (grid.width  + factor - 1) / factor;
+  uint32_t oh = (grid.height + factor - 1) / factor;
+  uint32_t od = (grid.depth  + factor - 1) / factor;
+  out = VoxelGrid(ow, oh, od);
+
+  // Each output slice only reads its own source slab, so slices are independent
+  parallelFor(0, od, [&](size_t z_begin, size_t z_end) {
+    for (uint32_t oz = uint32_t(z_begin); oz < z_end; oz++) {
+      uint32_t z0 = oz * factor, z1 = std::min(z0 + factor, grid.depth);
+      for (uint32_t oy = 0; oy < oh; oy++) {
+        uint32_t y0 = oy * factor, y1 = std::min(y0 + factor, grid.height);
+        for (uint32_t ox = 0; ox < ow; ox++) {
+          uint32_t x0 = ox * factor, x1 = std::min(x0 + factor, grid.width);
+
+          float sum = 0.f;
+          for (uint32_t z = z0; z < z1; z++) {
+            for (uint32_t y = y0; y < y1; y++) {
+              const float* row = &grid.at(0, y, z);
+              for (uint32_t x = x0; x < x1; x++) sum += row[x];
+            }
+          }
+          out.at(ox, oy, oz) = sum / float((z1 - z0) * (y1 - y0) * (x1 - x0));
+        }
+      }
+    }
+  });
+
+  out_metadata = metadata;
+  out_metadata.width     = ow;
+  out_metadata.height    = oh;
+  out_metadata.depth     = od;
+  out_metadata.spacing_x *= float(grid.width)  / ow;
+  out_metadata.spacing_y *= float(grid.height) / oh;
+  out_metadata.spacing_z *= float(grid.depth)  / od;
+}
+
+} // namespace preprocessing
@@ -0,0 +1,15 @@
+// preprocessing/downsample.hpp
+#pragma once
+#include <cstdint>
+
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // Box filters the densities by an integer factor so the largest axis is at most max_dim
+  // Spacing is scaled to keep the physical extent, normals are left for computeGradientKernel()
+  void downsampleGrid(const VoxelGrid& grid, const DicomMetadata& metadata, uint32_t max_dim,
+                      VoxelGrid& out, DicomMetadata& out_metadata);
+
+} // namespace preprocessing
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+#include "preprocessing/histogram.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  // Consecutive voxels are usually equal, so four interleaved tables keep the increments from
+  // waiting on each other. CT only touches a few thousand bins, so the tables stay in cache.
+  constexpr size_t LANES = 4;
+  // Largest run counted into 32 bit lanes before folding into the 64 bit totals
+  constexpr size_t FOLD_VOXELS = size_t(1) << 31;
+
+  // Anything below this is outside the patient and left out of the auto window
+  constexpr int16_t AIR_HU = -900;
+  // Share of the (non-air) volume a tissue class needs before it gets a peak and preset
+  constexpr float PEAK_MIN_FRACTION = 0.005f;
+
+  struct TissueClass {
+    const char* name;
+    int16_t lo_hu, hi_hu;
+    float width_hu;       // Conventional window width for the class
+  };
+
+  constexpr TissueClass TISSUE_CLASSES[] = {
+    { "Lung",        -950, -400, 1500.f },
+    { "Fat",         -200,  -31,  400.f },
+    { "Soft tissue",  -30,  100,  400.f },
+    { "Bone",         250, 2000, 1800.f },
+  };
+
+  void countRange(const int16_t* voxels, size_t begin, size_t end, std::vector<uint32_t>& lanes, std::vector<uint64_t>& counts) {
+    uint32_t* l0 = lanes.data();
+    uint32_t* l1 = l0 + HU_HISTOGRAM_BINS;
+    uint32_t* l2 = l1 + HU_HISTOGRAM_BINS;
+    uint32_t* l3 = l2 + HU_HISTOGRAM_BINS;
+
+    size_t i = begin;
+    for (; i + LANES <= end; i += LANES) {
+      l0[voxels[i]     + HU_HISTOGRAM_OFFSET]++;
+      l1[voxels[i + 1] + HU_HISTOGRAM_OFFSET]++;
+      l2[voxels[i + 2] + HU_HISTOGRAM_OFFSET]++;
+      l3[voxels[i + 3] + HU_HISTOGRAM_OFFSET]++;
+    }
+    for (; i < end; i++) l0[voxels[i] + HU_HISTOGRAM_OFFSET]++;
+
+    for (size_t b = 0; b < HU_HISTOGRAM_BINS; b++) {
+      counts[b] += uint64_t(l0[b]) + l1[b] + l2[b] + l3[b];
+    }
+    std::fill(lanes.begin(), lanes.end(), 0u);
+  }
+}
+
+void buildHuHistogram(const int16_t* voxels, size_t count, HuHistogram& out) {
+  out.counts.assign(HU_HISTOGRAM_BINS, 0);
+  out.total = count;
+  out.min_hu = out.max_hu = 0;
+  if (count == 0) return;
+
+  std::mutex merge;
+  parallelFor(0, count, [&](size_t begin, size_t end) {
+    std::vector<uint32_t> lanes(LANES * HU_HISTOGRAM_BINS, 0u);
+    std::vector<uint64_t> local(HU_HISTOGRAM_BINS, 0);
+    for (size_t b = begin; b < end; b += FOLD_VOXELS) {
+      countRange(voxels, b, std::min(end, b + FOLD_VOXELS), lanes, local);
+    }
+
+    std::lock_guard<std::mutex> lock(merge);
+    for (size_t b = 0; b < HU_HISTOGRAM_BINS; b++) out.counts[b] += local[b];
+  });
+
+  size_t lo = 0, hi = HU_HISTOGRAM_BINS - 1;
+  while (out.counts[lo] == 0) lo++;
+  while (out.counts[hi] == 0) hi--;
+  out.min_hu = int16_t(int32_t(lo) - HU_HISTOGRAM_OFFSET);
+  out.max_hu = int16_t(int32_t(hi) - HU_HISTOGRAM_OFFSET);
+}
+
+int16_t huPercentile(const HuHistogram& histogram, double fraction, int16_t floor_hu) {
+  if (histogram.counts.empty()) return 0;
+
+  size_t first = size_t(int32_t(floor_hu) + HU_HISTOGRAM_OFFSET);
+  uint64_t total = 0;
+  for (size_t b = first; b < HU_HISTOGRAM_BINS; b++) total += histogram.counts[b];
+  if (total == 0) return floor_hu;
+
+  uint64_t target = uint64_t(std::ceil(std::clamp(fraction, 0.0, 1.0) * double(total)));
+  uint64_t seen = 0;
+  for (size_t b = first; b < HU_HISTOGRAM_BINS; b++) {
+    seen += histogram.counts[b];
+    if (seen >= std::max<uint64_t>(target, 1)) return int16_t(int32_t(b) - HU_HISTOGRAM_OFFSET);
+  }
+  return histogram.max_hu;
+}
+
+void summarizeHistogram(const HuHistogram& histogram, HistogramStats& out) {
+  out = HistogramStats{};
+  if (histogram.counts.empty() || histogram.total == 0) return;
+
+  out.percentile_1  = huPercentile(histogram, 0.01);
+  out.median        = huPercentile(histogram, 0.5);
+  out.percentile_99 = huPercentile(histogram, 0.99);
+
+  uint64_t body = 0;
+  for (size_t b = size_t(AIR_HU + HU_HISTOGRAM_OFFSET); b < HU_HISTOGRAM_BINS; b++) body += histogram.counts[b];
+
+  // Auto spans the 1st to 99th percentile of everything denser than air
+  if (body > 0) {
+    float lo = huPercentile(histogram, 0.01, AIR_HU);
+    float hi = huPercentile(histogram, 0.99, AIR_HU);
+    out.presets.push_back({ "Auto", 0.5f * (lo + hi), std::max(hi - lo, 1.f) });
+  }
+
+  for (const TissueClass& tissue : TISSUE_CLASSES) {
+    uint64_t in_class = 0, best = 0;
+    int32_t peak = tissue.lo_hu;
+    for (int32_t hu = tissue.lo_hu; hu <= tissue.hi_hu; hu++) {
+      uint64_t c = histogram.counts[size_t(hu + HU_HISTOGRAM_OFFSET)];
+      in_class += c;
+      if (c > best) {
+        best = c;
+        peak = hu;
+      }
+    }
+
+    float fraction = float(double(in_class) / double(std::max<uint64_t>(body, 1)));
+    if (fraction < PEAK_MIN_FRACTION) continue;
+
+    out.peaks.push_back({ tissue.name, tissue.lo_hu, tissue.hi_hu, int16_t(peak), fraction });
+    out.presets.push_back({ tissue.name, float(peak), tissue.width_hu });
+  }
+
+  // Log counts so the air and soft tissue spikes don't flatten everything else
+  out.plot.assign(HISTOGRAM_PLOT_BINS, 0.f);
+  double span = double(histogram.max_hu) - histogram.min_hu + 1.0;
+  for (int32_t hu = histogram.min_hu; hu <= histogram.max_hu; hu++) {
+    size_t bin = std::min(HISTOGRAM_PLOT_BINS - 1, size_t(double(hu - histogram.min_hu) / span * HISTOGRAM_PLOT_BINS));
+    out.plot[bin] += float(histogram.counts[size_t(hu + HU_HISTOGRAM_OFFSET)]);
+  }
+  for (float& v : out.plot) v = std::log10(1.f + v);
+}
+
+} // namespace preprocessing
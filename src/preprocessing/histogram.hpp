@@ -0,0 +1,55 @@
+// preprocessing/histogram.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "preprocessing/dicom_utils.hpp"
+
+namespace preprocessing {
+
+  // One bin per Hounsfield unit over the whole signed short range
+  constexpr int32_t HU_HISTOGRAM_OFFSET = 32768;
+  constexpr size_t  HU_HISTOGRAM_BINS   = 65536;
+  constexpr size_t  HISTOGRAM_PLOT_BINS = 128;
+
+  struct HuHistogram {
+    std::vector<uint64_t> counts;     // counts[hu + HU_HISTOGRAM_OFFSET], empty if never built
+    uint64_t total = 0;
+    int16_t min_hu = 0, max_hu = 0;
+  };
+
+  // Most common value within a tissue class's HU range, fraction is of all voxels in the class
+  struct TissuePeak {
+    const char* name;
+    int16_t lo_hu, hi_hu;
+    int16_t peak_hu;
+    float fraction;
+  };
+
+  struct WindowPreset {
+    const char* name;
+    float center_hu, width_hu;
+  };
+
+  struct HistogramStats {
+    int16_t percentile_1 = 0, median = 0, percentile_99 = 0;
+    std::vector<TissuePeak> peaks;        // Only classes making up a noticeable share of the volume
+    std::vector<WindowPreset> presets;    // Auto first, then one per peak
+    std::vector<float> plot;              // log10(1 + count) over [min_hu, max_hu], HISTOGRAM_PLOT_BINS long
+  };
+
+  // Per-thread bins merged at the end, also fills in the min/max so callers need no second pass
+  void buildHuHistogram(const int16_t* voxels, size_t count, HuHistogram& out);
+
+  // Smallest HU with at least fraction of the voxels at or above floor_hu at or below it
+  int16_t huPercentile(const HuHistogram& histogram, double fraction, int16_t floor_hu = INT16_MIN);
+
+  void summarizeHistogram(const HuHistogram& histogram, HistogramStats& out);
+
+  // HU to the [0, 1] densities the grid and the window sliders use
+  inline float normalizedHu(const DicomMetadata& metadata, float hu) {
+    return (hu - metadata.min_value) / (metadata.max_value - metadata.min_value);
+  }
+
+} // namespace preprocessing
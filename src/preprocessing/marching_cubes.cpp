@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "preprocessing/marching_cubes.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  // Corner c of a cube sits at (c & 1, (c >> 1) & 1, (c >> 2) & 1)
+  // Edge e runs along axis e / 4 from corner EDGE_CORNERS[e][0]
+  constexpr int EDGE_CORNERS[12][2] = {
+    { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 },   // x
+    { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },   // y
+    { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 },   // z
+  };
+  constexpr int MAX_CASE_INDICES = 36;
+
+  struct CaseTable {
+    uint8_t count[256];                       // Number of indices, three per triangle
+    int8_t  edges[256][MAX_CASE_INDICES];
+  };
+
+  int edgeBetween(int a, int b) {
+    for (int e = 0; e < 12; e++) {
+      if ((EDGE_CORNERS[e][0] == a && EDGE_CORNERS[e][1] == b) || (EDGE_CORNERS[e][0] == b && EDGE_CORNERS[e][1] == a)) return e;
+    }
+    return -1;
+  }
+
+  // Built from the faces rather than typed in: on each face, walking its corners counter-clockwise
+  // from outside, a segment runs from every outside-to-inside crossing to the next inside-to-outside
+  // one. That always cuts off inside corners on ambiguous faces, and since both cubes sharing a face
+  // see the same corners the surface is watertight. Each crossing starts one segment and ends
+  // another, so the segments chain into closed loops that get fan triangulated.
+  CaseTable buildCaseTable() {
+    CaseTable table{};
+
+    int faces[6][4];
+    for (int axis = 0; axis < 3; axis++) {
+      int u = 1 << ((axis + 1) % 3), w = 1 << ((axis + 2) % 3), a = 1 << axis;
+      int ring[4] = { 0, u, u | w, w };
+      for (int side = 0; side < 2; side++) {
+        int* face = faces[axis * 2 + side];
+        for (int k = 0; k < 4; k++) face[k] = ring[side ? k : 3 - k] | (side ? a : 0);
+      }
+    }
+
+    // Bit f is set if the edge lies on face f
+    int edge_faces[12] = {};
+    for (int f = 0; f < 6; f++) {
+      for (int k = 0; k < 4; k++) edge_faces[edgeBetween(faces[f][k], faces[f][(k + 1) % 4])] |= 1 << f;
+    }
+
+    for (int config = 0; config < 256; config++) {
+      auto inside = [&](int c) { return (config >> c) & 1; };
+
+      int next[12];
+      std::fill(next, next + 12, -1);
+      for (const auto& face : faces) {
+        for (int k = 0; k < 4; k++) {
+          int a = face[k], b = face[(k + 1) % 4];
+          if (inside(a) || !inside(b)) continue;
+          for (int j = 1; j < 4; j++) {
+            int c = face[(k + j) % 4], d = face[(k + j + 1) % 4];
+            if (inside(c) && !inside(d)) {
+              next[edgeBetween(a, b)] = edgeBetween(c, d);
+              break;
+            }
+          }
+        }
+      }
+
+      int n = 0;
+      bool used[12] = {};
+      for (int start = 0; start < 12; start++) {
+        if (next[start] < 0 || used[start]) continue;
+        int loop[12], length = 0;
+        for (int e = start; !used[e]; e = next[e]) {
+          used[e] = true;
+          loop[length++] = e;
+        }
+        // Fan from a vertex whose diagonals stay off the cube faces, a diagonal lying in a face
+        // would overlap the neighbouring cube's triangles
+        int pivot = 0;
+        for (int r = 0; r < length; r++) {
+          bool clean = true;
+          for (int i = 2; i + 1 < length; i++) {
+            if (edge_faces[loop[r]] & edge_faces[loop[(r + i) % length]]) clean = false;
+          }
+          if (clean) {
+            pivot = r;
+            break;
+          }
+        }
+        for (int i = 1; i + 1 < length; i++) {
+          table.edges[config][n++] = int8_t(loop[pivot]);
+          table.edges[config][n++] = int8_t(loop[(pivot + i) % length]);
+          table.edges[config][n++] = int8_t(loop[(pivot + i + 1) % length]);
+        }
+      }
+      table.count[config] = uint8_t(n);
+    }
+    return table;
+  }
+
+  const CaseTable& caseTable() {
+    static const CaseTable table = buildCaseTable();
+    return table;
+  }
+
+  // Vertex index of every crossing edge in one plane of corners (x and y edges) or one layer
+  // between planes (z edges), -1 where the edge doesn't cross
+  struct PlaneEdges {
+    std::vector<int32_t> x, y;
+  };
+
+  struct SlabMesh {
+    Mesh mesh;
+    uint32_t bottom_count = 0;      // Leading vertices on the shared bottom plane
+    uint32_t top_begin = 0;         // Vertices on the shared top plane, in the same order as the
+    uint32_t top_count = 0;         // next slab's bottom plane
+  };
+
+  struct Extractor {
+    const VoxelGrid& grid;
+    const DicomMetadata& meta;
+    float iso;
+
+    float value(uint32_t x, uint32_t y, uint32_t z) const {
+      return grid.data[((size_t)z * grid.height + y) * grid.width + x];
+    }
+
+    float3 normalAt(uint32_t x, uint32_t y, uint32_t z) const {
+      const float4& n = grid.normals[((size_t)z * grid.height + y) * grid.width + x];
+      return make_float3(n.x, n.y, n.z);
+    }
+
+    // Crossing on the edge from (x, y, z) one voxel along axis
+    uint32_t addVertex(Mesh& mesh, uint32_t x, uint32_t y, uint32_t z, int axis) const {
+      uint32_t x1 = x + (axis == 0), y1 = y + (axis == 1), z1 = z + (axis == 2);
+      float v0 = value(x, y, z), v1 = value(x1, y1, z1);
+      float t = std::clamp((iso - v0) / (v1 - v0), 0.f, 1.f);
+
+      float3 p = make_float3(x + t * (x1 - x), y + t * (y1 - y), z + t * (z1 - z));
+      mesh.positions.push_back(make_float3(meta.origin_x + p.x * meta.spacing_x,
+                                           meta.origin_y + p.y * meta.spacing_y,
+                                           meta.origin_z + p.z * meta.spacing_z));
+
+      // Stored normals are in voxel space, dividing by spacing takes them to patient space
+      float3 n0 = normalAt(x, y, z), n1 = normalAt(x1, y1, z1);
+      float3 n = make_float3((n0.x + t * (n1.x - n0.x)) / meta.spacing_x,
+                             (n0.y + t * (n1.y - n0.y)) / meta.spacing_y,
+                             (n0.z + t * (n1.z - n0.z)) / meta.spacing_z);
+      float len = std::sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+      mesh.normals.push_back(len > 1e-12f ? make_float3(n.x / len, n.y / len, n.z / len) : make_float3(0.f, 0.f, 0.f));
+
+      return uint32_t(mesh.positions.size() - 1);
+    }
+
+    bool crosses(float a, float b) const { return (a >= iso) != (b >= iso); }
+
+    void fillPlane(Mesh& mesh, uint32_t z, PlaneEdges& plane) const {
+      const uint32_t w = grid.width, h = grid.height;
+      plane.x.assign((size_t)w * h, -1);
+      plane.y.assign((size_t)w * h, -1);
+      for (uint32_t y = 0; y < h; y++) {
+        for (uint32_t x = 0; x < w; x++) {
+          float v = value(x, y, z);
+          if (x + 1 < w && crosses(v, value(x + 1, y, z))) plane.x[(size_t)y * w + x] = int32_t(addVertex(mesh, x, y, z, 0));
+          if (y + 1 < h && crosses(v, value(x, y + 1, z))) plane.y[(size_t)y * w + x] = int32_t(addVertex(mesh, x, y, z, 1));
+        }
+      }
+    }
+
+    void fillLayer(Mesh& mesh, uint32_t z, std::vector<int32_t>& layer) const {
+      const uint32_t w = grid.width, h = grid.height;
+      layer.assign((size_t)w * h, -1);
+      for (uint32_t y = 0; y < h; y++) {
+        for (uint32_t x = 0; x < w; x++) {
+          if (crosses(value(x, y, z), value(x, y, z + 1))) layer[(size_t)y * w + x] = int32_t(addVertex(mesh, x, y, z, 2));
+        }
+      }
+    }
+
+    // Cubes between corner planes z0 and z1, vertices on both planes are emitted so the slab
+    // stands alone, the bottom plane is merged with the previous slab's top plane afterwards
+    void extractSlab(uint32_t z0, uint32_t z1, SlabMesh& out) const {
+      const uint32_t w = grid.width, h = grid.height;
+      const CaseTable& table = caseTable();
+      Mesh& mesh = out.mesh;
+
+      PlaneEdges lower, upper;
+      std::vector<int32_t> layer;
+      fillPlane(mesh, z0, lower);
+      out.bottom_count = uint32_t(mesh.positions.size());
+
+      for (uint32_t z = z0; z < z1; z++) {
+        fillLayer(mesh, z, layer);
+        if (z + 1 == z1) out.top_begin = uint32_t(mesh.positions.size());
+        fillPlane(mesh, z + 1, upper);
+
+        for (uint32_t y = 0; y + 1 < h; y++) {
+          for (uint32_t x = 0; x + 1 < w; x++) {
+            int config = 0;
+            for (int c = 0; c < 8; c++) {
+              if (value(x + (c & 1), y + ((c >> 1) & 1), z + ((c >> 2) & 1)) >= iso) config |= 1 << c;
+            }
+            if (config == 0 || config == 255) continue;
+
+            // Edge order matches EDGE_CORNERS
+            const size_t i = (size_t)y * w + x;
+            const int32_t edge_vertex[12] = {
+              lower.x[i], lower.x[i + w], upper.x[i], upper.x[i + w],
+              lower.y[i], lower.y[i + 1], upper.y[i], upper.y[i + 1],
+              layer[i],   layer[i + 1],   layer[i + w], layer[i + w + 1],
+            };
+            for (int k = 0; k < table.count[config]; k++) {
+              mesh.indices.push_back(uint32_t(edge_vertex[table.edges[config][k]]));
+            }
+          }
+        }
+        std::swap(lower, upper);
+      }
+      out.top_count = uint32_t(mesh.positions.size()) - out.top_begin;
+    }
+  };
+}
+
+void extractIsosurface(const VoxelGrid& grid, const DicomMetadata& metadata, float hu_threshold, Mesh& out) {
+  out = Mesh{};
+  if (grid.width < 2 || grid.height < 2 || grid.depth < 2) return;
+
+  float hu_range = std::max(metadata.max_value - metadata.min_value, 1.f);
+  Extractor extractor{ grid, metadata, (hu_threshold - metadata.min_value) / hu_range };
+
+  // One slab of cube layers per worker
+  const uint32_t layers = grid.depth - 1;
+  const uint32_t slab_count = std::min<uint32_t>(workerCount(), layers);
+  const uint32_t per_slab = (layers + slab_count - 1) / slab_count;
+  std::vector<SlabMesh> slabs((layers + per_slab - 1) / per_slab);
+
+  parallelFor(0, slabs.size(), [&](size_t begin, size_t end) {
+    for (size_t s = begin; s < end; s++) {
+      uint32_t z0 = uint32_t(s) * per_slab;
+      extractor.extractSlab(z0, std::min(z0 + per_slab, layers), slabs[s]);
+    }
+  });
+
+  // Drop each slab's bottom plane in favour of the previous slab's identical top plane
+  std::vector<uint32_t> base(slabs.size());
+  size_t vertex_count = 0, index_count = 0;
+  for (size_t s = 0; s < slabs.size(); s++) {
+    uint32_t dropped = s > 0 ? slabs[s].bottom_count : 0;
+    base[s] = uint32_t(vertex_count) - dropped;
+    vertex_count += slabs[s].mesh.positions.size() - dropped;
+    index_count += slabs[s].mesh.indices.size();
+  }
+  out.positions.resize(vertex_count);
+  out.normals.resize(vertex_count);
+  out.indices.resize(index_count);
+
+  std::vector<size_t> index_base(slabs.size(), 0);
+  for (size_t s = 1; s < slabs.size(); s++) index_base[s] = index_base[s - 1] + slabs[s - 1].mesh.indices.size();
+
+  parallelFor(0, slabs.size(), [&](size_t begin, size_t end) {
+    for (size_t s = begin; s < end; s++) {
+      const SlabMesh& slab = slabs[s];
+      uint32_t dropped = s > 0 ? slab.bottom_count : 0;
+      std::copy(slab.mesh.positions.begin() + dropped, slab.mesh.positions.end(), out.positions.begin() + base[s] + dropped);
+      std::copy(slab.mesh.normals.begin() + dropped, slab.mesh.normals.end(), out.normals.begin() + base[s] + dropped);
+
+      uint32_t shared = s > 0 ? base[s - 1] + slabs[s - 1].top_begin : 0;
+      uint32_t* dst = out.indices.data() + index_base[s];
+      for (uint32_t index : slab.mesh.indices) {
+        *dst++ = index < dropped ? shared + index : base[s] + index;
+      }
+    }
+  });
+}
+
+} // namespace preprocessing
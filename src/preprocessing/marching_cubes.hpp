@@ -0,0 +1,25 @@
+// preprocessing/marching_cubes.hpp
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <vector_types.h>
+
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // Indexed triangle mesh in patient space (millimetres, DICOM origin and spacing applied)
+  // Triangles wind counter-clockwise seen from the low density side
+  struct Mesh {
+    std::vector<float3> positions;
+    std::vector<float3> normals;
+    std::vector<uint32_t> indices;
+  };
+
+  // Isosurface of the grid at a Hounsfield value, metadata maps HU onto the normalized densities
+  // Runs one slab of slices per thread, vertices are shared through edge-indexed lookups so every
+  // edge crossing appears exactly once. Vertex normals come from grid.normals.
+  void extractIsosurface(const VoxelGrid& grid, const DicomMetadata& metadata, float hu_threshold, Mesh& out);
+
+} // namespace preprocessing
@@ -0,0 +1,110 @@
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "preprocessing/mesh_export.hpp"
+
+namespace preprocessing {
+
+namespace {
+  bool hasExtension(const std::string& path, const char* ext) {
+    size_t n = std::strlen(ext);
+    if (path.size() < n) return false;
+    for (size_t i = 0; i < n; i++) {
+      if (std::tolower(static_cast<unsigned char>(path[path.size() - n + i])) != ext[i]) return false;
+    }
+    return true;
+  }
+
+  template <typename T>
+  void put(std::vector<char>& out, const T& value) {
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+  }
+}
+
+bool writeStl(const std::string& path, const Mesh& mesh) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    printf("Failed to open %s for writing\n", path.c_str());
+    return false;
+  }
+
+  char header[80] = "VoxRay isosurface";
+  uint32_t triangles = uint32_t(mesh.indices.size() / 3);
+  out.write(header, sizeof(header));
+  out.write(reinterpret_cast<const char*>(&triangles), sizeof(triangles));
+
+  // 50 bytes per facet, buffered so the stream isn't hit per float
+  std::vector<char> facets;
+  facets.reserve(size_t(triangles) * 50);
+  for (uint32_t t = 0; t < triangles; t++) {
+    const float3& a = mesh.positions[mesh.indices[t * 3 + 0]];
+    const float3& b = mesh.positions[mesh.indices[t * 3 + 1]];
+    const float3& c = mesh.positions[mesh.indices[t * 3 + 2]];
+
+    float ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+    float vx = c.x - a.x, vy = c.y - a.y, vz = c.z - a.z;
+    float nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+    float len = std::sqrt(nx * nx + ny * ny + nz * nz);
+    if (len > 0.f) { nx /= len; ny /= len; nz /= len; }
+
+    put(facets, make_float3(nx, ny, nz));
+    put(facets, a);
+    put(facets, b);
+    put(facets, c);
+    put(facets, uint16_t(0));
+  }
+  out.write(facets.data(), std::streamsize(facets.size()));
+
+  out.close();
+  return !out.fail();
+}
+
+bool writePly(const std::string& path, const Mesh& mesh) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    printf("Failed to open %s for writing\n", path.c_str());
+    return false;
+  }
+
+  uint32_t triangles = uint32_t(mesh.indices.size() / 3);
+  out << "ply\n"
+      << "format binary_little_endian 1.0\n"
+      << "comment VoxRay isosurface, millimetres\n"
+      << "element vertex " << mesh.positions.size() << "\n"
+      << "property float x\nproperty float y\nproperty float z\n"
+      << "property float nx\nproperty float ny\nproperty float nz\n"
+      << "element face " << triangles << "\n"
+      << "property list uchar uint vertex_indices\n"
+      << "end_header\n";
+
+  std::vector<char> body;
+  body.reserve(mesh.positions.size() * 24 + size_t(triangles) * 13);
+  for (size_t i = 0; i < mesh.positions.size(); i++) {
+    put(body, mesh.positions[i]);
+    put(body, mesh.normals[i]);
+  }
+  for (uint32_t t = 0; t < triangles; t++) {
+    put(body, uint8_t(3));
+    put(body, mesh.indices[t * 3 + 0]);
+    put(body, mesh.indices[t * 3 + 1]);
+    put(body, mesh.indices[t * 3 + 2]);
+  }
+  out.write(body.data(), std::streamsize(body.size()));
+
+  out.close();
+  return !out.fail();
+}
+
+bool writeMesh(const std::string& path, const Mesh& mesh) {
+  if (hasExtension(path, ".stl")) return writeStl(path, mesh);
+  if (hasExtension(path, ".ply")) return writePly(path, mesh);
+  printf("Unknown mesh format for %s, expected .stl or .ply\n", path.c_str());
+  return false;
+}
+
+} // namespace preprocessing
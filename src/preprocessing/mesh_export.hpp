@@ -0,0 +1,16 @@
+// preprocessing/mesh_export.hpp
+#pragma once
+#include <string>
+
+#include "preprocessing/marching_cubes.hpp"
+
+namespace preprocessing {
+
+  // Binary STL, facet normals from the triangle winding
+  bool writeStl(const std::string& path, const Mesh& mesh);
+  // Binary little-endian PLY with per-vertex normals
+  bool writePly(const std::string& path, const Mesh& mesh);
+  // Picks the format from the extension (.stl or .ply)
+  bool writeMesh(const std::string& path, const Mesh& mesh);
+
+} // namespace preprocessing
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "preprocessing/minmax_octree.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  constexpr size_t OCTREE_HEADER_BYTES = (2 + OCTREE_MAX_LEVELS) * 4 * sizeof(uint32_t);
+
+  uint32_t halfUp(uint32_t v) { return (v + 1) / 2; }
+
+  // Leaf bounds over its voxels plus one voxel on every side, clamped to the grid
+  void buildLeaves(const VoxelGrid& grid, MinMaxOctree& tree) {
+    const OctreeLevel& leaves = tree.levels[0];
+    const uint32_t s = tree.leaf_size;
+
+    parallelFor(0, leaves.depth, [&](size_t z_begin, size_t z_end) {
+      for (uint32_t lz = uint32_t(z_begin); lz < z_end; lz++) {
+        uint32_t z0 = lz * s > 0 ? lz * s - 1 : 0;
+        uint32_t z1 = std::min(lz * s + s + 1, grid.depth);
+        for (uint32_t ly = 0; ly < leaves.height; ly++) {
+          uint32_t y0 = ly * s > 0 ? ly * s - 1 : 0;
+          uint32_t y1 = std::min(ly * s + s + 1, grid.height);
+          for (uint32_t lx = 0; lx < leaves.width; lx++) {
+            uint32_t x0 = lx * s > 0 ? lx * s - 1 : 0;
+            uint32_t x1 = std::min(lx * s + s + 1, grid.width);
+
+            float lo = grid.at(x0, y0, z0);
+            float hi = lo;
+            for (uint32_t z = z0; z < z1; z++) {
+              for (uint32_t y = y0; y < y1; y++) {
+                const float* row = &grid.at(0, y, z);
+                for (uint32_t x = x0; x < x1; x++) {
+                  lo = std::min(lo, row[x]);
+                  hi = std::max(hi, row[x]);
+                }
+              }
+            }
+            tree.nodes[leaves.offset + ((size_t)lz * leaves.height + ly) * leaves.width + lx] = make_float2(lo, hi);
+          }
+        }
+      }
+    });
+  }
+
+  void buildLevel(MinMaxOctree& tree, uint32_t level) {
+    const OctreeLevel& child = tree.levels[level - 1];
+    const OctreeLevel& parent = tree.levels[level];
+
+    parallelFor(0, parent.depth, [&](size_t z_begin, size_t z_end) {
+      for (uint32_t pz = uint32_t(z_begin); pz < z_end; pz++) {
+        for (uint32_t py = 0; py < parent.height; py++) {
+          for (uint32_t px = 0; px < parent.width; px++) {
+            float2 bounds = octreeNode(tree, level - 1, px * 2, py * 2, pz * 2);
+            for (uint32_t cz = pz * 2; cz < std::min(pz * 2 + 2, child.depth); cz++) {
+              for (uint32_t cy = py * 2; cy < std::min(py * 2 + 2, child.height); cy++) {
+                for (uint32_t cx = px * 2; cx < std::min(px * 2 + 2, child.width); cx++) {
+                  float2 c = octreeNode(tree, level - 1, cx, cy, cz);
+                  bounds.x = std::min(bounds.x, c.x);
+                  bounds.y = std::max(bounds.y, c.y);
+                }
+              }
+            }
+            tree.nodes[parent.offset + ((size_t)pz * parent.height + py) * parent.width + px] = bounds;
+          }
+        }
+      }
+    });
+  }
+}
+
+void buildMinMaxOctree(const VoxelGrid& grid, MinMaxOctree& out) {
+  out = MinMaxOctree{};
+  out.width  = grid.width;
+  out.height = grid.height;
+  out.depth  = grid.depth;
+  if (grid.data.empty()) return;
+
+  // Lay out every level up front so nodes is allocated once
+  uint32_t w = (grid.width  + out.leaf_size - 1) / out.leaf_size;
+  uint32_t h = (grid.height + out.leaf_size - 1) / out.leaf_size;
+  uint32_t d = (grid.depth  + out.leaf_size - 1) / out.leaf_size;
+  uint32_t offset = 0;
+  while (true) {
+    out.levels.push_back({ w, h, d, offset });
+    offset += w * h * d;
+    if ((w == 1 && h == 1 && d == 1) || out.levels.size() == OCTREE_MAX_LEVELS) break;
+    w = halfUp(w); h = halfUp(h); d = halfUp(d);
+  }
+  out.nodes.resize(offset);
+
+  buildLeaves(grid, out);
+  for (uint32_t level = 1; level < out.levels.size(); level++) buildLevel(out, level);
+}
+
+RangeClass classifyPoint(const MinMaxOctree& tree, uint32_t x, uint32_t y, uint32_t z, float lo, float hi, uint32_t& level) {
+  uint32_t lx = x / tree.leaf_size, ly = y / tree.leaf_size, lz = z / tree.leaf_size;
+  for (int l = int(tree.levels.size()) - 1; l >= 0; l--) {
+    RangeClass c = classifyRange(octreeNode(tree, l, lx >> l, ly >> l, lz >> l), lo, hi);
+    if (c != RangeClass::MIXED) {
+      level = uint32_t(l);
+      return c;
+    }
+  }
+  level = 0;
+  return RangeClass::MIXED;
+}
+
+RangeClass classifyRegion(const MinMaxOctree& tree, uint32_t x0, uint32_t y0, uint32_t z0,
+                          uint32_t x1, uint32_t y1, uint32_t z1, float lo, float hi) {
+  if (tree.levels.empty() || x1 <= x0 || y1 <= y0 || z1 <= z0) return RangeClass::EMPTY;
+
+  // Leaf coordinates of the first and last voxel
+  uint32_t s = tree.leaf_size;
+  uint32_t ax = x0 / s, ay = y0 / s, az = z0 / s;
+  uint32_t bx = (std::min(x1, tree.width) - 1) / s;
+  uint32_t by = (std::min(y1, tree.height) - 1) / s;
+  uint32_t bz = (std::min(z1, tree.depth) - 1) / s;
+
+  uint32_t level = 0;
+  while (level + 1 < tree.levels.size() &&
+         ((bx >> level) - (ax >> level) > 1 || (by >> level) - (ay >> level) > 1 || (bz >> level) - (az >> level) > 1)) {
+    level++;
+  }
+
+  RangeClass result = RangeClass::MIXED;
+  bool first = true;
+  for (uint32_t z = az >> level; z <= bz >> level; z++) {
+    for (uint32_t y = ay >> level; y <= by >> level; y++) {
+      for (uint32_t x = ax >> level; x <= bx >> level; x++) {
+        RangeClass c = classifyRange(octreeNode(tree, level, x, y, z), lo, hi);
+        if (c == RangeClass::MIXED || (!first && c != result)) return RangeClass::MIXED;
+        result = c;
+        first = false;
+      }
+    }
+  }
+  return result;
+}
+
+void serializeOctree(const MinMaxOctree& tree, std::vector<uint8_t>& out) {
+  uint32_t header[(2 + OCTREE_MAX_LEVELS) * 4] = {};
+  header[0] = tree.width;
+  header[1] = tree.height;
+  header[2] = tree.depth;
+  header[3] = tree.leaf_size;
+  header[4] = uint32_t(tree.levels.size());
+  for (size_t l = 0; l < tree.levels.size(); l++) {
+    const OctreeLevel& level = tree.levels[l];
+    uint32_t* dst = header + (2 + l) * 4;
+    dst[0] = level.width;
+    dst[1] = level.height;
+    dst[2] = level.depth;
+    dst[3] = level.offset;
+  }
+
+  out.resize(OCTREE_HEADER_BYTES + tree.nodes.size() * sizeof(float2));
+  std::memcpy(out.data(), header, OCTREE_HEADER_BYTES);
+  std::memcpy(out.data() + OCTREE_HEADER_BYTES, tree.nodes.data(), tree.nodes.size() * sizeof(float2));
+}
+
+bool deserializeOctree(const uint8_t* data, size_t size, MinMaxOctree& out) {
+  if (size < OCTREE_HEADER_BYTES) return false;
+
+  uint32_t header[(2 + OCTREE_MAX_LEVELS) * 4];
+  std::memcpy(header, data, OCTREE_HEADER_BYTES);
+  if (header[4] == 0 || header[4] > OCTREE_MAX_LEVELS || header[3] == 0) {
+    printf("Invalid octree header\n");
+    return false;
+  }
+
+  out = MinMaxOctree{};
+  out.width     = header[0];
+  out.height    = header[1];
+  out.depth     = header[2];
+  out.leaf_size = header[3];
+  for (uint32_t l = 0; l < header[4]; l++) {
+    const uint32_t* src = header + (2 + l) * 4;
+    out.levels.push_back({ src[0], src[1], src[2], src[3] });
+  }
+
+  const OctreeLevel& top = out.levels.back();
+  size_t node_count = top.offset + (size_t)top.width * top.height * top.depth;
+  if (size != OCTREE_HEADER_BYTES + node_count * sizeof(float2)) {
+    printf("Octree buffer size mismatch\n");
+    return false;
+  }
+
+  out.nodes.resize(node_count);
+  std::memcpy(out.nodes.data(), data + OCTREE_HEADER_BYTES, node_count * sizeof(float2));
+  return true;
+}
+
+} // namespace preprocessing
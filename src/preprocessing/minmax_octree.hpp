@@ -0,0 +1,67 @@
+// preprocessing/minmax_octree.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <vector_types.h>
+
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  constexpr uint32_t OCTREE_LEAF_SIZE  = 8;
+  constexpr uint32_t OCTREE_MAX_LEVELS = 16;   // Matches the levels array in compute.glsl
+
+  enum class RangeClass : uint8_t {
+    EMPTY,    // Every sample is at or below lo
+    FULL,     // Every sample is at or above hi
+    MIXED
+  };
+
+  struct OctreeLevel {
+    uint32_t width, height, depth;
+    uint32_t offset;          // First node of this level in MinMaxOctree::nodes
+  };
+
+  // Density min/max over a hierarchy of boxes. Level 0 holds OCTREE_LEAF_SIZE^3 voxel leaves,
+  // each level above halves the resolution down to a single root. Leaves include a one voxel
+  // apron so trilinear samples taken anywhere inside a node stay within its bounds.
+  // Nothing here depends on the window, so slider drags only change the lo/hi passed to queries.
+  struct MinMaxOctree {
+    uint32_t width = 0, height = 0, depth = 0;
+    uint32_t leaf_size = OCTREE_LEAF_SIZE;
+    std::vector<OctreeLevel> levels;
+    std::vector<float2> nodes;      // x = min, y = max
+  };
+
+  void buildMinMaxOctree(const VoxelGrid& grid, MinMaxOctree& out);
+
+  inline RangeClass classifyRange(float2 node, float lo, float hi) {
+    if (node.y <= lo) return RangeClass::EMPTY;
+    if (node.x >= hi) return RangeClass::FULL;
+    return RangeClass::MIXED;
+  }
+
+  inline float2 octreeNode(const MinMaxOctree& tree, uint32_t level, uint32_t x, uint32_t y, uint32_t z) {
+    const OctreeLevel& l = tree.levels[level];
+    return tree.nodes[l.offset + ((size_t)z * l.height + y) * l.width + x];
+  }
+
+  // Walks down from the root to the coarsest node containing voxel (x, y, z) that is entirely
+  // EMPTY or FULL, level is set to that node's level. MIXED with level 0 if even the leaf straddles.
+  RangeClass classifyPoint(const MinMaxOctree& tree, uint32_t x, uint32_t y, uint32_t z, float lo, float hi, uint32_t& level);
+
+  // Classifies the voxel box [x0, x1) x [y0, y1) x [z0, z1) from the finest level where it spans
+  // at most two nodes per axis. Conservative: EMPTY and FULL are exact, MIXED may not be.
+  RangeClass classifyRegion(const MinMaxOctree& tree, uint32_t x0, uint32_t y0, uint32_t z0,
+                            uint32_t x1, uint32_t y1, uint32_t z1, float lo, float hi);
+
+  // Flat layout matching the std430 minmax_octree block in compute.glsl:
+  //   uvec4 dims (width, height, depth, leaf_size)
+  //   uvec4 info (level_count, 0, 0, 0)
+  //   uvec4 levels[OCTREE_MAX_LEVELS] (width, height, depth, offset)
+  //   vec2  nodes[]
+  void serializeOctree(const MinMaxOctree& tree, std::vector<uint8_t>& out);
+  bool deserializeOctree(const uint8_t* data, size_t size, MinMaxOctree& out);
+
+} // namespace preprocessing
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <bit>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXRAY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "preprocessing/morphology.hpp"
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+namespace {
+  enum class Combine { OR, AND };
+
+  // Bits of the last word in a row that lie past width
+  uint64_t paddingBits(const BitMask& mask) {
+    uint32_t used = mask.width & 63;
+    return used ? ~0ull << used : 0ull;
+  }
+
+  void setPadding(BitMask& mask, bool value) {
+    uint64_t pad = paddingBits(mask);
+    if (!pad) return;
+    size_t rows = (size_t)mask.height * mask.depth;
+    for (size_t r = 0; r < rows; r++) {
+      uint64_t& last = mask.bits[(r + 1) * mask.row_words - 1];
+      last = value ? last | pad : last & ~pad;
+    }
+  }
+
+  // Word i of the row shifted towards higher x by shift bits, words off either end read as fill
+  uint64_t shiftedUp(const uint64_t* row, int64_t words, int64_t i, uint32_t shift, uint64_t fill) {
+    int64_t q = shift >> 6;
+    uint32_t b = shift & 63;
+    auto word = [&](int64_t j) { return j >= 0 && j < words ? row[j] : fill; };
+    if (b == 0) return word(i - q);
+    return (word(i - q) << b) | (word(i - q - 1) >> (64 - b));
+  }
+
+  uint64_t shiftedDown(const uint64_t* row, int64_t words, int64_t i, uint32_t shift, uint64_t fill) {
+    int64_t q = shift >> 6;
+    uint32_t b = shift & 63;
+    auto word = [&](int64_t j) { return j >= 0 && j < words ? row[j] : fill; };
+    if (b == 0) return word(i + q);
+    return (word(i + q) >> b) | (word(i + q + 1) << (64 - b));
+  }
+
+  // dst = src combined with src shifted by +-step voxels along axis (0 = x, 1 = y, 2 = z)
+  void axisStep(const BitMask& src, BitMask& dst, int axis, uint32_t step, Combine op) {
+    const uint64_t fill = op == Combine::AND ? ~0ull : 0ull;
+    const int64_t words = src.row_words;
+
+    parallelFor(0, src.depth, [&](size_t z0, size_t z1) {
+      for (uint32_t z = uint32_t(z0); z < z1; z++) {
+        for (uint32_t y = 0; y < src.height; y++) {
+          const uint64_t* in = src.row(y, z);
+          uint64_t* out = dst.row(y, z);
+
+          if (axis == 0) {
+            for (int64_t i = 0; i < words; i++) {
+              uint64_t a = shiftedUp(in, words, i, step, fill);
+              uint64_t b = shiftedDown(in, words, i, step, fill);
+              out[i] = op == Combine::OR ? in[i] | a | b : in[i] & a & b;
+            }
+            continue;
+          }
+
+          // Neighbour rows step voxels away along y or z, rows past the edge are all fill
+          uint32_t pos = axis == 1 ? y : z;
+          uint32_t len = axis == 1 ? src.height : src.depth;
+          const uint64_t* lo = nullptr;
+          const uint64_t* hi = nullptr;
+          if (pos >= step) lo = axis == 1 ? src.row(y - step, z) : src.row(y, z - step);
+          if (pos + step < len) hi = axis == 1 ? src.row(y + step, z) : src.row(y, z + step);
+
+          for (int64_t i = 0; i < words; i++) {
+            uint64_t a = lo ? lo[i] : fill;
+            uint64_t b = hi ? hi[i] : fill;
+            out[i] = op == Combine::OR ? in[i] | a | b : in[i] & a & b;
+          }
+        }
+      }
+    });
+  }
+
+  // Each step doubles the covered span, so a radius takes about log2(radius) passes per axis
+  void boxFilter(const BitMask& in, uint32_t radius, Combine op, BitMask& out) {
+    BitMask a = in;
+    BitMask b = in;
+    setPadding(a, op == Combine::AND);
+
+    for (int axis = 0; axis < 3; axis++) {
+      uint32_t covered = 0;
+      while (covered < radius) {
+        uint32_t step = std::min(covered + 1, radius - covered);
+        axisStep(a, b, axis, step, op);
+        std::swap(a, b);
+        covered += step;
+      }
+    }
+
+    setPadding(a, false);
+    out = std::move(a);
+  }
+
+  uint64_t reverseBits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    v = ((v >> 8) & 0x00FF00FF00FF00FFull) | ((v & 0x00FF00FF00FF00FFull) << 8);
+    v = ((v >> 16) & 0x0000FFFF0000FFFFull) | ((v & 0x0000FFFF0000FFFFull) << 16);
+    return (v >> 32) | (v << 32);
+  }
+
+  // Grows seed along the runs of open it touches, in both directions along x. Adding the seed
+  // to open carries it up through each run, and the carry out of a word seeds the next word.
+  void fillRow(uint64_t* seed, const uint64_t* open, uint32_t words) {
+    uint64_t carry = 0;
+    for (uint32_t i = 0; i < words; i++) {
+      uint64_t s = (seed[i] | (carry & open[i])) & open[i];
+      uint64_t sum = open[i] + s;
+      seed[i] = ((sum ^ open[i]) | s) & open[i];
+      carry = sum < open[i] ? 1 : 0;
+    }
+
+    // Same again downwards, with the bits reversed so the carry runs towards lower x
+    carry = 0;
+    for (uint32_t i = words; i-- > 0;) {
+      uint64_t m = reverseBits(open[i]);
+      uint64_t s = (reverseBits(seed[i]) | carry) & m;
+      uint64_t sum = m + s;
+      seed[i] = reverseBits(((sum ^ m) | s) & m);
+      carry = sum < m ? 1 : 0;
+    }
+  }
+
+  // Pulls reached in from the row before it along y or z and refills it, true if it grew
+  bool spreadRow(uint64_t* reached, const uint64_t* from, const uint64_t* open, uint32_t words) {
+    bool grew = false;
+    if (from) {
+      for (uint32_t i = 0; i < words; i++) {
+        uint64_t add = from[i] & open[i] & ~reached[i];
+        if (add) {
+          reached[i] |= add;
+          grew = true;
+        }
+      }
+    }
+    if (!grew) return false;
+    fillRow(reached, open, words);
+    return true;
+  }
+
+  // Forward and backward sweeps over slices [z0, z1) until nothing more is reached,
+  // only looks at rows inside the slab so slabs can sweep on their own threads
+  bool sweepSlab(BitMask& reached, const BitMask& open, uint32_t z0, uint32_t z1) {
+    bool any = false;
+    bool grew = true;
+    while (grew) {
+      grew = false;
+      for (uint32_t z = z0; z < z1; z++) {
+        for (uint32_t y = 0; y < open.height; y++) {
+          uint64_t* row = reached.row(y, z);
+          if (y > 0) grew |= spreadRow(row, reached.row(y - 1, z), open.row(y, z), open.row_words);
+          if (z > z0) grew |= spreadRow(row, reached.row(y, z - 1), open.row(y, z), open.row_words);
+        }
+      }
+      for (uint32_t z = z1; z-- > z0;) {
+        for (uint32_t y = open.height; y-- > 0;) {
+          uint64_t* row = reached.row(y, z);
+          if (y + 1 < open.height) grew |= spreadRow(row, reached.row(y + 1, z), open.row(y, z), open.row_words);
+          if (z + 1 < z1) grew |= spreadRow(row, reached.row(y, z + 1), open.row(y, z), open.row_words);
+        }
+      }
+      any |= grew;
+    }
+    return any;
+  }
+}
+
+void makeMask(uint32_t width, uint32_t height, uint32_t depth, BitMask& out) {
+  out.width = width;
+  out.height = height;
+  out.depth = depth;
+  out.row_words = (width + 63) / 64;
+  out.bits.assign((size_t)out.row_words * height * depth, 0ull);
+}
+
+uint64_t countVoxels(const BitMask& mask) {
+  uint64_t count = 0;
+  for (uint64_t word : mask.bits) count += std::popcount(word);
+  return count;
+}
+
+void thresholdMask(const VoxelGrid& grid, float lo, float hi, BitMask& out) {
+  makeMask(grid.width, grid.height, grid.depth, out);
+
+  parallelFor(0, grid.depth, [&](size_t z0, size_t z1) {
+    for (uint32_t z = uint32_t(z0); z < z1; z++) {
+      for (uint32_t y = 0; y < grid.height; y++) {
+        const float* src = &grid.data[((size_t)z * grid.height + y) * grid.width];
+        uint64_t* dst = out.row(y, z);
+
+        uint32_t x = 0;
+#ifdef VOXRAY_SSE2
+        // Four compares per movemask, sixteen of them fill a word
+        const __m128 lo4 = _mm_set1_ps(lo);
+        const __m128 hi4 = _mm_set1_ps(hi);
+        for (; x + 4 <= grid.width; x += 4) {
+          __m128 v = _mm_loadu_ps(src + x);
+          __m128 inside = _mm_and_ps(_mm_cmpge_ps(v, lo4), _mm_cmple_ps(v, hi4));
+          dst[x >> 6] |= uint64_t(_mm_movemask_ps(inside)) << (x & 63);
+        }
+#endif
+        for (; x < grid.width; x++) {
+          if (src[x] >= lo && src[x] <= hi) dst[x >> 6] |= 1ull << (x & 63);
+        }
+      }
+    }
+  });
+}
+
+void dilateMask(const BitMask& in, uint32_t radius, BitMask& out) {
+  boxFilter(in, radius, Combine::OR, out);
+}
+
+void erodeMask(const BitMask& in, uint32_t radius, BitMask& out) {
+  boxFilter(in, radius, Combine::AND, out);
+}
+
+void openMask(const BitMask& in, uint32_t radius, BitMask& out) {
+  erodeMask(in, radius, out);
+  dilateMask(out, radius, out);
+}
+
+void closeMask(const BitMask& in, uint32_t radius, BitMask& out) {
+  dilateMask(in, radius, out);
+  erodeMask(out, radius, out);
+}
+
+void fillHoles(const BitMask& in, BitMask& out) {
+  // Background, with the padding left closed so nothing is reached through it
+  BitMask open = in;
+  for (uint64_t& word : open.bits) word = ~word;
+  setPadding(open, false);
+
+  // Seeds are the background voxels on the six faces
+  BitMask reached;
+  makeMask(in.width, in.height, in.depth, reached);
+  for (uint32_t z = 0; z < in.depth; z++) {
+    for (uint32_t y = 0; y < in.height; y++) {
+      uint64_t* row = reached.row(y, z);
+      const uint64_t* free = open.row(y, z);
+      if (z == 0 || z + 1 == in.depth || y == 0 || y + 1 == in.height) {
+        std::copy(free, free + in.row_words, row);
+      } else if (in.row_words) {
+        row[0] |= free[0] & 1ull;
+        uint32_t last = in.width - 1;
+        row[last >> 6] |= free[last >> 6] & (1ull << (last & 63));
+        fillRow(row, free, in.row_words);
+      }
+    }
+  }
+
+  // Same slab split parallelFor uses, slabs sweep in parallel then trade across their boundaries
+  uint32_t slab_count = std::max(1u, std::min<uint32_t>(workerCount(), in.depth));
+  uint32_t slab_depth = std::max(1u, (in.depth + slab_count - 1) / slab_count);
+  slab_count = (in.depth + slab_depth - 1) / slab_depth;
+
+  bool grew = true;
+  while (grew) {
+    parallelFor(0, slab_count, [&](size_t begin, size_t end) {
+      for (size_t s = begin; s < end; s++) {
+        uint32_t z0 = uint32_t(s) * slab_depth;
+        sweepSlab(reached, open, z0, std::min(in.depth, z0 + slab_depth));
+      }
+    });
+
+    grew = false;
+    for (uint32_t s = 1; s < slab_count; s++) {
+      uint32_t z = s * slab_depth;
+      for (uint32_t y = 0; y < in.height; y++) {
+        grew |= spreadRow(reached.row(y, z), reached.row(y, z - 1), open.row(y, z), in.row_words);
+        grew |= spreadRow(reached.row(y, z - 1), reached.row(y, z), open.row(y, z - 1), in.row_words);
+      }
+    }
+  }
+
+  // Whatever the outside never reached is either foreground or an enclosed hole
+  for (uint64_t& word : reached.bits) word = ~word;
+  setPadding(reached, false);
+  out = std::move(reached);
+}
+
+} // namespace preprocessing
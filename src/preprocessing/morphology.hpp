@@ -0,0 +1,52 @@
+// preprocessing/morphology.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  // One bit per voxel, x is bit x & 63 of word x >> 6 in its row. Rows are padded to whole
+  // words and the padding is kept clear, so masks can be compared and counted a word at a time.
+  struct BitMask {
+    uint32_t width = 0, height = 0, depth = 0;
+    uint32_t row_words = 0;
+    std::vector<uint64_t> bits;
+
+    uint64_t* row(uint32_t y, uint32_t z) {
+      return &bits[((size_t)z * height + y) * row_words];
+    }
+
+    const uint64_t* row(uint32_t y, uint32_t z) const {
+      return &bits[((size_t)z * height + y) * row_words];
+    }
+
+    bool at(uint32_t x, uint32_t y, uint32_t z) const {
+      return (row(y, z)[x >> 6] >> (x & 63)) & 1;
+    }
+  };
+
+  // Cleared mask of the given size
+  void makeMask(uint32_t width, uint32_t height, uint32_t depth, BitMask& out);
+  uint64_t countVoxels(const BitMask& mask);
+
+  // Voxels with lo <= density <= hi
+  void thresholdMask(const VoxelGrid& grid, float lo, float hi, BitMask& out);
+
+  // Cube structuring element of side 2 * radius + 1, run as separable passes along x, y and z
+  // that each take log2(radius) shift-and-combine steps over whole words, one slab per thread.
+  // Dilation sees outside the volume as background, erosion sees it as foreground so objects
+  // touching the edge of the scan aren't eaten away. in and out may be the same mask.
+  void dilateMask(const BitMask& in, uint32_t radius, BitMask& out);
+  void erodeMask(const BitMask& in, uint32_t radius, BitMask& out);
+  // Removes specks and thin bridges narrower than the element
+  void openMask(const BitMask& in, uint32_t radius, BitMask& out);
+  // Closes gaps and notches narrower than the element
+  void closeMask(const BitMask& in, uint32_t radius, BitMask& out);
+
+  // Background that isn't 6-connected to a face of the volume becomes foreground
+  void fillHoles(const BitMask& in, BitMask& out);
+
+} // namespace preprocessing
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "preprocessing/paged_volume.hpp"
+
+namespace preprocessing {
+
+namespace {
+  size_t brickBytes(const PagedVolume& volume) {
+    return brickVoxels(volume.header) * sizeof(float);
+  }
+
+  BrickRef loadBrick(const PagedVolume& volume, std::ifstream& in, std::vector<uint8_t>& payload, uint32_t index) {
+    auto brick = std::make_shared<Brick>();
+    brick->data.resize(brickVoxels(volume.header));
+
+    // Decoding happens here on the loading thread, so a miss costs one read plus an unpack
+    if (!readBrickPayload(in, volume.header, volume.offsets, index, payload) ||
+        !decodeBrick(volume.header, payload, brick->data.data())) {
+      printf("Failed to read brick %u from %s\n", index, volume.path.c_str());
+      in.clear();
+      return nullptr;
+    }
+    return brick;
+  }
+
+  BrickRef findResident(PagedVolume& volume, uint32_t index) {
+    std::lock_guard<std::mutex> lock(volume.cache_mutex);
+    auto it = volume.resident.find(index);
+    if (it == volume.resident.end()) return nullptr;
+
+    volume.lru.splice(volume.lru.begin(), volume.lru, it->second.lru_it);
+    return it->second.brick;
+  }
+
+  // Returns the resident copy if another thread won the race to load the same brick
+  BrickRef insertResident(PagedVolume& volume, uint32_t index, BrickRef brick) {
+    std::lock_guard<std::mutex> lock(volume.cache_mutex);
+    auto it = volume.resident.find(index);
+    if (it != volume.resident.end()) {
+      volume.lru.splice(volume.lru.begin(), volume.lru, it->second.lru_it);
+      return it->second.brick;
+    }
+
+    volume.lru.push_front(index);
+    volume.resident.emplace(index, PagedVolume::Entry{ brick, volume.lru.begin() });
+    volume.resident_bytes += brickBytes(volume);
+
+    // Evict least recently used, always keep the brick that was just inserted
+    while (volume.resident_bytes > volume.config.memory_budget && volume.lru.size() > 1) {
+      uint32_t victim = volume.lru.back();
+      volume.lru.pop_back();
+      volume.resident.erase(victim);
+      volume.resident_bytes -= brickBytes(volume);
+    }
+
+    return brick;
+  }
+
+  void prefetchWorker(PagedVolume* volume) {
+    std::ifstream in(volume->path, std::ios::binary);
+    std::vector<uint8_t> scratch;
+
+    while (true) {
+      uint32_t index = 0;
+      {
+        std::unique_lock<std::mutex> lock(volume->queue_mutex);
+        volume->queue_cv.wait(lock, [&] {
+          return volume->stopping || !volume->queue.empty() || !volume->frustum.empty();
+        });
+        if (volume->stopping) return;
+
+        if (!volume->queue.empty()) {
+          index = volume->queue.front();
+          volume->queue.pop_front();
+          volume->queued.erase(index);
+        } else {
+          index = volume->frustum.front();
+          volume->frustum.pop_front();
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(volume->cache_mutex);
+        if (volume->resident.count(index)) continue;
+      }
+
+      BrickRef brick = loadBrick(*volume, in, scratch, index);
+      if (brick) {
+        insertResident(*volume, index, std::move(brick));
+        volume->loaded++;
+      }
+    }
+  }
+}
+
+PagedVolume::~PagedVolume() {
+  closePagedVolume(*this);
+}
+
+bool openPagedVolume(const std::string& path, const PagedVolumeConfig& config, PagedVolume& out) {
+  out.sync_in.open(path, std::ios::binary);
+  if (!out.sync_in) {
+    printf("Failed to open brick file: %s\n", path.c_str());
+    return false;
+  }
+  if (!readBrickFileHeader(out.sync_in, out.header, out.offsets)) return false;
+
+  out.path = path;
+  out.config = config;
+  out.stopping = false;
+
+  for (uint32_t i = 0; i < config.prefetch_threads; i++) {
+    out.workers.emplace_back(prefetchWorker, &out);
+  }
+
+  printf("Opened brick file %s: %ux%ux%u, %u bricks of %u^3\n", path.c_str(),
+         out.header.width, out.header.height, out.header.depth, brickCount(out.header), out.header.brick_size);
+  return true;
+}
+
+void closePagedVolume(PagedVolume& volume) {
+  {
+    std::lock_guard<std::mutex> lock(volume.queue_mutex);
+    volume.stopping = true;
+    volume.queue.clear();
+    volume.queued.clear();
+    volume.frustum.clear();
+  }
+  volume.queue_cv.notify_all();
+  for (auto& worker : volume.workers) worker.join();
+  volume.workers.clear();
+
+  std::lock_guard<std::mutex> lock(volume.cache_mutex);
+  volume.resident.clear();
+  volume.lru.clear();
+  volume.resident_bytes = 0;
+}
+
+BrickRef acquireBrick(PagedVolume& volume, uint32_t bx, uint32_t by, uint32_t bz) {
+  uint32_t index = brickIndex(volume.header, bx, by, bz);
+  if (BrickRef brick = findResident(volume, index)) {
+    volume.hits++;
+    return brick;
+  }
+
+  volume.misses++;
+  BrickRef brick;
+  {
+    std::lock_guard<std::mutex> lock(volume.sync_mutex);
+    thread_local std::vector<uint8_t> scratch;
+    brick = loadBrick(volume, volume.sync_in, scratch, index);
+  }
+  if (!brick) return nullptr;
+  return insertResident(volume, index, std::move(brick));
+}
+
+BrickRef tryAcquireBrick(PagedVolume& volume, uint32_t bx, uint32_t by, uint32_t bz) {
+  return findResident(volume, brickIndex(volume.header, bx, by, bz));
+}
+
+void requestBricks(PagedVolume& volume, const std::vector<uint32_t>& indices) {
+  {
+    std::lock_guard<std::mutex> lock(volume.queue_mutex);
+    for (uint32_t index : indices) {
+      if (volume.queued.insert(index).second) volume.queue.push_back(index);
+    }
+  }
+  volume.queue_cv.notify_all();
+}
+
+void prefetchFrustum(PagedVolume& volume, const glm::mat4& clip_from_volume) {
+  const BrickFileHeader& h = volume.header;
+  glm::vec3 extent = glm::vec3(float(h.brick_size)) / glm::vec3(float(h.width), float(h.height), float(h.depth));
+
+  struct Candidate { uint32_t index; float depth; };
+  std::vector<Candidate> candidates;
+
+  for (uint32_t bz = 0; bz < h.bricks_z; bz++) {
+    for (uint32_t by = 0; by < h.bricks_y; by++) {
+      for (uint32_t bx = 0; bx < h.bricks_x; bx++) {
+        glm::vec3 lo = glm::vec3(float(bx), float(by), float(bz)) * extent;
+        glm::vec3 hi = glm::min(lo + extent, glm::vec3(1.f));
+
+        // Culled if all 8 corners are outside the same clip plane
+        int outside = 0x3f;
+        for (int c = 0; c < 8; c++) {
+          glm::vec3 corner((c & 1) ? hi.x : lo.x, (c & 2) ? hi.y : lo.y, (c & 4) ? hi.z : lo.z);
+          glm::vec4 p = clip_from_volume * glm::vec4(corner, 1.f);
+          int mask = 0;
+          if (p.x < -p.w) mask |= 1;
+          if (p.x >  p.w) mask |= 2;
+          if (p.y < -p.w) mask |= 4;
+          if (p.y >  p.w) mask |= 8;
+          if (p.z < -p.w) mask |= 16;
+          if (p.z >  p.w) mask |= 32;
+          outside &= mask;
+        }
+        if (outside) continue;
+
+        glm::vec4 center = clip_from_volume * glm::vec4((lo + hi) * 0.5f, 1.f);
+        candidates.push_back({ brickIndex(h, bx, by, bz), center.w });
+      }
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.depth < b.depth; });
+
+  // Anything past half the budget would start evicting what slices and regions asked for
+  size_t max_bricks = std::max<size_t>(1, volume.config.memory_budget / brickBytes(volume) / 2);
+  if (candidates.size() > max_bricks) candidates.resize(max_bricks);
+
+  {
+    std::lock_guard<std::mutex> lock(volume.queue_mutex);
+    volume.frustum.clear();
+    for (const Candidate& c : candidates) volume.frustum.push_back(c.index);
+  }
+  volume.queue_cv.notify_all();
+}
+
+bool buildRegion(PagedVolume& volume, const CropBox& box, uint32_t max_dim, VoxelGrid& grid, DicomMetadata& metadata) {
+  const BrickFileHeader& h = volume.header;
+  const uint32_t size[3] = { box.max[0] - box.min[0], box.max[1] - box.min[1], box.max[2] - box.min[2] };
+  uint32_t largest = std::max({ size[0], size[1], size[2] });
+  uint32_t factor  = std::max(1u, (largest + max_dim - 1) / max_dim);
+
+  uint32_t ow = (size[0] + factor - 1) / factor;
+  uint32_t oh = (size[1] + factor - 1) / factor;
+  uint32_t od = (size[2] + factor - 1) / factor;
+  grid = VoxelGrid(ow, oh, od);
+  // Cells accumulate every source voxel that lands in them
+  grid.data.fill(0.f);
+
+  const uint32_t bs = h.brick_size;
+  uint32_t first[3], last[3];
+  for (int a = 0; a < 3; a++) {
+    first[a] = box.min[a] / bs;
+    last[a]  = (box.max[a] - 1) / bs;
+  }
+
+  for (uint32_t bz = first[2]; bz <= last[2]; bz++) {
+    // Keep the prefetch threads one slab ahead of the accumulation
+    if (bz < last[2]) {
+      std::vector<uint32_t> next;
+      for (uint32_t by = first[1]; by <= last[1]; by++) {
+        for (uint32_t bx = first[0]; bx <= last[0]; bx++) next.push_back(brickIndex(h, bx, by, bz + 1));
+      }
+      requestBricks(volume, next);
+    }
+
+    for (uint32_t by = first[1]; by <= last[1]; by++) {
+      for (uint32_t bx = first[0]; bx <= last[0]; bx++) {
+        BrickRef brick = acquireBrick(volume, bx, by, bz);
+        if (!brick) return false;
+
+        // Voxels of this brick inside the box
+        uint32_t x_begin = std::max(box.min[0], bx * bs), x_end = std::min(box.max[0], (bx + 1) * bs);
+        uint32_t y_begin = std::max(box.min[1], by * bs), y_end = std::min(box.max[1], (by + 1) * bs);
+        uint32_t z_begin = std::max(box.min[2], bz * bs), z_end = std::min(box.max[2], (bz + 1) * bs);
+
+        for (uint32_t z = z_begin; z < z_end; z++) {
+          uint32_t oz = (z - box.min[2]) / factor;
+          for (uint32_t y = y_begin; y < y_end; y++) {
+            uint32_t oy = (y - box.min[1]) / factor;
+            const float* src = brick->data.data() + ((size_t)(z - bz * bs) * bs + (y - by * bs)) * bs;
+            for (uint32_t x = x_begin; x < x_end; x++) {
+              grid.at((x - box.min[0]) / factor, oy, oz) += src[x - bx * bs];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Divide by the number of source voxels that landed in each cell, smaller on the far edges
+  auto extent = [&](uint32_t o, uint32_t size) { return float(std::min(factor, size - o * factor)); };
+  for (uint32_t z = 0; z < od; z++) {
+    for (uint32_t y = 0; y < oh; y++) {
+      for (uint32_t x = 0; x < ow; x++) {
+        grid.at(x, y, z) /= extent(x, size[0]) * extent(y, size[1]) * extent(z, size[2]);
+      }
+    }
+  }
+
+  // Each cell sits at the centre of the full voxels it averages
+  float shift = 0.5f * float(factor - 1);
+  metadata = metadataFromHeader(h);
+  metadata.width     = ow;
+  metadata.height    = oh;
+  metadata.depth     = od;
+  metadata.origin_x += (box.min[0] + shift) * h.spacing_x;
+  metadata.origin_y += (box.min[1] + shift) * h.spacing_y;
+  metadata.origin_z += (box.min[2] + shift) * h.spacing_z;
+  metadata.spacing_x *= float(factor);
+  metadata.spacing_y *= float(factor);
+  metadata.spacing_z *= float(factor);
+
+  printf("Built %ux%ux%u region (1/%u) of paged volume\n", ow, oh, od, factor);
+  return true;
+}
+
+bool buildOverview(PagedVolume& volume, uint32_t max_dim, VoxelGrid& grid, DicomMetadata& metadata) {
+  const BrickFileHeader& h = volume.header;
+  CropBox whole{ { 0, 0, 0 }, { h.width, h.height, h.depth } };
+  return buildRegion(volume, whole, max_dim, grid, metadata);
+}
+
+CropBox regionBox(const PagedVolume& volume, const DicomMetadata& shown, const CropRegion& region) {
+  const BrickFileHeader& h = volume.header;
+  const CropBox local = cropBox(shown, region);
+  const float shown_origin[3]  = { shown.origin_x, shown.origin_y, shown.origin_z };
+  const float shown_spacing[3] = { shown.spacing_x, shown.spacing_y, shown.spacing_z };
+  const float origin[3]  = { h.origin_x, h.origin_y, h.origin_z };
+  const float spacing[3] = { h.spacing_x, h.spacing_y, h.spacing_z };
+  const uint32_t size[3] = { h.width, h.height, h.depth };
+
+  // Voxel faces in millimetres, then back into full resolution voxels
+  CropBox box;
+  for (int a = 0; a < 3; a++) {
+    float lo = shown_origin[a] + (float(local.min[a]) - 0.5f) * shown_spacing[a];
+    float hi = shown_origin[a] + (float(local.max[a]) - 0.5f) * shown_spacing[a];
+    float v_lo = (lo - origin[a]) / spacing[a] + 0.5f;
+    float v_hi = (hi - origin[a]) / spacing[a] + 0.5f;
+    box.min[a] = uint32_t(std::clamp(std::floor(v_lo), 0.f, float(size[a] - 1)));
+    box.max[a] = std::clamp(uint32_t(std::max(std::ceil(v_hi), 0.f)), box.min[a] + 1, size[a]);
+  }
+  return box;
+}
+
+} // namespace preprocessing
@@ -0,0 +1,104 @@
+// preprocessing/paged_volume.hpp
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "preprocessing/brick_file.hpp"
+#include "preprocessing/crop.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  struct PagedVolumeConfig {
+    size_t   memory_budget    = size_t(2) << 30;  // Bytes of decoded bricks kept resident
+    uint32_t prefetch_threads = 2;
+  };
+
+  // Decoded brick, densities normalized to [0, 1] the same way importDicomSeries() does
+  struct Brick {
+    std::vector<float> data;
+  };
+  using BrickRef = std::shared_ptr<const Brick>;
+
+  // Volume backed by a brick file on disk
+  // Bricks are decoded on demand and kept in an LRU cache bounded by memory_budget.
+  // Handed out bricks are reference counted, so eviction never frees a brick still in use.
+  struct PagedVolume {
+    std::string path;
+    BrickFileHeader header{};
+    std::vector<uint64_t> offsets;
+    PagedVolumeConfig config;
+
+    // --- Cache ---
+    struct Entry {
+      BrickRef brick;
+      std::list<uint32_t>::iterator lru_it;
+    };
+    std::mutex cache_mutex;
+    std::unordered_map<uint32_t, Entry> resident;
+    std::list<uint32_t> lru;                    // Front is most recently used
+    size_t resident_bytes = 0;
+
+    // --- Prefetch ---
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<uint32_t> queue;                 // Explicit requests, always served first
+    std::unordered_set<uint32_t> queued;
+    std::deque<uint32_t> frustum;               // What the camera sees, replaced as it moves
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    // Stream used by synchronous loads on the calling thread
+    std::mutex sync_mutex;
+    std::ifstream sync_in;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> loaded{0};            // Bricks made resident by the prefetch threads
+
+    PagedVolume() = default;
+    PagedVolume(const PagedVolume&) = delete;
+    PagedVolume& operator=(const PagedVolume&) = delete;
+    ~PagedVolume();
+  };
+
+  bool openPagedVolume(const std::string& path, const PagedVolumeConfig& config, PagedVolume& out);
+  void closePagedVolume(PagedVolume& volume);
+
+  // Blocks and loads the brick on a miss
+  BrickRef acquireBrick(PagedVolume& volume, uint32_t bx, uint32_t by, uint32_t bz);
+  // Never blocks, returns nullptr if the brick is not resident yet
+  BrickRef tryAcquireBrick(PagedVolume& volume, uint32_t bx, uint32_t by, uint32_t bz);
+
+  // Queues bricks for the prefetch threads; earlier entries are loaded first
+  void requestBricks(PagedVolume& volume, const std::vector<uint32_t>& indices);
+  // Replaces the frustum queue with the bricks inside the view frustum, nearest first, up to half
+  // the budget so the bricks explicitly requested aren't evicted by it. Loaded after requestBricks().
+  // clip_from_volume maps normalized volume coordinates [0, 1]^3 to clip space
+  void prefetchFrustum(PagedVolume& volume, const glm::mat4& clip_from_volume);
+
+  // Box-filtered copy of the voxels in box whose largest dimension is at most max_dim, so a box
+  // no larger than that comes out at full resolution. Streams through the bricks it touches once,
+  // so it works for volumes far larger than the budget. Voxels keep their patient positions.
+  bool buildRegion(PagedVolume& volume, const CropBox& box, uint32_t max_dim, VoxelGrid& grid, DicomMetadata& metadata);
+  // buildRegion() of the whole volume
+  bool buildOverview(PagedVolume& volume, uint32_t max_dim, VoxelGrid& grid, DicomMetadata& metadata);
+
+  // Full resolution box of a crop region of shown, a series built from this volume (its overview
+  // or an earlier region), matched through patient positions
+  CropBox regionBox(const PagedVolume& volume, const DicomMetadata& shown, const CropRegion& region);
+
+} // namespace preprocessing
@@ -0,0 +1,42 @@
+// preprocessing/parallel.hpp
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace preprocessing {
+
+  // Caps workerCount() for the whole process, 0 leaves it at the hardware thread count. Processes
+  // sharing the machine with siblings, like sort-last workers, set it to their share of the cores.
+  inline unsigned worker_limit = 0;
+
+  inline unsigned workerCount() {
+    unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    return worker_limit ? std::min(worker_limit, hardware) : hardware;
+  }
+
+  // Splits [begin, end) into one contiguous range per worker and calls fn(range_begin, range_end)
+  // The calling thread takes the first range, so small inputs don't pay for a thread launch
+  template <typename Fn>
+  void parallelFor(size_t begin, size_t end, Fn&& fn) {
+    if (end <= begin) return;
+
+    size_t count   = end - begin;
+    size_t workers = std::min<size_t>(workerCount(), count);
+    size_t chunk   = (count + workers - 1) / workers;
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (size_t w = 1; w < workers; w++) {
+      size_t b = begin + w * chunk;
+      size_t e = std::min(end, b + chunk);
+      if (b >= e) break;
+      threads.emplace_back([&fn, b, e] { fn(b, e); });
+    }
+
+    fn(begin, std::min(end, begin + chunk));
+    for (auto& t : threads) t.join();
+  }
+
+} // namespace preprocessing
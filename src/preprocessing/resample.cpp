@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "preprocessing/parallel.hpp"
+#include "preprocessing/resample.hpp"
+
+namespace preprocessing {
+
+namespace {
+  constexpr float PI = 3.14159265358979f;
+
+  // Source taps of every output sample along one axis, taps[first[i] .. first[i + 1]) belong to sample i
+  struct AxisTaps {
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> index;
+    std::vector<float> weight;
+  };
+
+  float sinc(float x) {
+    if (std::fabs(x) < 1e-6f) return 1.f;
+    x *= PI;
+    return std::sin(x) / x;
+  }
+
+  float kernel(ResampleFilter filter, float x) {
+    x = std::fabs(x);
+    if (filter == ResampleFilter::LINEAR) return std::max(0.f, 1.f - x);
+    return x < 3.f ? sinc(x) * sinc(x / 3.f) : 0.f;
+  }
+
+  float kernelRadius(ResampleFilter filter) {
+    return filter == ResampleFilter::LINEAR ? 1.f : 3.f;
+  }
+
+  // Output sample i sits at (i + 0.5) * out_spacing from the start of the volume, positions
+  // past either end clamp to the edge voxel
+  void buildTaps(uint32_t in_size, uint32_t out_size, ResampleFilter filter, AxisTaps& taps) {
+    float ratio  = float(in_size) / float(out_size);
+    float widen  = std::max(1.f, ratio);
+    float radius = kernelRadius(filter) * widen;
+
+    taps.first.assign(1, 0);
+    taps.index.clear();
+    taps.weight.clear();
+    for (uint32_t i = 0; i < out_size; i++) {
+      float center = (i + 0.5f) * ratio - 0.5f;
+      int lo = int(std::ceil(center - radius));
+      int hi = int(std::floor(center + radius));
+
+      size_t start = taps.weight.size();
+      float sum = 0.f;
+      for (int s = lo; s <= hi; s++) {
+        float w = kernel(filter, (s - center) / widen);
+        if (w == 0.f) continue;
+        uint32_t clamped = uint32_t(std::clamp(s, 0, int(in_size) - 1));
+        // Clamped taps pile onto the edge voxel, merge them so edges cost no extra reads
+        if (taps.index.size() > start && taps.index.back() == clamped) taps.weight.back() += w;
+        else {
+          taps.index.push_back(clamped);
+          taps.weight.push_back(w);
+        }
+        sum += w;
+      }
+      for (size_t t = start; t < taps.weight.size(); t++) taps.weight[t] /= sum;
+      taps.first.push_back(uint32_t(taps.weight.size()));
+    }
+  }
+
+  // Filters along one axis of a [depth][height][width] float volume. out holds out_dims worth
+  // of voxels and every one is written, so it can be uninitialized.
+  // Output slices are independent, so threads split the outer z range
+  void filterAxis(const float* in, const uint32_t in_dims[3], int axis, const AxisTaps& taps,
+                  float* out, const uint32_t out_dims[3]) {
+    const size_t in_row   = in_dims[0];
+    const size_t in_slice = in_row * in_dims[1];
+
+    parallelFor(0, out_dims[2], [&](size_t z_begin, size_t z_end) {
+      for (size_t z = z_begin; z < z_end; z++) {
+        for (uint32_t y = 0; y < out_dims[1]; y++) {
+          float* dst = &out[(z * out_dims[1] + y) * out_dims[0]];
+
+          if (axis == 0) {
+            const float* src = &in[z * in_slice + y * in_row];
+            for (uint32_t x = 0; x < out_dims[0]; x++) {
+              float sum = 0.f;
+              for (uint32_t t = taps.first[x]; t < taps.first[x + 1]; t++) sum += taps.weight[t] * src[taps.index[t]];
+              dst[x] = sum;
+            }
+            continue;
+          }
+
+          // Whole rows at a time along y and z, so the inner loop runs over contiguous x
+          std::fill(dst, dst + out_dims[0], 0.f);
+          uint32_t i = axis == 1 ? y : uint32_t(z);
+          for (uint32_t t = taps.first[i]; t < taps.first[i + 1]; t++) {
+            const float* src = axis == 1 ? &in[z * in_slice + taps.index[t] * in_row]
+                                         : &in[taps.index[t] * in_slice + y * in_row];
+            float w = taps.weight[t];
+            for (uint32_t x = 0; x < out_dims[0]; x++) dst[x] += w * src[x];
+          }
+        }
+      }
+    });
+  }
+}
+
+void resampleSize(const DicomMetadata& metadata, const ResampleSettings& settings,
+                  uint32_t size[3], float spacing[3]) {
+  const int dims[3] = { metadata.width, metadata.height, metadata.depth };
+  const float in_spacing[3] = { metadata.spacing_x, metadata.spacing_y, metadata.spacing_z };
+
+  float target = settings.spacing_mm > 0.f ? settings.spacing_mm
+                                           : std::min({ in_spacing[0], in_spacing[1], in_spacing[2] });
+  float extent[3];
+  for (int a = 0; a < 3; a++) extent[a] = dims[a] * in_spacing[a];
+
+  auto fit = [&](float s) {
+    for (int a = 0; a < 3; a++) size[a] = std::max(1u, uint32_t(std::lround(extent[a] / s)));
+    return (size_t)size[0] * size[1] * size[2];
+  };
+
+  size_t voxels = fit(target);
+  if (settings.max_voxels > 0) {
+    // Voxel count scales with the cube of spacing, rounding can leave it a little over
+    while (voxels > settings.max_voxels) {
+      target *= std::max(1.001f, std::cbrt(float(voxels) / float(settings.max_voxels)));
+      voxels = fit(target);
+    }
+  }
+
+  for (int a = 0; a < 3; a++) spacing[a] = extent[a] / size[a];
+}
+
+bool isResampled(const DicomMetadata& metadata, const ResampleSettings& settings) {
+  uint32_t size[3];
+  float spacing[3];
+  resampleSize(metadata, settings, size, spacing);
+  return size[0] == uint32_t(metadata.width) && size[1] == uint32_t(metadata.height) && size[2] == uint32_t(metadata.depth);
+}
+
+void resampleGrid(const VoxelGrid& grid, const DicomMetadata& metadata, const ResampleSettings& settings,
+                  VoxelGrid& out, DicomMetadata& out_metadata) {
+  uint32_t size[3];
+  float spacing[3];
+  resampleSize(metadata, settings, size, spacing);
+
+  // Shrinking axes go first so the later passes touch fewer voxels
+  uint32_t in_dims[3] = { grid.width, grid.height, grid.depth };
+  int order[3] = { 0, 1, 2 };
+  std::sort(order, order + 3, [&](int a, int b) { return float(size[a]) / in_dims[a] < float(size[b]) / in_dims[b]; });
+
+  int passes = 0;
+  for (int a = 0; a < 3; a++) passes += size[a] != in_dims[a];
+
+  // The first pass reads the grid and the last writes the output, only the ones in between
+  // need scratch
+  out = VoxelGrid(size[0], size[1], size[2]);
+  if (passes == 0) std::copy(grid.data.begin(), grid.data.end(), out.data.begin());
+
+  std::vector<float> scratch[2];
+  const float* current = grid.data.data();
+  uint32_t dims[3] = { in_dims[0], in_dims[1], in_dims[2] };
+  AxisTaps taps;
+  for (int axis : order) {
+    if (size[axis] == in_dims[axis]) continue;
+    buildTaps(in_dims[axis], size[axis], settings.filter, taps);
+    uint32_t next_dims[3] = { dims[0], dims[1], dims[2] };
+    next_dims[axis] = size[axis];
+
+    float* next = out.data.data();
+    if (--passes > 0) {
+      std::vector<float>& buffer = scratch[passes & 1];
+      buffer.resize((size_t)next_dims[0] * next_dims[1] * next_dims[2]);
+      next = buffer.data();
+    }
+    filterAxis(current, dims, axis, taps, next, next_dims);
+    current = next;
+    std::copy(next_dims, next_dims + 3, dims);
+  }
+
+  // Lanczos overshoots at hard edges, densities stay normalized
+  if (settings.filter == ResampleFilter::LANCZOS3) {
+    parallelFor(0, out.data.size(), [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) out.data[i] = std::clamp(out.data[i], 0.f, 1.f);
+    });
+  }
+
+  out_metadata = metadata;
+  out_metadata.width     = int(size[0]);
+  out_metadata.height    = int(size[1]);
+  out_metadata.depth     = int(size[2]);
+  out_metadata.origin_x += 0.5f * (spacing[0] - metadata.spacing_x);
+  out_metadata.origin_y += 0.5f * (spacing[1] - metadata.spacing_y);
+  out_metadata.origin_z += 0.5f * (spacing[2] - metadata.spacing_z);
+  out_metadata.spacing_x = spacing[0];
+  out_metadata.spacing_y = spacing[1];
+  out_metadata.spacing_z = spacing[2];
+}
+
+} // namespace preprocessing
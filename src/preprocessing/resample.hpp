@@ -0,0 +1,39 @@
+// preprocessing/resample.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/voxel_grid.hpp"
+
+namespace preprocessing {
+
+  enum class ResampleFilter {
+    LINEAR,       // Tent, two taps when upsampling
+    LANCZOS3      // Windowed sinc, sharper but rings slightly at hard edges
+  };
+
+  // Either target can be left at 0. With both set the coarser result wins.
+  struct ResampleSettings {
+    float spacing_mm  = 0.f;    // Isotropic spacing, 0 uses the finest input spacing
+    size_t max_voxels = 0;      // Spacing grows until the volume fits, 0 for no budget
+    ResampleFilter filter = ResampleFilter::LINEAR;
+    bool enabled = false;
+  };
+
+  // Output size and spacing for the settings, each axis gets extent / spacing voxels rounded
+  // so its spacing is within half a voxel of isotropic
+  void resampleSize(const DicomMetadata& metadata, const ResampleSettings& settings,
+                    uint32_t size[3], float spacing[3]);
+
+  // Already at the size resampleSize() would give
+  bool isResampled(const DicomMetadata& metadata, const ResampleSettings& settings);
+
+  // Resamples the densities to the settings' spacing keeping the physical extent, one separable
+  // pass per axis with precomputed taps and each pass split into slabs across threads. Filters
+  // widen when downsampling so they also antialias. Origin is moved to the new first voxel
+  // centre, normals are left for computeGradientKernel().
+  void resampleGrid(const VoxelGrid& grid, const DicomMetadata& metadata, const ResampleSettings& settings,
+                    VoxelGrid& out, DicomMetadata& out_metadata);
+
+} // namespace preprocessing
@@ -0,0 +1,68 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "preprocessing/volume_buffer.hpp"
+
+namespace preprocessing {
+
+namespace {
+  size_t roundUp(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+  }
+
+  bool onHugePages(size_t bytes) {
+    return bytes >= HUGE_PAGE_SIZE;
+  }
+}
+
+void* allocateVolumeMemory(size_t bytes) {
+  if (bytes == 0) return nullptr;
+  if (!onHugePages(bytes)) {
+    void* memory = std::aligned_alloc(VOLUME_ALIGNMENT, roundUp(bytes, VOLUME_ALIGNMENT));
+    if (!memory) throw std::bad_alloc();
+    return memory;
+  }
+
+  // mmap only promises base page alignment, so one huge page more is mapped and the ends
+  // trimmed back to huge page boundaries the kernel can back with whole huge pages
+  size_t size = roundUp(bytes, HUGE_PAGE_SIZE);
+  void* mapped = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED) throw std::bad_alloc();
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+  uintptr_t aligned = roundUp(start, HUGE_PAGE_SIZE);
+  if (aligned > start) munmap(mapped, aligned - start);
+  uintptr_t tail = aligned + size;
+  if (start + size + HUGE_PAGE_SIZE > tail) munmap(reinterpret_cast<void*>(tail), start + size + HUGE_PAGE_SIZE - tail);
+
+  void* memory = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+  // Only advice, without transparent huge pages the mapping still works on base pages
+  madvise(memory, size, MADV_HUGEPAGE);
+#endif
+  return memory;
+}
+
+void freeVolumeMemory(void* memory, size_t bytes) {
+  if (!memory) return;
+  if (onHugePages(bytes)) munmap(memory, roundUp(bytes, HUGE_PAGE_SIZE));
+  else std::free(memory);
+}
+
+void firstTouch(void* memory, size_t bytes) {
+  // Smaller buffers are a handful of pages, faulting them in isn't worth a thread launch
+  if (!memory || !onHugePages(bytes)) return;
+
+  // Every base page is touched, huge pages may not be available for the whole range
+  const size_t page = size_t(sysconf(_SC_PAGESIZE));
+  char* base = static_cast<char*>(memory);
+  parallelFor(0, roundUp(bytes, page) / page, [base, page](size_t begin, size_t end) {
+    for (size_t p = begin; p < end; p++) base[p * page] = 0;
+  });
+}
+
+} // namespace preprocessing
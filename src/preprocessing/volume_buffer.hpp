@@ -0,0 +1,124 @@
+// preprocessing/volume_buffer.hpp
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+#include "preprocessing/parallel.hpp"
+
+namespace preprocessing {
+
+  // Buffers at least this big are mapped on transparent huge pages, smaller ones are aligned to
+  // a cache line
+  constexpr size_t HUGE_PAGE_SIZE   = size_t(2) << 20;
+  constexpr size_t VOLUME_ALIGNMENT = 64;
+
+  // Uninitialized memory aligned as above, freed with the size it was allocated with.
+  // Throws std::bad_alloc like operator new.
+  void* allocateVolumeMemory(size_t bytes);
+  void freeVolumeMemory(void* memory, size_t bytes);
+
+  // Writes every page of a fresh buffer from parallelFor()'s workers, so a large volume faults
+  // in on all cores instead of one. Linux places a page on the NUMA node of the thread that
+  // first writes it, and the slab passes split volumes the same way, so they mostly read local
+  // memory. Threads aren't pinned, so this is a tendency rather than a guarantee.
+  void firstTouch(void* memory, size_t bytes);
+
+  // Storage for volume sized arrays. Unlike std::vector nothing is zero-filled, a new buffer
+  // or the part resize() adds holds whatever the pages held, so only make one when every
+  // element is going to be written anyway. Large copies run on all cores.
+  template <typename T>
+  struct VolumeBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "Volume elements are copied as bytes");
+
+    T* elements = nullptr;
+    size_t count = 0;
+
+    VolumeBuffer() = default;
+    explicit VolumeBuffer(size_t n) { allocate(n); }
+
+    VolumeBuffer(const VolumeBuffer& other) {
+      allocate(other.count);
+      copyElements(other.elements, elements, count);
+    }
+
+    VolumeBuffer(VolumeBuffer&& other) noexcept : elements(other.elements), count(other.count) {
+      other.elements = nullptr;
+      other.count = 0;
+    }
+
+    VolumeBuffer& operator=(const VolumeBuffer& other) {
+      if (this != &other) {
+        VolumeBuffer copy(other);
+        *this = static_cast<VolumeBuffer&&>(copy);
+      }
+      return *this;
+    }
+
+    VolumeBuffer& operator=(VolumeBuffer&& other) noexcept {
+      if (this != &other) {
+        release();
+        elements = other.elements;
+        count = other.count;
+        other.elements = nullptr;
+        other.count = 0;
+      }
+      return *this;
+    }
+
+    ~VolumeBuffer() { release(); }
+
+    T* data() { return elements; }
+    const T* data() const { return elements; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T* begin() { return elements; }
+    T* end() { return elements + count; }
+    const T* begin() const { return elements; }
+    const T* end() const { return elements + count; }
+
+    T& operator[](size_t i) { return elements[i]; }
+    const T& operator[](size_t i) const { return elements[i]; }
+
+    // Keeps the first min(size(), n) elements, the rest are uninitialized
+    void resize(size_t n) {
+      if (n == count) return;
+      VolumeBuffer resized(n);
+      copyElements(elements, resized.elements, n < count ? n : count);
+      *this = static_cast<VolumeBuffer&&>(resized);
+    }
+
+    void clear() { release(); }
+
+    void fill(const T& value) {
+      T* to = elements;
+      parallelFor(0, count, [to, &value](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) to[i] = value;
+      });
+    }
+
+    void allocate(size_t n) {
+      elements = static_cast<T*>(allocateVolumeMemory(n * sizeof(T)));
+      count = n;
+      firstTouch(elements, n * sizeof(T));
+    }
+
+    void release() {
+      freeVolumeMemory(elements, count * sizeof(T));
+      elements = nullptr;
+      count = 0;
+    }
+
+    static void copyElements(const T* from, T* to, size_t n) {
+      if (n * sizeof(T) < HUGE_PAGE_SIZE) {
+        if (n) std::memcpy(to, from, n * sizeof(T));
+        return;
+      }
+      parallelFor(0, n, [from, to](size_t begin, size_t end) {
+        std::memcpy(to + begin, from + begin, (end - begin) * sizeof(T));
+      });
+    }
+  };
+
+} // namespace preprocessing
@@ -1,26 +1,25 @@
 // preprocessing/voxel_grid.hpp
 #pragma once
-#include <vector>
 #include <vector_types.h>
 #include <cstdint>
 
+#include "preprocessing/volume_buffer.hpp"
+
 namespace preprocessing {
 
   // Voxel grid data structure
   // Just handles a single source of data like density
   struct VoxelGrid {
-    std::vector<float> data;
-    std::vector<float4> normals;
+    VolumeBuffer<float> data;
+    VolumeBuffer<float4> normals;     // Empty until computeGradientKernel() fills it
     uint32_t width;
     uint32_t height;
     uint32_t depth;
 
     VoxelGrid() : width(0), height(0), depth(0) {}
 
-    VoxelGrid(uint32_t w, uint32_t h, uint32_t d) : width(w), height(h), depth(d) {
-      data.resize(w * h * d, 0.f);
-      normals.resize(w * h * d);
-    }
+    // The densities are left uninitialized, every importer writes each voxel
+    VoxelGrid(uint32_t w, uint32_t h, uint32_t d) : data((size_t)w * h * d), width(w), height(h), depth(d) {}
 
     // Helper to get data at a given position
     float& at(uint32_t x, uint32_t y, uint32_t z) {
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+
 #include <glm/glm.hpp>
 
 #include "imgui.h"
@@ -38,7 +41,9 @@ namespace ui {
     ImGui::Begin(viewport.name.c_str());
 
     ImVec2 size = ImGui::GetContentRegionAvail();
-    if (viewport.width != size.x || viewport.height != size.y) {
+    if (viewport.fixed_size) {
+      size = ImVec2(float(viewport.width), float(viewport.height));
+    } else if (viewport.width != size.x || viewport.height != size.y) {
       viewport.width = size.x;
       viewport.height = size.y;
 
@@ -46,15 +51,16 @@ namespace ui {
       flags |= VIEWPORT_RESIZE | RESIZE;
     }
 
+    // Holds the gamma corrected display output, so 8 bits per channel is enough
     if (viewport.update_framebuffer) {
       if (!viewport.fbo.id || !viewport.texture.id) {
-        graphics::makeTexture2D(GL_TEXTURE_2D, GL_RGBA32F, viewport.width, viewport.height, viewport.texture);
+        graphics::makeTexture2D(GL_TEXTURE_2D, GL_RGBA8, viewport.width, viewport.height, viewport.texture);
         graphics::makeFramebuffer(viewport.texture, viewport.fbo);
       } else {
         graphics::destroy(viewport.fbo);
         graphics::destroy(viewport.texture);
 
-        graphics::makeTexture2D(GL_TEXTURE_2D, GL_RGBA32F, viewport.width, viewport.height, viewport.texture);
+        graphics::makeTexture2D(GL_TEXTURE_2D, GL_RGBA8, viewport.width, viewport.height, viewport.texture);
         graphics::makeFramebuffer(viewport.texture, viewport.fbo);
       }
 
@@ -62,13 +68,99 @@ namespace ui {
     }
 
     ImGui::Image((void*)(intptr_t)viewport.texture.id, size, ImVec2(0, 1), ImVec2(1,0));
+    viewport.hovered = ImGui::IsItemHovered();
+    if (viewport.hovered) {
+      ImVec2 mouse = ImGui::GetMousePos();
+      ImVec2 corner = ImGui::GetItemRectMin();
+      viewport.mouse_x = mouse.x - corner.x;
+      viewport.mouse_y = float(viewport.height) - (mouse.y - corner.y);
+    }
+
+    ImGui::End();
+  }
+
+  void renderMprWindow(MprWindow& mpr, const preprocessing::VoxelGrid* grid, uint64_t generation,
+                       const preprocessing::DicomMetadata& meta, const controls::WinData& window,
+                       preprocessing::PagedVolume* paged) {
+    if (!mpr.open) return;
+    ImGui::Begin(mpr.name.c_str(), &mpr.open);
+
+    static const char* orientations[] = { "Axial", "Coronal", "Sagittal", "Oblique" };
+    int orientation = int(mpr.orientation);
+    if (ImGui::Combo("Plane", &orientation, orientations, 4)) {
+      mpr.orientation = graphics::MprOrientation(orientation);
+      mpr.slice = -1.f;
+    }
+    if (mpr.orientation == graphics::MprOrientation::OBLIQUE) {
+      ImGui::SliderAngle("Yaw", &mpr.yaw, -90.f, 90.f);
+      ImGui::SliderAngle("Pitch", &mpr.pitch, -90.f, 90.f);
+    }
+
+    if (!grid || grid->data.empty()) {
+      ImGui::TextDisabled("No volume loaded");
+      ImGui::End();
+      return;
+    }
+
+    graphics::MprSliceRange range = graphics::mprSliceRange(meta, mpr.orientation, mpr.yaw, mpr.pitch);
+    int last = int(range.count) - 1;
+    if (mpr.slice < 0.f) mpr.slice = 0.5f * last;
+
+    int slice = int(std::lround(mpr.slice));
+    if (ImGui::SliderInt("Slice", &slice, 0, last)) mpr.slice = float(slice);
+
+    ImVec2 size = ImGui::GetContentRegionAvail();
+    int width = std::max(int(size.x), 1), height = std::max(int(size.y), 1);
+    if (!mpr.texture.id || mpr.width != width || mpr.height != height) {
+      graphics::destroy(mpr.texture);
+      graphics::makeTexture2D(GL_TEXTURE_2D, GL_R8, width, height, mpr.texture);
+      const GLint grey[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+      glTextureParameteriv(mpr.texture.id, GL_TEXTURE_SWIZZLE_RGBA, grey);
+      mpr.width = width;
+      mpr.height = height;
+      mpr.pixels.resize((size_t)width * height);
+      mpr.shown_generation = 0;
+    }
+
+    graphics::MprPlane plane = graphics::makeMprPlane(meta, mpr.orientation, mpr.slice, mpr.yaw, mpr.pitch, width, height);
+    bool changed = mpr.shown_generation != generation || mpr.shown_center != window.win_center ||
+                   mpr.shown_width != window.win_width || mpr.shown_scale != window.density_scale ||
+                   plane.center != mpr.shown_plane.center || plane.u != mpr.shown_plane.u || plane.v != mpr.shown_plane.v ||
+                   plane.pixel_mm != mpr.shown_plane.pixel_mm;
+    // A partly paged slice is redone whenever more bricks have arrived
+    uint64_t loaded = paged ? paged->loaded.load() : 0;
+    changed = changed || (!mpr.shown_complete && loaded != mpr.shown_loaded);
+    if (changed) {
+      if (paged) {
+        mpr.shown_complete = graphics::reformatSlicePaged(*paged, *grid, meta, plane, width, height, window.win_center,
+                                                          window.win_width, window.density_scale, mpr.pixels.data());
+      } else {
+        graphics::reformatSlice(*grid, meta, plane, width, height, window.win_center, window.win_width, window.density_scale,
+                                mpr.pixels.data());
+        mpr.shown_complete = true;
+      }
+      mpr.shown_loaded = loaded;
+      graphics::uploadTexture2D(mpr.texture, mpr.pixels.data());
+      mpr.shown_generation = generation;
+      mpr.shown_plane = plane;
+      mpr.shown_center = window.win_center;
+      mpr.shown_width = window.win_width;
+      mpr.shown_scale = window.density_scale;
+    }
+
+    ImGui::Image((void*)(intptr_t)mpr.texture.id, ImVec2(float(width), float(height)));
+    if (ImGui::IsItemHovered()) {
+      float wheel = ImGui::GetIO().MouseWheel;
+      if (wheel != 0.f) mpr.slice = std::clamp(std::round(mpr.slice) + (wheel > 0.f ? 1.f : -1.f), 0.f, float(last));
+    }
 
     ImGui::End();
   }
 
-  void renderUI(const frame::FrameData& frame_data, controls::WinData& window) {
+  void renderUI(const frame::FrameData& frame_data, controls::WinData& window, const preprocessing::HistogramStats* stats,
+                const preprocessing::DicomMetadata& meta) {
     renderDiagnostics(frame_data);
-    renderControls(window);
+    renderControls(window, stats, meta);
   }
 
 } // namespace ui
@@ -6,12 +6,23 @@
 #include "app/controls_data.hpp"
 
 #include "app/update_flags.hpp"
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/histogram.hpp"
+#include "preprocessing/voxel_grid.hpp"
+#include "mpr_window.hpp"
 #include "viewport_window.hpp"
 
 namespace ui {
 
   void initUI(SDL_Window* window, SDL_GLContext context);
   void renderViewport(ViewportWindow& viewport, UpdateFlags& flags);
-  void renderUI(const frame::FrameData& frame_data, controls::WinData& window);
+  // grid holds the unsmoothed densities and is null while nothing is loaded, generation is
+  // LoadedSeries::generation. Slices are windowed like the 3D view. With paged set, grid is its
+  // overview and slices are read from the full resolution bricks, refined as they arrive.
+  void renderMprWindow(MprWindow& mpr, const preprocessing::VoxelGrid* grid, uint64_t generation,
+                       const preprocessing::DicomMetadata& meta, const controls::WinData& window,
+                       preprocessing::PagedVolume* paged = nullptr);
+  void renderUI(const frame::FrameData& frame_data, controls::WinData& window, const preprocessing::HistogramStats* stats,
+                const preprocessing::DicomMetadata& meta);
 
 } // namespace uig
@@ -0,0 +1,37 @@
+// ui/mpr_window.hpp
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "graphics/gl_utils.hpp"
+#include "graphics/mpr.hpp"
+
+namespace ui {
+
+  // A 2D slice view of the active volume, re-extracted on the CPU only when something it shows changes
+  struct MprWindow {
+    std::string name;
+    bool open = true;
+
+    graphics::MprOrientation orientation = graphics::MprOrientation::AXIAL;
+    float slice = -1.f;         // Negative picks the middle slice on the next frame
+    float yaw = 0.f;            // Radians, only used by OBLIQUE
+    float pitch = 0.f;
+
+    graphics::Texture texture;
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> pixels;
+
+    // What the texture currently shows
+    uint64_t shown_generation = 0;
+    graphics::MprPlane shown_plane{};
+    float shown_center = -1.f;
+    float shown_width = -1.f;
+    float shown_scale = -1.f;
+    bool shown_complete = true;   // False while a paged slice still has fallback pixels
+    uint64_t shown_loaded = 0;    // PagedVolume::loaded when it was extracted
+  };
+
+} // namespace ui
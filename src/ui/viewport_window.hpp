@@ -16,7 +16,13 @@ namespace ui {
 
     int width = 800;
     int height = 600;
+    bool fixed_size = false;    // Keep width and height instead of following the window, for replays
     size_t camera_index = 0;
+
+    // Cursor over the image in framebuffer pixels, origin at the bottom left like the compute shader
+    bool hovered = false;
+    float mouse_x = 0.f;
+    float mouse_y = 0.f;
   };
 
 } // namespace ui
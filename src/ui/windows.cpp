@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstdio>
+
 #include "imgui.h"
 
 #include "windows.hpp"
@@ -13,7 +16,8 @@ namespace ui {
     ImGui::End();
   }
 
-  void renderControls(controls::WinData& window) {
+  void renderControls(controls::WinData& window, const preprocessing::HistogramStats* stats,
+                      const preprocessing::DicomMetadata& meta) {
     ImGui::Begin("Controls");
 
     ImGui::SliderFloat("Scale", &window.scale, 0.1f, 5.0f);
@@ -21,6 +25,193 @@ namespace ui {
     ImGui::SliderFloat("Window Width", &window.win_width, 0.01f, 1.0f);
     ImGui::SliderFloat("Density Scale", &window.density_scale, 0.1f, 1.0f);
 
+    static const char* modes[] = { "Composite", "MIP", "MinIP", "Average" };
+    int mode = int(window.mode);
+    if (ImGui::Combo("Render Mode", &mode, modes, 4)) window.mode = controls::RenderMode(mode);
+    ImGui::Checkbox("Shadows", &window.shadows);
+    ImGui::SameLine();
+    ImGui::Checkbox("High Quality", &window.high_quality);
+    ImGui::Checkbox("Deferred Lighting", &window.deferred_lighting);
+    ImGui::SameLine();
+    ImGui::Checkbox("Ambient Occlusion", &window.ambient_occlusion);
+
+    ImGui::SeparatorText("Crop");
+    static const char* axes[] = { "X", "Y", "Z" };
+    for (int a = 0; a < 3; a++) {
+      ImGui::DragFloatRange2(axes[a], &window.crop_min[a], &window.crop_max[a], 0.002f, 0.0f, 1.0f, "%.3f", nullptr, ImGuiSliderFlags_AlwaysClamp);
+    }
+    if (ImGui::Button("Apply Crop")) window.apply_crop = true;
+    ImGui::SameLine();
+    if (ImGui::Button("Reset Crop")) {
+      for (int a = 0; a < 3; a++) {
+        window.crop_min[a] = 0.0f;
+        window.crop_max[a] = 1.0f;
+      }
+    }
+
+    if (stats && !stats->plot.empty() && meta.max_value > meta.min_value) {
+      ImGui::SeparatorText("Histogram");
+      ImGui::PlotHistogram("##hu", stats->plot.data(), int(stats->plot.size()), 0, nullptr, 0.f, 3.4e38f, ImVec2(-1.f, 60.f));
+      ImGui::Text("HU p1 %d  median %d  p99 %d", stats->percentile_1, stats->median, stats->percentile_99);
+      for (const auto& peak : stats->peaks) {
+        ImGui::Text("%s peak %d HU (%.0f%%)", peak.name, peak.peak_hu, peak.fraction * 100.f);
+      }
+
+      for (size_t i = 0; i < stats->presets.size(); i++) {
+        const auto& preset = stats->presets[i];
+        if (i > 0) ImGui::SameLine();
+        if (ImGui::Button(preset.name)) {
+          float hu_range = meta.max_value - meta.min_value;
+          window.win_center = preprocessing::normalizedHu(meta, preset.center_hu);
+          window.win_width = std::clamp(preset.width_hu / hu_range, 0.01f, 1.0f);
+        }
+        if (ImGui::IsItemHovered()) ImGui::SetTooltip("L %.0f / W %.0f HU", preset.center_hu, preset.width_hu);
+      }
+    }
+
+    ImGui::End();
+  }
+
+  void renderLabels(controls::LabelControls& controls, const preprocessing::LabelVolume* labels,
+                    const preprocessing::DicomMetadata& meta) {
+    // Long lists only show the largest components, the rest stay as they are
+    constexpr size_t MAX_LISTED = 100;
+
+    ImGui::Begin("Labels");
+
+    ImGui::DragFloatRange2("HU", &controls.hu_min, &controls.hu_max, 5.0f, -1024.0f, 4000.0f, "%.0f");
+    ImGui::SliderInt("Min Voxels", &controls.min_voxels, 1, 10000);
+    ImGui::SliderInt("Open Radius", &controls.open_radius, 0, 5);
+    ImGui::Checkbox("Fill Holes", &controls.fill_holes);
+    if (controls.running) {
+      ImGui::TextDisabled("Labeling...");
+    } else if (ImGui::Button("Label Components")) {
+      controls.run = true;
+    }
+
+    if (labels) {
+      ImGui::Text("%zu components, %llu dropped", labels->components.size(), (unsigned long long)labels->dropped);
+      if (ImGui::Checkbox("Mask By Label", &controls.enabled)) controls.visibility_changed = true;
+      if (ImGui::Checkbox("Unlabeled", &controls.show_unlabeled)) controls.visibility_changed = true;
+
+      float voxel_ml = meta.spacing_x * meta.spacing_y * meta.spacing_z / 1000.0f;
+      size_t listed = std::min(labels->components.size(), MAX_LISTED);
+      for (size_t i = 0; i < listed && i < controls.visible.size(); i++) {
+        const auto& c = labels->components[i];
+        char name[96];
+        snprintf(name, sizeof(name), "%zu: %llu voxels, %.1f ml", i + 1, (unsigned long long)c.voxels, c.voxels * voxel_ml);
+        bool visible = controls.visible[i] != 0;
+        if (ImGui::Checkbox(name, &visible)) {
+          controls.visible[i] = visible;
+          controls.visibility_changed = true;
+        }
+      }
+    }
+
+    ImGui::End();
+  }
+
+  bool renderLights(lights::light_set& set) {
+    ImGui::Begin("Lights");
+
+    bool changed = ImGui::ColorEdit3("Ambient", &set.ambient.x);
+
+    // Erased after the loops so indices stay valid while they draw
+    int remove_directional = -1, remove_point = -1, remove_spot = -1;
+    for (size_t i = 0; i < set.directionals.size(); i++) {
+      lights::directional& l = set.directionals[i];
+      ImGui::PushID(int(i));
+      ImGui::SeparatorText("Directional");
+      changed |= ImGui::DragFloat3("Direction", &l.direction.x, 0.01f, -1.0f, 1.0f);
+      changed |= ImGui::ColorEdit3("Color", &l.color.x);
+      changed |= ImGui::SliderFloat("Power", &l.power, 0.0f, 4.0f);
+      if (ImGui::Button("Remove")) remove_directional = int(i);
+      ImGui::PopID();
+    }
+    for (size_t i = 0; i < set.points.size(); i++) {
+      lights::point& l = set.points[i];
+      ImGui::PushID(int(1000 + i));
+      ImGui::SeparatorText("Point");
+      changed |= ImGui::DragFloat3("Position", &l.position.x, 0.01f);
+      changed |= ImGui::ColorEdit3("Color", &l.color.x);
+      changed |= ImGui::SliderFloat("Power", &l.power, 0.0f, 4.0f);
+      changed |= ImGui::SliderFloat("Size", &l.size, 0.05f, 5.0f);
+      if (ImGui::Button("Remove")) remove_point = int(i);
+      ImGui::PopID();
+    }
+    for (size_t i = 0; i < set.spots.size(); i++) {
+      lights::spot& l = set.spots[i];
+      ImGui::PushID(int(2000 + i));
+      ImGui::SeparatorText("Spot");
+      changed |= ImGui::DragFloat3("Position", &l.position.x, 0.01f);
+      changed |= ImGui::DragFloat3("Direction", &l.direction.x, 0.01f, -1.0f, 1.0f);
+      changed |= ImGui::ColorEdit3("Color", &l.color.x);
+      changed |= ImGui::SliderFloat("Power", &l.power, 0.0f, 4.0f);
+      changed |= ImGui::SliderAngle("Radius", &l.radius, 1.0f, 89.0f);
+      changed |= ImGui::SliderFloat("Size", &l.size, 0.05f, 5.0f);
+      if (ImGui::Button("Remove")) remove_spot = int(i);
+      ImGui::PopID();
+    }
+
+    // Zero directions can't be normalized, the last good one stays
+    for (auto& l : set.directionals) if (glm::dot(l.direction, l.direction) < 1e-6f) l.direction = { 0.f, 1.f, 0.f };
+    for (auto& l : set.spots) if (glm::dot(l.direction, l.direction) < 1e-6f) l.direction = { 0.f, 1.f, 0.f };
+
+    if (remove_directional >= 0) set.directionals.erase(set.directionals.begin() + remove_directional);
+    if (remove_point >= 0) set.points.erase(set.points.begin() + remove_point);
+    if (remove_spot >= 0) set.spots.erase(set.spots.begin() + remove_spot);
+    changed |= remove_directional >= 0 || remove_point >= 0 || remove_spot >= 0;
+
+    ImGui::Separator();
+    if (ImGui::Button("Add Directional")) { set.directionals.push_back(lights::directional{}); changed = true; }
+    ImGui::SameLine();
+    if (ImGui::Button("Add Point")) { set.points.push_back(lights::point{ glm::vec3(0.f, 1.f, 1.f) }); changed = true; }
+    ImGui::SameLine();
+    if (ImGui::Button("Add Spot")) { set.spots.push_back(lights::spot{ glm::vec3(0.f, 0.f, 2.f), glm::vec3(0.f, 0.f, -1.f) }); changed = true; }
+
+    ImGui::End();
+    return changed;
+  }
+
+  void renderProbeTooltip(const graphics::PickResult& pick) {
+    ImGui::BeginTooltip();
+    ImGui::Text("%.0f HU", pick.hu);
+    ImGui::Text("Voxel (%u, %u, %u)", pick.voxel.x, pick.voxel.y, pick.voxel.z);
+    ImGui::Text("Patient (%.1f, %.1f, %.1f) mm", pick.patient.x, pick.patient.y, pick.patient.z);
+    ImGui::Text("Gradient (%.1f, %.1f, %.1f) HU/mm", pick.gradient.x, pick.gradient.y, pick.gradient.z);
+    ImGui::EndTooltip();
+  }
+
+  void renderSeriesBrowser(const std::vector<series::SeriesStatus>& listing, const std::string& active_uid,
+                           float upload_progress, std::string& selected_uid) {
+    ImGui::Begin("Series");
+
+    for (const auto& status : listing) {
+      const char* state = "";
+      switch (status.state) {
+        case series::LoadState::UNLOADED: state = "";            break;
+        case series::LoadState::QUEUED:   state = " (queued)";   break;
+        case series::LoadState::LOADING:  state = " (loading)";  break;
+        case series::LoadState::READY:    state = " (cached)";   break;
+        case series::LoadState::FAILED:   state = " (failed)";   break;
+      }
+
+      std::string label = status.uid + state;
+      if (status.uid == active_uid) label += " *";
+      if (ImGui::Selectable(label.c_str(), status.uid == selected_uid)) {
+        selected_uid = status.uid;
+      }
+      if (ImGui::IsItemHovered() && !status.directory.empty()) {
+        ImGui::SetTooltip("%s\n%zu files", status.directory.c_str(), status.file_count);
+      }
+
+      if (status.state == series::LoadState::LOADING) {
+        ImGui::ProgressBar(status.progress, ImVec2(-1.f, 0.f), status.stage);
+      } else if (status.uid == selected_uid && upload_progress >= 0.f) {
+        ImGui::ProgressBar(upload_progress, ImVec2(-1.f, 0.f), "Uploading");
+      }
+    }
+
     ImGui::End();
   }
 
@@ -2,10 +2,31 @@
 #pragma once
 #include "app/controls_data.hpp"
 #include "app/frame_data.hpp"
+#include "app/lights.hpp"
+#include "app/series_cache.hpp"
+#include "graphics/cpu_raymarch.hpp"
+#include "preprocessing/connected_components.hpp"
+#include "preprocessing/dicom_utils.hpp"
+#include "preprocessing/histogram.hpp"
+
+#include <string>
+#include <vector>
 
 namespace ui {
 
   void renderDiagnostics(const frame::FrameData& frame_data);
-  void renderControls(controls::WinData& window);
+  // stats may be null, presets are converted to the normalized window using meta's HU range
+  void renderControls(controls::WinData& window, const preprocessing::HistogramStats* stats,
+                      const preprocessing::DicomMetadata& meta);
+  // labels is null until the first segmentation of the active volume finishes
+  void renderLabels(controls::LabelControls& controls, const preprocessing::LabelVolume* labels,
+                    const preprocessing::DicomMetadata& meta);
+  // Editor for the deferred lighting pass's lights, true when anything changed
+  bool renderLights(lights::light_set& set);
+  // Tooltip at the cursor describing the voxel under it
+  void renderProbeTooltip(const graphics::PickResult& pick);
+  // upload_progress is for the selected series' textures, negative when nothing is streaming
+  void renderSeriesBrowser(const std::vector<series::SeriesStatus>& listing, const std::string& active_uid,
+                           float upload_progress, std::string& selected_uid);
 
 } // namespace ui
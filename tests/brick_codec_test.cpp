@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "preprocessing/brick_codec.hpp"
+
+using namespace preprocessing;
+
+namespace {
+  // Stream lengths around the block size, so the padded tail block is covered at every width
+  constexpr size_t LENGTHS[] = { 1, 37, CODEC_BLOCK - 1, CODEC_BLOCK, CODEC_BLOCK + 1, 5 * CODEC_BLOCK + 77 };
+
+  int failures = 0;
+
+  void fail(const char* what, uint32_t bits, size_t count) {
+    printf("FAIL %s: %u bits, %zu values\n", what, bits, count);
+    failures++;
+  }
+
+  // Every block spans exactly bits of range, the first value of each block sits on its base and
+  // the second on its maximum, the rest are random in between
+  std::vector<uint16_t> makeCodes(uint32_t bits, size_t count, std::mt19937& rng) {
+    const uint32_t span = (1u << bits) - 1;
+    std::vector<uint16_t> codes(count);
+    for (size_t first = 0; first < count; first += CODEC_BLOCK) {
+      uint32_t base = rng() % (65536 - span);
+      for (size_t i = first; i < std::min(count, first + CODEC_BLOCK); i++) {
+        uint32_t offset = i == first ? 0 : i == first + 1 ? span : (span ? rng() % (span + 1) : 0);
+        codes[i] = uint16_t(base + offset);
+      }
+    }
+    return codes;
+  }
+
+  void testRoundTrip(uint32_t bits, size_t count, std::mt19937& rng) {
+    std::vector<uint16_t> codes = makeCodes(bits, count, rng);
+    std::vector<uint8_t> stream;
+    encodeBitpacked(codes.data(), count, stream);
+
+    // Offset 0 over a range of 1 hands back the codes themselves, all exact in a float
+    // The guard value past the end catches a tail block written out in full
+    std::vector<float> out(count + 1, -1.f);
+    if (!decodeBitpackedToFloat(stream.data(), stream.size(), count, 0, 1.f, out.data())) {
+      fail("decode", bits, count);
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (out[i] != float(codes[i])) {
+        fail("round trip", bits, count);
+        return;
+      }
+    }
+    if (out[count] != -1.f) fail("wrote past the end", bits, count);
+
+    // A stream cut short has to be rejected, not read past
+    if (decodeBitpackedToFloat(stream.data(), stream.size() - 1, count, 0, 1.f, out.data())) {
+      fail("truncated stream accepted", bits, count);
+    }
+  }
+
+  // decompressVolume() has to give exactly what importDicomSeries() computes from the same HU
+  void testVolume(std::mt19937& rng) {
+    const uint32_t w = 67, h = 31, d = 5;
+    const int32_t hu_min = -1024, hu_max = 3071;
+    std::vector<int16_t> hu((size_t)w * h * d);
+    for (int16_t& v : hu) v = int16_t(hu_min + int32_t(rng() % uint32_t(hu_max - hu_min + 1)));
+
+    CompressedVolume volume;
+    compressVolume(hu.data(), w, h, d, hu_min, hu_max, volume);
+    VoxelGrid grid;
+    if (!decompressVolume(volume, grid)) {
+      fail("decompress volume", 0, hu.size());
+      return;
+    }
+
+    const float hu_range = float(hu_max - hu_min);
+    for (size_t i = 0; i < hu.size(); i++) {
+      float expected = static_cast<float>(hu[i] - hu_min) / hu_range;
+      if (std::memcmp(&expected, &grid.data[i], sizeof(float)) != 0) {
+        fail("volume matches import", 0, hu.size());
+        return;
+      }
+    }
+  }
+}
+
+int main() {
+  std::mt19937 rng(26027);
+  for (uint32_t bits = 0; bits <= 16; bits++) {
+    for (size_t count : LENGTHS) testRoundTrip(bits, count, rng);
+  }
+  testVolume(rng);
+
+  if (failures) {
+    printf("%d brick codec checks failed\n", failures);
+    return 1;
+  }
+  printf("Brick codec round trips are lossless\n");
+  return 0;
+}